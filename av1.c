@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "av1.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bitstream.h"
+
+// Below entries are hardcoded, same as ffmpeg does:
+static const bool reduced_still_picture_header = 0;
+static const bool timing_info_present_flag = 0;
+static const bool initial_display_delay_present_flag = 0;
+static const uint8_t operating_points_cnt_minus_1 = 0;
+static const uint16_t operating_point_idc = 0;
+static const bool frame_id_numbers_present_flag = 0;
+static const bool seq_choose_screen_content_tools = 0;
+static const uint8_t seq_force_screen_content_tools = 0;
+static const bool separate_uv_delta_q = 0;
+static const bool film_grain_params_present = 0;
+static const bool show_existing_frame = 0;
+static const bool show_frame = 1;
+static const bool frame_size_override_flag = 0;
+static const bool render_and_frame_size_different = 0;
+static const bool frame_refs_short_signaling = 0;
+static const bool is_motion_mode_switchable = 0;
+static const bool allow_warped_motion = 0;
+static const uint8_t tile_size_bytes_minus_1 = 3;
+
+// Frame header obu_size is always coded with four bytes, so that the driver can
+// patch it in place after appending the tile data.
+static const size_t frame_header_obu_size_bytes = 4;
+
+// 6.10.24 Ref frames semantics
+#define NUM_REF_FRAMES 8
+#define REFS_PER_FRAME 7
+#define PRIMARY_REF_NONE 7
+
+// Annex A.3 Levels
+#define MAX_TILE_WIDTH 4096
+#define MAX_TILE_AREA (4096 * 2304)
+#define MAX_TILE_ROWS 64
+#define MAX_TILE_COLS 64
+
+// 6.8.9 Interpolation filter semantics
+#define SWITCHABLE 4
+
+static uint32_t TileLog2(uint32_t blk_size, uint32_t target) {
+  uint32_t k = 0;
+  while ((blk_size << k) < target) k++;
+  return k;
+}
+
+static uint32_t Min(uint32_t a, uint32_t b) { return a < b ? a : b; }
+
+static uint32_t Max(uint32_t a, uint32_t b) { return a > b ? a : b; }
+
+// 4.10.5 leb128
+static void PackLeb128(struct Bitstream* bitstream, uint32_t value,
+                       size_t fixed_size) {
+  for (size_t i = 0; i < fixed_size || !i || value; i++) {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    bool more = fixed_size ? i + 1 < fixed_size : value != 0;
+    BitstreamAppend(bitstream, 8, byte | (uint32_t)more << 7);
+    if (!more) break;
+  }
+}
+
+// 4.10.6 su(n)
+static void AppendSigned(struct Bitstream* bitstream, size_t size,
+                         int32_t value) {
+  BitstreamAppend(bitstream, size, (uint32_t)value & ((1u << size) - 1));
+}
+
+// 5.3.1 General OBU syntax
+static void PackObu(struct Bitstream* bitstream, enum ObuType obu_type,
+                    const struct Bitstream* payload, size_t fixed_size) {
+  // 5.3.2 OBU header syntax
+  BitstreamAppend(bitstream, 1, 0);  // obu_forbidden_bit
+  BitstreamAppend(bitstream, 4, obu_type);
+  BitstreamAppend(bitstream, 1, 0);  // obu_extension_flag
+  BitstreamAppend(bitstream, 1, 1);  // obu_has_size_field
+  BitstreamAppend(bitstream, 1, 0);  // obu_reserved_1bit
+
+  uint32_t obu_size = (uint32_t)(payload->size + 7) / 8;
+  PackLeb128(bitstream, obu_size, fixed_size);
+  const uint8_t* data = payload->data;
+  for (uint32_t i = 0; i < obu_size; i++)
+    BitstreamAppend(bitstream, 8, data[i]);
+}
+
+// 5.3.4 Trailing bits syntax
+static void PackTrailingBits(struct Bitstream* bitstream) {
+  BitstreamAppend(bitstream, 1, 1);  // trailing_one_bit
+  BitstreamByteAlign(bitstream);     // trailing_zero_bit
+}
+
+void DeriveUniformTileInfo(uint32_t frame_width, uint32_t frame_height,
+                           bool use_128x128_superblock,
+                           struct TileInfo* tile_info) {
+  // 5.9.15 Tile info syntax
+  uint32_t mi_cols = 2 * ((frame_width + 7) >> 3);
+  uint32_t mi_rows = 2 * ((frame_height + 7) >> 3);
+  uint32_t sb_cols =
+      use_128x128_superblock ? (mi_cols + 31) >> 5 : (mi_cols + 15) >> 4;
+  uint32_t sb_rows =
+      use_128x128_superblock ? (mi_rows + 31) >> 5 : (mi_rows + 15) >> 4;
+  uint32_t sb_shift = use_128x128_superblock ? 5 : 4;
+  uint32_t sb_size = sb_shift + 2;
+  uint32_t max_tile_width_sb = MAX_TILE_WIDTH >> sb_size;
+  uint32_t max_tile_area_sb = MAX_TILE_AREA >> (2 * sb_size);
+  uint32_t min_log2_tile_cols = TileLog2(max_tile_width_sb, sb_cols);
+  uint32_t min_log2_tiles = Max(min_log2_tile_cols,
+                                TileLog2(max_tile_area_sb, sb_rows * sb_cols));
+
+  *tile_info = (struct TileInfo){
+      .tile_cols_log2 = (uint8_t)min_log2_tile_cols,
+      .tile_rows_log2 = (uint8_t)(min_log2_tiles - min_log2_tile_cols),
+  };
+
+  uint32_t tile_width_sb =
+      (sb_cols + (1u << tile_info->tile_cols_log2) - 1) >>
+      tile_info->tile_cols_log2;
+  for (uint32_t start_sb = 0; start_sb < sb_cols; start_sb += tile_width_sb) {
+    tile_info->width_in_sbs_minus_1[tile_info->tile_cols++] =
+        (uint16_t)(Min(tile_width_sb, sb_cols - start_sb) - 1);
+  }
+
+  uint32_t tile_height_sb =
+      (sb_rows + (1u << tile_info->tile_rows_log2) - 1) >>
+      tile_info->tile_rows_log2;
+  for (uint32_t start_sb = 0; start_sb < sb_rows; start_sb += tile_height_sb) {
+    tile_info->height_in_sbs_minus_1[tile_info->tile_rows++] =
+        (uint16_t)(Min(tile_height_sb, sb_rows - start_sb) - 1);
+  }
+}
+
+// 5.6 Temporal delimiter obu syntax
+void PackTemporalDelimiterObu(struct Bitstream* bitstream) {
+  const struct Bitstream empty = {.data = NULL, .size = 0};
+  PackObu(bitstream, OBU_TEMPORAL_DELIMITER, &empty, 0);
+}
+
+// 5.5.2 Color config syntax
+static void PackColorConfig(struct Bitstream* bitstream,
+                            const VAEncSequenceParameterBufferAV1* seq,
+                            const struct MoreSequenceHeader* msh) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+
+  BitstreamAppend(bitstream, 1, seq_bits->bit_depth_minus8 != 0);
+  if (seq->seq_profile == 2 && seq_bits->bit_depth_minus8) {
+    BitstreamAppend(bitstream, 1, seq_bits->bit_depth_minus8 == 4);
+  }
+  if (seq->seq_profile != 1)
+    BitstreamAppend(bitstream, 1, seq_bits->mono_chrome);
+  BitstreamAppend(bitstream, 1, msh->color_description_present_flag);
+  if (msh->color_description_present_flag) {
+    BitstreamAppend(bitstream, 8, msh->color_primaries);
+    BitstreamAppend(bitstream, 8, msh->transfer_characteristics);
+    BitstreamAppend(bitstream, 8, msh->matrix_coefficients);
+  }
+  if (seq_bits->mono_chrome) {
+    BitstreamAppend(bitstream, 1, msh->color_range);
+    return;
+  }
+  if (msh->color_primaries == 1 && msh->transfer_characteristics == 13 &&
+      msh->matrix_coefficients == 0) {
+    // sRGB implies full range 4:4:4 and nothing is signalled.
+  } else {
+    BitstreamAppend(bitstream, 1, msh->color_range);
+    if (seq->seq_profile == 2 && seq_bits->bit_depth_minus8 == 4) {
+      BitstreamAppend(bitstream, 1, seq_bits->subsampling_x);
+      if (seq_bits->subsampling_x)
+        BitstreamAppend(bitstream, 1, seq_bits->subsampling_y);
+    }
+    if (seq_bits->subsampling_x && seq_bits->subsampling_y)
+      BitstreamAppend(bitstream, 2, msh->chroma_sample_position);
+  }
+  BitstreamAppend(bitstream, 1, separate_uv_delta_q);
+}
+
+// 5.5.1 General sequence header OBU syntax
+bool PackSequenceHeaderObu(struct Bitstream* bitstream,
+                           const VAEncSequenceParameterBufferAV1* seq,
+                           const struct MoreSequenceHeader* msh) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+
+  char buffer_on_the_stack[64];
+  struct Bitstream seq_obu = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  BitstreamAppend(&seq_obu, 3, seq->seq_profile);
+  BitstreamAppend(&seq_obu, 1, seq_bits->still_picture);
+  BitstreamAppend(&seq_obu, 1, reduced_still_picture_header);
+  BitstreamAppend(&seq_obu, 1, timing_info_present_flag);
+  BitstreamAppend(&seq_obu, 1, initial_display_delay_present_flag);
+  BitstreamAppend(&seq_obu, 5, operating_points_cnt_minus_1);
+  BitstreamAppend(&seq_obu, 12, operating_point_idc);
+  BitstreamAppend(&seq_obu, 5, seq->seq_level_idx);
+  if (seq->seq_level_idx > 7) BitstreamAppend(&seq_obu, 1, seq->seq_tier);
+
+  uint32_t frame_width_bits_minus_1 = 0;
+  while (msh->max_frame_width_minus_1 >> (frame_width_bits_minus_1 + 1))
+    frame_width_bits_minus_1++;
+  uint32_t frame_height_bits_minus_1 = 0;
+  while (msh->max_frame_height_minus_1 >> (frame_height_bits_minus_1 + 1))
+    frame_height_bits_minus_1++;
+  BitstreamAppend(&seq_obu, 4, frame_width_bits_minus_1);
+  BitstreamAppend(&seq_obu, 4, frame_height_bits_minus_1);
+  BitstreamAppend(&seq_obu, frame_width_bits_minus_1 + 1,
+                  msh->max_frame_width_minus_1);
+  BitstreamAppend(&seq_obu, frame_height_bits_minus_1 + 1,
+                  msh->max_frame_height_minus_1);
+
+  BitstreamAppend(&seq_obu, 1, frame_id_numbers_present_flag);
+  BitstreamAppend(&seq_obu, 1, seq_bits->use_128x128_superblock);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_filter_intra);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_intra_edge_filter);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_interintra_compound);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_masked_compound);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_warped_motion);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_dual_filter);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_order_hint);
+  if (seq_bits->enable_order_hint) {
+    BitstreamAppend(&seq_obu, 1, seq_bits->enable_jnt_comp);
+    BitstreamAppend(&seq_obu, 1, seq_bits->enable_ref_frame_mvs);
+  }
+  BitstreamAppend(&seq_obu, 1, seq_choose_screen_content_tools);
+  if (!seq_choose_screen_content_tools)
+    BitstreamAppend(&seq_obu, 1, seq_force_screen_content_tools);
+  if (seq_force_screen_content_tools > 0) {
+    fprintf(stderr, "Screen content tools are not supported\n");
+    return false;
+  }
+  if (seq_bits->enable_order_hint)
+    BitstreamAppend(&seq_obu, 3, seq->order_hint_bits_minus_1);
+
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_superres);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_cdef);
+  BitstreamAppend(&seq_obu, 1, seq_bits->enable_restoration);
+  PackColorConfig(&seq_obu, seq, msh);
+  BitstreamAppend(&seq_obu, 1, film_grain_params_present);
+  PackTrailingBits(&seq_obu);
+
+  PackObu(bitstream, OBU_SEQUENCE_HEADER, &seq_obu, 0);
+  return true;
+}
+
+// 5.9.15 Tile info syntax
+static void PackTileInfo(struct Bitstream* bitstream,
+                         const VAEncSequenceParameterBufferAV1* seq,
+                         const VAEncPictureParameterBufferAV1* pic) {
+  struct TileInfo min_tile_info;
+  DeriveUniformTileInfo(pic->frame_width_minus_1 + 1u,
+                        pic->frame_height_minus_1 + 1u,
+                        seq->seq_fields.bits.use_128x128_superblock,
+                        &min_tile_info);
+
+  uint32_t sb_cols = 0;
+  for (uint32_t i = 0; i < min_tile_info.tile_cols; i++)
+    sb_cols += min_tile_info.width_in_sbs_minus_1[i] + 1u;
+  uint32_t sb_rows = 0;
+  for (uint32_t i = 0; i < min_tile_info.tile_rows; i++)
+    sb_rows += min_tile_info.height_in_sbs_minus_1[i] + 1u;
+
+  // Only uniform spacing is supported, so tile counts in the va picture buffer
+  // are expected to come from DeriveUniformTileInfo.
+  uint32_t tile_cols_log2 = 0;
+  while ((1u << tile_cols_log2) < pic->tile_cols) tile_cols_log2++;
+  uint32_t tile_rows_log2 = 0;
+  while ((1u << tile_rows_log2) < pic->tile_rows) tile_rows_log2++;
+
+  BitstreamAppend(bitstream, 1, 1);  // uniform_tile_spacing_flag
+  uint32_t max_log2_tile_cols = TileLog2(1, Min(sb_cols, MAX_TILE_COLS));
+  for (uint32_t i = min_tile_info.tile_cols_log2; i < max_log2_tile_cols;
+       i++) {
+    bool increment_tile_cols_log2 = i < tile_cols_log2;
+    BitstreamAppend(bitstream, 1, increment_tile_cols_log2);
+    if (!increment_tile_cols_log2) break;
+  }
+  uint32_t min_log2_tiles =
+      min_tile_info.tile_cols_log2 + min_tile_info.tile_rows_log2;
+  uint32_t min_log2_tile_rows =
+      min_log2_tiles > tile_cols_log2 ? min_log2_tiles - tile_cols_log2 : 0;
+  uint32_t max_log2_tile_rows = TileLog2(1, Min(sb_rows, MAX_TILE_ROWS));
+  for (uint32_t i = min_log2_tile_rows; i < max_log2_tile_rows; i++) {
+    bool increment_tile_rows_log2 = i < tile_rows_log2;
+    BitstreamAppend(bitstream, 1, increment_tile_rows_log2);
+    if (!increment_tile_rows_log2) break;
+  }
+
+  if (tile_cols_log2 > 0 || tile_rows_log2 > 0) {
+    BitstreamAppend(bitstream, tile_rows_log2 + tile_cols_log2,
+                    pic->context_update_tile_id);
+    BitstreamAppend(bitstream, 2, tile_size_bytes_minus_1);
+  }
+}
+
+// 5.9.13 Delta quantizer syntax
+static void PackDeltaQ(struct Bitstream* bitstream, int8_t delta_q) {
+  BitstreamAppend(bitstream, 1, delta_q != 0);  // delta_coded
+  if (delta_q) AppendSigned(bitstream, 1 + 6, delta_q);
+}
+
+// 5.9.12 Quantization params syntax
+static bool PackQuantizationParams(struct Bitstream* bitstream,
+                                   const VAEncSequenceParameterBufferAV1* seq,
+                                   const VAEncPictureParameterBufferAV1* pic) {
+  const typeof(pic->qmatrix_flags.bits)* qmatrix_bits =
+      &pic->qmatrix_flags.bits;
+
+  BitstreamAppend(bitstream, 8, pic->base_qindex);
+  PackDeltaQ(bitstream, pic->y_dc_delta_q);
+  if (!seq->seq_fields.bits.mono_chrome) {
+    if (separate_uv_delta_q) {
+      fprintf(stderr, "Separate uv delta q is not supported\n");
+      return false;
+    }
+    PackDeltaQ(bitstream, pic->u_dc_delta_q);
+    PackDeltaQ(bitstream, pic->u_ac_delta_q);
+  }
+  BitstreamAppend(bitstream, 1, qmatrix_bits->using_qmatrix);
+  if (qmatrix_bits->using_qmatrix) {
+    BitstreamAppend(bitstream, 4, qmatrix_bits->qm_y);
+    BitstreamAppend(bitstream, 4, qmatrix_bits->qm_u);
+  }
+  return true;
+}
+
+// 5.9.11 Loop filter params syntax
+static void PackLoopFilterParams(struct Bitstream* bitstream,
+                                 const VAEncSequenceParameterBufferAV1* seq,
+                                 const VAEncPictureParameterBufferAV1* pic) {
+  const typeof(pic->loop_filter_flags.bits)* loop_filter_bits =
+      &pic->loop_filter_flags.bits;
+
+  BitstreamAppend(bitstream, 6, pic->filter_level[0]);
+  BitstreamAppend(bitstream, 6, pic->filter_level[1]);
+  if (!seq->seq_fields.bits.mono_chrome &&
+      (pic->filter_level[0] || pic->filter_level[1])) {
+    BitstreamAppend(bitstream, 6, pic->filter_level_u);
+    BitstreamAppend(bitstream, 6, pic->filter_level_v);
+  }
+  BitstreamAppend(bitstream, 3, loop_filter_bits->sharpness_level);
+  BitstreamAppend(bitstream, 1, loop_filter_bits->mode_ref_delta_enabled);
+  if (!loop_filter_bits->mode_ref_delta_enabled) return;
+  BitstreamAppend(bitstream, 1, loop_filter_bits->mode_ref_delta_update);
+  if (!loop_filter_bits->mode_ref_delta_update) return;
+  for (size_t i = 0; i < NUM_REF_FRAMES; i++) {
+    BitstreamAppend(bitstream, 1, 1);  // update_ref_delta
+    AppendSigned(bitstream, 1 + 6, pic->ref_deltas[i]);
+  }
+  for (size_t i = 0; i < 2; i++) {
+    BitstreamAppend(bitstream, 1, 1);  // update_mode_delta
+    AppendSigned(bitstream, 1 + 6, pic->mode_deltas[i]);
+  }
+}
+
+// 5.9.19 CDEF params syntax
+static void PackCdefParams(struct Bitstream* bitstream,
+                           const VAEncSequenceParameterBufferAV1* seq,
+                           const VAEncPictureParameterBufferAV1* pic) {
+  BitstreamAppend(bitstream, 2, pic->cdef_damping_minus_3);
+  BitstreamAppend(bitstream, 2, pic->cdef_bits);
+  for (uint32_t i = 0; i < 1u << pic->cdef_bits; i++) {
+    BitstreamAppend(bitstream, 4, pic->cdef_y_strengths[i] >> 2);
+    BitstreamAppend(bitstream, 2, pic->cdef_y_strengths[i] & 3);
+    if (!seq->seq_fields.bits.mono_chrome) {
+      BitstreamAppend(bitstream, 4, pic->cdef_uv_strengths[i] >> 2);
+      BitstreamAppend(bitstream, 2, pic->cdef_uv_strengths[i] & 3);
+    }
+  }
+}
+
+// 5.9.2 Uncompressed header syntax
+static bool PackUncompressedHeader(struct Bitstream* bitstream,
+                                   const VAEncSequenceParameterBufferAV1* seq,
+                                   const VAEncPictureParameterBufferAV1* pic,
+                                   struct FrameHeaderOffsets* offsets) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->picture_flags.bits)* pic_bits = &pic->picture_flags.bits;
+  const typeof(pic->mode_control_flags.bits)* mode_bits =
+      &pic->mode_control_flags.bits;
+
+  bool frame_is_intra = pic_bits->frame_type == KEY_FRAME ||
+                        pic_bits->frame_type == INTRA_ONLY_FRAME;
+  BitstreamAppend(bitstream, 1, show_existing_frame);
+  BitstreamAppend(bitstream, 2, pic_bits->frame_type);
+  BitstreamAppend(bitstream, 1, show_frame);
+
+  bool error_resilient_mode = pic_bits->error_resilient_mode;
+  if (pic_bits->frame_type == SWITCH_FRAME ||
+      (pic_bits->frame_type == KEY_FRAME && show_frame)) {
+    error_resilient_mode = 1;
+  } else {
+    BitstreamAppend(bitstream, 1, error_resilient_mode);
+  }
+  BitstreamAppend(bitstream, 1, pic_bits->disable_cdf_update);
+  if (pic_bits->frame_type != SWITCH_FRAME)
+    BitstreamAppend(bitstream, 1, frame_size_override_flag);
+  if (seq_bits->enable_order_hint) {
+    BitstreamAppend(bitstream, seq->order_hint_bits_minus_1 + 1,
+                    pic->order_hint);
+  }
+  if (!frame_is_intra && !error_resilient_mode)
+    BitstreamAppend(bitstream, 3, pic->primary_ref_frame);
+
+  uint8_t refresh_frame_flags = 0xff;
+  if (pic_bits->frame_type != SWITCH_FRAME &&
+      !(pic_bits->frame_type == KEY_FRAME && show_frame)) {
+    refresh_frame_flags = pic->refresh_frame_flags;
+    BitstreamAppend(bitstream, 8, refresh_frame_flags);
+  }
+  if ((!frame_is_intra || refresh_frame_flags != 0xff) &&
+      error_resilient_mode && seq_bits->enable_order_hint) {
+    fprintf(stderr,
+            "Error resilient reference order hints are not supported\n");
+    return false;
+  }
+
+  if (!frame_is_intra) {
+    if (seq_bits->enable_order_hint)
+      BitstreamAppend(bitstream, 1, frame_refs_short_signaling);
+    for (size_t i = 0; i < REFS_PER_FRAME; i++)
+      BitstreamAppend(bitstream, 3, pic->ref_frame_idx[i]);
+  }
+  // 5.9.5 Frame size syntax
+  if (seq_bits->enable_superres)
+    BitstreamAppend(bitstream, 1, pic_bits->use_superres);
+  if (pic_bits->use_superres) {
+    fprintf(stderr, "Superres is not supported\n");
+    return false;
+  }
+  // 5.9.6 Render size syntax
+  BitstreamAppend(bitstream, 1, render_and_frame_size_different);
+  if (!frame_is_intra) {
+    BitstreamAppend(bitstream, 1, pic_bits->allow_high_precision_mv);
+    // 5.9.10 Interpolation filter syntax
+    BitstreamAppend(bitstream, 1, pic->interpolation_filter == SWITCHABLE);
+    if (pic->interpolation_filter != SWITCHABLE)
+      BitstreamAppend(bitstream, 2, pic->interpolation_filter);
+    BitstreamAppend(bitstream, 1, is_motion_mode_switchable);
+    if (!error_resilient_mode && seq_bits->enable_ref_frame_mvs)
+      BitstreamAppend(bitstream, 1, pic_bits->use_ref_frame_mvs);
+  }
+  if (!pic_bits->disable_cdf_update)
+    BitstreamAppend(bitstream, 1, pic_bits->disable_frame_end_update_cdf);
+
+  PackTileInfo(bitstream, seq, pic);
+  offsets->bit_offset_qindex = (uint32_t)bitstream->size;
+  if (!PackQuantizationParams(bitstream, seq, pic)) return false;
+  offsets->bit_offset_segmentation = (uint32_t)bitstream->size;
+  BitstreamAppend(bitstream, 1,
+                  pic->segments.seg_flags.bits.segmentation_enabled);
+  if (pic->segments.seg_flags.bits.segmentation_enabled) {
+    fprintf(stderr, "Segmentation is not supported\n");
+    return false;
+  }
+
+  // 5.9.17 Quantizer index delta parameters syntax
+  if (pic->base_qindex > 0)
+    BitstreamAppend(bitstream, 1, mode_bits->delta_q_present);
+  if (mode_bits->delta_q_present) {
+    BitstreamAppend(bitstream, 2, mode_bits->delta_q_res);
+    // 5.9.18 Loop filter delta parameters syntax
+    if (!pic_bits->allow_intrabc)
+      BitstreamAppend(bitstream, 1, mode_bits->delta_lf_present);
+    if (mode_bits->delta_lf_present) {
+      BitstreamAppend(bitstream, 2, mode_bits->delta_lf_res);
+      BitstreamAppend(bitstream, 1, mode_bits->delta_lf_multi);
+    }
+  }
+
+  bool coded_lossless = !pic->base_qindex && !pic->y_dc_delta_q &&
+                        !pic->u_dc_delta_q && !pic->u_ac_delta_q &&
+                        !pic->v_dc_delta_q && !pic->v_ac_delta_q;
+  offsets->bit_offset_loopfilter_params = (uint32_t)bitstream->size;
+  if (!coded_lossless && !pic_bits->allow_intrabc)
+    PackLoopFilterParams(bitstream, seq, pic);
+  offsets->bit_offset_cdef_params = (uint32_t)bitstream->size;
+  if (!coded_lossless && !pic_bits->allow_intrabc && seq_bits->enable_cdef)
+    PackCdefParams(bitstream, seq, pic);
+  offsets->size_in_bits_cdef_params =
+      (uint32_t)bitstream->size - offsets->bit_offset_cdef_params;
+  if (!coded_lossless && !pic_bits->allow_intrabc &&
+      seq_bits->enable_restoration) {
+    fprintf(stderr, "Loop restoration is not supported\n");
+    return false;
+  }
+
+  // 5.9.21 TX mode syntax
+  if (!coded_lossless)
+    BitstreamAppend(bitstream, 1, mode_bits->tx_mode == 2);  // tx_mode_select
+  // 5.9.23 Frame reference mode syntax
+  if (!frame_is_intra)
+    BitstreamAppend(bitstream, 1, mode_bits->reference_mode != 0);
+  if (!frame_is_intra && mode_bits->reference_mode &&
+      seq_bits->enable_order_hint) {
+    fprintf(stderr, "Skip mode is not supported\n");
+    return false;
+  }
+  if (!frame_is_intra && !error_resilient_mode &&
+      seq_bits->enable_warped_motion)
+    BitstreamAppend(bitstream, 1, allow_warped_motion);
+  BitstreamAppend(bitstream, 1, pic_bits->reduced_tx_set);
+  // 5.9.24 Global motion params syntax
+  if (!frame_is_intra) {
+    for (size_t i = 0; i < REFS_PER_FRAME; i++)
+      BitstreamAppend(bitstream, 1, 0);  // is_global
+  }
+  return true;
+}
+
+// 5.9.1 General frame header OBU syntax
+bool PackFrameHeaderObu(struct Bitstream* bitstream,
+                        const VAEncSequenceParameterBufferAV1* seq,
+                        const VAEncPictureParameterBufferAV1* pic,
+                        struct FrameHeaderOffsets* offsets) {
+  char buffer_on_the_stack[256];
+  struct Bitstream frame_header_obu = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  if (!PackUncompressedHeader(&frame_header_obu, seq, pic, offsets))
+    return false;
+  PackTrailingBits(&frame_header_obu);
+
+  size_t obu_start = bitstream->size;
+  PackObu(bitstream, OBU_FRAME_HEADER, &frame_header_obu,
+          frame_header_obu_size_bytes);
+
+  uint32_t payload_start =
+      (uint32_t)(obu_start + 8 + frame_header_obu_size_bytes * 8);
+  offsets->bit_offset_qindex += payload_start;
+  offsets->bit_offset_segmentation += payload_start;
+  offsets->bit_offset_loopfilter_params += payload_start;
+  offsets->bit_offset_cdef_params += payload_start;
+  offsets->byte_offset_frame_hdr_obu_size = (uint32_t)(obu_start / 8 + 1);
+  offsets->size_in_bits_frame_hdr_obu =
+      (uint32_t)(bitstream->size - obu_start);
+  return true;
+}
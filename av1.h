@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_AV1_H_
+#define STREAMER_AV1_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// 6.2.2 OBU header semantics
+enum ObuType {
+  OBU_SEQUENCE_HEADER = 1,
+  OBU_TEMPORAL_DELIMITER = 2,
+  OBU_FRAME_HEADER = 3,
+  OBU_TILE_GROUP = 4,
+  OBU_METADATA = 5,
+  OBU_FRAME = 6,
+  OBU_PADDING = 15,
+};
+
+// 6.8.2 Uncompressed header semantics
+enum FrameType {
+  KEY_FRAME = 0,
+  INTER_FRAME = 1,
+  INTRA_ONLY_FRAME = 2,
+  SWITCH_FRAME = 3,
+};
+
+struct Bitstream;
+
+struct MoreSequenceHeader {
+  uint32_t max_frame_width_minus_1;
+  uint32_t max_frame_height_minus_1;
+  bool color_description_present_flag;
+  uint8_t color_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  bool color_range;
+  uint8_t chroma_sample_position;
+};
+
+// Uniform tile layout with the smallest tile count the frame size allows,
+// in the form both the frame header and the va picture buffer expect.
+struct TileInfo {
+  uint8_t tile_cols_log2;
+  uint8_t tile_rows_log2;
+  uint8_t tile_cols;
+  uint8_t tile_rows;
+  uint16_t width_in_sbs_minus_1[64];
+  uint16_t height_in_sbs_minus_1[64];
+};
+
+// Bit offsets are counted from the start of the bitstream passed to the
+// packer, which is what the va picture buffer expects when the packed
+// picture header carries several OBUs.
+struct FrameHeaderOffsets {
+  uint32_t bit_offset_qindex;
+  uint32_t bit_offset_segmentation;
+  uint32_t bit_offset_loopfilter_params;
+  uint32_t bit_offset_cdef_params;
+  uint32_t size_in_bits_cdef_params;
+  uint32_t byte_offset_frame_hdr_obu_size;
+  uint32_t size_in_bits_frame_hdr_obu;
+};
+
+void DeriveUniformTileInfo(uint32_t frame_width, uint32_t frame_height,
+                           bool use_128x128_superblock,
+                           struct TileInfo* tile_info);
+void PackTemporalDelimiterObu(struct Bitstream* bitstream);
+bool PackSequenceHeaderObu(struct Bitstream* bitstream,
+                           const VAEncSequenceParameterBufferAV1* seq,
+                           const struct MoreSequenceHeader* msh);
+bool PackFrameHeaderObu(struct Bitstream* bitstream,
+                        const VAEncSequenceParameterBufferAV1* seq,
+                        const VAEncPictureParameterBufferAV1* pic,
+                        struct FrameHeaderOffsets* offsets);
+
+#endif  // STREAMER_AV1_H_
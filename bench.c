@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "colorspace.h"
+#include "encode.h"
+#include "gpu.h"
+
+// Same as a regular session asks for, downgraded sessions are paced.
+#define BENCH_SESSION_FPS 30.0
+#define BENCH_MIN_FPS 15.0
+#define BENCH_DMA_HEAP "/dev/dma_heap/system"
+
+// Stands in for a captured or composited rgb frame, converted by the gpu like
+// real ones are.
+struct BenchSource {
+  int dmabuf_fd;
+  uint32_t pitch;
+  size_t size;
+  uint8_t* data;
+  struct GpuFrame* gpu_frame;
+};
+
+struct BenchSession {
+  const struct BenchConfig* bench_config;
+  // Every session converts on its own context shared with this one.
+  struct GpuContext* gpu_context;
+  pthread_barrier_t* barrier;
+  size_t index;
+  uint64_t* latencies;
+  size_t frames;
+  enum CapacityVerdict verdict;
+  double fps;
+};
+
+static uint64_t MicrosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int CompareLatencies(const void* a, const void* b) {
+  uint64_t lhs = *(const uint64_t*)a;
+  uint64_t rhs = *(const uint64_t*)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static double Percentile(const uint64_t* sorted, size_t count,
+                         double percentile) {
+  if (!count) return 0;
+  size_t index = (size_t)(percentile * (double)(count - 1) + 0.5);
+  return (double)sorted[index] / 1000.0;
+}
+
+static void StandinUpload(const struct BenchConfig* bench_config,
+                          uint8_t* staging, const uint8_t* y_data,
+                          const uint8_t* u_data, const uint8_t* v_data) {
+  // Mimic a derived va image with 64-byte aligned pitches.
+  size_t pitch = (bench_config->width + 63) & ~(size_t)63;
+  size_t chroma_width = bench_config->width / 2;
+  for (uint32_t y = 0; y < bench_config->height; y++) {
+    memcpy(staging + y * pitch, y_data + y * bench_config->width,
+           bench_config->width);
+  }
+  uint8_t* chroma = staging + pitch * bench_config->height;
+  for (uint32_t y = 0; y < bench_config->height / 2; y++) {
+    memcpy(chroma + y * pitch, u_data + y * chroma_width, chroma_width);
+    memcpy(chroma + y * pitch + pitch / 2, v_data + y * chroma_width,
+           chroma_width);
+  }
+}
+
+static bool CreateSource(struct GpuContext* gpu_context,
+                         const struct BenchConfig* bench_config,
+                         struct BenchSource* source) {
+  *source = (struct BenchSource){.dmabuf_fd = -1};
+  int heap = open(BENCH_DMA_HEAP, O_RDONLY | O_CLOEXEC);
+  if (heap == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", BENCH_DMA_HEAP,
+            strerror(errno));
+    return false;
+  }
+  source->pitch = (bench_config->width * 4 + 63) & ~63u;
+  source->size = (size_t)source->pitch * bench_config->height;
+  struct dma_heap_allocation_data allocation = {
+      .len = source->size,
+      .fd_flags = O_RDWR | O_CLOEXEC,
+  };
+  int result = ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &allocation);
+  close(heap);
+  if (result) {
+    fprintf(stderr, "Failed to allocate source dmabuf: %s\n",
+            strerror(errno));
+    return false;
+  }
+  source->dmabuf_fd = (int)allocation.fd;
+
+  source->data = mmap(NULL, source->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      source->dmabuf_fd, 0);
+  if (source->data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map source dmabuf: %s\n", strerror(errno));
+    goto rollback_dmabuf;
+  }
+  struct GpuFramePlane plane = {
+      .dmabuf_fd = source->dmabuf_fd,
+      .pitch = source->pitch,
+      .modifier = DRM_FORMAT_MOD_LINEAR,
+  };
+  source->gpu_frame =
+      GpuContextImportFrame(gpu_context, bench_config->width,
+                            bench_config->height, DRM_FORMAT_XRGB8888, 1,
+                            &plane);
+  if (!source->gpu_frame) {
+    fprintf(stderr, "Failed to import source dmabuf\n");
+    goto rollback_data;
+  }
+  return true;
+
+rollback_data:
+  munmap(source->data, source->size);
+rollback_dmabuf:
+  close(source->dmabuf_fd);
+  source->dmabuf_fd = -1;
+  return false;
+}
+
+static uint8_t Clamp(int value) {
+  return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Full range bt.709, matching the conversion the session is set up with.
+static bool FillSource(const struct BenchConfig* bench_config,
+                       struct BenchSource* source, const uint8_t* y_data,
+                       const uint8_t* u_data, const uint8_t* v_data) {
+  struct dma_buf_sync sync = {.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE};
+  if (ioctl(source->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+    fprintf(stderr, "Failed to sync source dmabuf: %s\n", strerror(errno));
+    return false;
+  }
+  size_t chroma_width = bench_config->width / 2;
+  for (uint32_t y = 0; y < bench_config->height; y++) {
+    uint32_t* row = (uint32_t*)(source->data + (size_t)y * source->pitch);
+    const uint8_t* luma = y_data + (size_t)y * bench_config->width;
+    const uint8_t* cb = u_data + (size_t)(y / 2) * chroma_width;
+    const uint8_t* cr = v_data + (size_t)(y / 2) * chroma_width;
+    for (uint32_t x = 0; x < bench_config->width; x++) {
+      int u = cb[x / 2] - 128;
+      int v = cr[x / 2] - 128;
+      int l = luma[x] * 256;
+      row[x] = (uint32_t)Clamp((l + 403 * v) >> 8) << 16 |
+               (uint32_t)Clamp((l - 48 * u - 120 * v) >> 8) << 8 |
+               Clamp((l + 475 * u) >> 8);
+    }
+  }
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+  if (ioctl(source->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+    fprintf(stderr, "Failed to sync source dmabuf: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static void DestroySource(struct GpuContext* gpu_context,
+                          struct BenchSource* source) {
+  if (source->dmabuf_fd == -1) return;
+  GpuContextDestroyFrame(gpu_context, source->gpu_frame);
+  munmap(source->data, source->size);
+  close(source->dmabuf_fd);
+}
+
+static bool RunSession(struct BenchSession* bench_session, uint8_t* y_data,
+                       uint8_t* u_data, uint8_t* v_data,
+                       struct SynthSource* synth_source) {
+  const struct BenchConfig* bench_config = bench_session->bench_config;
+  struct GpuContext* gpu_context = NULL;
+  struct EncodeContext* encode_context = NULL;
+  struct BenchSource source = {.dmabuf_fd = -1};
+  uint8_t* staging = NULL;
+  int fd = -1;
+  bool result = false;
+  uint64_t ticket = 0;
+  uint64_t interval = 0;
+
+  bench_session->fps = BENCH_SESSION_FPS;
+  if (bench_config->capacity_model) {
+    struct CapacityKey key = {
+        .entrypoint = EncodeCodecEntrypoint(bench_config->codec),
+        .preset = (uint32_t)bench_config->codec,
+    };
+    bench_session->verdict = CapacityModelAdmit(
+        bench_config->capacity_model, &key, bench_config->width,
+        bench_config->height, BENCH_MIN_FPS, &bench_session->fps, &ticket);
+    if (bench_session->verdict == kCapacityRejected) goto wait_barrier;
+    if (bench_session->verdict == kCapacityDowngraded)
+      interval = (uint64_t)(1e6 / bench_session->fps);
+  }
+
+  if (bench_config->standin) {
+    size_t pitch = (bench_config->width + 63) & ~(size_t)63;
+    staging = malloc(pitch * bench_config->height * 3 / 2);
+    if (!staging) {
+      fprintf(stderr, "Failed to allocate staging buffer: %s\n",
+              strerror(errno));
+      goto wait_barrier;
+    }
+  } else {
+    gpu_context = GpuContextCreateShared(bench_session->gpu_context);
+    if (!gpu_context) {
+      fprintf(stderr, "Failed to create shared gpu context\n");
+      goto wait_barrier;
+    }
+    encode_context =
+        EncodeContextCreate(gpu_context, bench_config->width,
+                            bench_config->height, kItuRec709, kFullRange,
+                            bench_config->codec);
+    if (!encode_context) {
+      fprintf(stderr, "Failed to create encode context\n");
+      goto wait_barrier;
+    }
+    if (!CreateSource(gpu_context, bench_config, &source)) goto wait_barrier;
+    fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+      goto wait_barrier;
+    }
+  }
+  result = true;
+
+wait_barrier:
+  // Sessions that failed to initialize still have to reach the barrier,
+  // otherwise the rest of them would never start.
+  pthread_barrier_wait(bench_session->barrier);
+  // Generating the content is not part of a session's work, so latency only
+  // covers the conversion and the encode, or the upload that stands in for
+  // them. Conversions of all sessions run concurrently on their own contexts.
+  uint64_t deadline = MicrosNow();
+  for (size_t i = 0; result && i < bench_config->frames; i++) {
+    if (interval) {
+      uint64_t now = MicrosNow();
+      if (deadline > now) usleep((useconds_t)(deadline - now));
+      deadline += interval;
+    }
+    SynthSourceFill(synth_source, i, y_data, u_data, v_data);
+    uint64_t started = 0;
+    if (bench_config->standin) {
+      started = MicrosNow();
+      StandinUpload(bench_config, staging, y_data, u_data, v_data);
+    } else if (FillSource(bench_config, &source, y_data, u_data, v_data)) {
+      started = MicrosNow();
+      result = GpuContextConvertFrame(gpu_context, source.gpu_frame,
+                                      EncodeContextGetFrame(encode_context),
+                                      NULL, NULL) &&
+               EncodeContextEncodeFrame(encode_context, fd, started);
+    } else {
+      result = false;
+    }
+    if (!result) {
+      fprintf(stderr, "Failed to encode frame %zu in session %zu\n", i,
+              bench_session->index);
+      break;
+    }
+    bench_session->latencies[bench_session->frames++] = MicrosNow() - started;
+  }
+
+  if (fd != -1) close(fd);
+  DestroySource(gpu_context, &source);
+  if (encode_context) EncodeContextDestroy(encode_context);
+  if (gpu_context) GpuContextDestroy(gpu_context);
+  free(staging);
+  if (ticket) CapacityModelRelease(bench_config->capacity_model, ticket);
+  return result;
+}
+
+static void* SessionThread(void* arg) {
+  struct BenchSession* bench_session = arg;
+  const struct BenchConfig* bench_config = bench_session->bench_config;
+  size_t luma_size = (size_t)bench_config->width * bench_config->height;
+  uint8_t* planes = malloc(luma_size * 3 / 2);
+  struct SynthSource* synth_source =
+      SynthSourceCreate(bench_config->width, bench_config->height,
+                        bench_config->complexity);
+  if (!planes || !synth_source) {
+    fprintf(stderr, "Failed to prepare synthetic source\n");
+    pthread_barrier_wait(bench_session->barrier);
+    goto rollback;
+  }
+  RunSession(bench_session, planes, planes + luma_size,
+             planes + luma_size + luma_size / 4, synth_source);
+
+rollback:
+  if (synth_source) SynthSourceDestroy(synth_source);
+  free(planes);
+  return NULL;
+}
+
+static bool RunStep(const struct BenchConfig* bench_config,
+                    struct GpuContext* gpu_context, size_t sessions) {
+  bool result = false;
+  struct BenchSession* bench_sessions =
+      calloc(sessions, sizeof(struct BenchSession));
+  pthread_t* threads = calloc(sessions, sizeof(pthread_t));
+  uint64_t* latencies =
+      calloc(sessions * bench_config->frames, sizeof(uint64_t));
+  if (!bench_sessions || !threads || !latencies) {
+    fprintf(stderr, "Failed to allocate benchmark step: %s\n",
+            strerror(errno));
+    goto rollback_allocations;
+  }
+
+  pthread_barrier_t barrier;
+  if (pthread_barrier_init(&barrier, NULL, (unsigned)sessions + 1)) {
+    fprintf(stderr, "Failed to create barrier\n");
+    goto rollback_allocations;
+  }
+
+  size_t started = 0;
+  for (; started < sessions; started++) {
+    bench_sessions[started] = (struct BenchSession){
+        .bench_config = bench_config,
+        .gpu_context = gpu_context,
+        .barrier = &barrier,
+        .index = started,
+        .latencies = latencies + started * bench_config->frames,
+    };
+    if (pthread_create(&threads[started], NULL, SessionThread,
+                       &bench_sessions[started])) {
+      fprintf(stderr, "Failed to create session thread\n");
+      break;
+    }
+  }
+  if (started != sessions) {
+    // The barrier can not be shrunk, so the missing threads are impersonated
+    // until everybody who is waiting gets released.
+    for (size_t i = started; i < sessions; i++) pthread_barrier_wait(&barrier);
+  }
+  pthread_barrier_wait(&barrier);
+  uint64_t step_started = MicrosNow();
+  for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  uint64_t elapsed = MicrosNow() - step_started;
+  pthread_barrier_destroy(&barrier);
+
+  size_t total_frames = 0;
+  size_t admitted = 0;
+  for (size_t i = 0; i < sessions; i++) {
+    total_frames += bench_sessions[i].frames;
+    if (bench_sessions[i].verdict != kCapacityRejected) admitted++;
+  }
+  printf("%zu session(s): %.1f fps aggregate, %zu frames in %.3f s\n",
+         sessions, elapsed ? (double)total_frames * 1e6 / (double)elapsed : 0,
+         total_frames, (double)elapsed / 1e6);
+  for (size_t i = 0; i < sessions; i++) {
+    struct BenchSession* bench_session = &bench_sessions[i];
+    if (bench_session->verdict == kCapacityRejected) {
+      printf("  session %zu: rejected by the capacity model\n", i);
+      continue;
+    }
+    if (bench_session->verdict == kCapacityDowngraded)
+      printf("  session %zu: downgraded to %.1f fps\n", i, bench_session->fps);
+    qsort(bench_session->latencies, bench_session->frames, sizeof(uint64_t),
+          CompareLatencies);
+    printf("  session %zu: %zu frames, latency p50 %.2f ms, p90 %.2f ms, "
+           "p99 %.2f ms, max %.2f ms\n",
+           i, bench_session->frames,
+           Percentile(bench_session->latencies, bench_session->frames, 0.5),
+           Percentile(bench_session->latencies, bench_session->frames, 0.9),
+           Percentile(bench_session->latencies, bench_session->frames, 0.99),
+           Percentile(bench_session->latencies, bench_session->frames, 1));
+  }
+  result = started == sessions &&
+           total_frames == admitted * bench_config->frames;
+
+rollback_allocations:
+  free(latencies);
+  free(threads);
+  free(bench_sessions);
+  return result;
+}
+
+bool BenchRun(const struct BenchConfig* bench_config) {
+  printf("Benchmark: %ux%u, %zu frames per session, complexity %d, %s\n",
+         bench_config->width, bench_config->height, bench_config->frames,
+         bench_config->complexity,
+         bench_config->standin ? "stand-in backend" : "hardware backend");
+  // Owns the programs and the vertex buffer shared by session contexts, and
+  // outlives them.
+  struct GpuContext* gpu_context = NULL;
+  if (!bench_config->standin) {
+    gpu_context = GpuContextCreate(kItuRec709, kFullRange);
+    if (!gpu_context) {
+      fprintf(stderr, "Failed to create gpu context\n");
+      return false;
+    }
+  }
+  bool result = true;
+  for (size_t sessions = 1; sessions <= bench_config->max_sessions;
+       sessions++) {
+    if (!RunStep(bench_config, gpu_context, sessions)) {
+      fprintf(stderr, "Benchmark step with %zu sessions failed\n", sessions);
+      result = false;
+      break;
+    }
+  }
+  if (gpu_context) GpuContextDestroy(gpu_context);
+  return result;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_BENCH_H_
+#define STREAMER_BENCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capacity.h"
+#include "encode.h"
+#include "synth.h"
+
+struct BenchConfig {
+  uint32_t width;
+  uint32_t height;
+  size_t max_sessions;
+  size_t frames;
+  enum SynthComplexity complexity;
+  enum EncodeCodec codec;
+  // Replaces gpu and va with a plain copy into a pitched staging buffer.
+  bool standin;
+  // Shared by all sessions, which are admitted, downgraded or rejected like
+  // real ones. NULL admits every session.
+  struct CapacityModel* capacity_model;
+};
+
+// Runs 1..max_sessions concurrent sessions fed by synthetic frames and
+// prints aggregate fps and per-session latency percentiles for each step.
+bool BenchRun(const struct BenchConfig* bench_config);
+
+#endif  // STREAMER_BENCH_H_
@@ -17,6 +17,9 @@
 
 #include "bitstream.h"
 
+#include <endian.h>
+#include <string.h>
+
 void BitstreamAppend(struct Bitstream* bitstream, size_t size, uint32_t bits) {
   uint8_t* ptr = (uint8_t*)bitstream->data + bitstream->size / 8;
   size_t vacant_bits = 8 - bitstream->size % 8;
@@ -75,3 +78,81 @@ void BitstreamInflate(struct Bitstream* bitstream,
 
   bitstream->size = (size_t)(dst_data - (uint8_t*)bitstream->data) * 8;
 }
+
+void BitstreamDeflate(struct Bitstream* bitstream,
+                      const struct Bitstream* source) {
+  uint8_t* dst_data = (uint8_t*)bitstream->data + (bitstream->size + 7) / 8;
+  const uint8_t* src_data = source->data;
+  size_t src_size = (source->size + 7) / 8;
+
+  size_t zeros = 0;
+  for (size_t i = 0; i < src_size; i++) {
+    // emulation_prevention_three_byte
+    if (zeros >= 2 && src_data[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = src_data[i] ? 0 : zeros + 1;
+    *dst_data++ = src_data[i];
+  }
+
+  bitstream->size = (size_t)(dst_data - (uint8_t*)bitstream->data) * 8;
+}
+
+// Returns 32 bits starting at the current offset without consuming them.
+// The common case is a single unaligned big-endian word load, so reading is
+// independent of the field width. Only the last few bytes of the stream take
+// the bytewise path that zero-fills everything past the end.
+static uint32_t BitstreamPeek(const struct BitstreamReader* reader) {
+  const uint8_t* data = reader->data;
+  size_t byte_offset = reader->offset / 8;
+  size_t byte_size = (reader->size + 7) / 8;
+  uint64_t word = 0;
+  if (reader->offset + 32 <= reader->size && byte_offset + 8 <= byte_size) {
+    memcpy(&word, data + byte_offset, sizeof(word));
+    word = be64toh(word);
+  } else {
+    if (reader->offset >= reader->size) return 0;
+    for (size_t i = 0; i < 8 && byte_offset + i < byte_size; i++)
+      word |= (uint64_t)data[byte_offset + i] << (56 - i * 8);
+    size_t valid_bits = reader->size - byte_offset * 8;
+    if (valid_bits < 64) word &= ~UINT64_C(0) << (64 - valid_bits);
+  }
+  return (uint32_t)(word << (reader->offset % 8) >> 32);
+}
+
+uint32_t BitstreamRead(struct BitstreamReader* reader, size_t size) {
+  if (!size) return 0;
+  uint32_t result = BitstreamPeek(reader) >> (32 - size);
+  reader->offset += size;
+  return result;
+}
+
+uint32_t BitstreamReadUE(struct BitstreamReader* reader) {
+  // Codes up to 31 bits long are decoded from a single peek.
+  uint32_t bits = BitstreamPeek(reader);
+  if (bits >= 1u << 16) {
+    size_t length = (size_t)__builtin_clz(bits) * 2 + 1;
+    reader->offset += length;
+    return (bits >> (32 - length)) - 1;
+  }
+
+  size_t leading_zeros = 0;
+  while (!BitstreamRead(reader, 1)) {
+    if (BitstreamExhausted(reader) || ++leading_zeros == 32) return 0;
+  }
+  return (1u << leading_zeros) - 1 + BitstreamRead(reader, leading_zeros);
+}
+
+int32_t BitstreamReadSE(struct BitstreamReader* reader) {
+  uint32_t bits = BitstreamReadUE(reader);
+  return bits & 1 ? (int32_t)(bits / 2 + 1) : -(int32_t)(bits / 2);
+}
+
+void BitstreamSkip(struct BitstreamReader* reader, size_t size) {
+  reader->offset += size;
+}
+
+bool BitstreamExhausted(const struct BitstreamReader* reader) {
+  return reader->offset > reader->size;
+}
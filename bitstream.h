@@ -18,6 +18,7 @@
 #ifndef STREAMER_BITSTREAM_H_
 #define STREAMER_BITSTREAM_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -33,5 +34,20 @@ void BitstreamByteAlign(struct Bitstream* bitstream);
 
 void BitstreamInflate(struct Bitstream* bitstream,
                       const struct Bitstream* source);
+void BitstreamDeflate(struct Bitstream* bitstream,
+                      const struct Bitstream* source);
+
+// Reading past the end yields zero bits and leaves the reader exhausted.
+struct BitstreamReader {
+  const void* data;
+  size_t size;
+  size_t offset;
+};
+
+uint32_t BitstreamRead(struct BitstreamReader* reader, size_t size);
+uint32_t BitstreamReadUE(struct BitstreamReader* reader);
+int32_t BitstreamReadSE(struct BitstreamReader* reader);
+void BitstreamSkip(struct BitstreamReader* reader, size_t size);
+bool BitstreamExhausted(const struct BitstreamReader* reader);
 
 #endif  // STREAMER_BITSTREAM_H_
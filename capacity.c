@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "capacity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "encode.h"
+#include "synth.h"
+
+// Leave some headroom, because the engine is also used by whatever else is
+// running on the device, and the calibration is never exact.
+#define CAPACITY_DEFAULT_BUDGET 0.9
+
+struct CapacityRate {
+  struct CapacityKey key;
+  double pixels_per_second;
+};
+
+struct CapacitySession {
+  uint64_t ticket;
+  double cost;
+};
+
+struct CapacityModel {
+  char device[64];
+  pthread_mutex_t mutex;
+  double budget;
+
+  size_t rates_count;
+  struct CapacityRate rates[16];
+
+  size_t sessions_count;
+  struct CapacitySession sessions[64];
+  uint64_t next_ticket;
+
+  int registry;
+};
+
+// Sessions of other processes found in the registry, along with their lines
+// to write back.
+struct CapacityForeign {
+  char* lines;
+  size_t size;
+  size_t sessions;
+  double cost;
+};
+
+static unsigned long long MicrosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL +
+         (unsigned long long)ts.tv_nsec / 1000ULL;
+}
+
+static struct CapacityRate* FindRate(struct CapacityModel* capacity_model,
+                                     const struct CapacityKey* key) {
+  for (size_t i = 0; i < capacity_model->rates_count; i++) {
+    struct CapacityRate* rate = &capacity_model->rates[i];
+    if (rate->key.entrypoint == key->entrypoint &&
+        rate->key.preset == key->preset)
+      return rate;
+  }
+  return NULL;
+}
+
+struct CapacityModel* CapacityModelCreate(const char* device) {
+  struct CapacityModel* capacity_model = malloc(sizeof(struct CapacityModel));
+  if (!capacity_model) {
+    fprintf(stderr, "Failed to allocate capacity model: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *capacity_model = (struct CapacityModel){
+      .budget = CAPACITY_DEFAULT_BUDGET,
+      .next_ticket = 1,
+      .registry = -1,
+  };
+  snprintf(capacity_model->device, sizeof(capacity_model->device), "%s",
+           device);
+  pthread_mutex_init(&capacity_model->mutex, NULL);
+  return capacity_model;
+}
+
+bool CapacityModelLoad(struct CapacityModel* capacity_model, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open capacity file %s: %s\n", path,
+            strerror(errno));
+    return false;
+  }
+
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    char device[64];
+    struct CapacityKey key;
+    double pixels_per_second;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "%63s %u %u %lf", device, &key.entrypoint, &key.preset,
+               &pixels_per_second) != 4) {
+      fprintf(stderr, "Malformed capacity entry: %s", line);
+      continue;
+    }
+    if (strcmp(device, capacity_model->device)) continue;
+    CapacityModelSetRate(capacity_model, &key, pixels_per_second);
+  }
+
+  fclose(file);
+  return true;
+}
+
+bool CapacityModelSave(struct CapacityModel* capacity_model,
+                       const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to create capacity file %s: %s\n", path,
+            strerror(errno));
+    return false;
+  }
+
+  fprintf(file, "# device entrypoint preset pixels_per_second\n");
+  pthread_mutex_lock(&capacity_model->mutex);
+  for (size_t i = 0; i < capacity_model->rates_count; i++) {
+    const struct CapacityRate* rate = &capacity_model->rates[i];
+    fprintf(file, "%s %u %u %.0f\n", capacity_model->device,
+            rate->key.entrypoint, rate->key.preset, rate->pixels_per_second);
+  }
+  pthread_mutex_unlock(&capacity_model->mutex);
+
+  bool result = !ferror(file);
+  if (fclose(file) || !result) {
+    fprintf(stderr, "Failed to write capacity file %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+void CapacityModelSetRate(struct CapacityModel* capacity_model,
+                          const struct CapacityKey* key,
+                          double pixels_per_second) {
+  pthread_mutex_lock(&capacity_model->mutex);
+  struct CapacityRate* rate = FindRate(capacity_model, key);
+  if (!rate) {
+    if (capacity_model->rates_count == LENGTH(capacity_model->rates)) {
+      fprintf(stderr, "Too many capacity entries\n");
+      goto unlock;
+    }
+    rate = &capacity_model->rates[capacity_model->rates_count++];
+    rate->key = *key;
+  }
+  rate->pixels_per_second = pixels_per_second;
+
+unlock:
+  pthread_mutex_unlock(&capacity_model->mutex);
+}
+
+bool CapacityModelShare(struct CapacityModel* capacity_model,
+                        const char* path) {
+  int registry = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (registry == -1) {
+    fprintf(stderr, "Failed to open capacity registry %s: %s\n", path,
+            strerror(errno));
+    return false;
+  }
+  pthread_mutex_lock(&capacity_model->mutex);
+  if (capacity_model->registry != -1) close(capacity_model->registry);
+  capacity_model->registry = registry;
+  pthread_mutex_unlock(&capacity_model->mutex);
+  return true;
+}
+
+static bool LockRegistry(int registry, int operation) {
+  while (flock(registry, operation)) {
+    if (errno == EINTR) continue;
+    fprintf(stderr, "Failed to lock capacity registry: %s\n",
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Keeps the sessions of other live processes. Own sessions are always
+// rewritten from memory, so the ones found in the registry are dropped.
+static bool ReadRegistry(int registry, struct CapacityForeign* foreign) {
+  *foreign = (struct CapacityForeign){0};
+  struct stat st;
+  if (fstat(registry, &st)) {
+    fprintf(stderr, "Failed to stat capacity registry: %s\n",
+            strerror(errno));
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  char* text = malloc(size + 1);
+  foreign->lines = malloc(size + 1);
+  if (!text || !foreign->lines) {
+    fprintf(stderr, "Failed to allocate capacity registry: %s\n",
+            strerror(errno));
+    goto rollback_text;
+  }
+  ssize_t result = pread(registry, text, size, 0);
+  if (result < 0) {
+    fprintf(stderr, "Failed to read capacity registry: %s\n",
+            strerror(errno));
+    goto rollback_text;
+  }
+  text[result] = 0;
+
+  pid_t self = getpid();
+  for (char *line = text, *next; *line; line = next) {
+    next = strchr(line, '\n');
+    next = next ? next + 1 : line + strlen(line);
+    int pid;
+    unsigned long long ticket;
+    double cost;
+    if (sscanf(line, "%d %llu %lf", &pid, &ticket, &cost) != 3 || pid <= 0 ||
+        pid == self || (kill(pid, 0) && errno == ESRCH))
+      continue;
+    memcpy(foreign->lines + foreign->size, line, (size_t)(next - line));
+    foreign->size += (size_t)(next - line);
+    foreign->sessions++;
+    foreign->cost += cost;
+  }
+  free(text);
+  return true;
+
+rollback_text:
+  free(text);
+  free(foreign->lines);
+  foreign->lines = NULL;
+  return false;
+}
+
+static bool WriteRegistry(const struct CapacityModel* capacity_model,
+                          const struct CapacityForeign* foreign) {
+  size_t capacity = foreign->size + capacity_model->sessions_count * 64 + 1;
+  char* text = malloc(capacity);
+  if (!text) {
+    fprintf(stderr, "Failed to allocate capacity registry: %s\n",
+            strerror(errno));
+    return false;
+  }
+  memcpy(text, foreign->lines, foreign->size);
+  size_t size = foreign->size;
+  for (size_t i = 0; i < capacity_model->sessions_count; i++) {
+    const struct CapacitySession* session = &capacity_model->sessions[i];
+    size += (size_t)snprintf(text + size, capacity - size, "%d %llu %.9f\n",
+                             (int)getpid(),
+                             (unsigned long long)session->ticket,
+                             session->cost);
+  }
+  bool result = !ftruncate(capacity_model->registry, 0) &&
+                pwrite(capacity_model->registry, text, size, 0) ==
+                    (ssize_t)size;
+  if (!result)
+    fprintf(stderr, "Failed to write capacity registry: %s\n",
+            strerror(errno));
+  free(text);
+  return result;
+}
+
+// Called with the mutex held. Returns the foreign sessions with the registry
+// locked until FinishRegistry, or none if there is no registry.
+static bool BeginRegistry(struct CapacityModel* capacity_model,
+                          struct CapacityForeign* foreign) {
+  *foreign = (struct CapacityForeign){0};
+  if (capacity_model->registry == -1) return true;
+  if (!LockRegistry(capacity_model->registry, LOCK_EX)) return false;
+  if (!ReadRegistry(capacity_model->registry, foreign)) {
+    LockRegistry(capacity_model->registry, LOCK_UN);
+    return false;
+  }
+  return true;
+}
+
+static void FinishRegistry(struct CapacityModel* capacity_model,
+                           struct CapacityForeign* foreign, bool write) {
+  if (capacity_model->registry == -1) return;
+  if (write) WriteRegistry(capacity_model, foreign);
+  LockRegistry(capacity_model->registry, LOCK_UN);
+  free(foreign->lines);
+}
+
+bool CapacityModelCalibrate(struct CapacityModel* capacity_model,
+                            const struct CapacityKey* key,
+                            struct EncodeContext* encode_context,
+                            uint32_t width, uint32_t height, size_t frames) {
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Re-encoding an unchanged surface is much cheaper than real content, so
+  // every frame is refilled with moving grain. Only the encode is timed.
+  bool result = false;
+  size_t luma_size = (size_t)width * height;
+  uint8_t* planes = malloc(luma_size * 3 / 2);
+  if (!planes) {
+    fprintf(stderr, "Failed to allocate calibration frame: %s\n",
+            strerror(errno));
+    goto rollback_fd;
+  }
+  struct SynthSource* synth_source =
+      SynthSourceCreate(width, height, kSynthGrain);
+  if (!synth_source) {
+    fprintf(stderr, "Failed to create calibration source\n");
+    goto rollback_planes;
+  }
+
+  // First frame carries all the lazy driver initialization and is not timed.
+  unsigned long long elapsed = 0;
+  for (size_t i = 0; i <= frames; i++) {
+    SynthSourceFill(synth_source, i, planes, planes + luma_size,
+                    planes + luma_size + luma_size / 4);
+    if (!EncodeContextWriteYuvData(encode_context, planes, planes + luma_size,
+                                   planes + luma_size + luma_size / 4, width,
+                                   height)) {
+      fprintf(stderr, "Failed to upload calibration frame\n");
+      goto rollback_synth_source;
+    }
+    unsigned long long started = MicrosNow();
+    if (!EncodeContextEncodeFrame(encode_context, fd, started)) {
+      fprintf(stderr, "Failed to encode calibration frame\n");
+      goto rollback_synth_source;
+    }
+    if (i) elapsed += MicrosNow() - started;
+  }
+  if (!elapsed) elapsed = 1;
+
+  double pixels_per_second =
+      (double)width * height * (double)frames * 1e6 / (double)elapsed;
+  CapacityModelSetRate(capacity_model, key, pixels_per_second);
+  result = true;
+
+rollback_synth_source:
+  SynthSourceDestroy(synth_source);
+rollback_planes:
+  free(planes);
+rollback_fd:
+  close(fd);
+  return result;
+}
+
+enum CapacityVerdict CapacityModelAdmit(struct CapacityModel* capacity_model,
+                                        const struct CapacityKey* key,
+                                        uint32_t width, uint32_t height,
+                                        double min_fps, double* fps,
+                                        uint64_t* ticket) {
+  enum CapacityVerdict verdict = kCapacityRejected;
+  pthread_mutex_lock(&capacity_model->mutex);
+  if (capacity_model->sessions_count == LENGTH(capacity_model->sessions)) {
+    fprintf(stderr, "Too many sessions on %s\n", capacity_model->device);
+    goto unlock;
+  }
+  struct CapacityForeign foreign;
+  if (!BeginRegistry(capacity_model, &foreign)) goto unlock;
+
+  // Without calibration data there is nothing to reason about, so the session
+  // is admitted without being accounted for.
+  double cost = 0;
+  const struct CapacityRate* rate = FindRate(capacity_model, key);
+  if (rate && rate->pixels_per_second > 0) {
+    double pixels = (double)width * height;
+    double available = capacity_model->budget - foreign.cost;
+    for (size_t i = 0; i < capacity_model->sessions_count; i++)
+      available -= capacity_model->sessions[i].cost;
+    cost = pixels * *fps / rate->pixels_per_second;
+    if (cost > available) {
+      double fitting_fps = available * rate->pixels_per_second / pixels;
+      if (min_fps <= 0 || fitting_fps < min_fps) goto finish_registry;
+      *fps = fitting_fps;
+      cost = available;
+      verdict = kCapacityDowngraded;
+    }
+  }
+
+  if (verdict != kCapacityDowngraded) verdict = kCapacityAdmitted;
+  *ticket = capacity_model->next_ticket++;
+  capacity_model->sessions[capacity_model->sessions_count++] =
+      (struct CapacitySession){
+          .ticket = *ticket,
+          .cost = cost,
+      };
+
+finish_registry:
+  FinishRegistry(capacity_model, &foreign, verdict != kCapacityRejected);
+unlock:
+  pthread_mutex_unlock(&capacity_model->mutex);
+  return verdict;
+}
+
+void CapacityModelRelease(struct CapacityModel* capacity_model,
+                          uint64_t ticket) {
+  pthread_mutex_lock(&capacity_model->mutex);
+  for (size_t i = 0; i < capacity_model->sessions_count; i++) {
+    if (capacity_model->sessions[i].ticket != ticket) continue;
+    capacity_model->sessions[i] =
+        capacity_model->sessions[--capacity_model->sessions_count];
+    break;
+  }
+  struct CapacityForeign foreign;
+  if (BeginRegistry(capacity_model, &foreign))
+    FinishRegistry(capacity_model, &foreign, true);
+  pthread_mutex_unlock(&capacity_model->mutex);
+}
+
+void CapacityModelGetLoad(struct CapacityModel* capacity_model,
+                          struct CapacityLoad* load) {
+  pthread_mutex_lock(&capacity_model->mutex);
+  // Without the registry the load of this process is still worth reporting.
+  struct CapacityForeign foreign;
+  bool shared = BeginRegistry(capacity_model, &foreign);
+  *load = (struct CapacityLoad){
+      .sessions = capacity_model->sessions_count + foreign.sessions,
+      .budget = capacity_model->budget,
+      .used = foreign.cost,
+  };
+  for (size_t i = 0; i < capacity_model->sessions_count; i++)
+    load->used += capacity_model->sessions[i].cost;
+  if (shared) FinishRegistry(capacity_model, &foreign, false);
+  pthread_mutex_unlock(&capacity_model->mutex);
+}
+
+void CapacityModelDestroy(struct CapacityModel* capacity_model) {
+  if (capacity_model->registry != -1) close(capacity_model->registry);
+  pthread_mutex_destroy(&capacity_model->mutex);
+  free(capacity_model);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_CAPACITY_H_
+#define STREAMER_CAPACITY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct CapacityModel;
+struct EncodeContext;
+
+struct CapacityKey {
+  uint32_t entrypoint;
+  uint32_t preset;
+};
+
+enum CapacityVerdict {
+  kCapacityAdmitted = 0,
+  kCapacityDowngraded,
+  kCapacityRejected,
+};
+
+struct CapacityLoad {
+  size_t sessions;
+  double budget;
+  double used;
+};
+
+struct CapacityModel* CapacityModelCreate(const char* device);
+bool CapacityModelLoad(struct CapacityModel* capacity_model, const char* path);
+bool CapacityModelSave(struct CapacityModel* capacity_model,
+                       const char* path);
+// Accounts for sessions of other processes on the same device, which share
+// the registry file at path. One model per process, sessions of exited
+// processes are dropped.
+bool CapacityModelShare(struct CapacityModel* capacity_model,
+                        const char* path);
+void CapacityModelSetRate(struct CapacityModel* capacity_model,
+                          const struct CapacityKey* key,
+                          double pixels_per_second);
+bool CapacityModelCalibrate(struct CapacityModel* capacity_model,
+                            const struct CapacityKey* key,
+                            struct EncodeContext* encode_context,
+                            uint32_t width, uint32_t height, size_t frames);
+enum CapacityVerdict CapacityModelAdmit(struct CapacityModel* capacity_model,
+                                        const struct CapacityKey* key,
+                                        uint32_t width, uint32_t height,
+                                        double min_fps, double* fps,
+                                        uint64_t* ticket);
+void CapacityModelRelease(struct CapacityModel* capacity_model,
+                          uint64_t ticket);
+void CapacityModelGetLoad(struct CapacityModel* capacity_model,
+                          struct CapacityLoad* load);
+void CapacityModelDestroy(struct CapacityModel* capacity_model);
+
+#endif  // STREAMER_CAPACITY_H_
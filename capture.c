@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "capture.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-heap.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define CAPTURE_DMA_HEAP "/dev/dma_heap/system"
+#define CAPTURE_TIMEOUT_MS 2000
+
+struct CaptureBuffer {
+  int dmabuf_fds[2];
+};
+
+struct CaptureContext {
+  int fd;
+  enum v4l2_buf_type type;
+  enum v4l2_memory memory;
+  struct CaptureFormat format;
+  // Memory planes per buffer and their layout as reported by the device.
+  uint32_t nmemplanes;
+  uint32_t pitches[2];
+  uint32_t sizes[2];
+  // Image planes, these might share a single memory plane.
+  size_t nplanes;
+  uint32_t buffer_count;
+  struct CaptureBuffer buffers[CAPTURE_MAX_BUFFERS];
+  bool fresh[CAPTURE_MAX_BUFFERS];
+  int held;
+  bool has_sequence;
+  uint32_t last_sequence;
+  uint64_t dropped;
+};
+
+static const struct {
+  uint32_t pixelformat;
+  uint32_t fourcc;
+} kPackedFormats[] = {
+    {V4L2_PIX_FMT_XBGR32, DRM_FORMAT_XRGB8888},
+    {V4L2_PIX_FMT_ABGR32, DRM_FORMAT_ARGB8888},
+    {V4L2_PIX_FMT_RGBX32, DRM_FORMAT_XBGR8888},
+    {V4L2_PIX_FMT_XRGB32, DRM_FORMAT_BGRX8888},
+};
+
+static int Ioctl(int fd, unsigned long request, void* arg) {
+  int result;
+  do {
+    result = ioctl(fd, request, arg);
+  } while (result == -1 && errno == EINTR);
+  return result;
+}
+
+static bool IsMplane(const struct CaptureContext* capture_context) {
+  return capture_context->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
+
+static void SetupColorimetry(struct CaptureContext* capture_context,
+                             const struct v4l2_format* format) {
+  uint32_t colorspace, ycbcr_enc, quantization;
+  if (IsMplane(capture_context)) {
+    colorspace = format->fmt.pix_mp.colorspace;
+    ycbcr_enc = format->fmt.pix_mp.ycbcr_enc;
+    quantization = format->fmt.pix_mp.quantization;
+  } else {
+    colorspace = format->fmt.pix.colorspace;
+    ycbcr_enc = format->fmt.pix.ycbcr_enc;
+    quantization = format->fmt.pix.quantization;
+  }
+
+  // Rgb sources are converted on the gpu, so the encoder is free to pick, and
+  // picks the same as for raw files.
+  capture_context->format.colorspace = kItuRec709;
+  capture_context->format.range = kFullRange;
+  if (capture_context->format.fourcc != DRM_FORMAT_NV12) return;
+
+  if (ycbcr_enc == V4L2_YCBCR_ENC_601 ||
+      (ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT &&
+       (colorspace == V4L2_COLORSPACE_SMPTE170M ||
+        colorspace == V4L2_COLORSPACE_470_SYSTEM_BG)))
+    capture_context->format.colorspace = kItuRec601;
+  capture_context->format.range =
+      quantization == V4L2_QUANTIZATION_FULL_RANGE ? kFullRange : kNarrowRange;
+}
+
+static bool NegotiateFormat(struct CaptureContext* capture_context,
+                            const struct CaptureConfig* config) {
+  struct v4l2_format format = {.type = capture_context->type};
+  if (Ioctl(capture_context->fd, VIDIOC_G_FMT, &format)) {
+    fprintf(stderr, "Failed to get capture format: %s\n", strerror(errno));
+    return false;
+  }
+  if (IsMplane(capture_context)) {
+    if (config->width) format.fmt.pix_mp.width = config->width;
+    if (config->height) format.fmt.pix_mp.height = config->height;
+    if (config->pixelformat)
+      format.fmt.pix_mp.pixelformat = config->pixelformat;
+    format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  } else {
+    if (config->width) format.fmt.pix.width = config->width;
+    if (config->height) format.fmt.pix.height = config->height;
+    if (config->pixelformat) format.fmt.pix.pixelformat = config->pixelformat;
+    format.fmt.pix.field = V4L2_FIELD_NONE;
+  }
+  if (Ioctl(capture_context->fd, VIDIOC_S_FMT, &format)) {
+    fprintf(stderr, "Failed to set capture format: %s\n", strerror(errno));
+    return false;
+  }
+
+  uint32_t pixelformat, field;
+  if (IsMplane(capture_context)) {
+    capture_context->format.width = format.fmt.pix_mp.width;
+    capture_context->format.height = format.fmt.pix_mp.height;
+    pixelformat = format.fmt.pix_mp.pixelformat;
+    field = format.fmt.pix_mp.field;
+    capture_context->nmemplanes = format.fmt.pix_mp.num_planes;
+    for (uint32_t i = 0; i < capture_context->nmemplanes &&
+                         i < LENGTH(capture_context->pitches);
+         i++) {
+      capture_context->pitches[i] =
+          format.fmt.pix_mp.plane_fmt[i].bytesperline;
+      capture_context->sizes[i] = format.fmt.pix_mp.plane_fmt[i].sizeimage;
+    }
+  } else {
+    capture_context->format.width = format.fmt.pix.width;
+    capture_context->format.height = format.fmt.pix.height;
+    pixelformat = format.fmt.pix.pixelformat;
+    field = format.fmt.pix.field;
+    capture_context->nmemplanes = 1;
+    capture_context->pitches[0] = format.fmt.pix.bytesperline;
+    capture_context->sizes[0] = format.fmt.pix.sizeimage;
+  }
+  if (field != V4L2_FIELD_NONE) {
+    fprintf(stderr, "Interlaced capture is not supported\n");
+    return false;
+  }
+
+  // Nv12 comes either as a single buffer with chroma right after luma, or as a
+  // buffer per plane. Packed rgb fourccs happen to match drm ones, but are
+  // spelled out to keep the list of supported ones explicit.
+  capture_context->format.fourcc = DRM_FORMAT_INVALID;
+  if (pixelformat == V4L2_PIX_FMT_NV12 && capture_context->nmemplanes == 1) {
+    capture_context->format.fourcc = DRM_FORMAT_NV12;
+    capture_context->nplanes = 2;
+  } else if (pixelformat == V4L2_PIX_FMT_NV12M &&
+             capture_context->nmemplanes == 2) {
+    capture_context->format.fourcc = DRM_FORMAT_NV12;
+    capture_context->nplanes = 2;
+  } else if (capture_context->nmemplanes == 1) {
+    for (size_t i = 0; i < LENGTH(kPackedFormats); i++) {
+      if (kPackedFormats[i].pixelformat != pixelformat) continue;
+      capture_context->format.fourcc = kPackedFormats[i].fourcc;
+      capture_context->nplanes = 1;
+    }
+  }
+  if (capture_context->format.fourcc == DRM_FORMAT_INVALID) {
+    fprintf(stderr, "Unsupported capture format %.4s with %u planes\n",
+            (const char*)&pixelformat, capture_context->nmemplanes);
+    return false;
+  }
+  SetupColorimetry(capture_context, &format);
+  return true;
+}
+
+static int AllocateDmabuf(int heap, size_t size) {
+  struct dma_heap_allocation_data allocation = {
+      .len = size,
+      .fd_flags = O_RDWR | O_CLOEXEC,
+  };
+  if (Ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &allocation)) {
+    fprintf(stderr, "Failed to allocate dmabuf: %s\n", strerror(errno));
+    return -1;
+  }
+  return (int)allocation.fd;
+}
+
+static bool ExportBuffers(struct CaptureContext* capture_context) {
+  for (uint32_t i = 0; i < capture_context->buffer_count; i++) {
+    for (uint32_t j = 0; j < capture_context->nmemplanes; j++) {
+      struct v4l2_exportbuffer exportbuffer = {
+          .type = capture_context->type,
+          .index = i,
+          .plane = j,
+          .flags = O_RDONLY | O_CLOEXEC,
+      };
+      if (Ioctl(capture_context->fd, VIDIOC_EXPBUF, &exportbuffer)) {
+        fprintf(stderr, "Failed to export capture buffer: %s\n",
+                strerror(errno));
+        return false;
+      }
+      capture_context->buffers[i].dmabuf_fds[j] = exportbuffer.fd;
+    }
+  }
+  return true;
+}
+
+static bool AllocateBuffers(struct CaptureContext* capture_context) {
+  int heap = open(CAPTURE_DMA_HEAP, O_RDONLY | O_CLOEXEC);
+  if (heap == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", CAPTURE_DMA_HEAP,
+            strerror(errno));
+    return false;
+  }
+  bool result = true;
+  for (uint32_t i = 0; i < capture_context->buffer_count && result; i++) {
+    for (uint32_t j = 0; j < capture_context->nmemplanes && result; j++) {
+      int fd = AllocateDmabuf(heap, capture_context->sizes[j]);
+      capture_context->buffers[i].dmabuf_fds[j] = fd;
+      result = fd != -1;
+    }
+  }
+  close(heap);
+  return result;
+}
+
+static bool QueueBuffer(struct CaptureContext* capture_context,
+                        uint32_t index) {
+  struct v4l2_plane planes[LENGTH(capture_context->pitches)] = {0};
+  struct v4l2_buffer buffer = {
+      .type = capture_context->type,
+      .memory = capture_context->memory,
+      .index = index,
+  };
+  const struct CaptureBuffer* capture_buffer =
+      &capture_context->buffers[index];
+  if (IsMplane(capture_context)) {
+    buffer.m.planes = planes;
+    buffer.length = capture_context->nmemplanes;
+    if (capture_context->memory == V4L2_MEMORY_DMABUF) {
+      for (uint32_t i = 0; i < capture_context->nmemplanes; i++) {
+        planes[i].m.fd = capture_buffer->dmabuf_fds[i];
+        planes[i].length = capture_context->sizes[i];
+      }
+    }
+  } else if (capture_context->memory == V4L2_MEMORY_DMABUF) {
+    buffer.m.fd = capture_buffer->dmabuf_fds[0];
+    buffer.length = capture_context->sizes[0];
+  }
+  if (Ioctl(capture_context->fd, VIDIOC_QBUF, &buffer)) {
+    fprintf(stderr, "Failed to queue capture buffer: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static void CloseBuffers(struct CaptureContext* capture_context) {
+  for (size_t i = 0; i < LENGTH(capture_context->buffers); i++) {
+    for (size_t j = 0; j < LENGTH(capture_context->buffers[i].dmabuf_fds);
+         j++) {
+      int fd = capture_context->buffers[i].dmabuf_fds[j];
+      if (fd != -1) close(fd);
+      capture_context->buffers[i].dmabuf_fds[j] = -1;
+    }
+  }
+}
+
+struct CaptureContext* CaptureContextCreate(
+    const char* device, const struct CaptureConfig* config) {
+  struct CaptureContext* capture_context =
+      malloc(sizeof(struct CaptureContext));
+  if (!capture_context) {
+    fprintf(stderr, "Failed to allocate capture context: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *capture_context = (struct CaptureContext){
+      .memory = config->memory == kCaptureMemoryDmabuf ? V4L2_MEMORY_DMABUF
+                                                        : V4L2_MEMORY_MMAP,
+      .held = -1,
+  };
+  for (size_t i = 0; i < LENGTH(capture_context->buffers); i++) {
+    for (size_t j = 0; j < LENGTH(capture_context->buffers[i].dmabuf_fds); j++)
+      capture_context->buffers[i].dmabuf_fds[j] = -1;
+  }
+
+  capture_context->fd = open(device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (capture_context->fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", device, strerror(errno));
+    goto rollback_capture_context;
+  }
+
+  struct v4l2_capability capability;
+  if (Ioctl(capture_context->fd, VIDIOC_QUERYCAP, &capability)) {
+    fprintf(stderr, "Failed to query %s: %s\n", device, strerror(errno));
+    goto rollback_fd;
+  }
+  uint32_t caps = capability.capabilities & V4L2_CAP_DEVICE_CAPS
+                      ? capability.device_caps
+                      : capability.capabilities;
+  if (!(caps & V4L2_CAP_STREAMING)) {
+    fprintf(stderr, "%s does not support streaming\n", device);
+    goto rollback_fd;
+  }
+  if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+    capture_context->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  } else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+    capture_context->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  } else {
+    fprintf(stderr, "%s is not a capture device\n", device);
+    goto rollback_fd;
+  }
+  if (!NegotiateFormat(capture_context, config)) {
+    fprintf(stderr, "Failed to negotiate capture format\n");
+    goto rollback_fd;
+  }
+
+  // Device might hand out fewer or more buffers than requested, the latter is
+  // clamped so that import caches can stay fixed size.
+  struct v4l2_requestbuffers requestbuffers = {
+      .count = config->buffer_count ? config->buffer_count : 4,
+      .type = capture_context->type,
+      .memory = capture_context->memory,
+  };
+  if (requestbuffers.count > CAPTURE_MAX_BUFFERS)
+    requestbuffers.count = CAPTURE_MAX_BUFFERS;
+  if (Ioctl(capture_context->fd, VIDIOC_REQBUFS, &requestbuffers)) {
+    fprintf(stderr, "Failed to request capture buffers: %s\n",
+            strerror(errno));
+    goto rollback_fd;
+  }
+  if (requestbuffers.count < 2 || requestbuffers.count > CAPTURE_MAX_BUFFERS) {
+    fprintf(stderr, "Unexpected capture buffer count %u\n",
+            requestbuffers.count);
+    goto rollback_buffers;
+  }
+  capture_context->buffer_count = requestbuffers.count;
+
+  if (capture_context->memory == V4L2_MEMORY_MMAP
+          ? !ExportBuffers(capture_context)
+          : !AllocateBuffers(capture_context)) {
+    fprintf(stderr, "Failed to set up capture buffers\n");
+    goto rollback_buffers;
+  }
+  for (uint32_t i = 0; i < capture_context->buffer_count; i++) {
+    if (!QueueBuffer(capture_context, i)) goto rollback_buffers;
+    capture_context->fresh[i] = true;
+  }
+
+  enum v4l2_buf_type type = capture_context->type;
+  if (Ioctl(capture_context->fd, VIDIOC_STREAMON, &type)) {
+    fprintf(stderr, "Failed to start capture: %s\n", strerror(errno));
+    goto rollback_buffers;
+  }
+  return capture_context;
+
+rollback_buffers:
+  CloseBuffers(capture_context);
+  requestbuffers.count = 0;
+  Ioctl(capture_context->fd, VIDIOC_REQBUFS, &requestbuffers);
+rollback_fd:
+  close(capture_context->fd);
+rollback_capture_context:
+  free(capture_context);
+  return NULL;
+}
+
+const struct CaptureFormat* CaptureContextGetFormat(
+    const struct CaptureContext* capture_context) {
+  return &capture_context->format;
+}
+
+static void FillFrame(struct CaptureContext* capture_context, uint32_t index,
+                      struct CapturedFrame* captured_frame) {
+  const struct CaptureBuffer* capture_buffer =
+      &capture_context->buffers[index];
+  captured_frame->index = index;
+  captured_frame->fresh = capture_context->fresh[index];
+  captured_frame->nplanes = capture_context->nplanes;
+  capture_context->fresh[index] = false;
+  for (size_t i = 0; i < capture_context->nplanes; i++) {
+    // Single buffer nv12 keeps chroma right after luma.
+    size_t memplane = i < capture_context->nmemplanes ? i : 0;
+    captured_frame->planes[i] = (struct GpuFramePlane){
+        .dmabuf_fd = capture_buffer->dmabuf_fds[memplane],
+        .pitch = capture_context->pitches[memplane],
+        .offset = memplane == i ? 0
+                                : capture_context->pitches[0] *
+                                      capture_context->format.height,
+        .modifier = DRM_FORMAT_MOD_LINEAR,
+    };
+  }
+}
+
+bool CaptureContextAcquire(struct CaptureContext* capture_context,
+                           struct CapturedFrame* captured_frame) {
+  for (;;) {
+    struct pollfd pfd = {.fd = capture_context->fd, .events = POLLIN};
+    int result = poll(&pfd, 1, CAPTURE_TIMEOUT_MS);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to poll capture: %s\n", strerror(errno));
+      return false;
+    }
+    if (!result) {
+      fprintf(stderr, "No capture frames for %d ms\n", CAPTURE_TIMEOUT_MS);
+      return false;
+    }
+    if (pfd.revents & POLLERR) {
+      fprintf(stderr, "Capture device reported an error\n");
+      return false;
+    }
+
+    struct v4l2_plane planes[LENGTH(capture_context->pitches)];
+    struct v4l2_buffer buffer = {
+        .type = capture_context->type,
+        .memory = capture_context->memory,
+    };
+    if (IsMplane(capture_context)) {
+      buffer.m.planes = planes;
+      buffer.length = capture_context->nmemplanes;
+    }
+    if (Ioctl(capture_context->fd, VIDIOC_DQBUF, &buffer)) {
+      if (errno == EAGAIN) continue;
+      fprintf(stderr, "Failed to dequeue capture buffer: %s\n",
+              strerror(errno));
+      return false;
+    }
+    if (buffer.index >= capture_context->buffer_count) {
+      fprintf(stderr, "Invalid capture buffer index %u\n", buffer.index);
+      return false;
+    }
+
+    if (capture_context->has_sequence &&
+        buffer.sequence > capture_context->last_sequence + 1) {
+      capture_context->dropped +=
+          buffer.sequence - capture_context->last_sequence - 1;
+    }
+    capture_context->has_sequence = true;
+    capture_context->last_sequence = buffer.sequence;
+
+    // Corrupted frames are reported for example when the signal changes
+    // mid-frame, these are silently recycled.
+    if (buffer.flags & V4L2_BUF_FLAG_ERROR) {
+      if (!QueueBuffer(capture_context, buffer.index)) return false;
+      continue;
+    }
+
+    FillFrame(capture_context, buffer.index, captured_frame);
+    captured_frame->sequence = buffer.sequence;
+    captured_frame->pts = (uint64_t)buffer.timestamp.tv_sec * 1000000ULL +
+                          (uint64_t)buffer.timestamp.tv_usec;
+    capture_context->held = (int)buffer.index;
+    return true;
+  }
+}
+
+void CaptureContextRelease(struct CaptureContext* capture_context) {
+  if (capture_context->held == -1) return;
+  QueueBuffer(capture_context, (uint32_t)capture_context->held);
+  capture_context->held = -1;
+}
+
+uint64_t CaptureContextDropped(const struct CaptureContext* capture_context) {
+  return capture_context->dropped;
+}
+
+void CaptureContextDestroy(struct CaptureContext* capture_context) {
+  enum v4l2_buf_type type = capture_context->type;
+  Ioctl(capture_context->fd, VIDIOC_STREAMOFF, &type);
+  // Exported buffers are only freed once every importer is gone, so the device
+  // buffers are released after closing the exports.
+  CloseBuffers(capture_context);
+  struct v4l2_requestbuffers requestbuffers = {
+      .type = capture_context->type,
+      .memory = capture_context->memory,
+  };
+  Ioctl(capture_context->fd, VIDIOC_REQBUFS, &requestbuffers);
+  close(capture_context->fd);
+  free(capture_context);
+}
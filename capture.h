@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_CAPTURE_H_
+#define STREAMER_CAPTURE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "colorspace.h"
+#include "gpu.h"
+
+#define CAPTURE_MAX_BUFFERS 16
+
+enum CaptureMemory {
+  // Buffers are allocated by the device and exported as dmabufs.
+  kCaptureMemoryMmap = 0,
+  // Buffers are allocated from the system dma heap and imported by the
+  // device, for devices that cannot export.
+  kCaptureMemoryDmabuf,
+};
+
+// Zero width, height or pixel format keeps the current one of the device,
+// e.g. the timings detected by an hdmi receiver. Pixel format is a v4l2
+// fourcc, nv12 and packed 32-bit rgb formats are supported.
+struct CaptureConfig {
+  uint32_t width;
+  uint32_t height;
+  uint32_t pixelformat;
+  uint32_t buffer_count;
+  enum CaptureMemory memory;
+};
+
+// Negotiated format, fourcc is a drm one suitable for importing frames.
+struct CaptureFormat {
+  uint32_t width;
+  uint32_t height;
+  uint32_t fourcc;
+  enum YuvColorspace colorspace;
+  enum YuvRange range;
+};
+
+// Planes are dmabufs of the capture buffer, owned by the capture context and
+// valid until the frame is released. The same index always refers to the
+// same buffer, fresh is set on the first use of a buffer, so that imports
+// can be cached by index.
+struct CapturedFrame {
+  uint32_t index;
+  bool fresh;
+  size_t nplanes;
+  struct GpuFramePlane planes[4];
+  uint32_t sequence;
+  uint64_t pts;
+};
+
+struct CaptureContext;
+
+// Streams from a v4l2 capture device, e.g. /dev/video0. All but the frame
+// held by the caller stay queued to the device.
+struct CaptureContext* CaptureContextCreate(const char* device,
+                                            const struct CaptureConfig* config);
+const struct CaptureFormat* CaptureContextGetFormat(
+    const struct CaptureContext* capture_context);
+// Returns false on error or when no frame arrives for a while, e.g. because
+// the source lost its signal.
+bool CaptureContextAcquire(struct CaptureContext* capture_context,
+                           struct CapturedFrame* captured_frame);
+void CaptureContextRelease(struct CaptureContext* capture_context);
+// Frames the device dropped because no buffer was queued, as reported by
+// gaps in sequence numbers.
+uint64_t CaptureContextDropped(const struct CaptureContext* capture_context);
+void CaptureContextDestroy(struct CaptureContext* capture_context);
+
+#endif  // STREAMER_CAPTURE_H_
@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cenc.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "bitstream.h"
+#include "hevc.h"
+#include "hevcparse.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CENC_X86
+#endif
+
+#define AES_BLOCK_SIZE 16
+#define AES_ROUNDS 10
+// An access unit is a handful of parameter sets and sei followed by slices,
+// anything beyond this is encrypted along with the last slice.
+#define CENC_MAX_NAL_UNITS 64
+// Parameter sets and slice segment headers are parsed from this many leading
+// bytes of a nal unit, which is plenty for what the encoder produces.
+#define CENC_NAL_PREFIX 1024
+
+// Keystream position within a record, encrypted ranges of all subsamples
+// form a single continuous ctr stream.
+struct CencStream {
+  uint64_t iv;
+  uint64_t counter;
+  uint8_t keystream[AES_BLOCK_SIZE];
+  size_t used;
+};
+
+// Position of a copy within a record, see CencContextBeginCopy.
+struct CencCopy {
+  const struct CencExtension* extension;
+  size_t verbatim;
+  size_t subsample;
+  size_t clear;
+  size_t encrypted;
+  struct CencStream stream;
+};
+
+struct CencContext {
+  uint8_t round_keys[AES_ROUNDS + 1][AES_BLOCK_SIZE]
+      __attribute__((aligned(16)));
+  uint64_t next_iv;
+  struct CencCopy copy;
+
+  // Slice segment headers stay clear, finding their size takes the parameter
+  // sets they refer to, which only come with keyframes.
+  struct SeqParameterSet sps[16];
+  struct PicParameterSet pps[64];
+  struct ParameterSets parameter_sets;
+  struct SliceSegmentHeader slice;
+  uint8_t nal_prefix[CENC_NAL_PREFIX];
+  uint8_t rbsp[CENC_NAL_PREFIX];
+};
+
+typedef void (*CtrFn)(const struct CencContext* cenc_context, uint8_t* dst,
+                      const uint8_t* src, size_t blocks, uint64_t iv,
+                      uint64_t counter);
+
+static pthread_once_t cenc_once = PTHREAD_ONCE_INIT;
+static CtrFn ctr_xor;
+
+#ifdef CENC_X86
+#define EXPAND_ROUND_KEY(keys, i, rcon)                                    \
+  do {                                                                     \
+    __m128i gen = _mm_shuffle_epi32(                                       \
+        _mm_aeskeygenassist_si128(keys[i - 1], rcon), 0xff);               \
+    __m128i key = keys[i - 1];                                             \
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));                      \
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));                      \
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));                      \
+    keys[i] = _mm_xor_si128(key, gen);                                     \
+  } while (0)
+
+__attribute__((target("aes"))) static void ExpandKey(
+    struct CencContext* cenc_context, const uint8_t key[CENC_KEY_SIZE]) {
+  __m128i keys[AES_ROUNDS + 1];
+  keys[0] = _mm_loadu_si128((const __m128i*)key);
+  EXPAND_ROUND_KEY(keys, 1, 0x01);
+  EXPAND_ROUND_KEY(keys, 2, 0x02);
+  EXPAND_ROUND_KEY(keys, 3, 0x04);
+  EXPAND_ROUND_KEY(keys, 4, 0x08);
+  EXPAND_ROUND_KEY(keys, 5, 0x10);
+  EXPAND_ROUND_KEY(keys, 6, 0x20);
+  EXPAND_ROUND_KEY(keys, 7, 0x40);
+  EXPAND_ROUND_KEY(keys, 8, 0x80);
+  EXPAND_ROUND_KEY(keys, 9, 0x1b);
+  EXPAND_ROUND_KEY(keys, 10, 0x36);
+  for (int i = 0; i <= AES_ROUNDS; i++)
+    _mm_store_si128((__m128i*)cenc_context->round_keys[i], keys[i]);
+}
+
+// Eight blocks are kept in flight to cover the aesenc latency. Source and
+// destination may be the same buffer.
+__attribute__((target("aes"))) static void CtrXorAesni(
+    const struct CencContext* cenc_context, uint8_t* dst, const uint8_t* src,
+    size_t blocks, uint64_t iv, uint64_t counter) {
+  __m128i keys[AES_ROUNDS + 1];
+  for (int i = 0; i <= AES_ROUNDS; i++)
+    keys[i] = _mm_load_si128((const __m128i*)cenc_context->round_keys[i]);
+  for (; blocks >= 8; blocks -= 8, counter += 8, dst += 8 * AES_BLOCK_SIZE,
+                      src += 8 * AES_BLOCK_SIZE) {
+    __m128i state[8];
+    for (int j = 0; j < 8; j++) {
+      state[j] = _mm_xor_si128(
+          _mm_set_epi64x((long long)htobe64(counter + (uint64_t)j),
+                         (long long)iv),
+          keys[0]);
+    }
+    for (int i = 1; i < AES_ROUNDS; i++) {
+      for (int j = 0; j < 8; j++)
+        state[j] = _mm_aesenc_si128(state[j], keys[i]);
+    }
+    for (int j = 0; j < 8; j++) {
+      const __m128i* block = (const __m128i*)(src + j * AES_BLOCK_SIZE);
+      state[j] = _mm_aesenclast_si128(state[j], keys[AES_ROUNDS]);
+      _mm_storeu_si128((__m128i*)(dst + j * AES_BLOCK_SIZE),
+                       _mm_xor_si128(_mm_loadu_si128(block), state[j]));
+    }
+  }
+  for (; blocks;
+       blocks--, counter++, dst += AES_BLOCK_SIZE, src += AES_BLOCK_SIZE) {
+    __m128i state = _mm_xor_si128(
+        _mm_set_epi64x((long long)htobe64(counter), (long long)iv), keys[0]);
+    for (int i = 1; i < AES_ROUNDS; i++)
+      state = _mm_aesenc_si128(state, keys[i]);
+    state = _mm_aesenclast_si128(state, keys[AES_ROUNDS]);
+    _mm_storeu_si128(
+        (__m128i*)dst,
+        _mm_xor_si128(_mm_loadu_si128((const __m128i*)src), state));
+  }
+}
+
+// Same as above with two blocks per register. The tail is handled with vex
+// encoded 128-bit instructions to avoid sse state transitions.
+__attribute__((target("vaes,avx2,aes"))) static void CtrXorVaes(
+    const struct CencContext* cenc_context, uint8_t* dst, const uint8_t* src,
+    size_t blocks, uint64_t iv, uint64_t counter) {
+  __m256i keys[AES_ROUNDS + 1];
+  for (int i = 0; i <= AES_ROUNDS; i++) {
+    keys[i] = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i*)cenc_context->round_keys[i]));
+  }
+  for (; blocks >= 8; blocks -= 8, counter += 8, dst += 8 * AES_BLOCK_SIZE,
+                      src += 8 * AES_BLOCK_SIZE) {
+    __m256i state[4];
+    for (int j = 0; j < 4; j++) {
+      uint64_t base = counter + (uint64_t)j * 2;
+      state[j] = _mm256_xor_si256(
+          _mm256_set_epi64x((long long)htobe64(base + 1), (long long)iv,
+                            (long long)htobe64(base), (long long)iv),
+          keys[0]);
+    }
+    for (int i = 1; i < AES_ROUNDS; i++) {
+      for (int j = 0; j < 4; j++)
+        state[j] = _mm256_aesenc_epi128(state[j], keys[i]);
+    }
+    for (int j = 0; j < 4; j++) {
+      const __m256i* block = (const __m256i*)(src + j * 2 * AES_BLOCK_SIZE);
+      state[j] = _mm256_aesenclast_epi128(state[j], keys[AES_ROUNDS]);
+      _mm256_storeu_si256(
+          (__m256i*)(dst + j * 2 * AES_BLOCK_SIZE),
+          _mm256_xor_si256(_mm256_loadu_si256(block), state[j]));
+    }
+  }
+  for (; blocks;
+       blocks--, counter++, dst += AES_BLOCK_SIZE, src += AES_BLOCK_SIZE) {
+    __m128i state = _mm_xor_si128(
+        _mm_set_epi64x((long long)htobe64(counter), (long long)iv),
+        _mm256_castsi256_si128(keys[0]));
+    for (int i = 1; i < AES_ROUNDS; i++)
+      state = _mm_aesenc_si128(state, _mm256_castsi256_si128(keys[i]));
+    state =
+        _mm_aesenclast_si128(state, _mm256_castsi256_si128(keys[AES_ROUNDS]));
+    _mm_storeu_si128(
+        (__m128i*)dst,
+        _mm_xor_si128(_mm_loadu_si128((const __m128i*)src), state));
+  }
+}
+#endif  // CENC_X86
+
+static void CencInit(void) {
+#ifdef CENC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes")) ctr_xor = CtrXorAesni;
+  if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2"))
+    ctr_xor = CtrXorVaes;
+#endif  // CENC_X86
+}
+
+bool CencSetKernel(enum CencKernel kernel) {
+  pthread_once(&cenc_once, CencInit);
+  switch (kernel) {
+#ifdef CENC_X86
+    case kCencKernelAesni:
+      if (!__builtin_cpu_supports("aes")) return false;
+      ctr_xor = CtrXorAesni;
+      return true;
+    case kCencKernelVaes:
+      if (!__builtin_cpu_supports("vaes") || !__builtin_cpu_supports("avx2"))
+        return false;
+      ctr_xor = CtrXorVaes;
+      return true;
+#endif  // CENC_X86
+    default:
+      return false;
+  }
+}
+
+struct CencContext* CencContextCreate(const uint8_t key[CENC_KEY_SIZE]) {
+  pthread_once(&cenc_once, CencInit);
+  if (!ctr_xor) {
+    fprintf(stderr, "Failed to find aes instructions\n");
+    return NULL;
+  }
+  struct CencContext* cenc_context = calloc(1, sizeof(struct CencContext));
+  if (!cenc_context) {
+    fprintf(stderr, "Failed to allocate cenc context: %s\n", strerror(errno));
+    return NULL;
+  }
+  // Ctr must never reuse a counter block under the same key, so the iv sequence
+  // starts at a random point rather than at zero.
+  if (getrandom(&cenc_context->next_iv, sizeof(cenc_context->next_iv), 0) !=
+      sizeof(cenc_context->next_iv)) {
+    fprintf(stderr, "Failed to get random iv: %s\n", strerror(errno));
+    free(cenc_context);
+    return NULL;
+  }
+#ifdef CENC_X86
+  ExpandKey(cenc_context, key);
+#else   // CENC_X86
+  (void)key;
+#endif  // CENC_X86
+  return cenc_context;
+}
+
+static void CryptBytes(const struct CencContext* cenc_context,
+                       struct CencStream* stream, uint8_t* dst,
+                       const uint8_t* src, size_t size) {
+  for (; size && stream->used < AES_BLOCK_SIZE; size--)
+    *dst++ = *src++ ^ stream->keystream[stream->used++];
+  size_t blocks = size / AES_BLOCK_SIZE;
+  ctr_xor(cenc_context, dst, src, blocks, stream->iv, stream->counter);
+  stream->counter += blocks;
+  dst += blocks * AES_BLOCK_SIZE;
+  src += blocks * AES_BLOCK_SIZE;
+  size -= blocks * AES_BLOCK_SIZE;
+  if (!size) return;
+  memset(stream->keystream, 0, sizeof(stream->keystream));
+  ctr_xor(cenc_context, stream->keystream, stream->keystream, 1, stream->iv,
+          stream->counter++);
+  for (stream->used = 0; stream->used < size; stream->used++)
+    dst[stream->used] = src[stream->used] ^ stream->keystream[stream->used];
+}
+
+static size_t GatherBytes(const struct iovec* iov, size_t count, size_t offset,
+                          uint8_t* buffer, size_t size) {
+  size_t result = 0;
+  for (size_t i = 0; i < count && result < size; i++) {
+    if (offset >= iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+    size_t chunk = iov[i].iov_len - offset;
+    if (chunk > size - result) chunk = size - result;
+    memcpy(buffer + result, (const uint8_t*)iov[i].iov_base + offset, chunk);
+    result += chunk;
+    offset = 0;
+  }
+  return result;
+}
+
+// Collects offsets of nal unit headers, i.e. the bytes right after start
+// codes, which may straddle segment boundaries.
+static size_t FindNalUnits(const struct iovec* iov, size_t count,
+                           size_t* offsets, size_t max_offsets) {
+  size_t result = 0, base = 0, carried_zeros = 0;
+  for (size_t i = 0; i < count; base += iov[i++].iov_len) {
+    const uint8_t* data = iov[i].iov_base;
+    size_t size = iov[i].iov_len;
+    for (const uint8_t* it = data; result < max_offsets;) {
+      it = memchr(it, 1, size - (size_t)(it - data));
+      if (!it) break;
+      size_t pos = (size_t)(it - data);
+      size_t zeros = 0;
+      while (zeros < 2 && zeros < pos && !data[pos - zeros - 1]) zeros++;
+      if (zeros == pos) zeros += carried_zeros;
+      if (zeros >= 2) offsets[result++] = base + pos + 1;
+      it++;
+    }
+    size_t trailing = 0;
+    while (trailing < 2 && trailing < size && !data[size - trailing - 1])
+      trailing++;
+    carried_zeros = trailing == size ? carried_zeros + trailing : trailing;
+  }
+  return result;
+}
+
+// Returns the number of escaped bytes holding the given number of rbsp bytes.
+static size_t EscapedSize(const uint8_t* data, size_t size, size_t rbsp_size) {
+  size_t result = 0;
+  for (size_t zeros = 0; rbsp_size && result < size; result++) {
+    if (zeros >= 2 && data[result] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = data[result] ? 0 : zeros + 1;
+    rbsp_size--;
+  }
+  return result;
+}
+
+// Returns the number of leading bytes of a nal unit to keep clear, which is
+// its header and, for slices, the slice segment header. Parameter sets are
+// stored for parsing the slice segment headers that follow them.
+static size_t ClearPrefix(struct CencContext* cenc_context,
+                          const struct iovec* iov, size_t count, size_t offset,
+                          size_t size) {
+  size_t nal_size =
+      GatherBytes(iov, count, offset, cenc_context->nal_prefix,
+                  size < CENC_NAL_PREFIX ? size : CENC_NAL_PREFIX);
+  struct Bitstream bitstream = {.data = cenc_context->rbsp};
+  const struct Bitstream source = {
+      .data = cenc_context->nal_prefix,
+      .size = nal_size * 8,
+  };
+  BitstreamDeflate(&bitstream, &source);
+  struct BitstreamReader reader = {
+      .data = cenc_context->rbsp,
+      .size = bitstream.size,
+      .offset = 16,  // nal_unit_header
+  };
+  uint8_t nal_unit_type = (cenc_context->nal_prefix[0] >> 1) & 0x3f;
+  switch (nal_unit_type) {
+    case SPS_NUT: {
+      struct SeqParameterSet sps;
+      if (!ParseSeqParameterSet(&reader, &sps)) break;
+      uint32_t id = sps.sps_seq_parameter_set_id;
+      cenc_context->sps[id] = sps;
+      cenc_context->parameter_sets.sps[id] = &cenc_context->sps[id];
+      break;
+    }
+    case PPS_NUT: {
+      struct PicParameterSet pps;
+      if (!ParsePicParameterSet(&reader, &pps)) break;
+      uint32_t id = pps.pps_pic_parameter_set_id;
+      cenc_context->pps[id] = pps;
+      cenc_context->parameter_sets.pps[id] = &cenc_context->pps[id];
+      break;
+    }
+    default:
+      if (nal_unit_type > RSV_VCL31) break;
+      // Slices that can not be parsed, e.g. before the first keyframe, only
+      // keep their nal unit header clear.
+      if (!ParseSliceSegmentHeader(&reader, nal_unit_type,
+                                   &cenc_context->parameter_sets,
+                                   &cenc_context->slice))
+        return 2;
+      return EscapedSize(cenc_context->nal_prefix, nal_size,
+                         2 + cenc_context->slice.header_size);
+  }
+  return size;
+}
+
+// Encrypted ranges are whole aes blocks, the unaligned remainder of a
+// protected range is moved into the clear range that precedes it.
+static void AppendSubsample(struct CencExtension* extension, size_t clear,
+                            size_t encrypted) {
+  struct CencSubsample* subsample;
+  if (extension->subsample_count == CENC_MAX_SUBSAMPLES) {
+    // Out of table space, the rest of the access unit including nal headers is
+    // encrypted along with the last subsample.
+    subsample = extension->subsamples + CENC_MAX_SUBSAMPLES - 1;
+    encrypted += subsample->encrypted + clear;
+    clear = subsample->clear;
+  } else {
+    subsample = extension->subsamples + extension->subsample_count++;
+  }
+  size_t remainder = encrypted % AES_BLOCK_SIZE;
+  *subsample = (struct CencSubsample){
+      .clear = (uint32_t)(clear + remainder),
+      .encrypted = (uint32_t)(encrypted - remainder),
+  };
+}
+
+bool CencContextPrepare(struct CencContext* cenc_context,
+                        const struct iovec* iov, size_t count,
+                        struct CencExtension* extension) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) size += iov[i].iov_len;
+  if (size > UINT32_MAX) {
+    fprintf(stderr, "Access unit is too big for encryption\n");
+    return false;
+  }
+
+  size_t offsets[CENC_MAX_NAL_UNITS];
+  size_t nal_units = FindNalUnits(iov, count, offsets, LENGTH(offsets));
+  *extension = (struct CencExtension){0};
+  uint64_t iv = htobe64(cenc_context->next_iv++);
+  memcpy(extension->iv, &iv, sizeof(extension->iv));
+
+  // Clear bytes accumulate up to the first encrypted byte of a vcl nal unit.
+  size_t clear_from = 0;
+  for (size_t i = 0; i < nal_units; i++) {
+    size_t begin = offsets[i];
+    size_t end = i + 1 < nal_units ? offsets[i + 1] - 3 : size;
+    if (end <= begin) continue;
+    size_t clear_to =
+        begin + ClearPrefix(cenc_context, iov, count, begin, end - begin);
+    if (clear_to >= end) continue;
+    AppendSubsample(extension, clear_to - clear_from, end - clear_to);
+    clear_from = end;
+  }
+  if (clear_from < size) AppendSubsample(extension, size - clear_from, 0);
+  return true;
+}
+
+void CencContextBeginCopy(struct CencContext* cenc_context,
+                          const struct CencExtension* extension,
+                          size_t verbatim) {
+  struct CencCopy* copy = &cenc_context->copy;
+  *copy = (struct CencCopy){
+      .extension = extension,
+      .verbatim = verbatim,
+      .stream = {.used = AES_BLOCK_SIZE},
+  };
+  memcpy(&copy->stream.iv, extension->iv, sizeof(copy->stream.iv));
+}
+
+void CencContextCopy(void* user, void* dst, const void* src, size_t size) {
+  struct CencContext* cenc_context = user;
+  struct CencCopy* copy = &cenc_context->copy;
+  uint8_t* to = dst;
+  const uint8_t* from = src;
+  while (size) {
+    if (!copy->verbatim && !copy->clear && !copy->encrypted &&
+        copy->subsample < copy->extension->subsample_count) {
+      const struct CencSubsample* subsample =
+          copy->extension->subsamples + copy->subsample++;
+      copy->clear = subsample->clear;
+      copy->encrypted = subsample->encrypted;
+      continue;
+    }
+    size_t* range = copy->verbatim ? &copy->verbatim
+                    : copy->clear  ? &copy->clear
+                                   : &copy->encrypted;
+    size_t chunk = *range && *range < size ? *range : size;
+    if (range == &copy->encrypted && *range) {
+      CryptBytes(cenc_context, &copy->stream, to, from, chunk);
+    } else if (to != from) {
+      memcpy(to, from, chunk);
+    }
+    if (*range) *range -= chunk;
+    to += chunk;
+    from += chunk;
+    size -= chunk;
+  }
+}
+
+bool CencContextDecrypt(struct CencContext* cenc_context,
+                        const struct CencExtension* extension,
+                        const struct iovec* iov, size_t count) {
+  size_t size = 0, covered = 0;
+  for (size_t i = 0; i < count; i++) size += iov[i].iov_len;
+  for (size_t i = 0; i < extension->subsample_count &&
+                  i < CENC_MAX_SUBSAMPLES;
+       i++) {
+    covered += (size_t)extension->subsamples[i].clear +
+               extension->subsamples[i].encrypted;
+  }
+  if (extension->subsample_count > CENC_MAX_SUBSAMPLES || covered > size) {
+    fprintf(stderr, "Invalid cenc subsamples\n");
+    return false;
+  }
+  CencContextBeginCopy(cenc_context, extension, 0);
+  for (size_t i = 0; i < count; i++) {
+    CencContextCopy(cenc_context, iov[i].iov_base, iov[i].iov_base,
+                    iov[i].iov_len);
+  }
+  return true;
+}
+
+void CencContextDestroy(struct CencContext* cenc_context) {
+  // Round keys are as good as the key itself.
+  explicit_bzero(cenc_context, sizeof(struct CencContext));
+  free(cenc_context);
+}
+
+size_t CencExtensionSize(const struct CencExtension* extension) {
+  return offsetof(struct CencExtension, subsamples) +
+         extension->subsample_count * sizeof(struct CencSubsample);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_CENC_H_
+#define STREAMER_CENC_H_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "proto.h"
+
+#define CENC_KEY_SIZE 16
+#define CENC_MAX_SUBSAMPLES 24
+
+enum CencKernel {
+  kCencKernelAesni = 0,
+  kCencKernelVaes,
+};
+
+// Clear bytes come first, encrypted bytes follow. Subsamples cover the whole
+// payload back to back.
+struct CencSubsample {
+  uint32_t clear;
+  uint32_t encrypted;
+};
+
+// Proto2 header extension of records flagged with PROTO_FLAG_ENCRYPTED, only
+// the used part of the subsample table is written. Payload is AES-128-CTR
+// with the counter block made of the iv followed by a 64-bit big endian
+// block number, running continuously over all encrypted bytes of a record.
+struct CencExtension {
+  uint8_t iv[8];
+  uint8_t subsample_count;
+  uint8_t reserved[7];
+  struct CencSubsample subsamples[CENC_MAX_SUBSAMPLES];
+};
+
+static_assert(sizeof(struct Proto2) + sizeof(struct CencExtension) <=
+                  UINT8_MAX,
+              "Cenc extension does not fit into proto header");
+
+struct CencContext;
+
+// Kernels are picked by cpu features on creation, this overrides the choice
+// e.g. for benchmarks. Returns false if the cpu lacks the instructions.
+bool CencSetKernel(enum CencKernel kernel);
+
+// Fails if the cpu has no aes instructions.
+struct CencContext* CencContextCreate(const uint8_t key[CENC_KEY_SIZE]);
+
+// Lays out subsamples of an annex b access unit and picks a fresh iv, the
+// access unit itself is not touched. Start codes, nal unit headers, slice
+// segment headers and non-vcl nal units stay clear, encrypted ranges are
+// whole aes blocks.
+bool CencContextPrepare(struct CencContext* cenc_context,
+                        const struct iovec* iov, size_t count,
+                        struct CencExtension* extension);
+// Encryption is fused with the copy an output makes anyway, CencContextCopy
+// matches DirectWriterCopy and FecCopy. The record is copied sequentially,
+// the first verbatim bytes are the header, the payload follows. Extension
+// must stay valid until the copy is complete.
+void CencContextBeginCopy(struct CencContext* cenc_context,
+                          const struct CencExtension* extension,
+                          size_t verbatim);
+void CencContextCopy(void* user, void* dst, const void* src, size_t size);
+bool CencContextDecrypt(struct CencContext* cenc_context,
+                        const struct CencExtension* extension,
+                        const struct iovec* iov, size_t count);
+void CencContextDestroy(struct CencContext* cenc_context);
+
+size_t CencExtensionSize(const struct CencExtension* extension);
+
+#endif  // STREAMER_CENC_H_
@@ -16,17 +16,34 @@
  */
 
 uniform sampler2D img_input;
-uniform mediump vec2 sample_offsets[4];
+uniform sampler2D img_cursor;
 uniform mediump mat3 colorspace;
 uniform mediump vec3 ranges[2];
 
 varying mediump vec2 texcoord;
+varying mediump vec2 texel;
+varying highp vec4 cursor;
 
-mediump vec4 supersample() {
-  return texture2D(img_input, texcoord + sample_offsets[0]) +
-         texture2D(img_input, texcoord + sample_offsets[1]) +
-         texture2D(img_input, texcoord + sample_offsets[2]) +
-         texture2D(img_input, texcoord + sample_offsets[3]);
+// Cursor is premultiplied like drm planes are by default, and is placed in
+// source texture coordinates, offset first and size second.
+mediump vec3 blend_cursor(in highp vec2 coord, in mediump vec3 rgb) {
+  highp vec2 cursor_coord = (coord - cursor.xy) / cursor.zw;
+  if (any(lessThan(cursor_coord, vec2(0.0))) ||
+      any(greaterThan(cursor_coord, vec2(1.0))))
+    return rgb;
+  mediump vec4 argb = texture2D(img_cursor, cursor_coord);
+  return argb.rgb + rgb * (1.0 - argb.a);
+}
+
+mediump vec3 sample_blended(in highp vec2 coord) {
+  return blend_cursor(coord, texture2D(img_input, coord).rgb);
+}
+
+mediump vec3 supersample() {
+  return sample_blended(texcoord) +
+         sample_blended(texcoord + vec2(texel.x, 0.0)) +
+         sample_blended(texcoord + vec2(0.0, texel.y)) +
+         sample_blended(texcoord + texel);
 }
 
 mediump vec3 rgb2yuv(in mediump vec3 rgb) {
@@ -35,7 +52,7 @@ mediump vec3 rgb2yuv(in mediump vec3 rgb) {
 }
 
 void main() {
-  mediump vec4 rgb = supersample() / 4.0;
-  mediump vec3 yuv = rgb2yuv(rgb.rgb);
+  mediump vec3 rgb = supersample() / 4.0;
+  mediump vec3 yuv = rgb2yuv(rgb);
   gl_FragColor = vec4(yuv.yz, 0.0, 1.0);
 }
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "damage.h"
+
+#include <string.h>
+
+bool DamageClipRect(const struct GpuRect* rect, uint32_t width,
+                    uint32_t height, struct GpuRect* result) {
+  int64_t left = rect->x < 0 ? 0 : rect->x;
+  int64_t top = rect->y < 0 ? 0 : rect->y;
+  int64_t right = (int64_t)rect->x + rect->width;
+  int64_t bottom = (int64_t)rect->y + rect->height;
+  if (right > width) right = width;
+  if (bottom > height) bottom = height;
+  if (right <= left || bottom <= top) return false;
+  *result = (struct GpuRect){
+      .x = (int32_t)left,
+      .y = (int32_t)top,
+      .width = (uint32_t)(right - left),
+      .height = (uint32_t)(bottom - top),
+  };
+  return true;
+}
+
+// Grows rect to cover other as well, zero sized rects cover nothing.
+static void UniteRect(struct GpuRect* rect, const struct GpuRect* other) {
+  if (!other->width || !other->height) return;
+  if (!rect->width || !rect->height) {
+    *rect = *other;
+    return;
+  }
+  int64_t left = rect->x < other->x ? rect->x : other->x;
+  int64_t top = rect->y < other->y ? rect->y : other->y;
+  int64_t right = (int64_t)rect->x + rect->width;
+  int64_t bottom = (int64_t)rect->y + rect->height;
+  int64_t other_right = (int64_t)other->x + other->width;
+  int64_t other_bottom = (int64_t)other->y + other->height;
+  if (other_right > right) right = other_right;
+  if (other_bottom > bottom) bottom = other_bottom;
+  *rect = (struct GpuRect){
+      .x = (int32_t)left,
+      .y = (int32_t)top,
+      .width = (uint32_t)(right - left),
+      .height = (uint32_t)(bottom - top),
+  };
+}
+
+static bool Overlaps(const struct GpuRect* a, const struct GpuRect* b) {
+  return (int64_t)a->x < (int64_t)b->x + b->width &&
+         (int64_t)b->x < (int64_t)a->x + a->width &&
+         (int64_t)a->y < (int64_t)b->y + b->height &&
+         (int64_t)b->y < (int64_t)a->y + a->height;
+}
+
+// Appends the clipped rectangle, merging it with any it overlaps. Merged
+// rectangles might overlap others in turn, so those are merged again.
+static size_t AppendRect(struct GpuRect* rects, size_t nrects,
+                         const struct GpuRect* rect, uint32_t width,
+                         uint32_t height) {
+  struct GpuRect clipped;
+  if (!DamageClipRect(rect, width, height, &clipped)) return nrects;
+  for (size_t i = 0; i < nrects; i++) {
+    if (!Overlaps(&rects[i], &clipped)) continue;
+    UniteRect(&clipped, &rects[i]);
+    rects[i] = rects[--nrects];
+    i = (size_t)-1;
+  }
+  rects[nrects++] = clipped;
+  return nrects;
+}
+
+static struct DamageTarget* FindTarget(struct DamageHistory* damage_history,
+                                       const void* target) {
+  struct DamageTarget* oldest = damage_history->targets;
+  for (size_t i = 0; i < DAMAGE_MAX_TARGETS; i++) {
+    struct DamageTarget* it = damage_history->targets + i;
+    if (it->target == target) return it;
+    if (it->last_used < oldest->last_used) oldest = it;
+  }
+  // Unknown targets replace the least recently used one, with nothing known
+  // about their contents.
+  *oldest = (struct DamageTarget){.target = target};
+  return oldest;
+}
+
+size_t DamageHistoryUpdate(struct DamageHistory* damage_history,
+                           const void* target, uint32_t width, uint32_t height,
+                           const void* cursor_image,
+                           const struct GpuRect* cursor_rect,
+                           const struct GpuRect* damage,
+                           struct GpuRect rects[DAMAGE_MAX_RECTS]) {
+  const struct GpuRect whole = {.width = width, .height = height};
+  for (size_t i = 0; i < DAMAGE_MAX_TARGETS; i++) {
+    struct DamageTarget* it = damage_history->targets + i;
+    if (it->target) UniteRect(&it->pending, damage ? damage : &whole);
+  }
+
+  struct DamageTarget* it = FindTarget(damage_history, target);
+  static const struct GpuRect kNoCursor = {0};
+  if (!cursor_image) cursor_rect = &kNoCursor;
+  size_t nrects = 0;
+  if (!it->last_used || it->width != width || it->height != height) {
+    nrects = AppendRect(rects, nrects, &whole, width, height);
+  } else {
+    nrects = AppendRect(rects, nrects, &it->pending, width, height);
+    if (cursor_image != it->cursor_image ||
+        memcmp(cursor_rect, &it->cursor_rect, sizeof(*cursor_rect))) {
+      nrects = AppendRect(rects, nrects, &it->cursor_rect, width, height);
+      nrects = AppendRect(rects, nrects, cursor_rect, width, height);
+    }
+  }
+
+  *it = (struct DamageTarget){
+      .target = target,
+      .last_used = ++damage_history->clock,
+      .width = width,
+      .height = height,
+      .cursor_image = cursor_image,
+      .cursor_rect = *cursor_rect,
+  };
+  return nrects;
+}
+
+void DamageHistoryForget(struct DamageHistory* damage_history,
+                         const void* frame) {
+  for (size_t i = 0; i < DAMAGE_MAX_TARGETS; i++) {
+    struct DamageTarget* it = damage_history->targets + i;
+    if (it->target == frame) {
+      *it = (struct DamageTarget){0};
+    } else if (it->cursor_image == frame) {
+      // Whatever image comes next compares as a cursor change.
+      it->cursor_image = NULL;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_DAMAGE_H_
+#define STREAMER_DAMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpu.h"
+
+// Enough for a single encoder input plus a few sessions or a rotating ring
+// sharing a context. Least recently converted targets are forgotten first
+// and fully redrawn on their next conversion.
+#define DAMAGE_MAX_TARGETS 4
+// Accumulated damage, where the cursor was and where it is.
+#define DAMAGE_MAX_RECTS 3
+
+// Frames are only compared by address, so a destroyed frame must be forgotten
+// before another one might take its place.
+struct DamageTarget {
+  const void* target;
+  uint64_t last_used;
+  uint32_t width;
+  uint32_t height;
+  // Bounding box of the source changes since the target was last converted,
+  // zero sized if there are none.
+  struct GpuRect pending;
+  const void* cursor_image;
+  struct GpuRect cursor_rect;
+};
+
+struct DamageHistory {
+  struct DamageTarget targets[DAMAGE_MAX_TARGETS];
+  uint64_t clock;
+};
+
+// Clips the rectangle to width by height, returns whether anything is left.
+bool DamageClipRect(const struct GpuRect* rect, uint32_t width,
+                    uint32_t height, struct GpuRect* result);
+
+// Returns the rectangles of a width by height source to convert into target
+// and records the conversion. Damage is the part of the source that changed
+// since the previous conversion into any target, NULL for all of it. Cursor
+// image is NULL for none. Overlapping rectangles are merged, none are
+// returned if nothing changed.
+size_t DamageHistoryUpdate(struct DamageHistory* damage_history,
+                           const void* target, uint32_t width, uint32_t height,
+                           const void* cursor_image,
+                           const struct GpuRect* cursor_rect,
+                           const struct GpuRect* damage,
+                           struct GpuRect rects[DAMAGE_MAX_RECTS]);
+// Drops a frame from the history, e.g. when it is destroyed or a conversion
+// into it failed. Works for both targets and cursor images.
+void DamageHistoryForget(struct DamageHistory* damage_history,
+                         const void* frame);
+
+#endif  // STREAMER_DAMAGE_H_
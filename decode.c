@@ -0,0 +1,1399 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "decode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+
+#include "bitstream.h"
+#include "hevc.h"
+#include "hevcparse.h"
+#include "trace.h"
+
+#define MAX_SURFACES 20
+#define NO_SLOT -1
+
+struct DecodePicture {
+  bool reference;
+  bool long_term;
+  bool needed_for_output;
+  bool queued;
+  bool held;
+  bool keyframe;
+  int32_t pic_order_cnt;
+  uint32_t latency_count;
+  uint64_t pts;
+};
+
+struct RefPicSet {
+  int st_curr_before[16];
+  int st_curr_after[16];
+  int lt_curr[32];
+  size_t st_curr_before_count;
+  size_t st_curr_after_count;
+  size_t lt_curr_count;
+};
+
+struct PtsMark {
+  size_t offset;
+  uint64_t pts;
+};
+
+struct DecodeContext {
+  bool standin;
+  int render_node;
+  VADisplay va_display;
+  VAConfigID va_config_id;
+  VAContextID va_context_id;
+
+  uint8_t* buffer;
+  size_t buffer_size;
+  size_t buffer_alloc;
+  size_t read_offset;
+  size_t scan_offset;
+  struct PtsMark* marks;
+  size_t marks_count;
+  size_t marks_alloc;
+  bool eos;
+  bool flushed;
+  bool failed;
+
+  uint8_t* rbsp;
+  size_t rbsp_alloc;
+  struct ParameterSets parameter_sets;
+  struct SeqParameterSet active_sps;
+  struct SliceSegmentHeader slice;
+
+  size_t nsurfaces;
+  VASurfaceID surfaces[MAX_SURFACES];
+  struct DecodedFrame frames[MAX_SURFACES];
+  struct DecodePicture pictures[MAX_SURFACES];
+
+  int current;
+  bool skipping;
+  bool first_picture;
+  bool skip_rasl;
+  int32_t prev_tid0_pic_order_cnt;
+  uint64_t picture_counter;
+  struct RefPicSet rps;
+  VAPictureParameterBufferHEVC pic;
+  VASliceParameterBufferHEVC* slice_params;
+  size_t slice_params_alloc;
+  VABufferID* slice_data;
+  size_t slice_data_alloc;
+  size_t slices_count;
+
+  size_t output_queue[MAX_SURFACES];
+  size_t output_head;
+  size_t output_count;
+  int held;
+};
+
+enum NalResult {
+  kNalFailed = 0,
+  kNalConsumed,
+  kNalDeferred,
+};
+
+static bool Reserve(void** data, size_t* alloc, size_t count, size_t size) {
+  if (count <= *alloc) return true;
+  size_t new_alloc = *alloc ? *alloc : 16;
+  while (new_alloc < count) new_alloc *= 2;
+  void* new_data = realloc(*data, new_alloc * size);
+  if (!new_data) {
+    fprintf(stderr, "Failed to reallocate buffer: %s\n", strerror(errno));
+    return false;
+  }
+  *data = new_data;
+  *alloc = new_alloc;
+  return true;
+}
+
+static bool IsIrap(uint8_t nal_unit_type) {
+  return nal_unit_type >= BLA_W_LP && nal_unit_type <= RSV_IRAP_VCL23;
+}
+
+static bool IsIdr(uint8_t nal_unit_type) {
+  return nal_unit_type == IDR_W_RADL || nal_unit_type == IDR_N_LP;
+}
+
+struct DecodeContext* DecodeContextCreate(bool standin) {
+  struct DecodeContext* decode_context = malloc(sizeof(struct DecodeContext));
+  if (!decode_context) {
+    fprintf(stderr, "Failed to allocate decode context: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *decode_context = (struct DecodeContext){
+      .standin = standin,
+      .render_node = -1,
+      .va_config_id = VA_INVALID_ID,
+      .va_context_id = VA_INVALID_ID,
+      .current = NO_SLOT,
+      .first_picture = true,
+      .held = NO_SLOT,
+  };
+  if (standin) return decode_context;
+
+  decode_context->render_node = open("/dev/dri/renderD128", O_RDWR);
+  if (decode_context->render_node == -1) {
+    fprintf(stderr, "Failed to open render node: %s\n", strerror(errno));
+    goto rollback_decode_context;
+  }
+
+  decode_context->va_display = vaGetDisplayDRM(decode_context->render_node);
+  if (!decode_context->va_display) {
+    fprintf(stderr, "Failed to get va display\n");
+    goto rollback_render_node;
+  }
+
+  int major, minor;
+  VAStatus status = vaInitialize(decode_context->va_display, &major, &minor);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to initialize va: %s\n", vaErrorStr(status));
+    goto rollback_va_display;
+  }
+
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribRTFormat, .value = VA_RT_FORMAT_YUV420},
+  };
+  status = vaCreateConfig(decode_context->va_display, VAProfileHEVCMain,
+                          VAEntrypointVLD, attrib_list, LENGTH(attrib_list),
+                          &decode_context->va_config_id);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to create va config: %s\n", vaErrorStr(status));
+    goto rollback_va_display;
+  }
+  return decode_context;
+
+rollback_va_display:
+  vaTerminate(decode_context->va_display);
+rollback_render_node:
+  close(decode_context->render_node);
+rollback_decode_context:
+  free(decode_context);
+  return NULL;
+}
+
+// Drops consumed input once per push, so that consuming a nal unit is only
+// an offset bump no matter how many of them a single push carried.
+static void CompactInput(struct DecodeContext* decode_context) {
+  size_t read_offset = decode_context->read_offset;
+  if (!read_offset) return;
+
+  size_t marks_consumed = 0;
+  while (marks_consumed + 1 < decode_context->marks_count &&
+         decode_context->marks[marks_consumed + 1].offset <= read_offset)
+    marks_consumed++;
+  decode_context->marks_count -= marks_consumed;
+  memmove(decode_context->marks, decode_context->marks + marks_consumed,
+          decode_context->marks_count * sizeof(struct PtsMark));
+  for (size_t i = 0; i < decode_context->marks_count; i++) {
+    struct PtsMark* mark = &decode_context->marks[i];
+    mark->offset = mark->offset > read_offset ? mark->offset - read_offset : 0;
+  }
+
+  decode_context->buffer_size -= read_offset;
+  memmove(decode_context->buffer, decode_context->buffer + read_offset,
+          decode_context->buffer_size);
+  decode_context->scan_offset -= read_offset;
+  decode_context->read_offset = 0;
+}
+
+bool DecodeContextPush(struct DecodeContext* decode_context, const void* data,
+                       size_t size, uint64_t pts) {
+  CompactInput(decode_context);
+  if (!Reserve((void**)&decode_context->buffer,
+               &decode_context->buffer_alloc,
+               decode_context->buffer_size + size, 1) ||
+      !Reserve((void**)&decode_context->marks, &decode_context->marks_alloc,
+               decode_context->marks_count + 1, sizeof(struct PtsMark))) {
+    //LOG("Failed to grow input buffers");
+    return false;
+  }
+  decode_context->marks[decode_context->marks_count++] = (struct PtsMark){
+      .offset = decode_context->buffer_size,
+      .pts = pts,
+  };
+  memcpy(decode_context->buffer + decode_context->buffer_size, data, size);
+  decode_context->buffer_size += size;
+  return true;
+}
+
+void DecodeContextFlush(struct DecodeContext* decode_context) {
+  decode_context->eos = true;
+}
+
+// B.2 Byte stream NAL unit semantics. Returns the payload of the first
+// complete nal unit, which is followed by the next start code or by the end
+// of the stream.
+static bool PeekNalUnit(struct DecodeContext* decode_context,
+                        const uint8_t** nal_data, size_t* nal_size,
+                        size_t* next_offset) {
+  const uint8_t* buffer = decode_context->buffer;
+  size_t size = decode_context->buffer_size;
+  size_t begin = decode_context->read_offset;
+  while (begin + 3 <= size &&
+         (buffer[begin] || buffer[begin + 1] || buffer[begin + 2] != 1))
+    begin++;
+  if (begin + 3 > size) return false;
+  begin += 3;
+
+  size_t end = decode_context->scan_offset > begin
+                   ? decode_context->scan_offset
+                   : begin;
+  while (end + 3 <= size &&
+         (buffer[end] || buffer[end + 1] || buffer[end + 2] != 1))
+    end++;
+  if (end + 3 > size) {
+    // Keep the incomplete tail rescannable once more data arrives.
+    decode_context->scan_offset = end;
+    if (!decode_context->eos) return false;
+    end = size;
+  }
+
+  *next_offset = end;
+  // trailing_zero_8bits and zero_byte belong to neither unit.
+  while (end > begin && !buffer[end - 1]) end--;
+  *nal_data = buffer + begin;
+  *nal_size = end - begin;
+  return true;
+}
+
+static void ConsumeNalUnit(struct DecodeContext* decode_context,
+                           size_t next_offset) {
+  decode_context->read_offset = next_offset;
+  decode_context->scan_offset = next_offset;
+}
+
+static uint64_t PtsAt(const struct DecodeContext* decode_context,
+                      const uint8_t* data) {
+  size_t offset = (size_t)(data - decode_context->buffer);
+  uint64_t pts = 0;
+  for (size_t i = 0; i < decode_context->marks_count; i++) {
+    if (decode_context->marks[i].offset > offset) break;
+    pts = decode_context->marks[i].pts;
+  }
+  return pts;
+}
+
+static bool Unescape(struct DecodeContext* decode_context,
+                     const uint8_t* nal_data, size_t nal_size,
+                     struct BitstreamReader* reader) {
+  if (!Reserve((void**)&decode_context->rbsp, &decode_context->rbsp_alloc,
+               nal_size, 1)) {
+    //LOG("Failed to grow rbsp buffer");
+    return false;
+  }
+  struct Bitstream bitstream = {
+      .data = decode_context->rbsp,
+      .size = 0,
+  };
+  const struct Bitstream source = {
+      .data = (void*)(uintptr_t)nal_data,
+      .size = nal_size * 8,
+  };
+  BitstreamDeflate(&bitstream, &source);
+  *reader = (struct BitstreamReader){
+      .data = decode_context->rbsp,
+      .size = bitstream.size,
+      .offset = 16,  // nal_unit_header
+  };
+  return true;
+}
+
+// Maps an offset within rbsp back to the escaped nal unit.
+static size_t EscapedOffset(const uint8_t* nal_data, size_t nal_size,
+                            size_t rbsp_offset, uint32_t* emulation_bytes) {
+  size_t zeros = 0;
+  size_t offset = 0;
+  *emulation_bytes = 0;
+  for (size_t i = 0; i < nal_size && rbsp_offset; i++) {
+    offset++;
+    if (zeros >= 2 && nal_data[i] == 3) {
+      (*emulation_bytes)++;
+      zeros = 0;
+      continue;
+    }
+    zeros = nal_data[i] ? 0 : zeros + 1;
+    rbsp_offset--;
+  }
+  return offset;
+}
+
+static void DestroySurfaces(struct DecodeContext* decode_context) {
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    struct DecodedFrame* frame = &decode_context->frames[i];
+    int fds[4] = {-1, -1, -1, -1};
+    for (size_t j = 0; j < frame->nplanes; j++)
+      fds[j] = frame->planes[j].dmabuf_fd;
+    CloseUniqueFds(fds);
+  }
+  if (!decode_context->standin && decode_context->nsurfaces) {
+    vaDestroyContext(decode_context->va_display,
+                     decode_context->va_context_id);
+    vaDestroySurfaces(decode_context->va_display, decode_context->surfaces,
+                      (int)decode_context->nsurfaces);
+  }
+  decode_context->va_context_id = VA_INVALID_ID;
+  decode_context->nsurfaces = 0;
+}
+
+static bool ExportSurface(struct DecodeContext* decode_context, size_t index) {
+  VADRMPRIMESurfaceDescriptor prime;
+  VAStatus status = vaExportSurfaceHandle(
+      decode_context->va_display, decode_context->surfaces[index],
+      VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+      VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &prime);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to export va surface: %s\n", vaErrorStr(status));
+    return false;
+  }
+
+  struct DecodedFrame* frame = &decode_context->frames[index];
+  frame->fourcc = prime.fourcc;
+  frame->nplanes = prime.layers[0].num_planes;
+  for (size_t i = 0; i < prime.layers[0].num_planes; i++) {
+    uint32_t object_index = prime.layers[0].object_index[i];
+    frame->planes[i] = (struct GpuFramePlane){
+        .dmabuf_fd = prime.objects[object_index].fd,
+        .pitch = prime.layers[0].pitch[i],
+        .offset = prime.layers[0].offset[i],
+        .modifier = prime.objects[object_index].drm_format_modifier,
+    };
+  }
+  // Objects not referenced by any plane would leak otherwise.
+  for (uint32_t i = 0; i < prime.num_objects; i++) {
+    bool referenced = false;
+    for (size_t j = 0; j < frame->nplanes; j++)
+      referenced |= frame->planes[j].dmabuf_fd == prime.objects[i].fd;
+    if (!referenced) close(prime.objects[i].fd);
+  }
+  return true;
+}
+
+static bool CreateSurfaces(struct DecodeContext* decode_context,
+                           const struct SeqParameterSet* sps) {
+  size_t nsurfaces = sps->sps_max_dec_pic_buffering_minus1 + 1 + 3;
+  if (nsurfaces > MAX_SURFACES) nsurfaces = MAX_SURFACES;
+  for (size_t i = 0; i < nsurfaces; i++) {
+    decode_context->pictures[i] = (struct DecodePicture){0};
+    decode_context->frames[i] = (struct DecodedFrame){
+        .index = (uint32_t)i,
+        .fresh = true,
+        .width = sps->pic_width_in_luma_samples,
+        .height = sps->pic_height_in_luma_samples,
+        // 7.4.3.2.1 SubWidthC and SubHeightC are both 2 for 4:2:0
+        .crop_width = sps->pic_width_in_luma_samples -
+                      2 * (sps->conf_win_left_offset +
+                           sps->conf_win_right_offset),
+        .crop_height = sps->pic_height_in_luma_samples -
+                       2 * (sps->conf_win_top_offset +
+                            sps->conf_win_bottom_offset),
+    };
+  }
+  if (decode_context->standin) {
+    for (size_t i = 0; i < nsurfaces; i++)
+      decode_context->surfaces[i] = (VASurfaceID)i;
+    decode_context->nsurfaces = nsurfaces;
+    return true;
+  }
+
+  VAStatus status = vaCreateSurfaces(
+      decode_context->va_display, VA_RT_FORMAT_YUV420,
+      sps->pic_width_in_luma_samples, sps->pic_height_in_luma_samples,
+      decode_context->surfaces, (unsigned)nsurfaces, NULL, 0);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to create va surfaces: %s\n", vaErrorStr(status));
+    return false;
+  }
+
+  status = vaCreateContext(
+      decode_context->va_display, decode_context->va_config_id,
+      (int)sps->pic_width_in_luma_samples,
+      (int)sps->pic_height_in_luma_samples, VA_PROGRESSIVE,
+      decode_context->surfaces, (int)nsurfaces, &decode_context->va_context_id);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to create va context: %s\n", vaErrorStr(status));
+    vaDestroySurfaces(decode_context->va_display, decode_context->surfaces,
+                      (int)nsurfaces);
+    return false;
+  }
+
+  decode_context->nsurfaces = nsurfaces;
+  for (size_t i = 0; i < nsurfaces; i++) {
+    if (!ExportSurface(decode_context, i)) {
+      //LOG("Failed to export surface");
+      DestroySurfaces(decode_context);
+      return false;
+    }
+  }
+  return true;
+}
+
+// C.5.2.2 "Bumping" process
+static bool Bump(struct DecodeContext* decode_context) {
+  int slot = NO_SLOT;
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    const struct DecodePicture* picture = &decode_context->pictures[i];
+    if (!picture->needed_for_output) continue;
+    if (slot == NO_SLOT ||
+        picture->pic_order_cnt <
+            decode_context->pictures[slot].pic_order_cnt)
+      slot = (int)i;
+  }
+  if (slot == NO_SLOT) return false;
+
+  decode_context->pictures[slot].needed_for_output = false;
+  decode_context->pictures[slot].queued = true;
+  size_t tail = (decode_context->output_head + decode_context->output_count++) %
+                LENGTH(decode_context->output_queue);
+  decode_context->output_queue[tail] = (size_t)slot;
+  return true;
+}
+
+static void BumpAll(struct DecodeContext* decode_context) {
+  while (Bump(decode_context));
+}
+
+static size_t CountNeededForOutput(const struct DecodeContext* decode_context,
+                                   bool* latency_exceeded) {
+  const struct SeqParameterSet* sps = &decode_context->active_sps;
+  uint32_t sps_max_latency_pictures = sps->sps_max_num_reorder_pics +
+                                      sps->sps_max_latency_increase_plus1 - 1;
+  size_t result = 0;
+  *latency_exceeded = false;
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    const struct DecodePicture* picture = &decode_context->pictures[i];
+    if (!picture->needed_for_output) continue;
+    result++;
+    if (sps->sps_max_latency_increase_plus1 &&
+        picture->latency_count >= sps_max_latency_pictures)
+      *latency_exceeded = true;
+  }
+  return result;
+}
+
+static bool IsFree(const struct DecodePicture* picture) {
+  return !picture->reference && !picture->needed_for_output &&
+         !picture->queued && !picture->held;
+}
+
+static int FindReference(const struct DecodeContext* decode_context,
+                         int32_t pic_order_cnt, int32_t mask,
+                         bool long_term) {
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    const struct DecodePicture* picture = &decode_context->pictures[i];
+    if ((int)i == decode_context->current || !picture->reference) continue;
+    if (!long_term && picture->long_term) continue;
+    if ((picture->pic_order_cnt & mask) == pic_order_cnt) return (int)i;
+  }
+  return NO_SLOT;
+}
+
+// 8.3.2 Decoding process for reference picture set
+static void DeriveRefPicSet(struct DecodeContext* decode_context,
+                            int32_t pic_order_cnt, bool clear,
+                            struct RefPicSet* rps) {
+  *rps = (struct RefPicSet){0};
+  bool keep[MAX_SURFACES] = {0};
+  if (!clear) {
+    const struct SliceSegmentHeader* slice = &decode_context->slice;
+    const struct ShortTermRefPicSet* st = &slice->st_ref_pic_set;
+    int32_t max_poc_lsb =
+        1 << (decode_context->active_sps.log2_max_pic_order_cnt_lsb_minus4 +
+              4);
+
+    for (uint32_t i = 0;
+         i < slice->num_long_term_sps + slice->num_long_term_pics; i++) {
+      int32_t poc_lt = (int32_t)slice->poc_lsb_lt[i];
+      int32_t mask = max_poc_lsb - 1;
+      if (slice->delta_poc_msb_present_flag[i]) {
+        poc_lt += pic_order_cnt -
+                  (int32_t)slice->delta_poc_msb_cycle_lt[i] * max_poc_lsb -
+                  (pic_order_cnt & (max_poc_lsb - 1));
+        mask = -1;
+      }
+      int slot = FindReference(decode_context, poc_lt, mask, true);
+      if (slot != NO_SLOT) {
+        keep[slot] = true;
+        decode_context->pictures[slot].long_term = true;
+      }
+      if (slice->used_by_curr_pic_lt[i])
+        rps->lt_curr[rps->lt_curr_count++] = slot;
+    }
+
+    for (uint32_t i = 0; i < st->num_negative_pics; i++) {
+      int slot = FindReference(decode_context,
+                               pic_order_cnt + st->delta_poc_s0[i], -1, false);
+      if (slot != NO_SLOT) keep[slot] = true;
+      if (st->used_by_curr_pic_s0[i])
+        rps->st_curr_before[rps->st_curr_before_count++] = slot;
+    }
+    for (uint32_t i = 0; i < st->num_positive_pics; i++) {
+      int slot = FindReference(decode_context,
+                               pic_order_cnt + st->delta_poc_s1[i], -1, false);
+      if (slot != NO_SLOT) keep[slot] = true;
+      if (st->used_by_curr_pic_s1[i])
+        rps->st_curr_after[rps->st_curr_after_count++] = slot;
+    }
+  }
+
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    if (keep[i]) continue;
+    decode_context->pictures[i].reference = false;
+    decode_context->pictures[i].long_term = false;
+  }
+}
+
+static VAPictureHEVC InvalidPicture(void) {
+  return (VAPictureHEVC){
+      .picture_id = VA_INVALID_ID,
+      .flags = VA_PICTURE_HEVC_INVALID,
+  };
+}
+
+static void FillPictureParameters(struct DecodeContext* decode_context,
+                                  const struct PicParameterSet* pps,
+                                  const struct RefPicSet* rps) {
+  const struct SeqParameterSet* sps = &decode_context->active_sps;
+  const struct SliceSegmentHeader* slice = &decode_context->slice;
+  const struct DecodePicture* current =
+      &decode_context->pictures[decode_context->current];
+  VAPictureParameterBufferHEVC* pic = &decode_context->pic;
+
+  *pic = (VAPictureParameterBufferHEVC){
+      .CurrPic =
+          {
+              .picture_id = decode_context->surfaces[decode_context->current],
+              .pic_order_cnt = current->pic_order_cnt,
+          },
+      .pic_width_in_luma_samples = (uint16_t)sps->pic_width_in_luma_samples,
+      .pic_height_in_luma_samples = (uint16_t)sps->pic_height_in_luma_samples,
+      .pic_fields.bits =
+          {
+              .chroma_format_idc = sps->chroma_format_idc,
+              .separate_colour_plane_flag = sps->separate_colour_plane_flag,
+              .pcm_enabled_flag = sps->pcm_enabled_flag,
+              .scaling_list_enabled_flag = sps->scaling_list_enabled_flag,
+              .transform_skip_enabled_flag = pps->transform_skip_enabled_flag,
+              .amp_enabled_flag = sps->amp_enabled_flag,
+              .strong_intra_smoothing_enabled_flag =
+                  sps->strong_intra_smoothing_enabled_flag,
+              .sign_data_hiding_enabled_flag =
+                  pps->sign_data_hiding_enabled_flag,
+              .constrained_intra_pred_flag = pps->constrained_intra_pred_flag,
+              .cu_qp_delta_enabled_flag = pps->cu_qp_delta_enabled_flag,
+              .weighted_pred_flag = pps->weighted_pred_flag,
+              .weighted_bipred_flag = pps->weighted_bipred_flag,
+              .transquant_bypass_enabled_flag =
+                  pps->transquant_bypass_enabled_flag,
+              .tiles_enabled_flag = pps->tiles_enabled_flag,
+              .entropy_coding_sync_enabled_flag =
+                  pps->entropy_coding_sync_enabled_flag,
+              .pps_loop_filter_across_slices_enabled_flag =
+                  pps->pps_loop_filter_across_slices_enabled_flag,
+              .loop_filter_across_tiles_enabled_flag =
+                  pps->loop_filter_across_tiles_enabled_flag,
+              .pcm_loop_filter_disabled_flag =
+                  sps->pcm_loop_filter_disabled_flag,
+              .NoPicReorderingFlag = sps->sps_max_num_reorder_pics == 0,
+              .NoBiPredFlag = 0,
+          },
+      .sps_max_dec_pic_buffering_minus1 =
+          (uint8_t)sps->sps_max_dec_pic_buffering_minus1,
+      .bit_depth_luma_minus8 = (uint8_t)sps->bit_depth_luma_minus8,
+      .bit_depth_chroma_minus8 = (uint8_t)sps->bit_depth_chroma_minus8,
+      .pcm_sample_bit_depth_luma_minus1 =
+          sps->pcm_sample_bit_depth_luma_minus1,
+      .pcm_sample_bit_depth_chroma_minus1 =
+          sps->pcm_sample_bit_depth_chroma_minus1,
+      .log2_min_luma_coding_block_size_minus3 =
+          (uint8_t)sps->log2_min_luma_coding_block_size_minus3,
+      .log2_diff_max_min_luma_coding_block_size =
+          (uint8_t)sps->log2_diff_max_min_luma_coding_block_size,
+      .log2_min_transform_block_size_minus2 =
+          (uint8_t)sps->log2_min_luma_transform_block_size_minus2,
+      .log2_diff_max_min_transform_block_size =
+          (uint8_t)sps->log2_diff_max_min_luma_transform_block_size,
+      .log2_min_pcm_luma_coding_block_size_minus3 =
+          (uint8_t)sps->log2_min_pcm_luma_coding_block_size_minus3,
+      .log2_diff_max_min_pcm_luma_coding_block_size =
+          (uint8_t)sps->log2_diff_max_min_pcm_luma_coding_block_size,
+      .max_transform_hierarchy_depth_intra =
+          (uint8_t)sps->max_transform_hierarchy_depth_intra,
+      .max_transform_hierarchy_depth_inter =
+          (uint8_t)sps->max_transform_hierarchy_depth_inter,
+      .init_qp_minus26 = (int8_t)pps->init_qp_minus26,
+      .diff_cu_qp_delta_depth = (uint8_t)pps->diff_cu_qp_delta_depth,
+      .pps_cb_qp_offset = (int8_t)pps->pps_cb_qp_offset,
+      .pps_cr_qp_offset = (int8_t)pps->pps_cr_qp_offset,
+      .log2_parallel_merge_level_minus2 =
+          (uint8_t)pps->log2_parallel_merge_level_minus2,
+      .num_tile_columns_minus1 = (uint8_t)pps->num_tile_columns_minus1,
+      .num_tile_rows_minus1 = (uint8_t)pps->num_tile_rows_minus1,
+      .slice_parsing_fields.bits =
+          {
+              .lists_modification_present_flag =
+                  pps->lists_modification_present_flag,
+              .long_term_ref_pics_present_flag =
+                  sps->long_term_ref_pics_present_flag,
+              .sps_temporal_mvp_enabled_flag =
+                  sps->sps_temporal_mvp_enabled_flag,
+              .cabac_init_present_flag = pps->cabac_init_present_flag,
+              .output_flag_present_flag = pps->output_flag_present_flag,
+              .dependent_slice_segments_enabled_flag =
+                  pps->dependent_slice_segments_enabled_flag,
+              .pps_slice_chroma_qp_offsets_present_flag =
+                  pps->pps_slice_chroma_qp_offsets_present_flag,
+              .sample_adaptive_offset_enabled_flag =
+                  sps->sample_adaptive_offset_enabled_flag,
+              .deblocking_filter_override_enabled_flag =
+                  pps->deblocking_filter_override_enabled_flag,
+              .pps_disable_deblocking_filter_flag =
+                  pps->pps_deblocking_filter_disabled_flag,
+              .slice_segment_header_extension_present_flag =
+                  pps->slice_segment_header_extension_present_flag,
+              .RapPicFlag = IsIrap(slice->nal_unit_type),
+              .IdrPicFlag = IsIdr(slice->nal_unit_type),
+              .IntraPicFlag = IsIrap(slice->nal_unit_type),
+          },
+      .log2_max_pic_order_cnt_lsb_minus4 =
+          (uint8_t)sps->log2_max_pic_order_cnt_lsb_minus4,
+      .num_short_term_ref_pic_sets = (uint8_t)sps->num_short_term_ref_pic_sets,
+      .num_long_term_ref_pic_sps = (uint8_t)sps->num_long_term_ref_pics_sps,
+      .num_ref_idx_l0_default_active_minus1 =
+          (uint8_t)pps->num_ref_idx_l0_default_active_minus1,
+      .num_ref_idx_l1_default_active_minus1 =
+          (uint8_t)pps->num_ref_idx_l1_default_active_minus1,
+      .pps_beta_offset_div2 = (int8_t)pps->pps_beta_offset_div2,
+      .pps_tc_offset_div2 = (int8_t)pps->pps_tc_offset_div2,
+      .num_extra_slice_header_bits = pps->num_extra_slice_header_bits,
+      .st_rps_bits = slice->st_ref_pic_set_bits,
+  };
+
+  // 6.5.1 Column and row widths for uniformly spaced tiles
+  uint32_t ctb_log2_size_y = sps->log2_min_luma_coding_block_size_minus3 +
+                             3 + sps->log2_diff_max_min_luma_coding_block_size;
+  uint32_t ctb_size_y = 1u << ctb_log2_size_y;
+  uint32_t pic_width_in_ctbs_y =
+      (sps->pic_width_in_luma_samples + ctb_size_y - 1) >> ctb_log2_size_y;
+  uint32_t pic_height_in_ctbs_y =
+      (sps->pic_height_in_luma_samples + ctb_size_y - 1) >> ctb_log2_size_y;
+  uint32_t num_columns = pps->num_tile_columns_minus1 + 1;
+  uint32_t num_rows = pps->num_tile_rows_minus1 + 1;
+  for (uint32_t i = 0; i < num_columns && i < LENGTH(pic->column_width_minus1);
+       i++) {
+    pic->column_width_minus1[i] =
+        (uint16_t)(pps->uniform_spacing_flag
+                       ? (i + 1) * pic_width_in_ctbs_y / num_columns -
+                             i * pic_width_in_ctbs_y / num_columns - 1
+                       : pps->column_width_minus1[i]);
+  }
+  for (uint32_t i = 0; i < num_rows && i < LENGTH(pic->row_height_minus1);
+       i++) {
+    pic->row_height_minus1[i] =
+        (uint16_t)(pps->uniform_spacing_flag
+                       ? (i + 1) * pic_height_in_ctbs_y / num_rows -
+                             i * pic_height_in_ctbs_y / num_rows - 1
+                       : pps->row_height_minus1[i]);
+  }
+
+  // Only the pictures of the current set are listed, the ones that are merely
+  // kept for the following pictures do not matter here.
+  size_t count = 0;
+  const struct {
+    const int* slots;
+    size_t count;
+    uint32_t flags;
+  } sets[] = {
+      {rps->st_curr_before, rps->st_curr_before_count,
+       VA_PICTURE_HEVC_RPS_ST_CURR_BEFORE},
+      {rps->st_curr_after, rps->st_curr_after_count,
+       VA_PICTURE_HEVC_RPS_ST_CURR_AFTER},
+      {rps->lt_curr, rps->lt_curr_count,
+       VA_PICTURE_HEVC_RPS_LT_CURR | VA_PICTURE_HEVC_LONG_TERM_REFERENCE},
+  };
+  for (size_t i = 0; i < LENGTH(sets); i++) {
+    for (size_t j = 0; j < sets[i].count; j++) {
+      int slot = sets[i].slots[j];
+      if (slot == NO_SLOT || count == LENGTH(pic->ReferenceFrames)) continue;
+      bool listed = false;
+      for (size_t k = 0; k < count; k++)
+        listed |= pic->ReferenceFrames[k].picture_id ==
+                  decode_context->surfaces[slot];
+      if (listed) continue;
+      pic->ReferenceFrames[count++] = (VAPictureHEVC){
+          .picture_id = decode_context->surfaces[slot],
+          .pic_order_cnt = decode_context->pictures[slot].pic_order_cnt,
+          .flags = sets[i].flags,
+      };
+    }
+  }
+  while (count < LENGTH(pic->ReferenceFrames))
+    pic->ReferenceFrames[count++] = InvalidPicture();
+}
+
+static uint8_t ReferenceIndex(const struct DecodeContext* decode_context,
+                              int slot) {
+  if (slot == NO_SLOT) return 0xff;
+  for (size_t i = 0; i < LENGTH(decode_context->pic.ReferenceFrames); i++) {
+    if (decode_context->pic.ReferenceFrames[i].picture_id ==
+        decode_context->surfaces[slot])
+      return (uint8_t)i;
+  }
+  return 0xff;
+}
+
+// 8.3.4 Decoding process for reference picture lists construction
+static bool BuildRefPicList(const struct DecodeContext* decode_context,
+                            const struct RefPicSet* rps, int list,
+                            uint8_t ref_pic_list[15]) {
+  const struct SliceSegmentHeader* slice = &decode_context->slice;
+  uint32_t num_ref_idx_active = (list ? slice->num_ref_idx_l1_active_minus1
+                                      : slice->num_ref_idx_l0_active_minus1) +
+                                1;
+  uint32_t num_rps_curr_temp_list = num_ref_idx_active;
+  if (num_rps_curr_temp_list < slice->num_pic_total_curr)
+    num_rps_curr_temp_list = slice->num_pic_total_curr;
+  if (!slice->num_pic_total_curr) {
+    fprintf(stderr, "Inter slice without reference pictures\n");
+    return false;
+  }
+
+  const int* first = list ? rps->st_curr_after : rps->st_curr_before;
+  size_t first_count =
+      list ? rps->st_curr_after_count : rps->st_curr_before_count;
+  const int* second = list ? rps->st_curr_before : rps->st_curr_after;
+  size_t second_count =
+      list ? rps->st_curr_before_count : rps->st_curr_after_count;
+
+  int temp[32];
+  uint32_t r_idx = 0;
+  while (r_idx < num_rps_curr_temp_list && r_idx < LENGTH(temp)) {
+    for (size_t i = 0; i < first_count && r_idx < num_rps_curr_temp_list; i++)
+      temp[r_idx++] = first[i];
+    for (size_t i = 0; i < second_count && r_idx < num_rps_curr_temp_list;
+         i++)
+      temp[r_idx++] = second[i];
+    for (size_t i = 0;
+         i < rps->lt_curr_count && r_idx < num_rps_curr_temp_list; i++)
+      temp[r_idx++] = rps->lt_curr[i];
+  }
+
+  bool modification = list ? slice->ref_pic_list_modification_flag_l1
+                           : slice->ref_pic_list_modification_flag_l0;
+  const uint32_t* list_entry =
+      list ? slice->list_entry_l1 : slice->list_entry_l0;
+  for (uint32_t i = 0; i < 15; i++) {
+    if (i >= num_ref_idx_active) {
+      ref_pic_list[i] = 0xff;
+      continue;
+    }
+    uint32_t entry = modification ? list_entry[i] : i;
+    if (entry >= r_idx) {
+      fprintf(stderr, "Invalid reference picture list entry\n");
+      return false;
+    }
+    ref_pic_list[i] = ReferenceIndex(decode_context, temp[entry]);
+    if (ref_pic_list[i] == 0xff)
+      fprintf(stderr, "Reference picture is missing\n");
+  }
+  return true;
+}
+
+static bool AddSlice(struct DecodeContext* decode_context,
+                     const uint8_t* nal_data, size_t nal_size) {
+  const struct SliceSegmentHeader* slice = &decode_context->slice;
+  const struct RefPicSet* rps = &decode_context->rps;
+  if (!Reserve((void**)&decode_context->slice_params,
+               &decode_context->slice_params_alloc,
+               decode_context->slices_count + 1,
+               sizeof(VASliceParameterBufferHEVC)) ||
+      !Reserve((void**)&decode_context->slice_data,
+               &decode_context->slice_data_alloc,
+               decode_context->slices_count + 1, sizeof(VABufferID))) {
+    //LOG("Failed to grow slices buffers");
+    return false;
+  }
+
+  uint32_t emulation_bytes;
+  size_t slice_data_byte_offset = EscapedOffset(
+      nal_data, nal_size, 2 + slice->header_size, &emulation_bytes);
+  VASliceParameterBufferHEVC* slice_param =
+      &decode_context->slice_params[decode_context->slices_count];
+  *slice_param = (VASliceParameterBufferHEVC){
+      .slice_data_size = (uint32_t)nal_size,
+      .slice_data_offset = 0,
+      .slice_data_flag = VA_SLICE_DATA_FLAG_ALL,
+      .slice_data_byte_offset = (uint32_t)slice_data_byte_offset,
+      .slice_segment_address = slice->slice_segment_address,
+      .LongSliceFlags.fields =
+          {
+              .LastSliceOfPic = 0,
+              .dependent_slice_segment_flag =
+                  slice->dependent_slice_segment_flag,
+              .slice_type = slice->slice_type,
+              .color_plane_id = slice->colour_plane_id,
+              .slice_sao_luma_flag = slice->slice_sao_luma_flag,
+              .slice_sao_chroma_flag = slice->slice_sao_chroma_flag,
+              .mvd_l1_zero_flag = slice->mvd_l1_zero_flag,
+              .cabac_init_flag = slice->cabac_init_flag,
+              .slice_temporal_mvp_enabled_flag =
+                  slice->slice_temporal_mvp_enabled_flag,
+              .slice_deblocking_filter_disabled_flag =
+                  slice->slice_deblocking_filter_disabled_flag,
+              .collocated_from_l0_flag = slice->collocated_from_l0_flag,
+              .slice_loop_filter_across_slices_enabled_flag =
+                  slice->slice_loop_filter_across_slices_enabled_flag,
+          },
+      .collocated_ref_idx = slice->slice_temporal_mvp_enabled_flag
+                                ? (uint8_t)slice->collocated_ref_idx
+                                : 0xff,
+      .num_ref_idx_l0_active_minus1 =
+          (uint8_t)slice->num_ref_idx_l0_active_minus1,
+      .num_ref_idx_l1_active_minus1 =
+          (uint8_t)slice->num_ref_idx_l1_active_minus1,
+      .slice_qp_delta = (int8_t)slice->slice_qp_delta,
+      .slice_cb_qp_offset = (int8_t)slice->slice_cb_qp_offset,
+      .slice_cr_qp_offset = (int8_t)slice->slice_cr_qp_offset,
+      .slice_beta_offset_div2 = (int8_t)slice->slice_beta_offset_div2,
+      .slice_tc_offset_div2 = (int8_t)slice->slice_tc_offset_div2,
+      .luma_log2_weight_denom = (uint8_t)slice->luma_log2_weight_denom,
+      .delta_chroma_log2_weight_denom =
+          (int8_t)slice->delta_chroma_log2_weight_denom,
+      .five_minus_max_num_merge_cand =
+          (uint8_t)slice->five_minus_max_num_merge_cand,
+      .num_entry_point_offsets = (uint16_t)slice->num_entry_point_offsets,
+      .entry_offset_to_subset_array = 0,
+      .slice_data_num_emu_prevn_bytes = (uint16_t)emulation_bytes,
+  };
+  memcpy(slice_param->delta_luma_weight_l0, slice->delta_luma_weight_l0,
+         sizeof(slice_param->delta_luma_weight_l0));
+  memcpy(slice_param->luma_offset_l0, slice->luma_offset_l0,
+         sizeof(slice_param->luma_offset_l0));
+  memcpy(slice_param->delta_chroma_weight_l0, slice->delta_chroma_weight_l0,
+         sizeof(slice_param->delta_chroma_weight_l0));
+  memcpy(slice_param->ChromaOffsetL0, slice->chroma_offset_l0,
+         sizeof(slice_param->ChromaOffsetL0));
+  memcpy(slice_param->delta_luma_weight_l1, slice->delta_luma_weight_l1,
+         sizeof(slice_param->delta_luma_weight_l1));
+  memcpy(slice_param->luma_offset_l1, slice->luma_offset_l1,
+         sizeof(slice_param->luma_offset_l1));
+  memcpy(slice_param->delta_chroma_weight_l1, slice->delta_chroma_weight_l1,
+         sizeof(slice_param->delta_chroma_weight_l1));
+  memcpy(slice_param->ChromaOffsetL1, slice->chroma_offset_l1,
+         sizeof(slice_param->ChromaOffsetL1));
+
+  memset(slice_param->RefPicList, 0xff, sizeof(slice_param->RefPicList));
+  if (slice->slice_type != I &&
+      !BuildRefPicList(decode_context, rps, 0, slice_param->RefPicList[0])) {
+    //LOG("Failed to build reference picture list 0");
+    return false;
+  }
+  if (slice->slice_type == B &&
+      !BuildRefPicList(decode_context, rps, 1, slice_param->RefPicList[1])) {
+    //LOG("Failed to build reference picture list 1");
+    return false;
+  }
+
+  VABufferID* slice_data =
+      &decode_context->slice_data[decode_context->slices_count];
+  *slice_data = VA_INVALID_ID;
+  if (!decode_context->standin) {
+    VAStatus status = vaCreateBuffer(
+        decode_context->va_display, decode_context->va_context_id,
+        VASliceDataBufferType, (unsigned)nal_size, 1,
+        (void*)(uintptr_t)nal_data, slice_data);
+    if (status != VA_STATUS_SUCCESS) {
+      fprintf(stderr, "Failed to create slice data buffer: %s\n",
+              vaErrorStr(status));
+      return false;
+    }
+  }
+  decode_context->slices_count++;
+  return true;
+}
+
+static void DropSlices(struct DecodeContext* decode_context) {
+  for (size_t i = 0; i < decode_context->slices_count; i++) {
+    if (decode_context->slice_data[i] == VA_INVALID_ID) continue;
+    vaDestroyBuffer(decode_context->va_display, decode_context->slice_data[i]);
+  }
+  decode_context->slices_count = 0;
+}
+
+static bool SubmitPicture(struct DecodeContext* decode_context) {
+  if (!decode_context->slices_count) return true;
+  decode_context->slice_params[decode_context->slices_count - 1]
+      .LongSliceFlags.fields.LastSliceOfPic = 1;
+  if (decode_context->standin) return true;
+
+  bool result = false;
+  VABufferID pic_buffer;
+  VAStatus status =
+      vaCreateBuffer(decode_context->va_display, decode_context->va_context_id,
+                     VAPictureParameterBufferType, sizeof(decode_context->pic),
+                     1, &decode_context->pic, &pic_buffer);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to create picture parameter buffer: %s\n",
+            vaErrorStr(status));
+    return false;
+  }
+
+  size_t created = 0;
+  VABufferID* slice_buffers =
+      malloc(decode_context->slices_count * 2 * sizeof(VABufferID));
+  if (!slice_buffers) {
+    fprintf(stderr, "Failed to allocate slice buffers: %s\n",
+            strerror(errno));
+    goto rollback_pic_buffer;
+  }
+  for (; created < decode_context->slices_count; created++) {
+    status = vaCreateBuffer(
+        decode_context->va_display, decode_context->va_context_id,
+        VASliceParameterBufferType, sizeof(VASliceParameterBufferHEVC), 1,
+        &decode_context->slice_params[created], &slice_buffers[created * 2]);
+    if (status != VA_STATUS_SUCCESS) {
+      fprintf(stderr, "Failed to create slice parameter buffer: %s\n",
+              vaErrorStr(status));
+      goto rollback_slice_buffers;
+    }
+    slice_buffers[created * 2 + 1] = decode_context->slice_data[created];
+  }
+
+  uint64_t trace_frame = decode_context->picture_counter;
+  TraceBegin("decode", 0, trace_frame);
+  status = vaBeginPicture(decode_context->va_display,
+                          decode_context->va_context_id,
+                          decode_context->surfaces[decode_context->current]);
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to begin va picture: %s\n", vaErrorStr(status));
+    TraceEnd("decode", 0, trace_frame);
+    goto rollback_slice_buffers;
+  }
+  status = vaRenderPicture(decode_context->va_display,
+                           decode_context->va_context_id, &pic_buffer, 1);
+  if (status == VA_STATUS_SUCCESS) {
+    status = vaRenderPicture(
+        decode_context->va_display, decode_context->va_context_id,
+        slice_buffers, (int)(decode_context->slices_count * 2));
+  }
+  VAStatus end_status =
+      vaEndPicture(decode_context->va_display, decode_context->va_context_id);
+  TraceEnd("decode", 0, trace_frame);
+  if (status != VA_STATUS_SUCCESS || end_status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to decode va picture: %s\n",
+            vaErrorStr(status != VA_STATUS_SUCCESS ? status : end_status));
+    goto rollback_slice_buffers;
+  }
+  result = true;
+
+rollback_slice_buffers:
+  while (created--) {
+    vaDestroyBuffer(decode_context->va_display, slice_buffers[created * 2]);
+  }
+  free(slice_buffers);
+rollback_pic_buffer:
+  vaDestroyBuffer(decode_context->va_display, pic_buffer);
+  return result;
+}
+
+// C.5.2.3 Picture decoding, marking, additional bumping and storage
+static bool FinishPicture(struct DecodeContext* decode_context) {
+  decode_context->skipping = false;
+  if (decode_context->current == NO_SLOT) return true;
+
+  bool result = SubmitPicture(decode_context);
+  DropSlices(decode_context);
+  struct DecodePicture* current =
+      &decode_context->pictures[decode_context->current];
+  decode_context->current = NO_SLOT;
+  decode_context->picture_counter++;
+  if (!result) {
+    //LOG("Failed to submit picture");
+    current->needed_for_output = false;
+    return false;
+  }
+
+  for (size_t i = 0; i < decode_context->nsurfaces; i++) {
+    if (decode_context->pictures[i].needed_for_output)
+      decode_context->pictures[i].latency_count++;
+  }
+  current->reference = true;
+  current->long_term = false;
+
+  bool latency_exceeded;
+  while (CountNeededForOutput(decode_context, &latency_exceeded) >
+             decode_context->active_sps.sps_max_num_reorder_pics ||
+         latency_exceeded) {
+    if (!Bump(decode_context)) break;
+  }
+  return true;
+}
+
+static bool ValidateSps(const struct SeqParameterSet* sps) {
+  if (sps->chroma_format_idc != 1 || sps->bit_depth_luma_minus8 ||
+      sps->bit_depth_chroma_minus8) {
+    fprintf(stderr, "Only 8-bit 4:2:0 streams are supported\n");
+    return false;
+  }
+  if (sps->scaling_list_enabled_flag) {
+    fprintf(stderr, "Scaling lists are not supported\n");
+    return false;
+  }
+  return true;
+}
+
+static enum NalResult StartPicture(struct DecodeContext* decode_context,
+                                   const struct PicParameterSet* pps,
+                                   const uint8_t* nal_data,
+                                   uint8_t nuh_temporal_id) {
+  struct SliceSegmentHeader* slice = &decode_context->slice;
+  const struct SeqParameterSet* sps =
+      decode_context->parameter_sets.sps[pps->pps_seq_parameter_set_id];
+  bool irap = IsIrap(slice->nal_unit_type);
+
+  // Leading pictures of an irap that starts decoding reference pictures that
+  // were never received.
+  bool no_rasl_output_flag =
+      irap && (IsIdr(slice->nal_unit_type) ||
+               slice->nal_unit_type <= BLA_N_LP ||
+               decode_context->first_picture);
+  if (irap) decode_context->skip_rasl = no_rasl_output_flag;
+  if ((slice->nal_unit_type == RASL_N || slice->nal_unit_type == RASL_R) &&
+      decode_context->skip_rasl) {
+    decode_context->skipping = true;
+    return kNalConsumed;
+  }
+  if (!irap && !decode_context->nsurfaces) {
+    // Nothing to decode until the first random access point.
+    decode_context->skipping = true;
+    return kNalConsumed;
+  }
+
+  if (irap) {
+    if (!ValidateSps(sps)) return kNalFailed;
+    const struct SeqParameterSet* active = &decode_context->active_sps;
+    bool reallocate =
+        !decode_context->nsurfaces ||
+        sps->pic_width_in_luma_samples != active->pic_width_in_luma_samples ||
+        sps->pic_height_in_luma_samples !=
+            active->pic_height_in_luma_samples ||
+        sps->sps_max_dec_pic_buffering_minus1 >
+            active->sps_max_dec_pic_buffering_minus1;
+    if (no_rasl_output_flag) {
+      if (slice->no_output_of_prior_pics_flag && !reallocate) {
+        for (size_t i = 0; i < decode_context->nsurfaces; i++)
+          decode_context->pictures[i].needed_for_output = false;
+      } else {
+        BumpAll(decode_context);
+      }
+    }
+    if (reallocate) {
+      // Bumped pictures have to be consumed before their surfaces are gone,
+      // this unit will be offered again after that.
+      if (decode_context->output_count || decode_context->held != NO_SLOT)
+        return kNalDeferred;
+      DestroySurfaces(decode_context);
+      if (!CreateSurfaces(decode_context, sps)) {
+        //LOG("Failed to create surfaces");
+        return kNalFailed;
+      }
+    }
+    decode_context->active_sps = *sps;
+  }
+  sps = &decode_context->active_sps;
+
+  // 8.3.1 Decoding process for picture order count
+  int32_t max_poc_lsb = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+  int32_t poc_lsb = (int32_t)slice->slice_pic_order_cnt_lsb;
+  int32_t poc_msb = 0;
+  if (!irap || !no_rasl_output_flag) {
+    int32_t prev_poc_lsb =
+        decode_context->prev_tid0_pic_order_cnt & (max_poc_lsb - 1);
+    int32_t prev_poc_msb =
+        decode_context->prev_tid0_pic_order_cnt - prev_poc_lsb;
+    if (poc_lsb < prev_poc_lsb && prev_poc_lsb - poc_lsb >= max_poc_lsb / 2)
+      poc_msb = prev_poc_msb + max_poc_lsb;
+    else if (poc_lsb > prev_poc_lsb &&
+             poc_lsb - prev_poc_lsb > max_poc_lsb / 2)
+      poc_msb = prev_poc_msb - max_poc_lsb;
+    else
+      poc_msb = prev_poc_msb;
+  }
+  int32_t pic_order_cnt = poc_msb + poc_lsb;
+  bool sub_layer_non_reference = slice->nal_unit_type <= RSV_VCL_N14 &&
+                                 !(slice->nal_unit_type & 1);
+  if (!nuh_temporal_id && !sub_layer_non_reference &&
+      !(slice->nal_unit_type >= RADL_N && slice->nal_unit_type <= RASL_R))
+    decode_context->prev_tid0_pic_order_cnt = pic_order_cnt;
+
+  // C.5.2.2 Output and removal of pictures from the DPB
+  DeriveRefPicSet(decode_context, pic_order_cnt, irap && no_rasl_output_flag,
+                  &decode_context->rps);
+  if (!irap || !no_rasl_output_flag) {
+    bool latency_exceeded;
+    size_t fullness = 0;
+    for (size_t i = 0; i < decode_context->nsurfaces; i++)
+      fullness += decode_context->pictures[i].reference ||
+                  decode_context->pictures[i].needed_for_output;
+    while (CountNeededForOutput(decode_context, &latency_exceeded) >
+               sps->sps_max_num_reorder_pics ||
+           latency_exceeded ||
+           fullness >= sps->sps_max_dec_pic_buffering_minus1 + 1) {
+      if (!Bump(decode_context)) break;
+      fullness = 0;
+      for (size_t i = 0; i < decode_context->nsurfaces; i++)
+        fullness += decode_context->pictures[i].reference ||
+                    decode_context->pictures[i].needed_for_output;
+    }
+  }
+
+  int slot = NO_SLOT;
+  for (size_t i = 0; i < decode_context->nsurfaces && slot == NO_SLOT; i++) {
+    if (IsFree(&decode_context->pictures[i])) slot = (int)i;
+  }
+  if (slot == NO_SLOT) {
+    // Queued pictures have to be consumed first.
+    if (decode_context->output_count) return kNalDeferred;
+    fprintf(stderr, "Decoded picture buffer is full\n");
+    return kNalFailed;
+  }
+
+  decode_context->current = slot;
+  decode_context->pictures[slot] = (struct DecodePicture){
+      .needed_for_output = slice->pic_output_flag,
+      .keyframe = irap,
+      .pic_order_cnt = pic_order_cnt,
+      .pts = PtsAt(decode_context, nal_data),
+  };
+  decode_context->first_picture = false;
+  FillPictureParameters(decode_context, pps, &decode_context->rps);
+  return kNalConsumed;
+}
+
+static enum NalResult ProcessSlice(struct DecodeContext* decode_context,
+                                   const uint8_t* nal_data, size_t nal_size,
+                                   struct BitstreamReader* reader) {
+  uint8_t nal_unit_type = (nal_data[0] >> 1) & 0x3f;
+  uint8_t nuh_temporal_id = (uint8_t)((nal_data[1] & 0x7) - 1);
+  bool first_slice_segment_in_pic_flag = BitstreamRead(reader, 1);
+  reader->offset--;
+  if (first_slice_segment_in_pic_flag && !FinishPicture(decode_context)) {
+    //LOG("Failed to finish picture");
+    return kNalFailed;
+  }
+  if (!first_slice_segment_in_pic_flag &&
+      (decode_context->skipping || decode_context->current == NO_SLOT))
+    return kNalConsumed;
+
+  if (!ParseSliceSegmentHeader(reader, nal_unit_type,
+                               &decode_context->parameter_sets,
+                               &decode_context->slice)) {
+    //LOG("Failed to parse slice segment header");
+    return kNalFailed;
+  }
+  const struct PicParameterSet* pps =
+      decode_context->parameter_sets
+          .pps[decode_context->slice.slice_pic_parameter_set_id];
+
+  if (first_slice_segment_in_pic_flag) {
+    enum NalResult result =
+        StartPicture(decode_context, pps, nal_data, nuh_temporal_id);
+    if (result != kNalConsumed || decode_context->skipping) return result;
+  }
+
+  if (!AddSlice(decode_context, nal_data, nal_size)) {
+    //LOG("Failed to add slice");
+    return kNalFailed;
+  }
+  return kNalConsumed;
+}
+
+static bool StoreParameterSet(void** slot, const void* parameter_set,
+                              size_t size) {
+  if (!*slot && !(*slot = malloc(size))) {
+    fprintf(stderr, "Failed to allocate parameter set: %s\n",
+            strerror(errno));
+    return false;
+  }
+  memcpy(*slot, parameter_set, size);
+  return true;
+}
+
+static enum NalResult ProcessNalUnit(struct DecodeContext* decode_context,
+                                     const uint8_t* nal_data,
+                                     size_t nal_size) {
+  // 7.3.1.2 NAL unit header syntax
+  if (nal_size < 3) return kNalConsumed;
+  uint8_t nal_unit_type = (nal_data[0] >> 1) & 0x3f;
+  uint8_t nuh_layer_id = (uint8_t)((nal_data[0] & 1) << 5 | nal_data[1] >> 3);
+  if (nuh_layer_id) return kNalConsumed;
+
+  bool decodable_vcl = nal_unit_type <= RASL_R ||
+                       (nal_unit_type >= BLA_W_LP && nal_unit_type <= CRA_NUT);
+  if (nal_unit_type != SPS_NUT && nal_unit_type != PPS_NUT && !decodable_vcl) {
+    if (nal_unit_type != AUD_NUT && nal_unit_type != EOS_NUT &&
+        nal_unit_type != EOB_NUT)
+      return kNalConsumed;
+    if (!FinishPicture(decode_context)) {
+      //LOG("Failed to finish picture");
+      return kNalFailed;
+    }
+    if (nal_unit_type != AUD_NUT) {
+      // Next picture is an irap with NoRaslOutputFlag set.
+      BumpAll(decode_context);
+      decode_context->first_picture = true;
+    }
+    return kNalConsumed;
+  }
+
+  struct BitstreamReader reader;
+  if (!Unescape(decode_context, nal_data, nal_size, &reader)) {
+    //LOG("Failed to unescape nal unit");
+    return kNalFailed;
+  }
+  if (decodable_vcl) return ProcessSlice(decode_context, nal_data, nal_size,
+                                         &reader);
+
+  if (nal_unit_type == SPS_NUT) {
+    struct SeqParameterSet sps;
+    if (!ParseSeqParameterSet(&reader, &sps)) {
+      //LOG("Failed to parse sequence parameter set");
+      return kNalFailed;
+    }
+    return StoreParameterSet(
+               (void**)&decode_context->parameter_sets
+                   .sps[sps.sps_seq_parameter_set_id],
+               &sps, sizeof(sps))
+               ? kNalConsumed
+               : kNalFailed;
+  }
+
+  struct PicParameterSet pps;
+  if (!ParsePicParameterSet(&reader, &pps)) {
+    //LOG("Failed to parse picture parameter set");
+    return kNalFailed;
+  }
+  return StoreParameterSet((void**)&decode_context->parameter_sets
+                               .pps[pps.pps_pic_parameter_set_id],
+                           &pps, sizeof(pps))
+             ? kNalConsumed
+             : kNalFailed;
+}
+
+bool DecodeContextAcquire(struct DecodeContext* decode_context,
+                          struct DecodedFrame* decoded_frame) {
+  if (decode_context->held != NO_SLOT) {
+    fprintf(stderr, "Previous decoded frame was not released\n");
+    return false;
+  }
+
+  for (;;) {
+    if (decode_context->output_count) {
+      size_t slot = decode_context->output_queue[decode_context->output_head];
+      decode_context->output_head = (decode_context->output_head + 1) %
+                                    LENGTH(decode_context->output_queue);
+      decode_context->output_count--;
+      struct DecodePicture* picture = &decode_context->pictures[slot];
+      picture->queued = false;
+      if (!decode_context->standin) {
+        VAStatus status = vaSyncSurface(decode_context->va_display,
+                                        decode_context->surfaces[slot]);
+        if (status != VA_STATUS_SUCCESS) {
+          fprintf(stderr, "Failed to sync va surface: %s\n",
+                  vaErrorStr(status));
+          decode_context->failed = true;
+          return false;
+        }
+      }
+      picture->held = true;
+      decode_context->held = (int)slot;
+      *decoded_frame = decode_context->frames[slot];
+      decoded_frame->pic_order_cnt = picture->pic_order_cnt;
+      decoded_frame->pts = picture->pts;
+      decoded_frame->keyframe = picture->keyframe;
+      decode_context->frames[slot].fresh = false;
+      return true;
+    }
+    if (decode_context->failed || decode_context->flushed) return false;
+
+    const uint8_t* nal_data;
+    size_t nal_size, next_offset;
+    if (!PeekNalUnit(decode_context, &nal_data, &nal_size, &next_offset)) {
+      if (!decode_context->eos) return false;
+      decode_context->failed = !FinishPicture(decode_context);
+      BumpAll(decode_context);
+      decode_context->flushed = true;
+      continue;
+    }
+
+    switch (ProcessNalUnit(decode_context, nal_data, nal_size)) {
+      case kNalFailed:
+        decode_context->failed = true;
+        return false;
+      case kNalConsumed:
+        ConsumeNalUnit(decode_context, next_offset);
+        break;
+      case kNalDeferred:
+        break;
+    }
+  }
+}
+
+void DecodeContextRelease(struct DecodeContext* decode_context) {
+  if (decode_context->held == NO_SLOT) return;
+  decode_context->pictures[decode_context->held].held = false;
+  decode_context->held = NO_SLOT;
+}
+
+bool DecodeContextFailed(const struct DecodeContext* decode_context) {
+  return decode_context->failed;
+}
+
+int DecodeContextGetRenderNode(const struct DecodeContext* decode_context) {
+  return decode_context->render_node;
+}
+
+void DecodeContextDestroy(struct DecodeContext* decode_context) {
+  DropSlices(decode_context);
+  DestroySurfaces(decode_context);
+  for (size_t i = 0; i < LENGTH(decode_context->parameter_sets.sps); i++)
+    free(decode_context->parameter_sets.sps[i]);
+  for (size_t i = 0; i < LENGTH(decode_context->parameter_sets.pps); i++)
+    free(decode_context->parameter_sets.pps[i]);
+  if (!decode_context->standin) {
+    vaDestroyConfig(decode_context->va_display, decode_context->va_config_id);
+    vaTerminate(decode_context->va_display);
+    close(decode_context->render_node);
+  }
+  free(decode_context->slice_data);
+  free(decode_context->slice_params);
+  free(decode_context->rbsp);
+  free(decode_context->marks);
+  free(decode_context->buffer);
+  free(decode_context);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_DECODE_H_
+#define STREAMER_DECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpu.h"
+
+// Planes are dmabufs of the decoder surface, owned by the decoder and valid
+// until the frame is released. The same index always refers to the same
+// surface, fresh is set when the surface behind the index was reallocated.
+struct DecodedFrame {
+  uint32_t index;
+  bool fresh;
+  uint32_t width;
+  uint32_t height;
+  uint32_t crop_width;
+  uint32_t crop_height;
+  uint32_t fourcc;
+  size_t nplanes;
+  struct GpuFramePlane planes[4];
+  int32_t pic_order_cnt;
+  uint64_t pts;
+  bool keyframe;
+};
+
+struct DecodeContext;
+
+// Decodes HEVC Main annex B streams. Stand-in context runs the demuxing,
+// parsing and picture management without touching va, and hands out frames
+// without planes.
+struct DecodeContext* DecodeContextCreate(bool standin);
+// Pts is attached to the pictures starting within the pushed data.
+bool DecodeContextPush(struct DecodeContext* decode_context, const void* data,
+                       size_t size, uint64_t pts);
+// Marks the end of the stream, so that remaining pictures are bumped out.
+void DecodeContextFlush(struct DecodeContext* decode_context);
+// Returns false when more data has to be pushed, at the end of the stream or
+// on error, see DecodeContextFailed.
+bool DecodeContextAcquire(struct DecodeContext* decode_context,
+                          struct DecodedFrame* decoded_frame);
+void DecodeContextRelease(struct DecodeContext* decode_context);
+bool DecodeContextFailed(const struct DecodeContext* decode_context);
+// Render node the va display was opened on, -1 for stand-in contexts.
+int DecodeContextGetRenderNode(const struct DecodeContext* decode_context);
+void DecodeContextDestroy(struct DecodeContext* decode_context);
+
+#endif  // STREAMER_DECODE_H_
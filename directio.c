@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// O_DIRECT is only declared for gnu builds.
+#define _GNU_SOURCE
+
+#include "directio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+// Chunks are a multiple of both the 4KiB O_DIRECT alignment and the 2MiB huge
+// page size. At 4K bitrates this is a write every few hundred milliseconds,
+// which keeps the per-syscall overhead negligible.
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_CHUNK_SIZE (4 << 20)
+
+struct DirectWriter {
+  int fd;
+  uint8_t* chunks[2];
+  size_t active;
+  size_t active_size;
+  uint64_t offset;
+  uint64_t chunk_offset;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending;
+  size_t pending_chunk;
+  uint64_t pending_offset;
+  bool stop;
+  bool failed;
+};
+
+static uint8_t* AllocateChunk(void) {
+  void* chunk = mmap(NULL, DIRECT_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (chunk != MAP_FAILED) return chunk;
+
+  // Explicit huge pages are rarely reserved, transparent ones still save most
+  // of the tlb misses while copying records in.
+  chunk = mmap(NULL, DIRECT_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    fprintf(stderr, "Failed to map chunk: %s\n", strerror(errno));
+    return NULL;
+  }
+  madvise(chunk, DIRECT_CHUNK_SIZE, MADV_HUGEPAGE);
+  return chunk;
+}
+
+static bool WriteChunk(int fd, const uint8_t* data, size_t size,
+                       uint64_t offset) {
+  while (size) {
+    ssize_t result = pwrite(fd, data, size, (off_t)offset);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write chunk: %s\n", strerror(errno));
+      return false;
+    }
+    data += result;
+    size -= (size_t)result;
+    offset += (uint64_t)result;
+  }
+  return true;
+}
+
+static void* DirectWriterThreadProc(void* arg) {
+  struct DirectWriter* direct_writer = arg;
+  pthread_mutex_lock(&direct_writer->mutex);
+  for (;;) {
+    while (!direct_writer->pending && !direct_writer->stop)
+      pthread_cond_wait(&direct_writer->cond, &direct_writer->mutex);
+    if (!direct_writer->pending) break;
+
+    const uint8_t* chunk = direct_writer->chunks[direct_writer->pending_chunk];
+    uint64_t offset = direct_writer->pending_offset;
+    pthread_mutex_unlock(&direct_writer->mutex);
+    bool result =
+        WriteChunk(direct_writer->fd, chunk, DIRECT_CHUNK_SIZE, offset);
+    pthread_mutex_lock(&direct_writer->mutex);
+
+    if (!result) direct_writer->failed = true;
+    direct_writer->pending = false;
+    pthread_cond_broadcast(&direct_writer->cond);
+  }
+  pthread_mutex_unlock(&direct_writer->mutex);
+  return NULL;
+}
+
+struct DirectWriter* DirectWriterCreate(const char* path) {
+  struct DirectWriter* direct_writer = malloc(sizeof(struct DirectWriter));
+  if (!direct_writer) {
+    fprintf(stderr, "Failed to allocate direct writer: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *direct_writer = (struct DirectWriter){0};
+
+  direct_writer->fd =
+      open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+  if (direct_writer->fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_direct_writer;
+  }
+
+  for (size_t i = 0; i < LENGTH(direct_writer->chunks); i++) {
+    direct_writer->chunks[i] = AllocateChunk();
+    if (!direct_writer->chunks[i]) {
+      fprintf(stderr, "Failed to allocate chunk\n");
+      goto rollback_chunks;
+    }
+  }
+
+  if (pthread_mutex_init(&direct_writer->mutex, NULL)) {
+    fprintf(stderr, "Failed to init mutex\n");
+    goto rollback_chunks;
+  }
+  if (pthread_cond_init(&direct_writer->cond, NULL)) {
+    fprintf(stderr, "Failed to init condition variable\n");
+    goto rollback_mutex;
+  }
+  int error = pthread_create(&direct_writer->thread, NULL,
+                             DirectWriterThreadProc, direct_writer);
+  if (error) {
+    fprintf(stderr, "Failed to create writer thread: %s\n", strerror(error));
+    goto rollback_cond;
+  }
+  return direct_writer;
+
+rollback_cond:
+  pthread_cond_destroy(&direct_writer->cond);
+rollback_mutex:
+  pthread_mutex_destroy(&direct_writer->mutex);
+rollback_chunks:
+  for (size_t i = 0; i < LENGTH(direct_writer->chunks); i++) {
+    if (direct_writer->chunks[i])
+      munmap(direct_writer->chunks[i], DIRECT_CHUNK_SIZE);
+  }
+  close(direct_writer->fd);
+rollback_direct_writer:
+  free(direct_writer);
+  return NULL;
+}
+
+// Waits for the background write of the other chunk to complete.
+static bool WaitPending(struct DirectWriter* direct_writer) {
+  pthread_mutex_lock(&direct_writer->mutex);
+  while (direct_writer->pending)
+    pthread_cond_wait(&direct_writer->cond, &direct_writer->mutex);
+  bool result = !direct_writer->failed;
+  pthread_mutex_unlock(&direct_writer->mutex);
+  return result;
+}
+
+static bool SubmitActive(struct DirectWriter* direct_writer) {
+  pthread_mutex_lock(&direct_writer->mutex);
+  while (direct_writer->pending)
+    pthread_cond_wait(&direct_writer->cond, &direct_writer->mutex);
+  bool result = !direct_writer->failed;
+  if (result) {
+    direct_writer->pending = true;
+    direct_writer->pending_chunk = direct_writer->active;
+    direct_writer->pending_offset = direct_writer->chunk_offset;
+    pthread_cond_broadcast(&direct_writer->cond);
+  }
+  pthread_mutex_unlock(&direct_writer->mutex);
+  if (!result) return false;
+
+  direct_writer->active ^= 1;
+  direct_writer->active_size = 0;
+  direct_writer->chunk_offset += DIRECT_CHUNK_SIZE;
+  return true;
+}
+
+bool DirectWriterWrite(struct DirectWriter* direct_writer,
+                       const struct iovec* iov, size_t count,
+                       DirectWriterCopy copy, void* user) {
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* data = iov[i].iov_base;
+    size_t size = iov[i].iov_len;
+    while (size) {
+      size_t vacant = DIRECT_CHUNK_SIZE - direct_writer->active_size;
+      size_t chunk_size = size < vacant ? size : vacant;
+      uint8_t* target = direct_writer->chunks[direct_writer->active] +
+                        direct_writer->active_size;
+      if (copy)
+        copy(user, target, data, chunk_size);
+      else
+        memcpy(target, data, chunk_size);
+      direct_writer->active_size += chunk_size;
+      direct_writer->offset += chunk_size;
+      data += chunk_size;
+      size -= chunk_size;
+      if (direct_writer->active_size == DIRECT_CHUNK_SIZE &&
+          !SubmitActive(direct_writer)) {
+        fprintf(stderr, "Failed to submit chunk\n");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+uint64_t DirectWriterOffset(const struct DirectWriter* direct_writer) {
+  return direct_writer->offset;
+}
+
+void DirectWriterDestroy(struct DirectWriter* direct_writer) {
+  bool result = WaitPending(direct_writer);
+  pthread_mutex_lock(&direct_writer->mutex);
+  direct_writer->stop = true;
+  pthread_cond_broadcast(&direct_writer->cond);
+  pthread_mutex_unlock(&direct_writer->mutex);
+  pthread_join(direct_writer->thread, NULL);
+
+  // O_DIRECT only takes whole blocks, so the tail is padded with zeros and the
+  // file is truncated back to its logical size afterwards.
+  if (result && direct_writer->active_size) {
+    size_t aligned_size = (direct_writer->active_size + DIRECT_ALIGNMENT - 1) &
+                          ~(size_t)(DIRECT_ALIGNMENT - 1);
+    uint8_t* chunk = direct_writer->chunks[direct_writer->active];
+    memset(chunk + direct_writer->active_size, 0,
+           aligned_size - direct_writer->active_size);
+    if (!WriteChunk(direct_writer->fd, chunk, aligned_size,
+                    direct_writer->chunk_offset) ||
+        ftruncate(direct_writer->fd, (off_t)direct_writer->offset)) {
+      fprintf(stderr, "Failed to write recording tail\n");
+    }
+  }
+
+  pthread_cond_destroy(&direct_writer->cond);
+  pthread_mutex_destroy(&direct_writer->mutex);
+  for (size_t i = 0; i < LENGTH(direct_writer->chunks); i++)
+    munmap(direct_writer->chunks[i], DIRECT_CHUNK_SIZE);
+  close(direct_writer->fd);
+  free(direct_writer);
+}
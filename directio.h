@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_DIRECTIO_H_
+#define STREAMER_DIRECTIO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct DirectWriter;
+
+// Replaces memcpy when gathering records into chunks, e.g. for encryption.
+typedef void (*DirectWriterCopy)(void* user, void* dst, const void* src,
+                                 size_t size);
+
+// Records are gathered into aligned chunks and written with O_DIRECT from a
+// background thread, so recordings neither pollute the page cache nor stall
+// the caller on writeback. Fails on filesystems without O_DIRECT support.
+struct DirectWriter* DirectWriterCreate(const char* path);
+// Returns false once any earlier chunk failed to write. Copy may be NULL.
+bool DirectWriterWrite(struct DirectWriter* direct_writer,
+                       const struct iovec* iov, size_t count,
+                       DirectWriterCopy copy, void* user);
+// Logical file offset the next write lands at.
+uint64_t DirectWriterOffset(const struct DirectWriter* direct_writer);
+// Writes the padded tail and truncates the file back to its logical size.
+void DirectWriterDestroy(struct DirectWriter* direct_writer);
+
+#endif  // STREAMER_DIRECTIO_H_
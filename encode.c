@@ -18,6 +18,7 @@
 #include "encode.h"
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -29,12 +30,17 @@
 #include <va/va_drm.h>
 #include <va/va_drmcommon.h>
 
+#include "av1.h"
 #include "bitstream.h"
+#include "fade.h"
 #include "gpu.h"
 #include "hevc.h"
+#include "metrics.h"
 #include "proto.h"
+#include "trace.h"
 
 #define UNCONST(x) ((void*)(uintptr_t)(x))
+#define AV1_DEFAULT_QINDEX 128
 
 // Utility function to get current time in microseconds
 static inline unsigned long long MicrosNow(void) {
@@ -43,32 +49,67 @@ static inline unsigned long long MicrosNow(void) {
   return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
 }
 
+struct EncodeSurface {
+  VASurfaceID surface_id;
+};
+
 struct EncodeContext {
   struct GpuContext* gpu_context;
   uint32_t width;
   uint32_t height;
   enum YuvColorspace colorspace;
   enum YuvRange range;
+  enum EncodeCodec codec;
 
   int render_node;
   VADisplay va_display;
   VAConfigID va_config_id;
 
   uint32_t va_packed_headers;
+  uint32_t va_rate_control;
+  bool max_size_ignored;
   VAConfigAttribValEncHEVCFeatures va_hevc_features;
   VAConfigAttribValEncHEVCBlockSizes va_hevc_block_sizes;
 
   VAContextID va_context_id;
   VASurfaceID input_surface_id;
+  VASurfaceID source_surface_id;
   struct GpuFrame* gpu_frame;
 
-  VASurfaceID recon_surface_ids[2];
+  // Decoder keeps up to two references besides the current picture, so one slot
+  // is always free for the next reconstruction.
+  VASurfaceID recon_surface_ids[3];
+  size_t recon_frames[3];
+  uint8_t recon_held;
+  size_t recon_current;
+  size_t recon_reference;
+  size_t idr_frame;
+  uint8_t skipped_frames;
+
+  // Fade statistics of the pending input and of every kept reconstruction, only
+  // known for frames that went through the cpu.
+  struct FadeStats fade_stats;
+  bool fade_stats_valid;
+  struct FadeStats recon_fade_stats[3];
+  uint8_t recon_fade_valid;
+  bool fade_weighted;
+  // Plain encoding codes every frame intra, controlled frames are predicted
+  // unless forced intra. Tracks which of the two the last frame went through,
+  // sessions start out assumed to be predicting.
+  bool predicting;
   VABufferID output_buffer_id;
 
   VAEncSequenceParameterBufferHEVC seq;
   VAEncPictureParameterBufferHEVC pic;
   VAEncSliceParameterBufferHEVC slice;
+  VAEncSequenceParameterBufferAV1 av1_seq;
+  VAEncPictureParameterBufferAV1 av1_pic;
+  struct TileInfo av1_tile_info;
   size_t frame_counter;
+
+  struct MetricsSession* metrics_session;
+  uint32_t session_id;
+  bool output_borrowed;
 };
 
 const char* VaErrorString(VAStatus error) {
@@ -125,6 +166,35 @@ static void OnVaLogMessage(void* context, const char* message) {
   //LOG("%.*s", (int)len, message);
 }
 
+uint32_t EncodeCodecEntrypoint(enum EncodeCodec codec) {
+  (void)codec;
+  return VAEntrypointEncSliceLP;
+}
+
+// Rate control is not requested explicitly, so the config carries whatever
+// the driver defaulted to. Drivers that do not report it use constant qp.
+static uint32_t QueryRateControl(struct EncodeContext* encode_context) {
+  int max_attribs = vaMaxNumConfigAttributes(encode_context->va_display);
+  VAConfigAttrib* attrib_list =
+      max_attribs > 0 ? calloc((size_t)max_attribs, sizeof(VAConfigAttrib))
+                      : NULL;
+  if (!attrib_list) return VA_RC_CQP;
+  VAProfile profile;
+  VAEntrypoint entrypoint;
+  int num_attribs = 0;
+  uint32_t result = VA_RC_CQP;
+  VAStatus status = vaQueryConfigAttributes(
+      encode_context->va_display, encode_context->va_config_id, &profile,
+      &entrypoint, attrib_list, &num_attribs);
+  for (int i = 0; status == VA_STATUS_SUCCESS && i < num_attribs; i++) {
+    if (attrib_list[i].type == VAConfigAttribRateControl &&
+        attrib_list[i].value != VA_ATTRIB_NOT_SUPPORTED)
+      result = attrib_list[i].value;
+  }
+  free(attrib_list);
+  return result;
+}
+
 static bool InitializeCodecCaps(struct EncodeContext* encode_context) {
   VAConfigAttrib attrib_list[] = {
       {.type = VAConfigAttribEncPackedHeaders},
@@ -132,8 +202,9 @@ static bool InitializeCodecCaps(struct EncodeContext* encode_context) {
       {.type = VAConfigAttribEncHEVCBlockSizes},
   };
   VAStatus status = vaGetConfigAttributes(
-      encode_context->va_display, VAProfileHEVCMain, VAEntrypointEncSliceLP,
-      attrib_list, LENGTH(attrib_list));
+      encode_context->va_display, VAProfileHEVCMain,
+      EncodeCodecEntrypoint(kEncodeCodecHevc), attrib_list,
+      LENGTH(attrib_list));
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to get va config attributes: %s\n", VaErrorString(status));
     return false;
@@ -164,7 +235,7 @@ static bool InitializeCodecCaps(struct EncodeContext* encode_context) {
                 .constrained_intra_pred = 0,     // TODO
                 .transform_skip = 0,             // defaulted
                 .cu_qp_delta = 0,                // Fixed quality
-                .weighted_prediction = 0,        // TODO
+                .weighted_prediction = 0,        // hardcoded
                 .transquant_bypass = 0,          // TODO
                 .deblocking_filter_disable = 0,  // TODO
             },
@@ -259,6 +330,31 @@ static bool InitializeCodecCaps(struct EncodeContext* encode_context) {
   return true;
 }
 
+static bool InitializeAv1CodecCaps(struct EncodeContext* encode_context) {
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribEncPackedHeaders},
+  };
+  VAStatus status = vaGetConfigAttributes(
+      encode_context->va_display, VAProfileAV1Profile0,
+      EncodeCodecEntrypoint(kEncodeCodecAv1), attrib_list,
+      LENGTH(attrib_list));
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to get va config attributes: %s\n",
+            VaErrorString(status));
+    return false;
+  }
+
+  // Unlike HEVC, AV1 headers are never generated by the driver, so there is no
+  // way to proceed without the packed picture header.
+  if (attrib_list[0].value == VA_ATTRIB_NOT_SUPPORTED ||
+      !(attrib_list[0].value & VA_ENC_PACKED_HEADER_PICTURE)) {
+    fprintf(stderr, "Packed AV1 picture headers are not supported\n");
+    return false;
+  }
+  encode_context->va_packed_headers = attrib_list[0].value;
+  return true;
+}
+
 static struct GpuFrame* VaSurfaceToGpuFrame(VADisplay va_display,
                                             VASurfaceID va_surface_id,
                                             struct GpuContext* gpu_context) {
@@ -446,7 +542,7 @@ static void InitializePicHeader(struct EncodeContext* encode_context) {
               .constrained_intra_pred_flag = 0,            // defaulted
               .transform_skip_enabled_flag = features_bits->transform_skip,
               .cu_qp_delta_enabled_flag = 0,               // Fixed quality
-              .weighted_pred_flag = 0,                     // defaulted
+              .weighted_pred_flag = features_bits->weighted_prediction,
               .weighted_bipred_flag = 0,                   // defaulted
               .transquant_bypass_enabled_flag = 0,         // defaulted
               .tiles_enabled_flag = 0,                     // No tiles
@@ -502,8 +598,8 @@ static void InitializeSliceHeader(struct EncodeContext* encode_context) {
       .num_ref_idx_l1_active_minus1 =
           encode_context->pic.num_ref_idx_l1_default_active_minus1,
 
-      .luma_log2_weight_denom = 0,          // defaulted
-      .delta_chroma_log2_weight_denom = 0,  // defaulted
+      .luma_log2_weight_denom = 0,          // dynamic
+      .delta_chroma_log2_weight_denom = 0,  // Same as luma
 
       // .delta_luma_weight_l0[15],
       // .luma_offset_l0[15],
@@ -541,8 +637,8 @@ static void InitializeSliceHeader(struct EncodeContext* encode_context) {
               .collocated_from_l0_flag = 0,                       // No B-frames
           },
 
-      .pred_weight_table_bit_offset = 0,  // defaulted
-      .pred_weight_table_bit_length = 0,  // defaulted
+      .pred_weight_table_bit_offset = 0,  // dynamic
+      .pred_weight_table_bit_length = 0,  // dynamic
   };
 
   for (size_t i = 0; i < LENGTH(encode_context->slice.ref_pic_list0); i++) {
@@ -560,10 +656,141 @@ static void InitializeSliceHeader(struct EncodeContext* encode_context) {
   }
 }
 
+static void InitializeAv1SeqHeader(struct EncodeContext* encode_context) {
+  encode_context->av1_seq = (VAEncSequenceParameterBufferAV1){
+      .seq_profile = 0,        // Main profile
+      .seq_level_idx = 13,     // Level 5.1
+      .seq_tier = 0,           // Main tier
+      .hierarchical_flag = 0,  // No B-frames
+
+      .intra_period = 120,  // Same as HEVC
+      .ip_period = 1,       // No B-frames
+
+      .seq_fields.bits =
+          {
+              .still_picture = 0,               // defaulted
+              .use_128x128_superblock = 0,      // hardcoded
+              .enable_filter_intra = 0,         // defaulted
+              .enable_intra_edge_filter = 0,    // defaulted
+              .enable_interintra_compound = 0,  // No B-frames
+              .enable_masked_compound = 0,      // No B-frames
+              .enable_warped_motion = 0,        // defaulted
+              .enable_dual_filter = 0,          // defaulted
+              .enable_order_hint = 1,           // hardcoded
+              .enable_jnt_comp = 0,             // No B-frames
+              .enable_ref_frame_mvs = 0,        // defaulted
+              .enable_superres = 0,             // defaulted
+              .enable_cdef = 1,                 // hardcoded
+              .enable_restoration = 0,          // defaulted
+              .bit_depth_minus8 = 0,            // 8 bpp
+              .subsampling_x = 1,               // 4:2:0
+              .subsampling_y = 1,               // 4:2:0
+              .mono_chrome = 0,                 // defaulted
+          },
+
+      .order_hint_bits_minus_1 = 7,  // hardcoded
+  };
+}
+
+static void InitializeAv1PicHeader(struct EncodeContext* encode_context) {
+  DeriveUniformTileInfo(
+      encode_context->width, encode_context->height,
+      encode_context->av1_seq.seq_fields.bits.use_128x128_superblock,
+      &encode_context->av1_tile_info);
+
+  encode_context->av1_pic = (VAEncPictureParameterBufferAV1){
+      .frame_width_minus_1 = (uint16_t)(encode_context->width - 1),
+      .frame_height_minus_1 = (uint16_t)(encode_context->height - 1),
+      .reconstructed_frame = VA_INVALID_SURFACE,  // dynamic
+      .coded_buf = encode_context->output_buffer_id,
+
+      // .reference_frames[8],
+      // .ref_frame_idx[7],
+
+      .primary_ref_frame = 7,    // dynamic
+      .order_hint = 0,           // dynamic
+      .refresh_frame_flags = 0,  // dynamic
+
+      .picture_flags.bits =
+          {
+              .frame_type = KEY_FRAME,            // dynamic
+              .error_resilient_mode = 0,          // defaulted
+              .disable_cdf_update = 0,            // defaulted
+              .use_superres = 0,                  // defaulted
+              .allow_high_precision_mv = 0,       // defaulted
+              .use_ref_frame_mvs = 0,             // defaulted
+              .disable_frame_end_update_cdf = 0,  // defaulted
+              .reduced_tx_set = 0,                // defaulted
+              .enable_frame_obu = 0,              // Separate frame header
+              .allow_intrabc = 0,                 // defaulted
+              .palette_mode_enable = 0,           // defaulted
+          },
+
+      .filter_level = {15, 15},  // hardcoded
+      .filter_level_u = 15,      // hardcoded
+      .filter_level_v = 15,      // hardcoded
+      .interpolation_filter = 0,  // EIGHTTAP
+
+      .base_qindex = AV1_DEFAULT_QINDEX,  // Fixed quality
+      .min_base_qindex = 1,               // Fixed quality
+      .max_base_qindex = 255,             // Fixed quality
+
+      .mode_control_flags.bits =
+          {
+              .delta_q_present = 0,  // Fixed quality
+              .tx_mode = 2,          // TX_MODE_SELECT
+              .reference_mode = 0,   // SINGLE_REFERENCE
+          },
+
+      .tile_cols = encode_context->av1_tile_info.tile_cols,
+      .tile_rows = encode_context->av1_tile_info.tile_rows,
+      .context_update_tile_id = 0,  // defaulted
+
+      .cdef_damping_minus_3 = 2,  // hardcoded
+      .cdef_bits = 0,             // Single strength
+      .cdef_y_strengths = {0},    // Driver decides
+      .cdef_uv_strengths = {0},   // Driver decides
+
+      .tile_group_obu_hdr_info.bits =
+          {
+              .obu_has_size_field = 1,
+          },
+  };
+
+  for (size_t i = 0; i < encode_context->av1_tile_info.tile_cols; i++) {
+    encode_context->av1_pic.width_in_sbs_minus_1[i] =
+        encode_context->av1_tile_info.width_in_sbs_minus_1[i];
+  }
+  for (size_t i = 0; i < encode_context->av1_tile_info.tile_rows; i++) {
+    encode_context->av1_pic.height_in_sbs_minus_1[i] =
+        encode_context->av1_tile_info.height_in_sbs_minus_1[i];
+  }
+  for (size_t i = 0; i < LENGTH(encode_context->av1_pic.reference_frames);
+       i++) {
+    encode_context->av1_pic.reference_frames[i] = VA_INVALID_SURFACE;
+  }
+}
+
 struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
                                           uint32_t width, uint32_t height,
                                           enum YuvColorspace colorspace,
-                                          enum YuvRange range) {
+                                          enum YuvRange range,
+                                          enum EncodeCodec codec) {
+  struct EncodeContext* encode_context =
+      EncodeContextCreateUnbound(width, height, colorspace, range, codec);
+  if (!encode_context) return NULL;
+  if (!EncodeContextBindGpu(encode_context, gpu_context)) {
+    EncodeContextDestroy(encode_context);
+    return NULL;
+  }
+  return encode_context;
+}
+
+struct EncodeContext* EncodeContextCreateUnbound(uint32_t width,
+                                                 uint32_t height,
+                                                 enum YuvColorspace colorspace,
+                                                 enum YuvRange range,
+                                                 enum EncodeCodec codec) {
   struct EncodeContext* encode_context = malloc(sizeof(struct EncodeContext));
   if (!encode_context) {
     //LOG("Faield to allocate encode context (%s)", strerror(errno));
@@ -571,14 +798,20 @@ struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
   }
 
   *encode_context = (struct EncodeContext){
-      .gpu_context = gpu_context,
       .width = width,
       .height = height,
       .colorspace = colorspace,
       .range = range,
+      .codec = codec,
+      .predicting = true,
   };
 
-  encode_context->render_node = open("/dev/dri/renderD128", O_RDWR);
+  // Session zero is left for the input side of the pipeline. The same id is
+  // used as proto stream id and as trace session.
+  static atomic_uint session_ids;
+  encode_context->session_id = atomic_fetch_add(&session_ids, 1) + 1;
+
+  encode_context->render_node = open(ENCODE_RENDER_NODE, O_RDWR);
   if (encode_context->render_node == -1) {
     fprintf(stderr, "Failed to open render node: %s\n", strerror(errno));
     goto rollback_encode_context;
@@ -608,15 +841,19 @@ struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
   VAConfigAttrib attrib_list[] = {
       {.type = VAConfigAttribRTFormat, .value = VA_RT_FORMAT_YUV420},
   };
-  status = vaCreateConfig(encode_context->va_display, VAProfileHEVCMain,
-                          VAEntrypointEncSliceLP, attrib_list,
+  VAProfile profile =
+      codec == kEncodeCodecAv1 ? VAProfileAV1Profile0 : VAProfileHEVCMain;
+  status = vaCreateConfig(encode_context->va_display, profile,
+                          EncodeCodecEntrypoint(codec), attrib_list,
                           LENGTH(attrib_list), &encode_context->va_config_id);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to create va config: %s\n", VaErrorString(status));
     goto rollback_va_display;
   }
 
-  if (!InitializeCodecCaps(encode_context)) {
+  encode_context->va_rate_control = QueryRateControl(encode_context);
+  if (codec == kEncodeCodecAv1 ? !InitializeAv1CodecCaps(encode_context)
+                               : !InitializeCodecCaps(encode_context)) {
     fprintf(stderr, "Failed to initialize codec caps\n");
     goto rollback_va_config_id;
   }
@@ -648,21 +885,13 @@ struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
     goto rollback_va_context_id;
   }
 
-  encode_context->gpu_frame = VaSurfaceToGpuFrame(
-      encode_context->va_display, encode_context->input_surface_id,
-      encode_context->gpu_context);
-  if (!encode_context->gpu_frame) {
-    //LOG("Failed to convert va surface to gpu frame");
-    goto rollback_input_surface_id;
-  }
-
   status = vaCreateSurfaces(encode_context->va_display, VA_RT_FORMAT_YUV420,
                             aligned_width, aligned_height,
                             encode_context->recon_surface_ids,
                             LENGTH(encode_context->recon_surface_ids), NULL, 0);
   if (status != VA_STATUS_SUCCESS) {
     //LOG("Failed to create va recon surfaces (%s)", VaErrorString(status));
-    goto rollback_gpu_frame;
+    goto rollback_input_surface_id;
   }
 
   unsigned int max_encoded_size =
@@ -676,6 +905,12 @@ struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
     goto rollback_recon_surface_ids;
   }
 
+  encode_context->source_surface_id = encode_context->input_surface_id;
+  if (codec == kEncodeCodecAv1) {
+    InitializeAv1SeqHeader(encode_context);
+    InitializeAv1PicHeader(encode_context);
+    return encode_context;
+  }
   InitializeSeqHeader(encode_context, (uint16_t)aligned_width,
                       (uint16_t)aligned_height);
   InitializePicHeader(encode_context);
@@ -686,9 +921,6 @@ rollback_recon_surface_ids:
   vaDestroySurfaces(encode_context->va_display,
                     encode_context->recon_surface_ids,
                     LENGTH(encode_context->recon_surface_ids));
-rollback_gpu_frame:
-  GpuContextDestroyFrame(encode_context->gpu_context,
-                         encode_context->gpu_frame);
 rollback_input_surface_id:
   vaDestroySurfaces(encode_context->va_display,
                     &encode_context->input_surface_id, 1);
@@ -705,11 +937,135 @@ rollback_encode_context:
   return NULL;
 }
 
+bool EncodeContextBindGpu(struct EncodeContext* encode_context,
+                          struct GpuContext* gpu_context) {
+  encode_context->gpu_frame = VaSurfaceToGpuFrame(
+      encode_context->va_display, encode_context->input_surface_id,
+      gpu_context);
+  if (!encode_context->gpu_frame) {
+    //LOG("Failed to convert va surface to gpu frame");
+    return false;
+  }
+  encode_context->gpu_context = gpu_context;
+  return true;
+}
+
 const struct GpuFrame* EncodeContextGetFrame(
     struct EncodeContext* encode_context) {
   return encode_context->gpu_frame;
 }
 
+uint32_t EncodeContextGetSessionId(const struct EncodeContext* encode_context) {
+  return encode_context->session_id;
+}
+
+uint64_t EncodeContextGetFrameCounter(
+    const struct EncodeContext* encode_context) {
+  return encode_context->frame_counter;
+}
+
+int EncodeContextGetRenderNode(const struct EncodeContext* encode_context) {
+  return encode_context->render_node;
+}
+
+void EncodeContextSetMetrics(struct EncodeContext* encode_context,
+                             struct MetricsSession* metrics_session) {
+  encode_context->metrics_session = metrics_session;
+}
+
+struct EncodeSurface* EncodeContextImportSurface(
+    struct EncodeContext* encode_context, uint32_t width, uint32_t height,
+    uint32_t fourcc, size_t nplanes, const struct GpuFramePlane* planes) {
+  VADRMPRIMESurfaceDescriptor prime = {
+      .fourcc = fourcc,
+      .width = width,
+      .height = height,
+      .num_layers = 1,
+  };
+  if (nplanes > LENGTH(prime.layers[0].object_index)) {
+    fprintf(stderr, "Too many planes to import (%zu)\n", nplanes);
+    return NULL;
+  }
+
+  // Planes of a single surface usually share one dmabuf, and the driver expects
+  // such planes to reference the same object.
+  prime.layers[0].drm_format = fourcc;
+  prime.layers[0].num_planes = (uint32_t)nplanes;
+  for (size_t i = 0; i < nplanes; i++) {
+    uint32_t object_index = 0;
+    while (object_index < prime.num_objects &&
+           prime.objects[object_index].fd != planes[i].dmabuf_fd)
+      object_index++;
+    if (object_index == prime.num_objects) {
+      off_t size = lseek(planes[i].dmabuf_fd, 0, SEEK_END);
+      if (size == -1) {
+        fprintf(stderr, "Failed to get dmabuf size: %s\n", strerror(errno));
+        return NULL;
+      }
+      prime.objects[object_index] = (typeof(prime.objects[0])){
+          .fd = planes[i].dmabuf_fd,
+          .size = (uint32_t)size,
+          .drm_format_modifier = planes[i].modifier,
+      };
+      prime.num_objects++;
+    }
+    prime.layers[0].object_index[i] = object_index;
+    prime.layers[0].offset[i] = planes[i].offset;
+    prime.layers[0].pitch[i] = planes[i].pitch;
+  }
+
+  struct EncodeSurface* encode_surface = malloc(sizeof(struct EncodeSurface));
+  if (!encode_surface) {
+    fprintf(stderr, "Failed to allocate encode surface: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+
+  VASurfaceAttrib attribs[] = {
+      {.type = VASurfaceAttribMemoryType,
+       .flags = VA_SURFACE_ATTRIB_SETTABLE,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2},
+      {.type = VASurfaceAttribExternalBufferDescriptor,
+       .flags = VA_SURFACE_ATTRIB_SETTABLE,
+       .value.type = VAGenericValueTypePointer,
+       .value.value.p = &prime},
+  };
+  VAStatus status = vaCreateSurfaces(
+      encode_context->va_display, VA_RT_FORMAT_YUV420, width, height,
+      &encode_surface->surface_id, 1, attribs, LENGTH(attribs));
+  if (status != VA_STATUS_SUCCESS) {
+    fprintf(stderr, "Failed to import va surface: %s\n",
+            VaErrorString(status));
+    free(encode_surface);
+    return NULL;
+  }
+  return encode_surface;
+}
+
+void EncodeContextSetSurface(struct EncodeContext* encode_context,
+                             const struct EncodeSurface* encode_surface) {
+  encode_context->source_surface_id = encode_surface
+                                          ? encode_surface->surface_id
+                                          : encode_context->input_surface_id;
+}
+
+void EncodeContextDestroySurface(struct EncodeContext* encode_context,
+                                 struct EncodeSurface* encode_surface) {
+  if (encode_context->source_surface_id == encode_surface->surface_id)
+    EncodeContextSetSurface(encode_context, NULL);
+  vaDestroySurfaces(encode_context->va_display, &encode_surface->surface_id,
+                    1);
+  free(encode_surface);
+}
+
+static void RecordStage(const struct EncodeContext* encode_context,
+                        enum MetricsStage stage, unsigned long long started) {
+  if (!encode_context->metrics_session) return;
+  MetricsSessionStage(encode_context->metrics_session, stage,
+                      MicrosNow() - started);
+}
+
 static bool UploadBuffer(const struct EncodeContext* encode_context,
                          VABufferType va_buffer_type, unsigned int size,
                          void* data, VABufferID** presult) {
@@ -739,52 +1095,206 @@ static bool UploadPackedBuffer(const struct EncodeContext* encode_context,
                       (bit_length + 7) / 8, data, presult);
 }
 
+static bool UploadMiscBuffer(const struct EncodeContext* encode_context,
+                             VAEncMiscParameterType type, const void* data,
+                             size_t size, VABufferID** presult) {
+  uint8_t buffer[sizeof(VAEncMiscParameterBuffer) + 64];
+  assert(size <= sizeof(buffer) - sizeof(VAEncMiscParameterBuffer));
+  VAEncMiscParameterBuffer header = {.type = type};
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), data, size);
+  return UploadBuffer(encode_context, VAEncMiscParameterBufferType,
+                      (unsigned int)(sizeof(header) + size), buffer, presult);
+}
+
+static bool UploadControlBuffers(struct EncodeContext* encode_context,
+                                 const struct EncodeFrameControl* control,
+                                 VABufferID** pbuffer_ptr) {
+  // Drivers ignore the frame size limit under constant qp, there is no
+  // bitrate controller to enforce it.
+  static const uint32_t bitrate_controls = VA_RC_CBR | VA_RC_VBR | VA_RC_VCM |
+                                           VA_RC_VBR_CONSTRAINED | VA_RC_QVBR |
+                                           VA_RC_AVBR;
+  if (control && control->max_size &&
+      !(encode_context->va_rate_control & bitrate_controls)) {
+    if (!encode_context->max_size_ignored) {
+      fprintf(stderr, "Max frame size is ignored without bitrate control\n");
+      encode_context->max_size_ignored = true;
+    }
+  } else if (control && control->max_size) {
+    uint64_t max_frame_bits = (uint64_t)control->max_size * 8;
+    VAEncMiscParameterBufferMaxFrameSize max_frame_size = {
+        .max_frame_size =
+            max_frame_bits > UINT32_MAX ? UINT32_MAX : (uint32_t)max_frame_bits,
+    };
+    if (!UploadMiscBuffer(encode_context, VAEncMiscParameterTypeMaxFrameSize,
+                          &max_frame_size, sizeof(max_frame_size),
+                          pbuffer_ptr)) {
+      fprintf(stderr, "Failed to upload max frame size buffer\n");
+      return false;
+    }
+  }
+  if (encode_context->skipped_frames) {
+    VAEncMiscParameterSkipFrame skip_frame = {
+        .skip_frame_flag = 1,  // Frames were skipped before this one
+        .num_skip_frames = encode_context->skipped_frames,
+        .size_skip_frames = 0,
+    };
+    if (!UploadMiscBuffer(encode_context, VAEncMiscParameterTypeSkipFrame,
+                          &skip_frame, sizeof(skip_frame), pbuffer_ptr)) {
+      fprintf(stderr, "Failed to upload skip frame buffer\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Picks the reconstruction slot for the next frame and the reference it is
+// predicted from. Returns whether the frame has to be coded as idr.
+static bool PlanReferences(struct EncodeContext* encode_context,
+                           const struct EncodeFrameControl* control) {
+  uint32_t intra_period = encode_context->codec == kEncodeCodecAv1
+                              ? encode_context->av1_seq.intra_period
+                              : encode_context->seq.intra_idr_period;
+  // 目前P帧在此硬件上存在参考帧问题，不受控编码时使用全I帧确保稳定性
+  bool idr = !control || control->force_intra ||
+             encode_context->frame_counter - encode_context->idr_frame >=
+                 intra_period;
+
+  size_t reference = LENGTH(encode_context->recon_surface_ids);
+  for (size_t i = 0; !idr && i < LENGTH(encode_context->recon_surface_ids);
+       i++) {
+    if (!(encode_context->recon_held & (1u << i))) continue;
+    if (control->use_reference
+            ? encode_context->recon_frames[i] == control->reference_sequence
+            : reference == LENGTH(encode_context->recon_surface_ids) ||
+                  encode_context->recon_frames[i] >
+                      encode_context->recon_frames[reference])
+      reference = i;
+  }
+  if (reference == LENGTH(encode_context->recon_surface_ids)) idr = true;
+
+  uint8_t kept = 0;
+  if (!idr) {
+    // The most recent other picture stays in the dpb as well, so that the
+    // caller can still fall back to it if the previous frame is lost on the
+    // way.
+    size_t other = reference;
+    for (size_t i = 0; i < LENGTH(encode_context->recon_surface_ids); i++) {
+      if (i == reference || !(encode_context->recon_held & (1u << i)))
+        continue;
+      if (other == reference || encode_context->recon_frames[i] >
+                                    encode_context->recon_frames[other])
+        other = i;
+    }
+    kept = (uint8_t)(1u << reference | 1u << other);
+  }
+
+  size_t current = 0;
+  while (kept & (1u << current)) current++;
+  // The slot being overwritten is released right away, so that a failed frame
+  // never leaves a stale reference behind.
+  encode_context->recon_held = kept;
+  encode_context->recon_current = current;
+  encode_context->recon_reference = reference;
+  if (idr) encode_context->idr_frame = encode_context->frame_counter;
+  return idr;
+}
+
+static int32_t PicOrderCnt(const struct EncodeContext* encode_context,
+                           size_t frame) {
+  return (int32_t)(frame - encode_context->idr_frame);
+}
+
 static void UpdatePicHeader(struct EncodeContext* encode_context, bool idr) {
   encode_context->pic.decoded_curr_pic = (VAPictureHEVC){
       .picture_id =
-          encode_context
-              ->recon_surface_ids[encode_context->frame_counter %
-                                  LENGTH(encode_context->recon_surface_ids)],
-      .pic_order_cnt = (int32_t)(encode_context->frame_counter %
-                                 encode_context->seq.intra_idr_period),
+          encode_context->recon_surface_ids[encode_context->recon_current],
+      .pic_order_cnt =
+          PicOrderCnt(encode_context, encode_context->frame_counter),
   };
 
-  if (idr) {
-    encode_context->pic.reference_frames[0] = (VAPictureHEVC){
+  // Pictures kept in the dpb are listed most recent first, which is the
+  // order of the short-term reference picture set as well.
+  VAPictureHEVC* reference_frames = encode_context->pic.reference_frames;
+  for (size_t i = 0; i < LENGTH(encode_context->pic.reference_frames); i++) {
+    reference_frames[i] = (VAPictureHEVC){
         .picture_id = VA_INVALID_ID,
         .flags = VA_PICTURE_HEVC_INVALID,
     };
+  }
+  size_t nreferences = 0;
+  for (size_t i = 0; i < LENGTH(encode_context->recon_surface_ids); i++) {
+    if (!(encode_context->recon_held & (1u << i))) continue;
+    reference_frames[nreferences++] = (VAPictureHEVC){
+        .picture_id = encode_context->recon_surface_ids[i],
+        .pic_order_cnt =
+            PicOrderCnt(encode_context, encode_context->recon_frames[i]),
+        .flags = i == encode_context->recon_reference
+                     ? VA_PICTURE_HEVC_RPS_ST_CURR_BEFORE
+                     : 0,
+    };
+  }
+  if (nreferences == 2 &&
+      reference_frames[1].pic_order_cnt > reference_frames[0].pic_order_cnt) {
+    VAPictureHEVC temp = reference_frames[0];
+    reference_frames[0] = reference_frames[1];
+    reference_frames[1] = temp;
+  }
+
+  if (idr) {
     encode_context->pic.nal_unit_type = IDR_W_RADL;
     encode_context->pic.pic_fields.bits.idr_pic_flag = 1;
     encode_context->pic.pic_fields.bits.coding_type = 1;
   } else {
-    encode_context->pic.reference_frames[0] = (VAPictureHEVC){
-        .picture_id =
-            encode_context
-                ->recon_surface_ids[(encode_context->frame_counter - 1) %
-                                    LENGTH(encode_context->recon_surface_ids)],
-        .pic_order_cnt = (int32_t)((encode_context->frame_counter - 1) %
-                                   encode_context->seq.intra_idr_period),
-    };
     encode_context->pic.nal_unit_type = TRAIL_R;
     encode_context->pic.pic_fields.bits.idr_pic_flag = 0;
     encode_context->pic.pic_fields.bits.coding_type = 2;
   }
 }
 
-bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
-                              unsigned long long timestamp) {
-  bool result = false;
-  VABufferID buffers[8];
-  VABufferID* buffer_ptr = buffers;
+// Explicit weights for the slice, estimated from cpu-side statistics of the
+// frame and its reference. Weights stay at identity when either is unknown
+// or there is no fade, pred_weight_table then costs a few bits per slice.
+static void UpdateSliceWeights(struct EncodeContext* encode_context,
+                               bool idr) {
+  VAEncSliceParameterBufferHEVC* slice = &encode_context->slice;
+  size_t reference = encode_context->recon_reference;
+  struct FadeWeights weights;
+  encode_context->fade_weighted =
+      !idr && encode_context->pic.pic_fields.bits.weighted_pred_flag &&
+      encode_context->fade_stats_valid &&
+      (encode_context->recon_fade_valid & (1u << reference)) &&
+      FadeEstimateWeights(&encode_context->fade_stats,
+                          &encode_context->recon_fade_stats[reference],
+                          &weights);
+
+  slice->luma_log2_weight_denom = 0;
+  memset(slice->delta_luma_weight_l0, 0, sizeof(slice->delta_luma_weight_l0));
+  memset(slice->luma_offset_l0, 0, sizeof(slice->luma_offset_l0));
+  memset(slice->delta_chroma_weight_l0, 0,
+         sizeof(slice->delta_chroma_weight_l0));
+  memset(slice->chroma_offset_l0, 0, sizeof(slice->chroma_offset_l0));
+  if (!encode_context->fade_weighted) return;
+
+  int32_t unity = 1 << weights.log2_denom;
+  slice->luma_log2_weight_denom = weights.log2_denom;
+  slice->delta_luma_weight_l0[0] = (int8_t)(weights.weights[0] - unity);
+  slice->luma_offset_l0[0] = weights.offsets[0];
+  for (size_t i = 0; i < 2; i++) {
+    slice->delta_chroma_weight_l0[0][i] =
+        (int8_t)(weights.weights[i + 1] - unity);
+    slice->chroma_offset_l0[0][i] = weights.offsets[i + 1];
+  }
+}
 
-  // 目前P帧在此硬件上存在参考帧问题，使用全I帧确保稳定性
-  bool idr = true; // 全I帧编码，确保100%成功率
+static bool UploadHevcBuffers(struct EncodeContext* encode_context, bool idr,
+                              uint8_t qp, VABufferID** pbuffer_ptr) {
   if (idr && !UploadBuffer(encode_context, VAEncSequenceParameterBufferType,
                            sizeof(encode_context->seq), &encode_context->seq,
-                           &buffer_ptr)) {
+                           pbuffer_ptr)) {
     fprintf(stderr, "Failed to upload sequence parameter buffer\n");
-    goto rollback_buffers;
+    return false;
   }
 
   if (idr &&
@@ -796,7 +1306,7 @@ bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
     };
 
     static const struct MoreVideoParameters mvp = {
-        .vps_max_dec_pic_buffering_minus1 = 1,  // No B-frames
+        .vps_max_dec_pic_buffering_minus1 = 2,  // Two references
         .vps_max_num_reorder_pics = 0,          // No B-frames
     };
     uint32_t conf_win_right_offset_luma =
@@ -808,7 +1318,7 @@ bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
         .conf_win_right_offset = conf_win_right_offset_luma / 2,
         .conf_win_top_offset = 0,
         .conf_win_bottom_offset = conf_win_bottom_offset_luma / 2,
-        .sps_max_dec_pic_buffering_minus1 = 1,  // No B-frames
+        .sps_max_dec_pic_buffering_minus1 = 2,  // Two references
         .sps_max_num_reorder_pics = 0,          // No B-frames
         .video_signal_type_present_flag = 1,
         .video_full_range_flag = encode_context->range == kFullRange,
@@ -824,63 +1334,235 @@ bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
     PackPicParameterSetNalUnit(&bitstream, &encode_context->pic);
     if (!UploadPackedBuffer(encode_context, VAEncPackedHeaderSequence,
                             (unsigned int)bitstream.size, bitstream.data,
-                            &buffer_ptr)) {
+                            pbuffer_ptr)) {
       //LOG("Failed to upload packed sequence header");
-      goto rollback_buffers;
+      return false;
     }
   }
 
   UpdatePicHeader(encode_context, idr);
   if (!UploadBuffer(encode_context, VAEncPictureParameterBufferType,
                     sizeof(encode_context->pic), &encode_context->pic,
-                    &buffer_ptr)) {
+                    pbuffer_ptr)) {
     fprintf(stderr, "Failed to upload picture parameter buffer\n");
-    goto rollback_buffers;
+    return false;
   }
 
   encode_context->slice.slice_type = idr ? I : P;
-  encode_context->slice.ref_pic_list0[0] =
-      encode_context->pic.reference_frames[0];
+  encode_context->slice.slice_qp_delta =
+      qp ? (int8_t)(qp - encode_context->pic.pic_init_qp) : 0;
+  struct NegativePics negative_pics[2];
+  uint32_t num_negative_pics = 0;
+  int32_t pic_order_cnt = encode_context->pic.decoded_curr_pic.pic_order_cnt;
+  for (size_t i = 0; !idr && i < LENGTH(negative_pics); i++) {
+    const VAPictureHEVC* reference = encode_context->pic.reference_frames + i;
+    if (reference->picture_id == VA_INVALID_ID) break;
+    bool used = reference->flags & VA_PICTURE_HEVC_RPS_ST_CURR_BEFORE;
+    if (used) encode_context->slice.ref_pic_list0[0] = *reference;
+    negative_pics[num_negative_pics++] = (struct NegativePics){
+        .delta_poc_s0_minus1 =
+            (uint32_t)(pic_order_cnt - reference->pic_order_cnt - 1),
+        .used_by_curr_pic_s0_flag = used,
+    };
+    pic_order_cnt = reference->pic_order_cnt;
+  }
+  if (idr) {
+    encode_context->slice.ref_pic_list0[0] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+  }
+  UpdateSliceWeights(encode_context, idr);
   if (encode_context->va_packed_headers & VA_ENC_PACKED_HEADER_SLICE) {
     char buffer[256];
     struct Bitstream bitstream = {
         .data = buffer,
         .size = 0,
     };
-    static const struct NegativePics negative_pics[] = {
-        {
-            .delta_poc_s0_minus1 = 0,
-            .used_by_curr_pic_s0_flag = true,
-        },
-    };
     const struct MoreSliceParamerters msp = {
         .first_slice_segment_in_pic_flag = 1,
-        .num_negative_pics = idr ? 0 : LENGTH(negative_pics),
-        .negative_pics = idr ? NULL : negative_pics,
+        .num_negative_pics = num_negative_pics,
+        .negative_pics = negative_pics,
     };
+    struct SliceHeaderOffsets offsets;
     PackSliceSegmentHeaderNalUnit(&bitstream, &encode_context->seq,
                                   &encode_context->pic, &encode_context->slice,
-                                  &msp);
+                                  &msp, &offsets);
+    encode_context->slice.pred_weight_table_bit_offset =
+        offsets.pred_weight_table_bit_offset;
+    encode_context->slice.pred_weight_table_bit_length =
+        offsets.pred_weight_table_bit_length;
     if (!UploadPackedBuffer(encode_context, VAEncPackedHeaderSlice,
                             (unsigned int)bitstream.size, bitstream.data,
-                            &buffer_ptr)) {
+                            pbuffer_ptr)) {
       //LOG("Failed to upload packed sequence header");
-      goto rollback_buffers;
+      return false;
     }
   }
 
   if (!UploadBuffer(encode_context, VAEncSliceParameterBufferType,
                     sizeof(encode_context->slice), &encode_context->slice,
-                    &buffer_ptr)) {
+                    pbuffer_ptr)) {
     fprintf(stderr, "Failed to upload slice parameter buffer\n");
-    goto rollback_buffers;
+    return false;
+  }
+  return true;
+}
+
+static void UpdateAv1PicHeader(struct EncodeContext* encode_context,
+                               bool idr) {
+  VAEncPictureParameterBufferAV1* pic = &encode_context->av1_pic;
+  pic->reconstructed_frame =
+      encode_context->recon_surface_ids[encode_context->recon_current];
+  pic->order_hint = (uint8_t)encode_context->frame_counter;
+
+  // Reference slots mirror the recon slots, every frame refreshes the slot it
+  // is reconstructed into, and every ref_frame_idx points at the slot of the
+  // chosen reference.
+  for (size_t i = 0; i < LENGTH(pic->reference_frames); i++)
+    pic->reference_frames[i] = VA_INVALID_SURFACE;
+  for (size_t i = 0; i < LENGTH(encode_context->recon_surface_ids); i++) {
+    if (encode_context->recon_held & (1u << i))
+      pic->reference_frames[i] = encode_context->recon_surface_ids[i];
+  }
+  if (idr) {
+    pic->picture_flags.bits.frame_type = KEY_FRAME;
+    pic->primary_ref_frame = 7;  // PRIMARY_REF_NONE
+    pic->refresh_frame_flags = 0xff;
+    pic->ref_frame_ctrl_l0.value = 0;
+  } else {
+    pic->picture_flags.bits.frame_type = INTER_FRAME;
+    pic->primary_ref_frame = 0;
+    pic->refresh_frame_flags = (uint8_t)(1u << encode_context->recon_current);
+    pic->ref_frame_ctrl_l0.value = 0;
+    pic->ref_frame_ctrl_l0.fields.search_idx0 = 1;  // LAST_FRAME
+  }
+  for (size_t i = 0; i < LENGTH(pic->ref_frame_idx); i++)
+    pic->ref_frame_idx[i] = idr ? 0 : (uint8_t)encode_context->recon_reference;
+}
+
+static bool UploadAv1Buffers(struct EncodeContext* encode_context, bool idr,
+                             uint8_t qp, VABufferID** pbuffer_ptr) {
+  if (idr && !UploadBuffer(encode_context, VAEncSequenceParameterBufferType,
+                           sizeof(encode_context->av1_seq),
+                           &encode_context->av1_seq, pbuffer_ptr)) {
+    fprintf(stderr, "Failed to upload sequence parameter buffer\n");
+    return false;
+  }
+
+  // Sequence header goes into the packed picture header as well, so that the
+  // temporal delimiter stays in front of everything.
+  UpdateAv1PicHeader(encode_context, idr);
+  encode_context->av1_pic.base_qindex = qp ? qp : AV1_DEFAULT_QINDEX;
+  char buffer[256];
+  struct Bitstream bitstream = {
+      .data = buffer,
+      .size = 0,
+  };
+  PackTemporalDelimiterObu(&bitstream);
+  if (idr) {
+    const struct MoreSequenceHeader msh = {
+        .max_frame_width_minus_1 = encode_context->width - 1,
+        .max_frame_height_minus_1 = encode_context->height - 1,
+        .color_description_present_flag = 1,
+        .color_primaries = 2,           // CP_UNSPECIFIED
+        .transfer_characteristics = 2,  // TC_UNSPECIFIED
+        .matrix_coefficients =
+            encode_context->colorspace == kItuRec601 ? 6 : 1,  // Section 6.4.2
+        .color_range = encode_context->range == kFullRange,
+        .chroma_sample_position = 0,  // CSP_UNKNOWN
+    };
+    if (!PackSequenceHeaderObu(&bitstream, &encode_context->av1_seq, &msh)) {
+      fprintf(stderr, "Failed to pack sequence header\n");
+      return false;
+    }
+  }
+  struct FrameHeaderOffsets offsets;
+  if (!PackFrameHeaderObu(&bitstream, &encode_context->av1_seq,
+                          &encode_context->av1_pic, &offsets)) {
+    fprintf(stderr, "Failed to pack frame header\n");
+    return false;
+  }
+  encode_context->av1_pic.bit_offset_qindex = offsets.bit_offset_qindex;
+  encode_context->av1_pic.bit_offset_segmentation =
+      offsets.bit_offset_segmentation;
+  encode_context->av1_pic.bit_offset_loopfilter_params =
+      offsets.bit_offset_loopfilter_params;
+  encode_context->av1_pic.bit_offset_cdef_params =
+      offsets.bit_offset_cdef_params;
+  encode_context->av1_pic.size_in_bits_cdef_params =
+      offsets.size_in_bits_cdef_params;
+  encode_context->av1_pic.byte_offset_frame_hdr_obu_size =
+      offsets.byte_offset_frame_hdr_obu_size;
+  encode_context->av1_pic.size_in_bits_frame_hdr_obu =
+      offsets.size_in_bits_frame_hdr_obu;
+  if (!UploadPackedBuffer(encode_context, VAEncPackedHeaderPicture,
+                          (unsigned int)bitstream.size, bitstream.data,
+                          pbuffer_ptr)) {
+    fprintf(stderr, "Failed to upload packed picture header\n");
+    return false;
+  }
+
+  if (!UploadBuffer(encode_context, VAEncPictureParameterBufferType,
+                    sizeof(encode_context->av1_pic), &encode_context->av1_pic,
+                    pbuffer_ptr)) {
+    fprintf(stderr, "Failed to upload picture parameter buffer\n");
+    return false;
+  }
+
+  VAEncTileGroupBufferAV1 tile_group = {
+      .tg_start = 0,
+      .tg_end = (uint8_t)(encode_context->av1_tile_info.tile_cols *
+                              encode_context->av1_tile_info.tile_rows -
+                          1),
+  };
+  if (!UploadBuffer(encode_context, VAEncSliceParameterBufferType,
+                    sizeof(tile_group), &tile_group, pbuffer_ptr)) {
+    fprintf(stderr, "Failed to upload tile group buffer\n");
+    return false;
+  }
+  return true;
+}
+
+static bool EncodeFrame(struct EncodeContext* encode_context,
+                        unsigned long long timestamp,
+                        const struct EncodeFrameControl* control,
+                        struct EncodedFrame* encoded_frame,
+                        struct EncodeFrameResult* frame_result) {
+  if (encode_context->output_borrowed) {
+    fprintf(stderr, "Previous encoded frame was not released\n");
+    return false;
+  }
+
+  uint8_t qp = control ? control->qp : 0;
+  if (encode_context->codec != kEncodeCodecAv1 && qp > ENCODE_HEVC_MAX_QP) {
+    fprintf(stderr, "Invalid hevc qp %u\n", qp);
+    return false;
   }
 
+  bool result = false;
+  VABufferID buffers[12];
+  VABufferID* buffer_ptr = buffers;
+
+  bool idr = PlanReferences(encode_context, control);
+  encode_context->predicting = control != NULL;
+  bool uploaded =
+      encode_context->codec == kEncodeCodecAv1
+          ? UploadAv1Buffers(encode_context, idr, qp, &buffer_ptr)
+          : UploadHevcBuffers(encode_context, idr, qp, &buffer_ptr);
+  if (!uploaded || !UploadControlBuffers(encode_context, control, &buffer_ptr))
+    goto rollback_buffers;
+
+  uint32_t trace_session = encode_context->session_id;
+  uint64_t trace_frame = encode_context->frame_counter;
+  unsigned long long stage_started = MicrosNow();
+  TraceBegin("submit", trace_session, trace_frame);
   VAStatus status =
       vaBeginPicture(encode_context->va_display, encode_context->va_context_id,
-                     encode_context->input_surface_id);
+                     encode_context->source_surface_id);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to begin va picture: %s\n", VaErrorString(status));
+    TraceEnd("submit", trace_session, trace_frame);
     goto rollback_buffers;
   }
 
@@ -889,22 +1571,31 @@ bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
                            encode_context->va_context_id, buffers, num_buffers);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to render va picture: %s\n", VaErrorString(status));
+    TraceEnd("submit", trace_session, trace_frame);
     goto rollback_buffers;
   }
 
   status =
       vaEndPicture(encode_context->va_display, encode_context->va_context_id);
+  TraceEnd("submit", trace_session, trace_frame);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to end va picture: %s\n", VaErrorString(status));
     goto rollback_buffers;
   }
+  RecordStage(encode_context, kMetricsStageSubmit, stage_started);
+  unsigned long long submit_micros = MicrosNow() - stage_started;
 
+  stage_started = MicrosNow();
+  TraceBegin("sync", trace_session, trace_frame);
   status = vaSyncBuffer(encode_context->va_display,
                         encode_context->output_buffer_id, VA_TIMEOUT_INFINITE);
+  TraceEnd("sync", trace_session, trace_frame);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to sync va buffer: %s\n", VaErrorString(status));
     goto rollback_buffers;
   }
+  RecordStage(encode_context, kMetricsStageSync, stage_started);
+  unsigned long long sync_micros = MicrosNow() - stage_started;
 
   VACodedBufferSegment* segment;
   status = vaMapBuffer(encode_context->va_display,
@@ -913,62 +1604,221 @@ bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
     fprintf(stderr, "Failed to map va buffer: %s\n", VaErrorString(status));
     goto rollback_buffers;
   }
-  bool owned_data = false;
-  void* data = segment->buf;
-  uint32_t size = segment->size;
-  VACodedBufferSegment* next = segment->next;
-  if (next && next->size) {
-    // TODO(mburakov): How to avoid copying?
-    for (VACodedBufferSegment* it = next; it; it = it->next) {
-      size += it->size;
-    }
-    owned_data = true;
-    data = malloc(size);
-    if (!data) {
-      //LOG("Failed to allocate interim data buffer (%s)", strerror(errno));
-      goto rollback_segment;
-    }
-    void* ptr = data;
-    for (VACodedBufferSegment* it = segment; it; it = it->next) {
-      memcpy(ptr, it->buf, it->size);
-      ptr = (uint8_t*)ptr + it->size;
+  // Segments are handed out in place and stay mapped until the caller releases
+  // the frame, so multi-segment output needs no copy.
+  uint32_t status_bits = 0;
+  *encoded_frame = (struct EncodedFrame){
+      .keyframe = idr,
+      .pts = timestamp,
+      .stream_id = encode_context->session_id,
+      .sequence = (uint32_t)encode_context->frame_counter,
+  };
+  for (VACodedBufferSegment* it = segment; it; it = it->next) {
+    if (!it->size) continue;
+    if (encoded_frame->nsegments == LENGTH(encoded_frame->segments)) {
+      fprintf(stderr, "Too many coded buffer segments\n");
+      vaUnmapBuffer(encode_context->va_display,
+                    encode_context->output_buffer_id);
+      goto rollback_buffers;
     }
+    encoded_frame->segments[encoded_frame->nsegments++] =
+        (struct iovec){.iov_base = it->buf, .iov_len = it->size};
+    encoded_frame->size += it->size;
+    status_bits |= it->status;
   }
-  struct Proto proto = {
-      .size = size,
-      .type = PROTO_TYPE_VIDEO,
-      .flags = idr ? PROTO_FLAG_KEYFRAME : 0,
-      .latency = (uint16_t)(MicrosNow() - timestamp),
-  };
-  if (!WriteProto(fd, &proto, data)) {
-    //LOG("Failed to write encoded frame");
-    goto rollback_data;
+  encoded_frame->latency = (uint16_t)(MicrosNow() - timestamp);
+
+  if (frame_result) {
+    uint8_t average_qp = status_bits & VA_CODED_BUF_STATUS_PICTURE_AVE_QP_MASK;
+    uint8_t default_qp = encode_context->codec == kEncodeCodecAv1
+                             ? AV1_DEFAULT_QINDEX
+                             : encode_context->pic.pic_init_qp;
+    *frame_result = (struct EncodeFrameResult){
+        .type = idr ? kEncodeFrameTypeIntra : kEncodeFrameTypeInter,
+        .sequence = encoded_frame->sequence,
+        .size = encoded_frame->size,
+        .qp = average_qp ? average_qp : qp ? qp : default_qp,
+        .size_overflow =
+            !!(status_bits & VA_CODED_BUF_STATUS_FRAME_SIZE_OVERFLOW),
+        .weighted = encode_context->codec == kEncodeCodecHevc &&
+                    encode_context->fade_weighted,
+        .submit_micros = (uint32_t)submit_micros,
+        .sync_micros = (uint32_t)sync_micros,
+    };
   }
 
+  encode_context->recon_frames[encode_context->recon_current] =
+      encode_context->frame_counter;
+  encode_context->recon_fade_stats[encode_context->recon_current] =
+      encode_context->fade_stats;
+  if (encode_context->fade_stats_valid) {
+    encode_context->recon_fade_valid |=
+        (uint8_t)(1u << encode_context->recon_current);
+  } else {
+    encode_context->recon_fade_valid &=
+        (uint8_t)~(1u << encode_context->recon_current);
+  }
+  encode_context->fade_stats_valid = false;
+  encode_context->recon_held |= (uint8_t)(1u << encode_context->recon_current);
+  encode_context->skipped_frames = 0;
+  encode_context->output_borrowed = true;
   encode_context->frame_counter++;
   result = true;
 
-rollback_data:
-  if (owned_data) free(data);
-rollback_segment:
-  vaUnmapBuffer(encode_context->va_display, encode_context->output_buffer_id);
 rollback_buffers:
   while (buffer_ptr-- > buffers)
     vaDestroyBuffer(encode_context->va_display, *buffer_ptr);
   return result;
 }
 
+static void RecordFrame(struct EncodeContext* encode_context,
+                        const struct EncodedFrame* encoded_frame) {
+  if (!encode_context->metrics_session) return;
+  MetricsSessionFrame(encode_context->metrics_session, encoded_frame->size,
+                      encoded_frame->keyframe);
+}
+
+bool EncodeContextEncodeFrameBorrowed(struct EncodeContext* encode_context,
+                                      unsigned long long timestamp,
+                                      struct EncodedFrame* encoded_frame) {
+  // Borrowed frames are delivered by the caller, so handing one out is as
+  // far as the encoder can tell.
+  if (!EncodeFrame(encode_context, timestamp, NULL, encoded_frame, NULL))
+    return false;
+  RecordFrame(encode_context, encoded_frame);
+  return true;
+}
+
+void EncodeContextReleaseFrame(struct EncodeContext* encode_context) {
+  if (!encode_context->output_borrowed) return;
+  vaUnmapBuffer(encode_context->va_display, encode_context->output_buffer_id);
+  encode_context->output_borrowed = false;
+}
+
+bool EncodeContextEncodeFrameToSink(struct EncodeContext* encode_context,
+                                    unsigned long long timestamp,
+                                    EncodeSink sink, void* user) {
+  return EncodeContextEncodeFrameControlled(encode_context, timestamp, NULL,
+                                            sink, user, NULL);
+}
+
+bool EncodeContextEncodeFrameControlled(
+    struct EncodeContext* encode_context, unsigned long long timestamp,
+    const struct EncodeFrameControl* control, EncodeSink sink, void* user,
+    struct EncodeFrameResult* result) {
+  if (control && control->skip) {
+    // The driver only keeps a byte worth of skipped frames.
+    if (encode_context->skipped_frames < UINT8_MAX)
+      encode_context->skipped_frames++;
+    if (result) {
+      *result = (struct EncodeFrameResult){
+          .type = kEncodeFrameTypeSkipped,
+          .sequence = (uint32_t)encode_context->frame_counter,
+      };
+    }
+    return true;
+  }
+
+  struct EncodedFrame encoded_frame;
+  struct EncodeFrameResult frame_result;
+  if (!EncodeFrame(encode_context, timestamp, control, &encoded_frame,
+                   &frame_result)) {
+    //LOG("Failed to encode frame");
+    return false;
+  }
+  unsigned long long stage_started = MicrosNow();
+  TraceBegin("write", encode_context->session_id, encoded_frame.sequence);
+  bool sink_result = sink(user, &encoded_frame);
+  TraceEnd("write", encode_context->session_id, encoded_frame.sequence);
+  EncodeContextReleaseFrame(encode_context);
+  if (!sink_result) return false;
+  RecordFrame(encode_context, &encoded_frame);
+  RecordStage(encode_context, kMetricsStageWrite, stage_started);
+  frame_result.write_micros = (uint32_t)(MicrosNow() - stage_started);
+  if (result) *result = frame_result;
+  return true;
+}
+
+void PackEncodedFrameProto(const struct EncodedFrame* frame,
+                           struct Proto* proto) {
+  *proto = (struct Proto){
+      .size = frame->size,
+      .type = PROTO_TYPE_VIDEO,
+      .flags = frame->keyframe ? PROTO_FLAG_KEYFRAME : 0,
+      .latency = frame->latency,
+  };
+}
+
+void PackEncodedFrameProto2(const struct EncodedFrame* frame,
+                            struct Proto2* proto) {
+  *proto = (struct Proto2){
+      .marker = PROTO_MARKER,
+      .version = PROTO_VERSION,
+      .header_size = sizeof(struct Proto2),
+      .type = PROTO_TYPE_VIDEO,
+      .flags = frame->keyframe ? PROTO_FLAG_KEYFRAME : 0,
+      .stream_id = frame->stream_id,
+      .size = frame->size,
+      .pts = frame->pts,
+      .sequence = frame->sequence,
+      .latency = frame->latency,
+      .fragment = PROTO_FRAGMENT_WHOLE,
+  };
+}
+
+bool WriteEncodedFrame(void* user, const struct EncodedFrame* frame) {
+  struct Proto proto;
+  PackEncodedFrameProto(frame, &proto);
+  if (!WriteProtov(*(int*)user, &proto, frame->segments, frame->nsegments)) {
+    //LOG("Failed to write encoded frame");
+    return false;
+  }
+  return true;
+}
+
+bool WriteEncodedFrame2(void* user, const struct EncodedFrame* frame) {
+  struct Proto2 proto;
+  PackEncodedFrameProto2(frame, &proto);
+  if (!WriteProto2(*(int*)user, &proto, frame->segments, frame->nsegments)) {
+    //LOG("Failed to write encoded frame");
+    return false;
+  }
+  return true;
+}
+
+bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
+                              unsigned long long timestamp) {
+  return EncodeContextEncodeFrameToSink(encode_context, timestamp,
+                                        WriteEncodedFrame, &fd);
+}
+
+bool EncodeContextWantsFadeStats(const struct EncodeContext* encode_context) {
+  return encode_context->codec == kEncodeCodecHevc &&
+         encode_context->pic.pic_fields.bits.weighted_pred_flag &&
+         encode_context->predicting;
+}
+
+void EncodeContextSetFadeStats(struct EncodeContext* encode_context,
+                               const struct FadeStats* fade_stats) {
+  encode_context->fade_stats_valid = fade_stats != NULL;
+  if (fade_stats) encode_context->fade_stats = *fade_stats;
+}
+
 bool EncodeContextWriteYuvData(struct EncodeContext* encode_context,
-                              unsigned char *y_data,
-                              unsigned char *u_data, 
-                              unsigned char *v_data,
+                              const unsigned char *y_data,
+                              const unsigned char *u_data, 
+                              const unsigned char *v_data,
                               uint32_t width, uint32_t height) {
   // 从表面派生图像
+  uint32_t trace_session = encode_context->session_id;
+  uint64_t trace_frame = encode_context->frame_counter;
+  TraceBegin("upload", trace_session, trace_frame);
   VAImage va_image;
   VAStatus status = vaDeriveImage(encode_context->va_display, 
                                  encode_context->input_surface_id, &va_image);
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to derive image: %s\n", VaErrorString(status));
+    TraceEnd("upload", trace_session, trace_frame);
     return false;
   }
   
@@ -978,6 +1828,7 @@ bool EncodeContextWriteYuvData(struct EncodeContext* encode_context,
   if (status != VA_STATUS_SUCCESS) {
     fprintf(stderr, "Failed to map buffer: %s\n", VaErrorString(status));
     vaDestroyImage(encode_context->va_display, va_image.image_id);
+    TraceEnd("upload", trace_session, trace_frame);
     return false;
   }
   
@@ -1010,14 +1861,32 @@ bool EncodeContextWriteYuvData(struct EncodeContext* encode_context,
   // 取消映射并清理
   vaUnmapBuffer(encode_context->va_display, va_image.buf);
   vaDestroyImage(encode_context->va_display, va_image.image_id);
+  TraceEnd("upload", trace_session, trace_frame);
+
+  // 统计亮度/色度均值与方差，供P帧加权预测检测淡入淡出，
+  // 仅在加权预测开启且后续会编码P帧时才多走这一遍
+  if (!EncodeContextWantsFadeStats(encode_context)) {
+    EncodeContextSetFadeStats(encode_context, NULL);
+    return true;
+  }
+  struct FadeStats fade_stats = {0};
+  FadeStatsAddPlane(&fade_stats.planes[0], y_data, width, width, height);
+  FadeStatsAddPlane(&fade_stats.planes[1], u_data, chroma_width, chroma_width,
+                    chroma_height);
+  FadeStatsAddPlane(&fade_stats.planes[2], v_data, chroma_width, chroma_width,
+                    chroma_height);
+  EncodeContextSetFadeStats(encode_context, &fade_stats);
   
   return true;
 }
 
 void EncodeContextDestroy(struct EncodeContext* encode_context) {
+  EncodeContextReleaseFrame(encode_context);
   vaDestroyBuffer(encode_context->va_display, encode_context->output_buffer_id);
-  GpuContextDestroyFrame(encode_context->gpu_context,
-                         encode_context->gpu_frame);
+  if (encode_context->gpu_frame) {
+    GpuContextDestroyFrame(encode_context->gpu_context,
+                           encode_context->gpu_frame);
+  }
   vaDestroySurfaces(encode_context->va_display,
                     &encode_context->input_surface_id, 1);
   vaDestroyContext(encode_context->va_display, encode_context->va_context_id);
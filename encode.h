@@ -19,29 +19,175 @@
 #define STREAMER_ENCODE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "colorspace.h"
 
 // Utility macro for array length
 #define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
 
+// Render node every encode context is opened on.
+#define ENCODE_RENDER_NODE "/dev/dri/renderD128"
+
+// Largest qp EncodeFrameControl accepts, 8-bit hevc qp or av1 base_qindex.
+#define ENCODE_HEVC_MAX_QP 51
+#define ENCODE_AV1_MAX_QINDEX 255
+
 struct EncodeContext;
+struct EncodeSurface;
+struct FadeStats;
 struct GpuContext;
 struct GpuFrame;
+struct GpuFramePlane;
+struct MetricsSession;
+struct Proto;
+struct Proto2;
+
+// Coded segments point straight into the mapped va output buffer and stay
+// valid until the frame is released.
+struct EncodedFrame {
+  struct iovec segments[8];
+  size_t nsegments;
+  uint32_t size;
+  bool keyframe;
+  uint64_t pts;
+  uint32_t stream_id;
+  uint32_t sequence;
+  uint16_t latency;
+};
+
+enum EncodeCodec {
+  kEncodeCodecHevc = 0,
+  kEncodeCodecAv1,
+};
+
+enum EncodeFrameType {
+  kEncodeFrameTypeSkipped = 0,
+  kEncodeFrameTypeIntra,
+  kEncodeFrameTypeInter,
+};
+
+// Per-frame overrides for callers running their own rate control, a zeroed
+// struct keeps the encoder defaults. Unlike plain encoding, which codes every
+// frame as a keyframe, controlled frames are predicted unless forced intra.
+struct EncodeFrameControl {
+  // Hevc qp or av1 base_qindex, zero keeps the default. Frames with a qp
+  // above the codec maximum are rejected.
+  uint8_t qp;
+  bool force_intra;
+  // Drops the frame without coding it, the encoder learns about the gap
+  // along with the next coded frame.
+  bool skip;
+  // Predicts from the frame with the given sequence instead of the previous
+  // one, e.g. the last frame acknowledged by the receiver. Only the last
+  // reference and the most recent other coded frame are kept, older ones
+  // force an intra frame.
+  bool use_reference;
+  uint32_t reference_sequence;
+  // Upper bound for the coded size in bytes, zero for none. Only bitrate
+  // control enforces it, under constant qp it is ignored with a warning.
+  uint32_t max_size;
+};
+
+struct EncodeFrameResult {
+  enum EncodeFrameType type;
+  uint32_t sequence;
+  uint32_t size;
+  // Average qp reported by the driver, or the requested one if it does not.
+  uint8_t qp;
+  bool size_overflow;
+  // Predicted with explicit weights for a detected fade.
+  bool weighted;
+  uint32_t submit_micros;
+  uint32_t sync_micros;
+  uint32_t write_micros;
+};
+
+typedef bool (*EncodeSink)(void* user, const struct EncodedFrame* frame);
+
+// VA entrypoint contexts of the given codec are created with, exposed for
+// keying admission control before any context exists.
+uint32_t EncodeCodecEntrypoint(enum EncodeCodec codec);
 
 struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
                                           uint32_t width, uint32_t height,
                                           enum YuvColorspace colorspace,
-                                          enum YuvRange range);
+                                          enum YuvRange range,
+                                          enum EncodeCodec codec);
+// Two-phase creation for overlapping va and gpu initialization. Unbound
+// contexts own all the va objects, but have no gpu frame until bound, which
+// exports the input surface as dmabuf and imports it into the gpu context.
+// Binding needs the gpu context current on the calling thread.
+struct EncodeContext* EncodeContextCreateUnbound(uint32_t width,
+                                                 uint32_t height,
+                                                 enum YuvColorspace colorspace,
+                                                 enum YuvRange range,
+                                                 enum EncodeCodec codec);
+bool EncodeContextBindGpu(struct EncodeContext* encode_context,
+                          struct GpuContext* gpu_context);
 const struct GpuFrame* EncodeContextGetFrame(
     struct EncodeContext* encode_context);
+int EncodeContextGetRenderNode(const struct EncodeContext* encode_context);
+// Trace events of the encoder are tagged with these, so that stages running
+// outside of it can be correlated. Frame counter is the one of the frame to be
+// encoded next.
+uint32_t EncodeContextGetSessionId(const struct EncodeContext* encode_context);
+uint64_t EncodeContextGetFrameCounter(
+    const struct EncodeContext* encode_context);
+void EncodeContextSetMetrics(struct EncodeContext* encode_context,
+                             struct MetricsSession* metrics_session);
+// Imported surfaces wrap external dmabufs, e.g. decoded frames, so they can
+// be encoded without a conversion pass. Plane fds are not consumed.
+struct EncodeSurface* EncodeContextImportSurface(
+    struct EncodeContext* encode_context, uint32_t width, uint32_t height,
+    uint32_t fourcc, size_t nplanes, const struct GpuFramePlane* planes);
+// Selects the surface the following frames are encoded from, NULL switches
+// back to the surface behind EncodeContextGetFrame.
+void EncodeContextSetSurface(struct EncodeContext* encode_context,
+                             const struct EncodeSurface* encode_surface);
+void EncodeContextDestroySurface(struct EncodeContext* encode_context,
+                                 struct EncodeSurface* encode_surface);
 bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
                               unsigned long long timestamp);
+// Only one frame can be borrowed at a time, it must be released before the
+// next one is encoded.
+bool EncodeContextEncodeFrameBorrowed(struct EncodeContext* encode_context,
+                                      unsigned long long timestamp,
+                                      struct EncodedFrame* encoded_frame);
+void EncodeContextReleaseFrame(struct EncodeContext* encode_context);
+bool EncodeContextEncodeFrameToSink(struct EncodeContext* encode_context,
+                                    unsigned long long timestamp,
+                                    EncodeSink sink, void* user);
+// Skipped frames are not passed to the sink. Result is optional.
+bool EncodeContextEncodeFrameControlled(
+    struct EncodeContext* encode_context, unsigned long long timestamp,
+    const struct EncodeFrameControl* control, EncodeSink sink, void* user,
+    struct EncodeFrameResult* result);
+// Sink behind EncodeContextEncodeFrame, user points to the fd that receives
+// version 1 proto records, which every existing receiver understands. The
+// version 2 sink adds stream id, pts and sequence, and has to be opted into.
+// Exposed for sinks that wrap the file output, along with the headers they
+// write in front of every frame.
+void PackEncodedFrameProto(const struct EncodedFrame* frame,
+                           struct Proto* proto);
+void PackEncodedFrameProto2(const struct EncodedFrame* frame,
+                            struct Proto2* proto);
+bool WriteEncodedFrame(void* user, const struct EncodedFrame* frame);
+bool WriteEncodedFrame2(void* user, const struct EncodedFrame* frame);
+// Statistics of the next frame for fade detection, needed for weighted
+// prediction of inputs the encoder never sees on the cpu. Frames written
+// with EncodeContextWriteYuvData get them computed automatically, as long as
+// the encoder wants them at all, i.e. weighted prediction is enabled and
+// frames are predicted. NULL marks the next frame as unknown.
+bool EncodeContextWantsFadeStats(const struct EncodeContext* encode_context);
+void EncodeContextSetFadeStats(struct EncodeContext* encode_context,
+                               const struct FadeStats* fade_stats);
 bool EncodeContextWriteYuvData(struct EncodeContext* encode_context,
-                              unsigned char *y_data,
-                              unsigned char *u_data, 
-                              unsigned char *v_data,
+                              const unsigned char *y_data,
+                              const unsigned char *u_data, 
+                              const unsigned char *v_data,
                               uint32_t width, uint32_t height);
 void EncodeContextDestroy(struct EncodeContext* encode_context);
 
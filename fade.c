@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fade.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FADE_X86
+#endif
+
+// Squares are summed in 32-bit lanes, which overflow after about half a
+// megabyte of samples, so long rows are fed to kernels in chunks.
+#define FADE_MAX_CHUNK 65536
+
+// Below these the frames are considered the same brightness, global stats
+// drift by about as much with ordinary motion.
+#define FADE_MIN_MEAN_DELTA 1.5
+#define FADE_MIN_SIGMA_RATIO 0.03
+
+// Sums even and odd bytes of the row separately, planar callers add both.
+typedef void (*FadeRowFn)(const uint8_t* row, size_t size, uint64_t sums[2],
+                          uint64_t squares[2]);
+
+static pthread_once_t fade_once = PTHREAD_ONCE_INIT;
+static FadeRowFn fade_row;
+
+static void FadeRowScalar(const uint8_t* row, size_t size, uint64_t sums[2],
+                          uint64_t squares[2]) {
+  for (size_t i = 0; i < size; i++) {
+    sums[i & 1] += row[i];
+    squares[i & 1] += (uint32_t)row[i] * row[i];
+  }
+}
+
+#ifdef FADE_X86
+__attribute__((target("sse2"))) static void FadeRowSse2(const uint8_t* row,
+                                                        size_t size,
+                                                        uint64_t sums[2],
+                                                        uint64_t squares[2]) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i even = _mm_set1_epi16(0x00ff);
+  __m128i sum_even = zero;
+  __m128i sum_odd = zero;
+  __m128i square_even = zero;
+  __m128i square_odd = zero;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(row + i));
+    __m128i e = _mm_and_si128(s, even);
+    __m128i o = _mm_srli_epi16(s, 8);
+    sum_even = _mm_add_epi64(sum_even, _mm_sad_epu8(e, zero));
+    sum_odd = _mm_add_epi64(sum_odd, _mm_sad_epu8(o, zero));
+    square_even = _mm_add_epi32(square_even, _mm_madd_epi16(e, e));
+    square_odd = _mm_add_epi32(square_odd, _mm_madd_epi16(o, o));
+  }
+  uint64_t lanes[2];
+  uint32_t square_lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, sum_even);
+  sums[0] += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)lanes, sum_odd);
+  sums[1] += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)square_lanes, square_even);
+  squares[0] += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] +
+                square_lanes[3];
+  _mm_storeu_si128((__m128i*)square_lanes, square_odd);
+  squares[1] += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] +
+                square_lanes[3];
+  FadeRowScalar(row + i, size - i, sums, squares);
+}
+
+__attribute__((target("avx2"))) static void FadeRowAvx2(const uint8_t* row,
+                                                        size_t size,
+                                                        uint64_t sums[2],
+                                                        uint64_t squares[2]) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i even = _mm256_set1_epi16(0x00ff);
+  __m256i sum_even = zero;
+  __m256i sum_odd = zero;
+  __m256i square_even = zero;
+  __m256i square_odd = zero;
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(row + i));
+    __m256i e = _mm256_and_si256(s, even);
+    __m256i o = _mm256_srli_epi16(s, 8);
+    sum_even = _mm256_add_epi64(sum_even, _mm256_sad_epu8(e, zero));
+    sum_odd = _mm256_add_epi64(sum_odd, _mm256_sad_epu8(o, zero));
+    square_even = _mm256_add_epi32(square_even, _mm256_madd_epi16(e, e));
+    square_odd = _mm256_add_epi32(square_odd, _mm256_madd_epi16(o, o));
+  }
+  // The tail stays in vex encoded instructions, see fec.c for why.
+  __m128i sum_even_128 = _mm_add_epi64(_mm256_castsi256_si128(sum_even),
+                                       _mm256_extracti128_si256(sum_even, 1));
+  __m128i sum_odd_128 = _mm_add_epi64(_mm256_castsi256_si128(sum_odd),
+                                      _mm256_extracti128_si256(sum_odd, 1));
+  __m128i square_even_128 =
+      _mm_add_epi32(_mm256_castsi256_si128(square_even),
+                    _mm256_extracti128_si256(square_even, 1));
+  __m128i square_odd_128 =
+      _mm_add_epi32(_mm256_castsi256_si128(square_odd),
+                    _mm256_extracti128_si256(square_odd, 1));
+  if (i + 16 <= size) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(row + i));
+    __m128i e = _mm_and_si128(s, _mm256_castsi256_si128(even));
+    __m128i o = _mm_srli_epi16(s, 8);
+    __m128i z = _mm256_castsi256_si128(zero);
+    sum_even_128 = _mm_add_epi64(sum_even_128, _mm_sad_epu8(e, z));
+    sum_odd_128 = _mm_add_epi64(sum_odd_128, _mm_sad_epu8(o, z));
+    square_even_128 = _mm_add_epi32(square_even_128, _mm_madd_epi16(e, e));
+    square_odd_128 = _mm_add_epi32(square_odd_128, _mm_madd_epi16(o, o));
+    i += 16;
+  }
+  uint64_t lanes[2];
+  uint32_t square_lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, sum_even_128);
+  sums[0] += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)lanes, sum_odd_128);
+  sums[1] += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)square_lanes, square_even_128);
+  squares[0] += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] +
+                square_lanes[3];
+  _mm_storeu_si128((__m128i*)square_lanes, square_odd_128);
+  squares[1] += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] +
+                square_lanes[3];
+  FadeRowScalar(row + i, size - i, sums, squares);
+}
+#endif  // FADE_X86
+
+static void FadeInit(void) {
+  fade_row = FadeRowScalar;
+#ifdef FADE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) fade_row = FadeRowSse2;
+  if (__builtin_cpu_supports("avx2")) fade_row = FadeRowAvx2;
+#endif  // FADE_X86
+}
+
+bool FadeSetKernel(enum FadeKernel kernel) {
+  pthread_once(&fade_once, FadeInit);
+  switch (kernel) {
+    case kFadeKernelScalar:
+      fade_row = FadeRowScalar;
+      return true;
+#ifdef FADE_X86
+    case kFadeKernelSse2:
+      if (!__builtin_cpu_supports("sse2")) return false;
+      fade_row = FadeRowSse2;
+      return true;
+    case kFadeKernelAvx2:
+      if (!__builtin_cpu_supports("avx2")) return false;
+      fade_row = FadeRowAvx2;
+      return true;
+#endif  // FADE_X86
+    default:
+      return false;
+  }
+}
+
+static void AddRows(const uint8_t* data, size_t stride, size_t size,
+                    uint32_t height, uint64_t sums[2], uint64_t squares[2]) {
+  pthread_once(&fade_once, FadeInit);
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t* row = data + y * stride;
+    // Chunks are even sized, so parity of the samples holds.
+    for (size_t i = 0; i < size; i += FADE_MAX_CHUNK) {
+      size_t chunk = size - i < FADE_MAX_CHUNK ? size - i : FADE_MAX_CHUNK;
+      fade_row(row + i, chunk, sums, squares);
+    }
+  }
+}
+
+void FadeStatsAddPlane(struct FadePlaneStats* stats, const void* data,
+                       size_t stride, uint32_t width, uint32_t height) {
+  uint64_t sums[2] = {0};
+  uint64_t squares[2] = {0};
+  AddRows(data, stride, width, height, sums, squares);
+  stats->count += (uint64_t)width * height;
+  stats->sum += sums[0] + sums[1];
+  stats->squares += squares[0] + squares[1];
+}
+
+void FadeStatsAddInterleaved(struct FadePlaneStats* first,
+                             struct FadePlaneStats* second, const void* data,
+                             size_t stride, uint32_t width, uint32_t height) {
+  uint64_t sums[2] = {0};
+  uint64_t squares[2] = {0};
+  AddRows(data, stride, (size_t)width * 2, height, sums, squares);
+  first->count += (uint64_t)width * height;
+  first->sum += sums[0];
+  first->squares += squares[0];
+  second->count += (uint64_t)width * height;
+  second->sum += sums[1];
+  second->squares += squares[1];
+}
+
+static void PlaneMoments(const struct FadePlaneStats* stats, double* mean,
+                         double* sigma) {
+  *mean = stats->count ? (double)stats->sum / (double)stats->count : 0;
+  double variance =
+      stats->count ? (double)stats->squares / (double)stats->count -
+                         *mean * *mean
+                   : 0;
+  *sigma = variance > 0 ? sqrt(variance) : 0;
+}
+
+static int32_t Clamp(long value, int32_t min, int32_t max) {
+  return value < min ? min : value > max ? max : (int32_t)value;
+}
+
+bool FadeEstimateWeights(const struct FadeStats* current,
+                         const struct FadeStats* reference,
+                         struct FadeWeights* weights) {
+  static const int32_t kUnity = 1 << FADE_LOG2_WEIGHT_DENOM;
+  *weights = (struct FadeWeights){
+      .log2_denom = FADE_LOG2_WEIGHT_DENOM,
+      .weights = {kUnity, kUnity, kUnity},
+  };
+
+  double mean[2], sigma[2];
+  PlaneMoments(&current->planes[0], &mean[0], &sigma[0]);
+  PlaneMoments(&reference->planes[0], &mean[1], &sigma[1]);
+  // Flat references, e.g. the black frame a fade starts from, carry no contrast
+  // to scale, so those only get an offset.
+  double ratio = sigma[1] >= 1 ? sigma[0] / sigma[1] : 1;
+  if (fabs(mean[0] - mean[1]) < FADE_MIN_MEAN_DELTA &&
+      fabs(ratio - 1) < FADE_MIN_SIGMA_RATIO)
+    return false;
+
+  for (size_t i = 0; i < 3; i++) {
+    if (i) {
+      PlaneMoments(&current->planes[i], &mean[0], &sigma[0]);
+      PlaneMoments(&reference->planes[i], &mean[1], &sigma[1]);
+      ratio = sigma[1] >= 1 ? sigma[0] / sigma[1] : 1;
+    }
+    // 7.4.7.3 delta weights are limited to -128..127 around unity, offsets
+    // are limited to -128..127 for 8-bit samples.
+    int32_t weight = Clamp(lround(ratio * kUnity), 0, kUnity + 127);
+    int32_t offset =
+        Clamp(lround(mean[0] - mean[1] * weight / kUnity), -128, 127);
+    weights->weights[i] = (int16_t)weight;
+    weights->offsets[i] = (int8_t)offset;
+  }
+  return true;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_FADE_H_
+#define STREAMER_FADE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Weight precision, the same x264 and friends use for 8-bit content.
+#define FADE_LOG2_WEIGHT_DENOM 6
+
+enum FadeKernel {
+  kFadeKernelScalar = 0,
+  kFadeKernelSse2,
+  kFadeKernelAvx2,
+};
+
+struct FadePlaneStats {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t squares;
+};
+
+// Planes are y, cb and cr.
+struct FadeStats {
+  struct FadePlaneStats planes[3];
+};
+
+// Explicit weighted prediction in hevc terms, every plane is predicted as
+// ((reference * weight) >> log2_denom) + offset.
+struct FadeWeights {
+  uint8_t log2_denom;
+  int16_t weights[3];
+  int8_t offsets[3];
+};
+
+// Kernels are picked by cpu features on first use, this overrides the choice
+// e.g. for benchmarks. Returns false if the cpu lacks the instructions.
+bool FadeSetKernel(enum FadeKernel kernel);
+
+// Accumulates samples into the stats, which must be zeroed beforehand.
+// Interleaved planes, e.g. nv12 chroma, carry width pairs of samples per row
+// and are split between the two stats.
+void FadeStatsAddPlane(struct FadePlaneStats* stats, const void* data,
+                       size_t stride, uint32_t width, uint32_t height);
+void FadeStatsAddInterleaved(struct FadePlaneStats* first,
+                             struct FadePlaneStats* second, const void* data,
+                             size_t stride, uint32_t width, uint32_t height);
+
+// Weights predicting the current frame from the reference by matching means
+// and variances of every plane. Returns whether the frames differ enough in
+// brightness or contrast to be worth weighting, weights are set to identity
+// otherwise.
+bool FadeEstimateWeights(const struct FadeStats* current,
+                         const struct FadeStats* reference,
+                         struct FadeWeights* weights);
+
+#endif  // STREAMER_FADE_H_
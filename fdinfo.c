@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fdinfo.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+struct EngineSampler {
+  int fdinfo;
+  struct DrmFdinfo last;
+};
+
+// Engine names used by i915 and engine classes used by xe, see
+// Documentation/gpu/drm-usage-stats.rst in the kernel tree.
+static const struct {
+  const char* name;
+  const char* engine_class;
+} kEngineNames[kDrmEngineCount] = {
+    [kDrmEngineRender] = {"render", "rcs"},
+    [kDrmEngineCopy] = {"copy", "bcs"},
+    [kDrmEngineVideo] = {"video", "vcs"},
+    [kDrmEngineVideoEnhance] = {"video-enhance", "vecs"},
+    [kDrmEngineCompute] = {"compute", "ccs"},
+};
+
+const char* DrmEngineName(enum DrmEngine engine) {
+  return engine < kDrmEngineCount ? kEngineNames[engine].name : "???";
+}
+
+static int LookupEngine(const char* name, size_t size) {
+  for (size_t i = 0; i < LENGTH(kEngineNames); i++) {
+    if ((strlen(kEngineNames[i].name) == size &&
+         !memcmp(kEngineNames[i].name, name, size)) ||
+        (strlen(kEngineNames[i].engine_class) == size &&
+         !memcmp(kEngineNames[i].engine_class, name, size)))
+      return (int)i;
+  }
+  return -1;
+}
+
+static bool StartsWith(const char* key, size_t key_size, const char* prefix,
+                       size_t* prefix_size) {
+  *prefix_size = strlen(prefix);
+  return key_size > *prefix_size && !memcmp(key, prefix, *prefix_size);
+}
+
+static void ParseLine(const char* key, size_t key_size, uint64_t value,
+                      struct DrmFdinfo* fdinfo) {
+  static const char kClientId[] = "drm-client-id";
+  if (key_size == sizeof(kClientId) - 1 && !memcmp(key, kClientId, key_size)) {
+    fdinfo->client_id = value;
+    return;
+  }
+
+  size_t prefix_size;
+  uint64_t* target = NULL;
+  bool cycles = false;
+  int engine = -1;
+  if (StartsWith(key, key_size, "drm-engine-capacity-", &prefix_size)) {
+    engine = LookupEngine(key + prefix_size, key_size - prefix_size);
+    if (engine != -1) fdinfo->engines[engine].capacity = (uint32_t)value;
+    return;
+  } else if (StartsWith(key, key_size, "drm-engine-", &prefix_size)) {
+    engine = LookupEngine(key + prefix_size, key_size - prefix_size);
+    if (engine != -1) target = &fdinfo->engines[engine].busy;
+  } else if (StartsWith(key, key_size, "drm-total-cycles-", &prefix_size)) {
+    engine = LookupEngine(key + prefix_size, key_size - prefix_size);
+    if (engine != -1) target = &fdinfo->engines[engine].total;
+    cycles = true;
+  } else if (StartsWith(key, key_size, "drm-cycles-", &prefix_size)) {
+    engine = LookupEngine(key + prefix_size, key_size - prefix_size);
+    if (engine != -1) target = &fdinfo->engines[engine].busy;
+    cycles = true;
+  }
+
+  if (!target) return;
+  *target = value;
+  fdinfo->engines[engine].present = true;
+  fdinfo->engines[engine].cycles |= cycles;
+}
+
+bool DrmFdinfoParse(const char* text, size_t size, struct DrmFdinfo* fdinfo) {
+  *fdinfo = (struct DrmFdinfo){0};
+  bool drm_client = false;
+  const char* end = text + size;
+  while (text < end) {
+    const char* eol = memchr(text, '\n', (size_t)(end - text));
+    if (!eol) eol = end;
+    const char* colon = memchr(text, ':', (size_t)(eol - text));
+    if (colon && colon - text > 4 && !memcmp(text, "drm-", 4)) {
+      const char* ptr = colon + 1;
+      while (ptr < eol && (*ptr == ' ' || *ptr == '\t')) ptr++;
+      uint64_t value = 0;
+      bool has_value = false;
+      for (; ptr < eol && '0' <= *ptr && *ptr <= '9'; ptr++) {
+        value = value * 10 + (uint64_t)(*ptr - '0');
+        has_value = true;
+      }
+      if (has_value) ParseLine(text, (size_t)(colon - text), value, fdinfo);
+      drm_client = true;
+    }
+    text = eol + 1;
+  }
+
+  for (size_t i = 0; i < LENGTH(fdinfo->engines); i++) {
+    if (!fdinfo->engines[i].capacity) fdinfo->engines[i].capacity = 1;
+  }
+  return drm_client;
+}
+
+void DrmFdinfoUtilization(const struct DrmFdinfo* prev,
+                          const struct DrmFdinfo* next,
+                          double utilization[kDrmEngineCount]) {
+  for (size_t i = 0; i < kDrmEngineCount; i++) {
+    const struct DrmFdinfoEngine* a = &prev->engines[i];
+    const struct DrmFdinfoEngine* b = &next->engines[i];
+    utilization[i] = 0;
+    if (!a->present || !b->present || b->busy < a->busy) continue;
+
+    double busy = (double)(b->busy - a->busy);
+    double total = b->cycles
+                       ? (double)(b->total - a->total)
+                       : (double)(next->timestamp_ns - prev->timestamp_ns);
+    if (total <= 0) continue;
+    utilization[i] = busy / total / b->capacity;
+    if (utilization[i] > 1) utilization[i] = 1;
+  }
+}
+
+static bool ReadFdinfo(struct EngineSampler* engine_sampler,
+                       struct DrmFdinfo* fdinfo) {
+  char buffer[4096];
+  ssize_t size = pread(engine_sampler->fdinfo, buffer, sizeof(buffer), 0);
+  if (size < 0) {
+    fprintf(stderr, "Failed to read fdinfo: %s\n", strerror(errno));
+    return false;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (!DrmFdinfoParse(buffer, (size_t)size, fdinfo)) {
+    fprintf(stderr, "Fdinfo does not describe a drm client\n");
+    return false;
+  }
+  fdinfo->timestamp_ns =
+      (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  return true;
+}
+
+struct EngineSampler* EngineSamplerCreate(int fd) {
+  struct EngineSampler* engine_sampler = malloc(sizeof(struct EngineSampler));
+  if (!engine_sampler) {
+    fprintf(stderr, "Failed to allocate engine sampler: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *engine_sampler = (struct EngineSampler){0};
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+  engine_sampler->fdinfo = open(path, O_RDONLY | O_CLOEXEC);
+  if (engine_sampler->fdinfo == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_engine_sampler;
+  }
+
+  if (!ReadFdinfo(engine_sampler, &engine_sampler->last)) {
+    fprintf(stderr, "Failed to read initial fdinfo sample\n");
+    goto rollback_fdinfo;
+  }
+  return engine_sampler;
+
+rollback_fdinfo:
+  close(engine_sampler->fdinfo);
+rollback_engine_sampler:
+  free(engine_sampler);
+  return NULL;
+}
+
+bool EngineSamplerSample(struct EngineSampler* engine_sampler,
+                         double utilization[kDrmEngineCount]) {
+  struct DrmFdinfo fdinfo;
+  if (!ReadFdinfo(engine_sampler, &fdinfo)) return false;
+  DrmFdinfoUtilization(&engine_sampler->last, &fdinfo, utilization);
+  engine_sampler->last = fdinfo;
+  return true;
+}
+
+void EngineSamplerDestroy(struct EngineSampler* engine_sampler) {
+  close(engine_sampler->fdinfo);
+  free(engine_sampler);
+}
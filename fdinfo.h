@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_FDINFO_H_
+#define STREAMER_FDINFO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum DrmEngine {
+  kDrmEngineRender = 0,
+  kDrmEngineCopy,
+  kDrmEngineVideo,
+  kDrmEngineVideoEnhance,
+  kDrmEngineCompute,
+  kDrmEngineCount,
+};
+
+// Snapshot of a single drm client as reported in /proc/<pid>/fdinfo/<fd>. The
+// i915 driver reports busy time in nanoseconds (drm-engine-<name>), while the
+// xe driver reports busy and total gpu cycles (drm-cycles-<class> and
+// drm-total-cycles-<class>).
+struct DrmFdinfo {
+  uint64_t client_id;
+  uint64_t timestamp_ns;
+  struct DrmFdinfoEngine {
+    bool present;
+    bool cycles;
+    uint64_t busy;
+    uint64_t total;
+    uint32_t capacity;
+  } engines[kDrmEngineCount];
+};
+
+struct EngineSampler;
+
+const char* DrmEngineName(enum DrmEngine engine);
+bool DrmFdinfoParse(const char* text, size_t size, struct DrmFdinfo* fdinfo);
+void DrmFdinfoUtilization(const struct DrmFdinfo* prev,
+                          const struct DrmFdinfo* next,
+                          double utilization[kDrmEngineCount]);
+
+struct EngineSampler* EngineSamplerCreate(int fd);
+bool EngineSamplerSample(struct EngineSampler* engine_sampler,
+                         double utilization[kDrmEngineCount]);
+void EngineSamplerDestroy(struct EngineSampler* engine_sampler);
+
+#endif  // STREAMER_FDINFO_H_
@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fec.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#endif
+
+// Enough to ride out reordering across a couple of frames, while still
+// declaring a frame lost before the next keyframe is due.
+#define FEC_DECODER_GROUPS 8
+
+typedef void (*GfMulAddFn)(uint8_t* dst, const uint8_t* src, uint8_t c,
+                           size_t size);
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual primitive polynomial for GF(2^8)
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+// Products of every coefficient with every low and high nibble, which is
+// exactly the layout pshufb wants.
+static uint8_t gf_mul_lo[256][16] __attribute__((aligned(16)));
+static uint8_t gf_mul_hi[256][16] __attribute__((aligned(16)));
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+static GfMulAddFn gf_mul_add;
+
+struct FecEncoder {
+  struct FecConfig config;
+  uint32_t group;
+  uint8_t* shards;
+  size_t shards_alloc;
+};
+
+struct FecGroup {
+  bool used;
+  bool done;
+  uint32_t group;
+  uint32_t size;
+  uint16_t shard_size;
+  uint8_t parity_shards;
+  uint8_t scheme;
+  size_t data_shards;
+  size_t blocks;
+  size_t blocks_done;
+  bool recovered;
+  uint8_t* buffer;
+  size_t buffer_alloc;
+  // Per shard presence, followed by per block data and parity counters.
+  uint8_t* present;
+  size_t present_alloc;
+  uint16_t* counters;
+  size_t counters_alloc;
+};
+
+struct FecDecoder {
+  struct FecGroup groups[FEC_DECODER_GROUPS];
+  struct FecDecoderStats stats;
+};
+
+static uint8_t GfMul(uint8_t a, uint8_t b) {
+  if (!a || !b) return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t GfInv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+static void GfMulAddScalar(uint8_t* dst, const uint8_t* src, uint8_t c,
+                           size_t size) {
+  const uint8_t* lo = gf_mul_lo[c];
+  const uint8_t* hi = gf_mul_hi[c];
+  for (size_t i = 0; i < size; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#ifdef FEC_X86
+__attribute__((target("ssse3"))) static void GfMulAddSsse3(
+    uint8_t* dst, const uint8_t* src, uint8_t c, size_t size) {
+  const __m128i lo = _mm_load_si128((const __m128i*)gf_mul_lo[c]);
+  const __m128i hi = _mm_load_si128((const __m128i*)gf_mul_hi[c]);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+    __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+  GfMulAddScalar(dst + i, src + i, c, size - i);
+}
+
+__attribute__((target("avx2"))) static void GfMulAddAvx2(uint8_t* dst,
+                                                         const uint8_t* src,
+                                                         uint8_t c,
+                                                         size_t size) {
+  const __m256i lo = _mm256_broadcastsi128_si256(
+      _mm_load_si128((const __m128i*)gf_mul_lo[c]));
+  const __m256i hi = _mm256_broadcastsi128_si256(
+      _mm_load_si128((const __m128i*)gf_mul_hi[c]));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+    __m256i h = _mm256_shuffle_epi8(
+        hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+  // The tail stays in vex encoded instructions, calling into the legacy sse
+  // kernel here costs a state transition on every shard.
+  if (i + 16 <= size) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i m = _mm256_castsi256_si128(mask);
+    __m128i l =
+        _mm_shuffle_epi8(_mm256_castsi256_si128(lo), _mm_and_si128(s, m));
+    __m128i h = _mm_shuffle_epi8(_mm256_castsi256_si128(hi),
+                                 _mm_and_si128(_mm_srli_epi64(s, 4), m));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    i += 16;
+  }
+  GfMulAddScalar(dst + i, src + i, c, size - i);
+}
+#endif  // FEC_X86
+
+static void GfInit(void) {
+  unsigned value = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = gf_exp[i + 255] = (uint8_t)value;
+    gf_log[value] = (uint8_t)i;
+    value <<= 1;
+    if (value & 0x100) value ^= 0x11d;
+  }
+  for (int c = 0; c < 256; c++) {
+    for (int x = 0; x < 16; x++) {
+      gf_mul_lo[c][x] = GfMul((uint8_t)c, (uint8_t)x);
+      gf_mul_hi[c][x] = GfMul((uint8_t)c, (uint8_t)(x << 4));
+    }
+  }
+  gf_mul_add = GfMulAddScalar;
+#ifdef FEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) gf_mul_add = GfMulAddSsse3;
+  if (__builtin_cpu_supports("avx2")) gf_mul_add = GfMulAddAvx2;
+#endif  // FEC_X86
+}
+
+bool FecSetKernel(enum FecKernel kernel) {
+  pthread_once(&gf_once, GfInit);
+  switch (kernel) {
+    case kFecKernelScalar:
+      gf_mul_add = GfMulAddScalar;
+      return true;
+#ifdef FEC_X86
+    case kFecKernelSsse3:
+      if (!__builtin_cpu_supports("ssse3")) return false;
+      gf_mul_add = GfMulAddSsse3;
+      return true;
+    case kFecKernelAvx2:
+      if (!__builtin_cpu_supports("avx2")) return false;
+      gf_mul_add = GfMulAddAvx2;
+      return true;
+#endif  // FEC_X86
+    default:
+      return false;
+  }
+}
+
+// Parity rows are x_i = FEC_MAX_DATA_SHARDS + i and data columns y_j = j,
+// which never collide, so every square submatrix of 1 / (x_i + y_j) is
+// invertible. Xor parity is the degenerate all-ones row.
+static uint8_t ParityCoefficient(uint8_t scheme, size_t parity, size_t data) {
+  if (scheme == kFecSchemeXor) return 1;
+  return GfInv((uint8_t)((FEC_MAX_DATA_SHARDS + parity) ^ data));
+}
+
+static size_t CountShards(size_t size, size_t shard_size) {
+  return (size + shard_size - 1) / shard_size;
+}
+
+static size_t BlockDataShards(size_t data_shards, size_t block) {
+  size_t remaining = data_shards - block * FEC_MAX_DATA_SHARDS;
+  return remaining < FEC_MAX_DATA_SHARDS ? remaining : FEC_MAX_DATA_SHARDS;
+}
+
+static bool Reserve(void** data, size_t* alloc, size_t count, size_t size) {
+  if (count <= *alloc) return true;
+  size_t new_alloc = *alloc ? *alloc : 16;
+  while (new_alloc < count) new_alloc *= 2;
+  void* new_data = realloc(*data, new_alloc * size);
+  if (!new_data) {
+    fprintf(stderr, "Failed to reallocate buffer: %s\n", strerror(errno));
+    return false;
+  }
+  *data = new_data;
+  *alloc = new_alloc;
+  return true;
+}
+
+struct FecEncoder* FecEncoderCreate(const struct FecConfig* config) {
+  if (!config->shard_size) {
+    fprintf(stderr, "Invalid fec shard size\n");
+    return NULL;
+  }
+  struct FecEncoder* fec_encoder = malloc(sizeof(struct FecEncoder));
+  if (!fec_encoder) {
+    fprintf(stderr, "Failed to allocate fec encoder: %s\n", strerror(errno));
+    return NULL;
+  }
+  *fec_encoder = (struct FecEncoder){.config = *config};
+  pthread_once(&gf_once, GfInit);
+  return fec_encoder;
+}
+
+static size_t ParityShards(const struct FecEncoder* fec_encoder,
+                           size_t data_shards, uint8_t flags) {
+  uint8_t percent = flags & PROTO_FLAG_KEYFRAME
+                        ? fec_encoder->config.keyframe_parity_percent
+                        : fec_encoder->config.parity_percent;
+  if (!percent) return 0;
+  if (fec_encoder->config.scheme == kFecSchemeXor) return 1;
+  size_t block_shards =
+      data_shards < FEC_MAX_DATA_SHARDS ? data_shards : FEC_MAX_DATA_SHARDS;
+  size_t result = (block_shards * percent + 99) / 100;
+  return result < FEC_MAX_PARITY_SHARDS ? result : FEC_MAX_PARITY_SHARDS;
+}
+
+bool FecEncoderEncode(struct FecEncoder* fec_encoder, const struct iovec* iov,
+                      size_t count, uint8_t flags, FecCopy copy,
+                      void* copy_user, FecSend send, void* user) {
+  size_t shard_size = fec_encoder->config.shard_size;
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) size += iov[i].iov_len;
+  size_t data_shards = CountShards(size, shard_size);
+  size_t blocks = CountShards(data_shards, FEC_MAX_DATA_SHARDS);
+  size_t parity_shards = ParityShards(fec_encoder, data_shards, flags);
+  if (!size || size > UINT32_MAX || blocks > 256) {
+    fprintf(stderr, "Invalid record size for fec\n");
+    return false;
+  }
+  if (!Reserve((void**)&fec_encoder->shards, &fec_encoder->shards_alloc,
+               (data_shards + parity_shards) * shard_size, 1)) {
+    fprintf(stderr, "Failed to reserve shards\n");
+    return false;
+  }
+
+  uint8_t* data = fec_encoder->shards;
+  for (size_t i = 0, offset = 0; i < count; offset += iov[i++].iov_len) {
+    if (copy)
+      copy(copy_user, data + offset, iov[i].iov_base, iov[i].iov_len);
+    else
+      memcpy(data + offset, iov[i].iov_base, iov[i].iov_len);
+  }
+  memset(data + size, 0, data_shards * shard_size - size);
+
+  uint8_t* parity = data + data_shards * shard_size;
+  struct FecHeader header = {
+      .group = fec_encoder->group++,
+      .size = (uint32_t)size,
+      .shard_size = (uint16_t)shard_size,
+      .parity_shards = (uint8_t)parity_shards,
+      .scheme = (uint8_t)fec_encoder->config.scheme,
+      .flags = flags,
+  };
+  for (size_t block = 0; block < blocks; block++) {
+    size_t block_shards = BlockDataShards(data_shards, block);
+    const uint8_t* block_data = data + block * FEC_MAX_DATA_SHARDS * shard_size;
+
+    // Each data shard is streamed through all parity shards while it is hot in
+    // cache, parity of a block fits into l2 comfortably.
+    memset(parity, 0, parity_shards * shard_size);
+    for (size_t j = 0; j < block_shards; j++) {
+      for (size_t i = 0; i < parity_shards; i++) {
+        gf_mul_add(parity + i * shard_size, block_data + j * shard_size,
+                   ParityCoefficient(header.scheme, i, j), shard_size);
+      }
+    }
+
+    header.block = (uint8_t)block;
+    for (size_t i = 0; i < block_shards + parity_shards; i++) {
+      header.index = (uint8_t)i;
+      const uint8_t* shard = i < block_shards
+                                 ? block_data + i * shard_size
+                                 : parity + (i - block_shards) * shard_size;
+      const struct iovec datagram[] = {
+          {.iov_base = &header, .iov_len = sizeof(header)},
+          {.iov_base = (void*)(uintptr_t)shard, .iov_len = shard_size},
+      };
+      if (!send(user, datagram, LENGTH(datagram))) {
+        fprintf(stderr, "Failed to send fec datagram\n");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void FecEncoderDestroy(struct FecEncoder* fec_encoder) {
+  free(fec_encoder->shards);
+  free(fec_encoder);
+}
+
+struct FecDecoder* FecDecoderCreate(void) {
+  struct FecDecoder* fec_decoder = calloc(1, sizeof(struct FecDecoder));
+  if (!fec_decoder) {
+    fprintf(stderr, "Failed to allocate fec decoder: %s\n", strerror(errno));
+    return NULL;
+  }
+  pthread_once(&gf_once, GfInit);
+  return fec_decoder;
+}
+
+static bool ResetGroup(struct FecGroup* group, const struct FecHeader* header) {
+  size_t data_shards = CountShards(header->size, header->shard_size);
+  size_t blocks = CountShards(data_shards, FEC_MAX_DATA_SHARDS);
+  size_t shards = data_shards + blocks * header->parity_shards;
+  if (!Reserve((void**)&group->buffer, &group->buffer_alloc,
+               shards * header->shard_size, 1) ||
+      !Reserve((void**)&group->present, &group->present_alloc, shards, 1) ||
+      !Reserve((void**)&group->counters, &group->counters_alloc, blocks * 2,
+               sizeof(uint16_t))) {
+    fprintf(stderr, "Failed to reserve group buffers\n");
+    return false;
+  }
+  memset(group->present, 0, shards);
+  memset(group->counters, 0, blocks * 2 * sizeof(uint16_t));
+  group->used = true;
+  group->done = false;
+  group->group = header->group;
+  group->size = header->size;
+  group->shard_size = header->shard_size;
+  group->parity_shards = header->parity_shards;
+  group->scheme = header->scheme;
+  group->data_shards = data_shards;
+  group->blocks = blocks;
+  group->blocks_done = 0;
+  group->recovered = false;
+  return true;
+}
+
+static uint8_t* ShardAt(const struct FecGroup* group, size_t block,
+                        size_t index) {
+  size_t block_shards = BlockDataShards(group->data_shards, block);
+  size_t position = index < block_shards
+                        ? block * FEC_MAX_DATA_SHARDS + index
+                        : group->data_shards + block * group->parity_shards +
+                              index - block_shards;
+  return group->buffer + position * group->shard_size;
+}
+
+static bool IsPresent(const struct FecGroup* group, size_t block,
+                      size_t index) {
+  size_t offset = (size_t)(ShardAt(group, block, index) - group->buffer);
+  return group->present[offset / group->shard_size];
+}
+
+// Inverts an n by n matrix over GF(2^8) in place with Gauss-Jordan.
+static bool InvertMatrix(uint8_t* matrix, size_t n) {
+  uint8_t inverse[FEC_MAX_PARITY_SHARDS * FEC_MAX_PARITY_SHARDS];
+  memset(inverse, 0, n * n);
+  for (size_t i = 0; i < n; i++) inverse[i * n + i] = 1;
+  for (size_t col = 0; col < n; col++) {
+    size_t pivot = col;
+    while (pivot < n && !matrix[pivot * n + col]) pivot++;
+    if (pivot == n) return false;
+    for (size_t k = 0; k < n && pivot != col; k++) {
+      uint8_t temp = matrix[col * n + k];
+      matrix[col * n + k] = matrix[pivot * n + k];
+      matrix[pivot * n + k] = temp;
+      temp = inverse[col * n + k];
+      inverse[col * n + k] = inverse[pivot * n + k];
+      inverse[pivot * n + k] = temp;
+    }
+    uint8_t scale = GfInv(matrix[col * n + col]);
+    for (size_t k = 0; k < n; k++) {
+      matrix[col * n + k] = GfMul(matrix[col * n + k], scale);
+      inverse[col * n + k] = GfMul(inverse[col * n + k], scale);
+    }
+    for (size_t row = 0; row < n; row++) {
+      uint8_t factor = matrix[row * n + col];
+      if (row == col || !factor) continue;
+      for (size_t k = 0; k < n; k++) {
+        matrix[row * n + k] ^= GfMul(factor, matrix[col * n + k]);
+        inverse[row * n + k] ^= GfMul(factor, inverse[col * n + k]);
+      }
+    }
+  }
+  memcpy(matrix, inverse, n * n);
+  return true;
+}
+
+static bool RecoverBlock(struct FecGroup* group, size_t block) {
+  size_t block_shards = BlockDataShards(group->data_shards, block);
+  size_t missing[FEC_MAX_PARITY_SHARDS];
+  size_t parity[FEC_MAX_PARITY_SHARDS];
+  size_t nmissing = 0;
+  for (size_t j = 0; j < block_shards; j++) {
+    if (!IsPresent(group, block, j)) missing[nmissing++] = j;
+  }
+  if (!nmissing) return true;
+  for (size_t i = 0, nparity = 0; nparity < nmissing; i++) {
+    if (IsPresent(group, block, block_shards + i)) parity[nparity++] = i;
+  }
+
+  uint8_t matrix[FEC_MAX_PARITY_SHARDS * FEC_MAX_PARITY_SHARDS];
+  for (size_t r = 0; r < nmissing; r++) {
+    for (size_t c = 0; c < nmissing; c++) {
+      matrix[r * nmissing + c] =
+          ParityCoefficient(group->scheme, parity[r], missing[c]);
+    }
+  }
+  if (!InvertMatrix(matrix, nmissing)) {
+    fprintf(stderr, "Failed to invert recovery matrix\n");
+    return false;
+  }
+
+  // Received parity shards are reduced to syndromes in place by removing
+  // contributions of the data shards that did arrive.
+  for (size_t r = 0; r < nmissing; r++) {
+    uint8_t* syndrome = ShardAt(group, block, block_shards + parity[r]);
+    for (size_t j = 0, m = 0; j < block_shards; j++) {
+      if (m < nmissing && missing[m] == j) {
+        m++;
+        continue;
+      }
+      gf_mul_add(syndrome, ShardAt(group, block, j),
+                 ParityCoefficient(group->scheme, parity[r], j),
+                 group->shard_size);
+    }
+  }
+  for (size_t c = 0; c < nmissing; c++) {
+    uint8_t* shard = ShardAt(group, block, missing[c]);
+    memset(shard, 0, group->shard_size);
+    for (size_t r = 0; r < nmissing; r++) {
+      gf_mul_add(shard, ShardAt(group, block, block_shards + parity[r]),
+                 matrix[c * nmissing + r], group->shard_size);
+    }
+  }
+  group->recovered = true;
+  return true;
+}
+
+bool FecDecoderPush(struct FecDecoder* fec_decoder, const void* datagram,
+                    size_t size, const void** record, size_t* record_size) {
+  struct FecHeader header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, datagram, sizeof(header));
+  if (!header.shard_size || size != sizeof(header) + header.shard_size ||
+      !header.size || header.parity_shards > FEC_MAX_PARITY_SHARDS ||
+      (header.scheme == kFecSchemeXor && header.parity_shards > 1) ||
+      header.scheme > kFecSchemeReedSolomon)
+    return false;
+  size_t data_shards = CountShards(header.size, header.shard_size);
+  size_t blocks = CountShards(data_shards, FEC_MAX_DATA_SHARDS);
+  if (header.block >= blocks ||
+      header.index >= BlockDataShards(data_shards, header.block) +
+                          header.parity_shards)
+    return false;
+
+  struct FecGroup* group =
+      &fec_decoder->groups[header.group % FEC_DECODER_GROUPS];
+  if (group->used && group->group != header.group) {
+    // Late datagrams of an evicted group are simply dropped.
+    if ((int32_t)(header.group - group->group) < 0) return false;
+    if (!group->done) fec_decoder->stats.lost_frames++;
+    group->used = false;
+  }
+  if (!group->used && !ResetGroup(group, &header)) return false;
+  if (group->done || group->size != header.size ||
+      group->shard_size != header.shard_size ||
+      group->parity_shards != header.parity_shards ||
+      group->scheme != header.scheme)
+    return false;
+
+  uint8_t* shard = ShardAt(group, header.block, header.index);
+  size_t position = (size_t)(shard - group->buffer) / group->shard_size;
+  if (group->present[position]) return false;
+  memcpy(shard, (const uint8_t*)datagram + sizeof(header), header.shard_size);
+  group->present[position] = 1;
+
+  size_t block_shards = BlockDataShards(group->data_shards, header.block);
+  uint16_t* counters = group->counters + header.block * 2;
+  counters[header.index < block_shards ? 0 : 1]++;
+  // Shards are counted one by one, so the total hits the block size exactly
+  // once, and that is when the block becomes decodable.
+  if (counters[0] + counters[1] != block_shards) return false;
+  if (counters[0] < block_shards) {
+    fec_decoder->stats.recovered_shards += block_shards - counters[0];
+    if (!RecoverBlock(group, header.block)) return false;
+  }
+  if (++group->blocks_done < group->blocks) return false;
+
+  group->done = true;
+  fec_decoder->stats.frames++;
+  if (group->recovered) fec_decoder->stats.recovered_frames++;
+  *record = group->buffer;
+  *record_size = group->size;
+  return true;
+}
+
+void FecDecoderGetStats(const struct FecDecoder* fec_decoder,
+                        struct FecDecoderStats* stats) {
+  *stats = fec_decoder->stats;
+}
+
+void FecDecoderDestroy(struct FecDecoder* fec_decoder) {
+  for (size_t i = 0; i < LENGTH(fec_decoder->groups); i++) {
+    free(fec_decoder->groups[i].buffer);
+    free(fec_decoder->groups[i].present);
+    free(fec_decoder->groups[i].counters);
+  }
+  free(fec_decoder);
+}
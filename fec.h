@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_FEC_H_
+#define STREAMER_FEC_H_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Records are cut into blocks of up to this many data shards, each block is
+// protected separately so that shard indices fit into a byte.
+#define FEC_MAX_DATA_SHARDS 128
+#define FEC_MAX_PARITY_SHARDS 128
+
+enum FecScheme {
+  // Single parity shard per block, recovers one lost shard.
+  kFecSchemeXor = 0,
+  // Systematic Reed-Solomon over GF(2^8) with a Cauchy parity matrix,
+  // recovers as many lost shards per block as there are parity shards.
+  kFecSchemeReedSolomon,
+};
+
+enum FecKernel {
+  kFecKernelScalar = 0,
+  kFecKernelSsse3,
+  kFecKernelAvx2,
+};
+
+// Every datagram starts with this header, followed by shard_size bytes of
+// shard. Data shards come first in a block, then parity shards.
+struct FecHeader {
+  uint32_t group;
+  uint32_t size;
+  uint16_t shard_size;
+  uint8_t block;
+  uint8_t index;
+  uint8_t parity_shards;
+  uint8_t scheme;
+  uint8_t flags;
+  uint8_t reserved;
+};
+
+static_assert(sizeof(struct FecHeader) == 16 * sizeof(uint8_t),
+              "Suspicious fec header struct size");
+
+// Parity is given in percent of data shards per block, keyframes are
+// flagged with PROTO_FLAG_KEYFRAME and typically get more of it.
+struct FecConfig {
+  enum FecScheme scheme;
+  uint16_t shard_size;
+  uint8_t parity_percent;
+  uint8_t keyframe_parity_percent;
+};
+
+struct FecDecoderStats {
+  uint64_t frames;
+  uint64_t recovered_frames;
+  uint64_t recovered_shards;
+  uint64_t lost_frames;
+};
+
+struct FecEncoder;
+struct FecDecoder;
+
+// Called once per datagram, header and shard are passed as separate iovs.
+typedef bool (*FecSend)(void* user, const struct iovec* iov, size_t count);
+// Replaces memcpy when gathering records into shards, e.g. for encryption.
+typedef void (*FecCopy)(void* user, void* dst, const void* src, size_t size);
+
+// Kernels are picked by cpu features on first use, this overrides the choice
+// e.g. for benchmarks. Returns false if the cpu lacks the instructions.
+bool FecSetKernel(enum FecKernel kernel);
+
+struct FecEncoder* FecEncoderCreate(const struct FecConfig* config);
+// Copy may be NULL.
+bool FecEncoderEncode(struct FecEncoder* fec_encoder, const struct iovec* iov,
+                      size_t count, uint8_t flags, FecCopy copy,
+                      void* copy_user, FecSend send, void* user);
+void FecEncoderDestroy(struct FecEncoder* fec_encoder);
+
+// Record stays valid until the next push. Groups that are not completed
+// before a few newer ones arrive are counted as lost.
+struct FecDecoder* FecDecoderCreate(void);
+bool FecDecoderPush(struct FecDecoder* fec_decoder, const void* datagram,
+                    size_t size, const void** record, size_t* record_size);
+void FecDecoderGetStats(const struct FecDecoder* fec_decoder,
+                        struct FecDecoderStats* stats);
+void FecDecoderDestroy(struct FecDecoder* fec_decoder);
+
+#endif  // STREAMER_FEC_H_
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fec.h"
+#include "proto.h"
+
+// Keyframes of a typical low latency stream are several times the size of the
+// frames in between, and come once per second at 60 fps.
+#define KEYFRAME_INTERVAL 60
+#define KEYFRAME_SCALE 4
+
+struct LossChannel {
+  struct FecDecoder* fec_decoder;
+  uint64_t random;
+  uint32_t loss_permille;
+  uint64_t datagrams;
+  uint64_t dropped;
+  uint64_t bytes;
+  size_t mismatches;
+  uint8_t* expected;
+};
+
+static uint64_t NanosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t XorShift(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static size_t FrameSize(size_t frame, size_t frame_size) {
+  return frame % KEYFRAME_INTERVAL ? frame_size : frame_size * KEYFRAME_SCALE;
+}
+
+static void FillFrame(uint8_t* data, size_t size, size_t frame) {
+  uint64_t state = frame * 0x9e3779b97f4a7c15ull + 1;
+  for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+    uint64_t word = XorShift(&state);
+    memcpy(data + i, &word,
+           size - i < sizeof(word) ? size - i : sizeof(word));
+  }
+}
+
+static bool CountDatagram(void* user, const struct iovec* iov, size_t count) {
+  struct LossChannel* channel = user;
+  for (size_t i = 0; i < count; i++) channel->bytes += iov[i].iov_len;
+  channel->datagrams++;
+  return true;
+}
+
+static bool LoseDatagram(void* user, const struct iovec* iov, size_t count) {
+  struct LossChannel* channel = user;
+  channel->datagrams++;
+  if (XorShift(&channel->random) % 1000 < channel->loss_permille) {
+    channel->dropped++;
+    return true;
+  }
+
+  uint8_t datagram[sizeof(struct FecHeader) + UINT16_MAX];
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(datagram + size, iov[i].iov_base, iov[i].iov_len);
+    size += iov[i].iov_len;
+  }
+  const void* record;
+  size_t record_size;
+  if (!FecDecoderPush(channel->fec_decoder, datagram, size, &record,
+                      &record_size))
+    return true;
+
+  // Frame number is smuggled in the first bytes of every record.
+  uint64_t frame;
+  memcpy(&frame, record, sizeof(frame));
+  FillFrame(channel->expected, record_size, frame);
+  memcpy(channel->expected, &frame, sizeof(frame));
+  if (memcmp(record, channel->expected, record_size)) channel->mismatches++;
+  return true;
+}
+
+static bool BenchEncode(const char* name, const struct FecConfig* config,
+                        size_t frame_size, size_t frames) {
+  static const char* const kKernelNames[] = {"scalar", "ssse3", "avx2"};
+  uint8_t* data = malloc(frame_size);
+  if (!data) {
+    fprintf(stderr, "Failed to allocate frame: %s\n", strerror(errno));
+    return false;
+  }
+  FillFrame(data, frame_size, 0);
+  struct iovec iov = {.iov_base = data, .iov_len = frame_size};
+
+  bool result = true;
+  for (size_t kernel = 0; kernel < LENGTH(kKernelNames); kernel++) {
+    if (!FecSetKernel((enum FecKernel)kernel)) continue;
+    struct FecEncoder* fec_encoder = FecEncoderCreate(config);
+    if (!fec_encoder) {
+      result = false;
+      break;
+    }
+    struct LossChannel channel = {0};
+    uint64_t started = NanosNow();
+    for (size_t i = 0; i < frames && result; i++) {
+      result = FecEncoderEncode(fec_encoder, &iov, 1, 0, NULL, NULL,
+                                CountDatagram, &channel);
+    }
+    uint64_t elapsed = NanosNow() - started;
+    FecEncoderDestroy(fec_encoder);
+    if (!result) break;
+    double seconds = (double)elapsed / 1e9;
+    printf("%s %s: %.2f Gbit/s, %.1f%% overhead\n", name, kKernelNames[kernel],
+           (double)frames * (double)frame_size * 8 / seconds / 1e9,
+           ((double)channel.bytes / ((double)frames * (double)frame_size) -
+            1) * 100);
+  }
+  free(data);
+  return result;
+}
+
+static bool BenchLoss(const struct FecConfig* config, uint32_t loss_permille,
+                      size_t frame_size, size_t frames) {
+  size_t max_size = frame_size * KEYFRAME_SCALE;
+  uint8_t* data = malloc(max_size);
+  uint8_t* expected = malloc(max_size);
+  struct FecEncoder* fec_encoder = FecEncoderCreate(config);
+  struct FecDecoder* fec_decoder = FecDecoderCreate();
+  bool result = data && expected && fec_encoder && fec_decoder;
+  if (!data || !expected)
+    fprintf(stderr, "Failed to allocate frame: %s\n", strerror(errno));
+
+  struct LossChannel channel = {
+      .fec_decoder = fec_decoder,
+      .random = 0x2545f4914f6cdd1dull,
+      .loss_permille = loss_permille,
+      .expected = expected,
+  };
+  size_t lost_keyframes = 0;
+  for (size_t i = 0; i < frames && result; i++) {
+    size_t size = FrameSize(i, frame_size);
+    FillFrame(data, size, i);
+    uint64_t frame = i;
+    memcpy(data, &frame, sizeof(frame));
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    uint8_t flags = i % KEYFRAME_INTERVAL ? 0 : PROTO_FLAG_KEYFRAME;
+    struct FecDecoderStats before;
+    FecDecoderGetStats(fec_decoder, &before);
+    result = FecEncoderEncode(fec_encoder, &iov, 1, flags, NULL, NULL,
+                              LoseDatagram, &channel);
+    struct FecDecoderStats after;
+    FecDecoderGetStats(fec_decoder, &after);
+    if (flags && after.frames == before.frames) lost_keyframes++;
+  }
+
+  if (result) {
+    struct FecDecoderStats stats;
+    FecDecoderGetStats(fec_decoder, &stats);
+    uint64_t lost = frames - stats.frames;
+    printf(
+        "%4.1f%% loss: %5.2f%% frames lost (%zu of %zu keyframes), "
+        "%" PRIu64 " recovered with %" PRIu64 " shards\n",
+        (double)loss_permille / 10,
+        (double)lost * 100 / (double)frames, lost_keyframes,
+        (frames + KEYFRAME_INTERVAL - 1) / KEYFRAME_INTERVAL,
+        stats.recovered_frames, stats.recovered_shards);
+    if (channel.mismatches) {
+      fprintf(stderr, "Recovered %zu corrupted frames\n", channel.mismatches);
+      result = false;
+    }
+  }
+  if (fec_decoder) FecDecoderDestroy(fec_decoder);
+  if (fec_encoder) FecEncoderDestroy(fec_encoder);
+  free(expected);
+  free(data);
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  size_t frame_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 65536;
+  size_t frames = argc > 2 ? strtoul(argv[2], NULL, 10) : 6000;
+  if (frame_size < sizeof(uint64_t) ||
+      frame_size * KEYFRAME_SCALE > UINT32_MAX || !frames) {
+    fprintf(stderr, "Usage: %s [frame_size] [frames]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  static const struct {
+    const char* name;
+    struct FecConfig config;
+  } kEncodeConfigs[] = {
+      {"xor", {kFecSchemeXor, 1200, 100, 100}},
+      {"rs 10%", {kFecSchemeReedSolomon, 1200, 10, 10}},
+      {"rs 50%", {kFecSchemeReedSolomon, 1200, 50, 50}},
+  };
+  printf("Encoding %zu frames of %zu bytes\n", frames, frame_size);
+  for (size_t i = 0; i < LENGTH(kEncodeConfigs); i++) {
+    if (!BenchEncode(kEncodeConfigs[i].name, &kEncodeConfigs[i].config,
+                     frame_size, frames))
+      return EXIT_FAILURE;
+  }
+
+  static const uint32_t kLossPermille[] = {10, 50, 100, 200};
+  const struct FecConfig config = {kFecSchemeReedSolomon, 1200, 10, 50};
+  printf("Streaming with rs %u%% parity, %u%% on keyframes\n",
+         config.parity_percent, config.keyframe_parity_percent);
+  for (size_t i = 0; i < LENGTH(kLossPermille); i++) {
+    if (!BenchLoss(&config, kLossPermille[i], frame_size, frames))
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
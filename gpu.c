@@ -34,6 +34,7 @@
 #include <gbm.h>
 #endif  // USE_EGL_MESA_PLATFORM_SURFACELESS
 
+#include "damage.h"
 //#include "toolbox/utils.h"
 
 #define _(...) __VA_ARGS__
@@ -57,8 +58,11 @@ extern const char _binary_luma_glsl_start[];
 extern const char _binary_luma_glsl_end[];
 extern const char _binary_chroma_glsl_start[];
 extern const char _binary_chroma_glsl_end[];
+extern const char _binary_preview_glsl_start[];
+extern const char _binary_preview_glsl_end[];
 
 struct GpuContext {
+  struct GpuContext* parent;
 #ifndef USE_EGL_MESA_PLATFORM_SURFACELESS
   int render_node;
   struct gbm_device* device;
@@ -70,9 +74,14 @@ struct GpuContext {
   PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
   GLuint program_luma;
   GLuint program_chroma;
-  GLint sample_offsets;
+  GLuint program_preview;
+  GLuint linear_sampler;
   GLuint framebuffer;
   GLuint vertices;
+
+  // Damage and cursor history of recent targets, so that a cursor moving over
+  // a static screen only redraws where it was and where it is.
+  struct DamageHistory damage_history;
 };
 
 struct GpuFrameImpl {
@@ -82,6 +91,14 @@ struct GpuFrameImpl {
   GLuint textures[2];
 };
 
+struct GpuReadback {
+  uint32_t width;
+  uint32_t height;
+  GLuint texture;
+  GLuint pixels;
+  EGLSync sync;
+};
+
 const char* EglErrorString(EGLint error) {
   static const char* const egl_error_strings[] = {
       "EGL_SUCCESS",       "EGL_NOT_INITIALIZED",     "EGL_BAD_ACCESS",
@@ -177,6 +194,12 @@ static GLuint CreateGlProgram(const char* vs_begin, const char* vs_end,
   }
   glAttachShader(program, vertex);
   glAttachShader(program, fragment);
+  // Chroma sample step is passed as a constant vertex attribute instead of a
+  // uniform. Attribute values are per-context state, uniforms are per-program
+  // state, and programs are shared between worker contexts.
+  glBindAttribLocation(program, 0, "position");
+  glBindAttribLocation(program, 1, "sample_step");
+  glBindAttribLocation(program, 2, "cursor_rect");
   glLinkProgram(program);
   if (!CheckBuildableProgram(program)) {
     glDeleteProgram(program);
@@ -232,6 +255,62 @@ static const GLfloat* GetRangeVectors(enum YuvRange range) {
   }
 }
 
+static const GLfloat* GetInverseColorspaceMatrix(
+    enum YuvColorspace colorspace) {
+  static const GLfloat rec601[] = {
+      _(1.f, 0.f, 1.402f),
+      _(1.f, -0.344136f, -0.714136f),
+      _(1.f, 1.772f, 0.f),
+  };
+  static const GLfloat rec709[] = {
+      _(1.f, 0.f, 1.5748f),
+      _(1.f, -0.187324f, -0.468124f),
+      _(1.f, 1.8556f, 0.f),
+  };
+  switch (colorspace) {
+    case kItuRec601:
+      return rec601;
+    case kItuRec709:
+      return rec709;
+    default:
+      __builtin_unreachable();
+  }
+}
+
+static bool SetupPreviewUniforms(GLuint program, enum YuvColorspace colorspace,
+                                 enum YuvRange range) {
+  struct {
+    const char* name;
+    GLint location;
+  } uniforms[] = {
+      {.name = "img_luma"},
+      {.name = "img_chroma"},
+      {.name = "colorspace"},
+      {.name = "ranges"},
+  };
+
+  for (size_t i = 0; i < LENGTH(uniforms); i++) {
+    uniforms[i].location = glGetUniformLocation(program, uniforms[i].name);
+    if (uniforms[i].location == -1) {
+      //LOG("Failed to locate %s uniform (%s)", uniforms[i].name, GlErrorString(glGetError()));
+      return false;
+    }
+  }
+
+  glUseProgram(program);
+  glUniform1i(uniforms[0].location, 0);
+  glUniform1i(uniforms[1].location, 1);
+  glUniformMatrix3fv(uniforms[2].location, 1, GL_TRUE,
+                     GetInverseColorspaceMatrix(colorspace));
+  glUniform3fv(uniforms[3].location, 2, GetRangeVectors(range));
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    //LOG("Failed to set preview uniforms (%s)", GlErrorString(glGetError()));
+    return false;
+  }
+  return true;
+}
+
 static bool SetupCommonUniforms(GLuint program, enum YuvColorspace colorspace,
                                 enum YuvRange range) {
   struct {
@@ -241,6 +320,7 @@ static bool SetupCommonUniforms(GLuint program, enum YuvColorspace colorspace,
       {.name = "img_input"},
       {.name = "colorspace"},
       {.name = "ranges"},
+      {.name = "img_cursor"},
   };
 
   for (size_t i = 0; i < LENGTH(uniforms); i++) {
@@ -256,6 +336,7 @@ static bool SetupCommonUniforms(GLuint program, enum YuvColorspace colorspace,
   glUniformMatrix3fv(uniforms[1].location, 1, GL_TRUE,
                      GetColorspaceMatrix(colorspace));
   glUniform3fv(uniforms[2].location, 2, GetRangeVectors(range));
+  glUniform1i(uniforms[3].location, 1);
   GLenum error = glGetError();
   if (error != GL_NO_ERROR) {
     //LOG("Failed to set img_input uniform (%s)", GlErrorString(glGetError()));
@@ -264,6 +345,36 @@ static bool SetupCommonUniforms(GLuint program, enum YuvColorspace colorspace,
   return true;
 }
 
+// Framebuffers and vertex attribute bindings are container objects and context
+// state respectively, so they are not shared between contexts of the same share
+// group and have to be recreated for every context.
+static bool SetupContextObjects(struct GpuContext* gpu_context) {
+  glGenFramebuffers(1, &gpu_context->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, gpu_context->framebuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, gpu_context->vertices);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+  glEnableVertexAttribArray(0);
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    //LOG("Failed to create gl objects (%s)", GlErrorString(error));
+    if (gpu_context->framebuffer)
+      glDeleteFramebuffers(1, &gpu_context->framebuffer);
+    return false;
+  }
+  return true;
+}
+
+static bool WaitForGpu(struct GpuContext* gpu_context) {
+  EGLSync sync = eglCreateSync(gpu_context->display, EGL_SYNC_FENCE, NULL);
+  if (sync == EGL_NO_SYNC) {
+    //LOG("Failed to create egl fence sync (%s)", EglErrorString(eglGetError()));
+    return false;
+  }
+  eglClientWaitSync(gpu_context->display, sync, 0, EGL_FOREVER);
+  eglDestroySync(gpu_context->display, sync);
+  return true;
+}
+
 struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
                                     enum YuvRange range) {
   struct GpuContext* gpu_context = malloc(sizeof(struct GpuContext));
@@ -277,7 +388,6 @@ struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
 #endif  // USE_EGL_MESA_PLATFORM_SURFACELESS
       .display = EGL_NO_DISPLAY,
       .context = EGL_NO_CONTEXT,
-      .sample_offsets = -1,
   };
 
   const char* egl_ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
@@ -395,37 +505,51 @@ struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
   if (!gpu_context->program_chroma ||
       !SetupCommonUniforms(gpu_context->program_chroma, colorspace, range)) {
     //LOG("Failed to create chroma program");
-    goto rollback_program_luma;
-  }
-  gpu_context->sample_offsets =
-      glGetUniformLocation(gpu_context->program_chroma, "sample_offsets");
-  if (gpu_context->sample_offsets == -1) {
-    //LOG("Failed to find sample_offsets uniform (%s)", GlErrorString(glGetError()));
     goto rollback_program_chroma;
   }
 
-  glGenFramebuffers(1, &gpu_context->framebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, gpu_context->framebuffer);
+  gpu_context->program_preview =
+      CreateGlProgram(_binary_vertex_glsl_start, _binary_vertex_glsl_end,
+                      _binary_preview_glsl_start, _binary_preview_glsl_end);
+  if (!gpu_context->program_preview ||
+      !SetupPreviewUniforms(gpu_context->program_preview, colorspace, range)) {
+    //LOG("Failed to create preview program");
+    goto rollback_program_preview;
+  }
+
+  // Frame textures are sampled with nearest filtering for the conversion,
+  // downscaling overrides that with a sampler object instead of touching the
+  // textures.
+  glGenSamplers(1, &gpu_context->linear_sampler);
+  glSamplerParameteri(gpu_context->linear_sampler, GL_TEXTURE_MAG_FILTER,
+                      GL_LINEAR);
+  glSamplerParameteri(gpu_context->linear_sampler, GL_TEXTURE_MIN_FILTER,
+                      GL_LINEAR);
+  glSamplerParameteri(gpu_context->linear_sampler, GL_TEXTURE_WRAP_S,
+                      GL_CLAMP_TO_EDGE);
+  glSamplerParameteri(gpu_context->linear_sampler, GL_TEXTURE_WRAP_T,
+                      GL_CLAMP_TO_EDGE);
+
   glGenBuffers(1, &gpu_context->vertices);
   glBindBuffer(GL_ARRAY_BUFFER, gpu_context->vertices);
   static const GLfloat vertices[] = {0, 0, 1, 0, 1, 1, 0, 1};
   glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-  glEnableVertexAttribArray(0);
-  GLenum error = glGetError();
-  if (error != GL_NO_ERROR) {
-    //LOG("Failed to create gl objects (%s)", GlErrorString(glGetError()));
+  if (!SetupContextObjects(gpu_context)) {
+    //LOG("Failed to create gl objects");
     goto rollback_buffers;
   }
   return gpu_context;
 
 rollback_buffers:
   if (gpu_context->vertices) glDeleteBuffers(1, &gpu_context->vertices);
-  if (gpu_context->framebuffer)
-    glDeleteFramebuffers(1, &gpu_context->framebuffer);
+  if (gpu_context->linear_sampler)
+    glDeleteSamplers(1, &gpu_context->linear_sampler);
+rollback_program_preview:
+  if (gpu_context->program_preview)
+    glDeleteProgram(gpu_context->program_preview);
 rollback_program_chroma:
-  glDeleteProgram(gpu_context->program_chroma);
-rollback_program_luma:
+  if (gpu_context->program_chroma)
+    glDeleteProgram(gpu_context->program_chroma);
   glDeleteProgram(gpu_context->program_luma);
 rollback_context:
   eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -444,6 +568,78 @@ rollback_gpu_context:
   return NULL;
 }
 
+struct GpuContext* GpuContextCreateShared(struct GpuContext* gpu_context) {
+  struct GpuContext* shared_context = malloc(sizeof(struct GpuContext));
+  if (!shared_context) {
+    //LOG("Failed to allocate shared gpu context (%s)", strerror(errno));
+    return NULL;
+  }
+  *shared_context = *gpu_context;
+  shared_context->parent = gpu_context;
+  shared_context->framebuffer = 0;
+  shared_context->damage_history = (struct DamageHistory){0};
+
+  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+    //LOG("Failed to bind egl api (%s)", EglErrorString(eglGetError()));
+    goto rollback_shared_context;
+  }
+
+  static const EGLint context_attribs[] = {
+      _(EGL_CONTEXT_MAJOR_VERSION, 3),
+      _(EGL_CONTEXT_MINOR_VERSION, 1),
+      EGL_NONE,
+  };
+  shared_context->context =
+      eglCreateContext(gpu_context->display, EGL_NO_CONFIG_KHR,
+                       gpu_context->context, context_attribs);
+  if (shared_context->context == EGL_NO_CONTEXT) {
+    //LOG("Failed to create shared egl context (%s)", EglErrorString(eglGetError()));
+    goto rollback_shared_context;
+  }
+
+  if (!eglMakeCurrent(shared_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                      shared_context->context)) {
+    //LOG("Failed to make shared egl context current (%s)", EglErrorString(eglGetError()));
+    goto rollback_context;
+  }
+
+  if (!SetupContextObjects(shared_context)) {
+    //LOG("Failed to create gl objects");
+    goto rollback_context;
+  }
+  return shared_context;
+
+rollback_context:
+  eglMakeCurrent(shared_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  eglDestroyContext(shared_context->display, shared_context->context);
+rollback_shared_context:
+  free(shared_context);
+  return NULL;
+}
+
+bool GpuContextMakeCurrent(struct GpuContext* gpu_context) {
+  if (!eglBindAPI(EGL_OPENGL_ES_API) ||
+      !eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                      gpu_context->context)) {
+    fprintf(stderr, "Failed to make egl context current: %s\n",
+            EglErrorString(eglGetError()));
+    return false;
+  }
+  // Bound api is per-thread state in egl, unlike everything set up inside the
+  // gl context, e.g. the framebuffer binding, which moves along.
+  return true;
+}
+
+void GpuContextReleaseCurrent(struct GpuContext* gpu_context) {
+  eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+}
+
+int GpuContextGetRenderNode(const struct GpuContext* gpu_context) {
+  return gpu_context->render_node;
+}
+
 static void DumpEglImageParams(const EGLAttrib* attribs) {
   for (; *attribs != EGL_NONE; attribs += 2) {
     switch (attribs[0]) {
@@ -675,6 +871,13 @@ struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
     }
   }
 
+  // Textures might be sampled or rendered to from another context of the share
+  // group, and that requires their creation to be complete.
+  if (!WaitForGpu(gpu_context)) {
+    //LOG("Failed to wait for textures creation");
+    goto rollback_textures;
+  }
+
   for (size_t i = 0; i < nplanes; i++)
     gpu_frame_impl->dmabuf_fds[i] = planes[i].dmabuf_fd;
   return (struct GpuFrame*)gpu_frame_impl;
@@ -694,7 +897,36 @@ rollback_gpu_frame:
   return NULL;
 }
 
-static bool GpuFrameConvertImpl(GLuint from, GLuint to) {
+struct GpuFrame* GpuContextImportFrame(struct GpuContext* gpu_context,
+                                       uint32_t width, uint32_t height,
+                                       uint32_t fourcc, size_t nplanes,
+                                       const struct GpuFramePlane* planes) {
+  struct GpuFramePlane owned_planes[4] = {0};
+  if (nplanes > LENGTH(owned_planes)) {
+    fprintf(stderr, "Unsupported number of planes %zu\n", nplanes);
+    return NULL;
+  }
+  for (size_t i = 0; i < nplanes; i++) {
+    owned_planes[i] = planes[i];
+    owned_planes[i].dmabuf_fd = dup(planes[i].dmabuf_fd);
+    if (owned_planes[i].dmabuf_fd == -1) {
+      fprintf(stderr, "Failed to dup dmabuf: %s\n", strerror(errno));
+      while (i--) close(owned_planes[i].dmabuf_fd);
+      return NULL;
+    }
+  }
+  struct GpuFrame* gpu_frame = GpuContextCreateFrame(
+      gpu_context, width, height, fourcc, nplanes, owned_planes);
+  if (!gpu_frame) {
+    for (size_t i = 0; i < nplanes; i++) close(owned_planes[i].dmabuf_fd);
+  }
+  return gpu_frame;
+}
+
+static bool GpuFrameConvertImpl(GLuint from, GLuint to,
+                                const struct GpuFrame* source, uint32_t width,
+                                uint32_t height, const struct GpuRect* rects,
+                                size_t nrects) {
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
                          to, 0);
   GLenum framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
@@ -703,8 +935,23 @@ static bool GpuFrameConvertImpl(GLuint from, GLuint to) {
     return false;
   }
 
+  glViewport(0, 0, (GLsizei)width, (GLsizei)height);
   glBindTexture(GL_TEXTURE_2D, from);
-  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  for (size_t i = 0; i < nrects; i++) {
+    // Scissor boxes are rounded outwards, so that scaled and subsampled planes
+    // cover every pixel the source rectangle touches.
+    uint64_t left = (uint64_t)rects[i].x * width / source->width;
+    uint64_t top = (uint64_t)rects[i].y * height / source->height;
+    uint64_t right = ((uint64_t)(rects[i].x + rects[i].width) * width +
+                      source->width - 1) /
+                     source->width;
+    uint64_t bottom = ((uint64_t)(rects[i].y + rects[i].height) * height +
+                       source->height - 1) /
+                      source->height;
+    glScissor((GLint)left, (GLint)top, (GLsizei)(right - left),
+              (GLsizei)(bottom - top));
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  }
   GLenum error = glGetError();
   if (error != GL_NO_ERROR) {
     //LOG("Failed to convert plane (%s)", GlErrorString(error));
@@ -715,45 +962,77 @@ static bool GpuFrameConvertImpl(GLuint from, GLuint to) {
 
 bool GpuContextConvertFrame(struct GpuContext* gpu_context,
                             const struct GpuFrame* from,
-                            const struct GpuFrame* to) {
+                            const struct GpuFrame* to,
+                            const struct GpuCursor* cursor,
+                            const struct GpuRect* damage) {
   const struct GpuFrameImpl* from_impl = (const void*)from;
   const struct GpuFrameImpl* to_impl = (const void*)to;
 
+  const struct GpuFrame* cursor_image = cursor ? cursor->image : NULL;
+  struct GpuRect cursor_rect = {0};
+  if (cursor_image) {
+    cursor_rect = (struct GpuRect){
+        .x = cursor->x,
+        .y = cursor->y,
+        .width = cursor_image->width,
+        .height = cursor_image->height,
+    };
+  }
+
+  struct GpuRect rects[DAMAGE_MAX_RECTS];
+  size_t nrects = DamageHistoryUpdate(&gpu_context->damage_history, to,
+                                      from->width, from->height, cursor_image,
+                                      &cursor_rect, damage, rects);
+  if (!nrects) return true;
+
+  if (cursor_image) {
+    const struct GpuFrameImpl* cursor_impl = (const void*)cursor_image;
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, cursor_impl->textures[0]);
+    glActiveTexture(GL_TEXTURE0);
+    glVertexAttrib4f(2, (GLfloat)cursor_rect.x / (GLfloat)from->width,
+                     (GLfloat)cursor_rect.y / (GLfloat)from->height,
+                     (GLfloat)cursor_rect.width / (GLfloat)from->width,
+                     (GLfloat)cursor_rect.height / (GLfloat)from->height);
+  } else {
+    // Texture coordinates never get outside of the unit square, so a cursor
+    // placed there is never blended.
+    glVertexAttrib4f(2, 2.f, 2.f, 1.f, 1.f);
+  }
+
+  glEnable(GL_SCISSOR_TEST);
   glUseProgram(gpu_context->program_luma);
-  glViewport(0, 0, (GLsizei)to->width, (GLsizei)to->height);
-  if (!GpuFrameConvertImpl(from_impl->textures[0], to_impl->textures[0])) {
+  if (!GpuFrameConvertImpl(from_impl->textures[0], to_impl->textures[0], from,
+                           to->width, to->height, rects, nrects)) {
     //LOG("Failed to convert luma plane");
-    return false;
+    glDisable(GL_SCISSOR_TEST);
+    goto rollback_history;
   }
 
-  const GLfloat sample_offsets[] = {
-      _(0.f, 0.f),
-      _(1.f / (GLfloat)from->width, 0.f),
-      _(0.f, 1.f / (GLfloat)from->height),
-      _(1.f / (GLfloat)from->width, 1.f / (GLfloat)from->height),
-  };
-
   glUseProgram(gpu_context->program_chroma);
-  glUniform2fv(gpu_context->sample_offsets, 4, sample_offsets);
-  glViewport(0, 0, (GLsizei)to->width / 2, (GLsizei)to->height / 2);
-  if (!GpuFrameConvertImpl(from_impl->textures[0], to_impl->textures[1])) {
+  glVertexAttrib2f(1, 1.f / (GLfloat)from->width, 1.f / (GLfloat)from->height);
+  if (!GpuFrameConvertImpl(from_impl->textures[0], to_impl->textures[1], from,
+                           to->width / 2, to->height / 2, rects, nrects)) {
     //LOG("Failed to convert chroma plane");
-    return false;
-  }
-
-  EGLSync sync = eglCreateSync(gpu_context->display, EGL_SYNC_FENCE, NULL);
-  if (sync == EGL_NO_SYNC) {
-    //LOG("Failed to create egl fence sync (%s)", EglErrorString(eglGetError()));
-    return false;
+    glDisable(GL_SCISSOR_TEST);
+    goto rollback_history;
   }
-  eglClientWaitSync(gpu_context->display, sync, 0, EGL_FOREVER);
-  eglDestroySync(gpu_context->display, sync);
+  glDisable(GL_SCISSOR_TEST);
+  if (!WaitForGpu(gpu_context)) goto rollback_history;
   return true;
+
+rollback_history:
+  // Contents of the target are unknown now.
+  DamageHistoryForget(&gpu_context->damage_history, to);
+  return false;
 }
 
 void GpuContextDestroyFrame(struct GpuContext* gpu_context,
                             struct GpuFrame* gpu_frame) {
   struct GpuFrameImpl* gpu_frame_impl = (void*)gpu_frame;
+  // A new frame might be allocated at the same address, and must not be
+  // mistaken for a target or cursor of earlier conversions.
+  DamageHistoryForget(&gpu_context->damage_history, gpu_frame);
   for (size_t i = LENGTH(gpu_frame_impl->textures); i; i--) {
     if (gpu_frame_impl->textures[i - 1])
       glDeleteTextures(1, &gpu_frame_impl->textures[i - 1]);
@@ -766,9 +1045,146 @@ void GpuContextDestroyFrame(struct GpuContext* gpu_context,
   free(gpu_frame_impl);
 }
 
+struct GpuReadback* GpuContextCreateReadback(struct GpuContext* gpu_context,
+                                             uint32_t width, uint32_t height) {
+  (void)gpu_context;
+  struct GpuReadback* gpu_readback = calloc(1, sizeof(struct GpuReadback));
+  if (!gpu_readback) {
+    fprintf(stderr, "Failed to allocate gpu readback: %s\n", strerror(errno));
+    return NULL;
+  }
+  gpu_readback->width = width;
+  gpu_readback->height = height;
+  gpu_readback->sync = EGL_NO_SYNC;
+
+  glGenTextures(1, &gpu_readback->texture);
+  glBindTexture(GL_TEXTURE_2D, gpu_readback->texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, (GLsizei)width, (GLsizei)height);
+  glGenBuffers(1, &gpu_readback->pixels);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu_readback->pixels);
+  glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL,
+               GL_STREAM_READ);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    fprintf(stderr, "Failed to create readback objects: %s\n",
+            GlErrorString(error));
+    glDeleteBuffers(1, &gpu_readback->pixels);
+    glDeleteTextures(1, &gpu_readback->texture);
+    free(gpu_readback);
+    return NULL;
+  }
+  return gpu_readback;
+}
+
+bool GpuContextStartReadback(struct GpuContext* gpu_context,
+                             const struct GpuFrame* from,
+                             struct GpuReadback* gpu_readback) {
+  const struct GpuFrameImpl* from_impl = (const void*)from;
+  if (!from_impl->textures[1]) {
+    fprintf(stderr, "Readback source is not an nv12 frame\n");
+    return false;
+  }
+
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         gpu_readback->texture, 0);
+  GLenum framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Readback framebuffer is incomplete (0x%x)\n",
+            framebuffer_status);
+    return false;
+  }
+
+  glUseProgram(gpu_context->program_preview);
+  glVertexAttrib2f(1, 1.f / (GLfloat)gpu_readback->width,
+                   1.f / (GLfloat)gpu_readback->height);
+  glViewport(0, 0, (GLsizei)gpu_readback->width,
+             (GLsizei)gpu_readback->height);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, from_impl->textures[1]);
+  glBindSampler(1, gpu_context->linear_sampler);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, from_impl->textures[0]);
+  glBindSampler(0, gpu_context->linear_sampler);
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  glBindSampler(0, 0);
+  glBindSampler(1, 0);
+  // Unit 1 is where conversions look for the cursor, and must not keep a
+  // texture that might become their render target.
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu_readback->pixels);
+  glReadPixels(0, 0, (GLsizei)gpu_readback->width,
+               (GLsizei)gpu_readback->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    fprintf(stderr, "Failed to start readback: %s\n", GlErrorString(error));
+    return false;
+  }
+
+  gpu_readback->sync =
+      eglCreateSync(gpu_context->display, EGL_SYNC_FENCE, NULL);
+  if (gpu_readback->sync == EGL_NO_SYNC) {
+    fprintf(stderr, "Failed to create readback fence: %s\n",
+            EglErrorString(eglGetError()));
+    return false;
+  }
+  // Fences are only guaranteed to signal once flushed, and the waiting side
+  // might be another context.
+  glFlush();
+  return true;
+}
+
+bool GpuContextFinishReadback(struct GpuContext* gpu_context,
+                              struct GpuReadback* gpu_readback, void* pixels) {
+  if (gpu_readback->sync == EGL_NO_SYNC) {
+    fprintf(stderr, "Readback was not started\n");
+    return false;
+  }
+  eglClientWaitSync(gpu_context->display, gpu_readback->sync, 0, EGL_FOREVER);
+  eglDestroySync(gpu_context->display, gpu_readback->sync);
+  gpu_readback->sync = EGL_NO_SYNC;
+
+  size_t size = (size_t)gpu_readback->width * gpu_readback->height * 4;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu_readback->pixels);
+  const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                        (GLsizeiptr)size, GL_MAP_READ_BIT);
+  if (!mapped) {
+    fprintf(stderr, "Failed to map readback buffer: %s\n",
+            GlErrorString(glGetError()));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return false;
+  }
+  memcpy(pixels, mapped, size);
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return true;
+}
+
+void GpuContextDestroyReadback(struct GpuContext* gpu_context,
+                               struct GpuReadback* gpu_readback) {
+  if (gpu_readback->sync != EGL_NO_SYNC)
+    eglDestroySync(gpu_context->display, gpu_readback->sync);
+  glDeleteBuffers(1, &gpu_readback->pixels);
+  glDeleteTextures(1, &gpu_readback->texture);
+  free(gpu_readback);
+}
+
 void GpuContextDestroy(struct GpuContext* gpu_context) {
-  glDeleteBuffers(1, &gpu_context->vertices);
   glDeleteFramebuffers(1, &gpu_context->framebuffer);
+  if (gpu_context->parent) {
+    eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    eglDestroyContext(gpu_context->display, gpu_context->context);
+    free(gpu_context);
+    return;
+  }
+  glDeleteBuffers(1, &gpu_context->vertices);
+  glDeleteSamplers(1, &gpu_context->linear_sampler);
+  glDeleteProgram(gpu_context->program_preview);
   glDeleteProgram(gpu_context->program_chroma);
   glDeleteProgram(gpu_context->program_luma);
   eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
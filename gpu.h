@@ -41,17 +41,71 @@ struct GpuFramePlane {
   uint64_t modifier;
 };
 
+// Rectangles are in pixels of the source frame.
+struct GpuRect {
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+// Image is a premultiplied argb frame, e.g. imported from a cursor plane,
+// positioned with its top left corner at x and y. Its contents are assumed to
+// stay the same for as long as the same frame is passed.
+struct GpuCursor {
+  const struct GpuFrame* image;
+  int32_t x;
+  int32_t y;
+};
+
 struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
                                     enum YuvRange range);
+// Creates a context in the share group of gpu_context and makes it current on
+// the calling thread. Must be destroyed on the same thread before its parent.
+struct GpuContext* GpuContextCreateShared(struct GpuContext* gpu_context);
+// Contexts are current on the thread that created them. Moving one to
+// another thread requires releasing it first.
+bool GpuContextMakeCurrent(struct GpuContext* gpu_context);
+void GpuContextReleaseCurrent(struct GpuContext* gpu_context);
+// Render node behind the gbm device, -1 for the surfaceless platform.
+int GpuContextGetRenderNode(const struct GpuContext* gpu_context);
 struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
                                        uint32_t width, uint32_t height,
                                        uint32_t fourcc, size_t nplanes,
                                        const struct GpuFramePlane* planes);
+// Same for dmabufs that stay owned by someone else, e.g. a decoder, capture
+// device or producer process. Descriptors are duplicated, the frame owns and
+// closes the duplicates.
+struct GpuFrame* GpuContextImportFrame(struct GpuContext* gpu_context,
+                                       uint32_t width, uint32_t height,
+                                       uint32_t fourcc, size_t nplanes,
+                                       const struct GpuFramePlane* planes);
+// Cursor is blended in the same pass, NULL for none. Damage is the part of
+// the source that changed since the previous conversion into the same frame,
+// NULL for all of it. Only damage and the areas the cursor moved between are
+// converted then, which costs nothing for a static screen.
 bool GpuContextConvertFrame(struct GpuContext* gpu_context,
                             const struct GpuFrame* from,
-                            const struct GpuFrame* to);
+                            const struct GpuFrame* to,
+                            const struct GpuCursor* cursor,
+                            const struct GpuRect* damage);
 void GpuContextDestroyFrame(struct GpuContext* gpu_context,
                             struct GpuFrame* gpu_frame);
+
+// Readbacks are small rgba render targets, e.g. for thumbnails. Starting one
+// renders a downscaled rgb copy of an nv12 frame and queues reading it back
+// without waiting for the gpu. Finishing waits for the pixels and copies
+// them out as tightly packed rgba, it might be called from another context
+// of the share group. A readback must be finished before it is restarted.
+struct GpuReadback* GpuContextCreateReadback(struct GpuContext* gpu_context,
+                                             uint32_t width, uint32_t height);
+bool GpuContextStartReadback(struct GpuContext* gpu_context,
+                             const struct GpuFrame* from,
+                             struct GpuReadback* gpu_readback);
+bool GpuContextFinishReadback(struct GpuContext* gpu_context,
+                              struct GpuReadback* gpu_readback, void* pixels);
+void GpuContextDestroyReadback(struct GpuContext* gpu_context,
+                               struct GpuReadback* gpu_readback);
 void GpuContextDestroy(struct GpuContext* gpu_context);
 
 void CloseUniqueFds(int fds[4]);
@@ -550,17 +550,90 @@ static void PackStRefPicSet(struct Bitstream* bitstream, uint32_t stRpsIdx,
   }
 }
 
+// 7.3.6.3 Weighted prediction parameters syntax
+static void PackPredWeightTable(struct Bitstream* bitstream,
+                                const VAEncSequenceParameterBufferHEVC* seq,
+                                const VAEncPictureParameterBufferHEVC* pic,
+                                const VAEncSliceParameterBufferHEVC* slice) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  uint32_t ChromaArrayType =
+      !seq_bits->separate_colour_plane_flag ? seq_bits->chroma_format_idc : 0;
+  BitstreamAppendUE(bitstream, slice->luma_log2_weight_denom);
+  if (ChromaArrayType != 0)
+    BitstreamAppendSE(bitstream, slice->delta_chroma_log2_weight_denom);
+  int32_t ChromaLog2WeightDenom =
+      slice->luma_log2_weight_denom + slice->delta_chroma_log2_weight_denom;
+
+  for (int list = 0; list < (slice->slice_type == B ? 2 : 1); list++) {
+    uint32_t count = (list ? slice->num_ref_idx_l1_active_minus1
+                           : slice->num_ref_idx_l0_active_minus1) +
+                     1;
+    const VAPictureHEVC* ref_pic_list =
+        list ? slice->ref_pic_list1 : slice->ref_pic_list0;
+    const int8_t* delta_luma_weight =
+        list ? slice->delta_luma_weight_l1 : slice->delta_luma_weight_l0;
+    const int8_t* luma_offset =
+        list ? slice->luma_offset_l1 : slice->luma_offset_l0;
+    const int8_t(*delta_chroma_weight)[2] =
+        list ? slice->delta_chroma_weight_l1 : slice->delta_chroma_weight_l0;
+    const int8_t(*chroma_offset)[2] =
+        list ? slice->chroma_offset_l1 : slice->chroma_offset_l0;
+
+    // Va has no flags for these, weights that are all defaults are simply not
+    // transmitted.
+    bool luma_weight_flag[15] = {0};
+    bool chroma_weight_flag[15] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+      luma_weight_flag[i] = delta_luma_weight[i] || luma_offset[i];
+      chroma_weight_flag[i] =
+          delta_chroma_weight[i][0] || chroma_offset[i][0] ||
+          delta_chroma_weight[i][1] || chroma_offset[i][1];
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      if (ref_pic_list[i].pic_order_cnt != pic->decoded_curr_pic.pic_order_cnt)
+        BitstreamAppend(bitstream, 1, luma_weight_flag[i]);
+    }
+    if (ChromaArrayType != 0) {
+      for (uint32_t i = 0; i < count; i++) {
+        if (ref_pic_list[i].pic_order_cnt !=
+            pic->decoded_curr_pic.pic_order_cnt)
+          BitstreamAppend(bitstream, 1, chroma_weight_flag[i]);
+      }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      if (luma_weight_flag[i]) {
+        BitstreamAppendSE(bitstream, delta_luma_weight[i]);
+        BitstreamAppendSE(bitstream, luma_offset[i]);
+      }
+      if (!chroma_weight_flag[i]) continue;
+      for (int j = 0; j < 2; j++) {
+        // 7.4.7.3 Equation 7-56, va carries ChromaOffset rather than its
+        // delta to the weighted half range.
+        int32_t ChromaWeight =
+            (1 << ChromaLog2WeightDenom) + delta_chroma_weight[i][j];
+        int32_t delta_chroma_offset =
+            chroma_offset[i][j] - 128 +
+            ((128 * ChromaWeight) >> ChromaLog2WeightDenom);
+        BitstreamAppendSE(bitstream, delta_chroma_weight[i][j]);
+        BitstreamAppendSE(bitstream, delta_chroma_offset);
+      }
+    }
+  }
+}
+
 // 7.3.6.1 General slice segment header syntax
 void PackSliceSegmentHeaderNalUnit(struct Bitstream* bitstream,
                                    const VAEncSequenceParameterBufferHEVC* seq,
                                    const VAEncPictureParameterBufferHEVC* pic,
                                    const VAEncSliceParameterBufferHEVC* slice,
-                                   const struct MoreSliceParamerters* msp) {
+                                   const struct MoreSliceParamerters* msp,
+                                   struct SliceHeaderOffsets* offsets) {
   const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
   const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
   const typeof(slice->slice_fields.bits)* slice_bits =
       &slice->slice_fields.bits;
 
+  *offsets = (struct SliceHeaderOffsets){0};
   PackNalUnitHeader(bitstream, pic->nal_unit_type);
 
   char buffer_on_the_stack[64];
@@ -651,8 +724,13 @@ void PackSliceSegmentHeaderNalUnit(struct Bitstream* bitstream,
       }
       if ((pic_bits->weighted_pred_flag && slice->slice_type == P) ||
           (pic_bits->weighted_bipred_flag && slice->slice_type == B)) {
-        // TODO(mburakov): Implement this!!!
-        abort();
+        // Offset does not include emulation prevention bytes.
+        size_t pred_weight_table_start = slice_rbsp.size;
+        PackPredWeightTable(&slice_rbsp, seq, pic, slice);
+        offsets->pred_weight_table_bit_offset =
+            (uint32_t)pred_weight_table_start + 16;
+        offsets->pred_weight_table_bit_length =
+            (uint32_t)(slice_rbsp.size - pred_weight_table_start);
       }
       BitstreamAppendUE(
           &slice_rbsp,
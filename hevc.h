@@ -24,13 +24,23 @@
 // Table 7-1
 enum NalUnitType {
   TRAIL_R = 1,
+  RADL_N = 6,
+  RASL_N = 8,
+  RASL_R = 9,
+  RSV_VCL_N14 = 14,
   BLA_W_LP = 16,
+  BLA_N_LP = 18,
   IDR_W_RADL = 19,
   IDR_N_LP = 20,
+  CRA_NUT = 21,
   RSV_IRAP_VCL23 = 23,
+  RSV_VCL31 = 31,
   VPS_NUT = 32,
   SPS_NUT = 33,
   PPS_NUT = 34,
+  AUD_NUT = 35,
+  EOS_NUT = 36,
+  EOB_NUT = 37,
 };
 
 // Table 7-7
@@ -65,6 +75,14 @@ struct MoreSeqParameters {
   uint32_t chroma_sample_loc_type_bottom_field;
 };
 
+// Where pred_weight_table ended up in the packed slice header, in bits from
+// the start of the nal unit header. Drivers look at these when given packed
+// slice headers.
+struct SliceHeaderOffsets {
+  uint32_t pred_weight_table_bit_offset;
+  uint32_t pred_weight_table_bit_length;
+};
+
 struct MoreSliceParamerters {
   bool first_slice_segment_in_pic_flag;
   // TODO(mburakov): Deduce from picture parameter buffer?
@@ -92,6 +110,7 @@ void PackSliceSegmentHeaderNalUnit(struct Bitstream* bitstream,
                                    const VAEncSequenceParameterBufferHEVC* seq,
                                    const VAEncPictureParameterBufferHEVC* pic,
                                    const VAEncSliceParameterBufferHEVC* slice,
-                                   const struct MoreSliceParamerters* msp);
+                                   const struct MoreSliceParamerters* msp,
+                                   struct SliceHeaderOffsets* offsets);
 
 #endif  // STREAMER_HEVC_H_
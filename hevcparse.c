@@ -0,0 +1,836 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hevcparse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "hevc.h"
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+static uint32_t CeilLog2(uint32_t value) {
+  uint32_t result = 0;
+  while ((1u << result) < value) result++;
+  return result;
+}
+
+// 7.3.3 Profile, tier and level syntax
+static void SkipProfileTierLevel(struct BitstreamReader* reader,
+                                 uint8_t max_sub_layers_minus1,
+                                 uint8_t* general_profile_idc,
+                                 uint8_t* general_level_idc) {
+  BitstreamSkip(reader, 3);  // general_profile_space, general_tier_flag
+  *general_profile_idc = (uint8_t)BitstreamRead(reader, 5);
+  // Compatibility and constraint flags are of no interest here.
+  BitstreamSkip(reader, 32 + 4 + 43 + 1);
+  *general_level_idc = (uint8_t)BitstreamRead(reader, 8);
+
+  bool sub_layer_profile_present_flag[8];
+  bool sub_layer_level_present_flag[8];
+  for (uint8_t i = 0; i < max_sub_layers_minus1; i++) {
+    sub_layer_profile_present_flag[i] = BitstreamRead(reader, 1);
+    sub_layer_level_present_flag[i] = BitstreamRead(reader, 1);
+  }
+  if (max_sub_layers_minus1 > 0) {
+    for (uint8_t i = max_sub_layers_minus1; i < 8; i++)
+      BitstreamSkip(reader, 2);  // reserved_zero_2bits
+  }
+  for (uint8_t i = 0; i < max_sub_layers_minus1; i++) {
+    if (sub_layer_profile_present_flag[i]) BitstreamSkip(reader, 88);
+    if (sub_layer_level_present_flag[i]) BitstreamSkip(reader, 8);
+  }
+}
+
+// 7.3.4 Scaling list data syntax
+static void SkipScalingListData(struct BitstreamReader* reader) {
+  for (uint32_t size_id = 0; size_id < 4; size_id++) {
+    for (uint32_t matrix_id = 0; matrix_id < 6;
+         matrix_id += size_id == 3 ? 3 : 1) {
+      bool scaling_list_pred_mode_flag = BitstreamRead(reader, 1);
+      if (!scaling_list_pred_mode_flag) {
+        BitstreamReadUE(reader);  // scaling_list_pred_matrix_id_delta
+        continue;
+      }
+      uint32_t coef_num = 1u << (4 + (size_id << 1));
+      if (coef_num > 64) coef_num = 64;
+      if (size_id > 1) BitstreamReadSE(reader);  // scaling_list_dc_coef
+      for (uint32_t i = 0; i < coef_num; i++)
+        BitstreamReadSE(reader);  // scaling_list_delta_coef
+    }
+  }
+}
+
+// 7.3.7 Short-term reference picture set syntax
+static bool ParseShortTermRefPicSet(struct BitstreamReader* reader,
+                                    uint32_t st_rps_idx,
+                                    uint32_t num_short_term_ref_pic_sets,
+                                    const struct ShortTermRefPicSet* sets,
+                                    struct ShortTermRefPicSet* rps) {
+  bool inter_ref_pic_set_prediction_flag =
+      st_rps_idx != 0 && BitstreamRead(reader, 1);
+  if (!inter_ref_pic_set_prediction_flag) {
+    rps->num_negative_pics = BitstreamReadUE(reader);
+    rps->num_positive_pics = BitstreamReadUE(reader);
+    if (rps->num_negative_pics > LENGTH(rps->delta_poc_s0) ||
+        rps->num_positive_pics > LENGTH(rps->delta_poc_s1)) {
+      fprintf(stderr, "Invalid short-term reference picture set\n");
+      return false;
+    }
+    for (uint32_t i = 0; i < rps->num_negative_pics; i++) {
+      int32_t delta_poc_s0_minus1 = (int32_t)BitstreamReadUE(reader);
+      rps->delta_poc_s0[i] =
+          (i ? rps->delta_poc_s0[i - 1] : 0) - (delta_poc_s0_minus1 + 1);
+      rps->used_by_curr_pic_s0[i] = BitstreamRead(reader, 1);
+    }
+    for (uint32_t i = 0; i < rps->num_positive_pics; i++) {
+      int32_t delta_poc_s1_minus1 = (int32_t)BitstreamReadUE(reader);
+      rps->delta_poc_s1[i] =
+          (i ? rps->delta_poc_s1[i - 1] : 0) + (delta_poc_s1_minus1 + 1);
+      rps->used_by_curr_pic_s1[i] = BitstreamRead(reader, 1);
+    }
+    return true;
+  }
+
+  uint32_t delta_idx_minus1 = 0;
+  if (st_rps_idx == num_short_term_ref_pic_sets)
+    delta_idx_minus1 = BitstreamReadUE(reader);
+  if (delta_idx_minus1 + 1 > st_rps_idx) {
+    fprintf(stderr, "Invalid short-term reference picture set index\n");
+    return false;
+  }
+  bool delta_rps_sign = BitstreamRead(reader, 1);
+  int32_t abs_delta_rps_minus1 = (int32_t)BitstreamReadUE(reader);
+  int32_t delta_rps = (1 - 2 * delta_rps_sign) * (abs_delta_rps_minus1 + 1);
+
+  // 7.4.8 Derivation of the predicted set, equations 7-61 and 7-62
+  const struct ShortTermRefPicSet* ref =
+      &sets[st_rps_idx - (delta_idx_minus1 + 1)];
+  uint32_t num_delta_pocs = ref->num_negative_pics + ref->num_positive_pics;
+  bool used_by_curr_pic_flag[33];
+  bool use_delta_flag[33];
+  for (uint32_t j = 0; j <= num_delta_pocs; j++) {
+    used_by_curr_pic_flag[j] = BitstreamRead(reader, 1);
+    use_delta_flag[j] = used_by_curr_pic_flag[j] || BitstreamRead(reader, 1);
+  }
+
+  struct ShortTermRefPicSet result = {0};
+  for (uint32_t j = ref->num_positive_pics; j--;) {
+    int32_t delta_poc = ref->delta_poc_s1[j] + delta_rps;
+    uint32_t k = ref->num_negative_pics + j;
+    if (delta_poc < 0 && use_delta_flag[k]) {
+      if (result.num_negative_pics == LENGTH(result.delta_poc_s0)) break;
+      result.delta_poc_s0[result.num_negative_pics] = delta_poc;
+      result.used_by_curr_pic_s0[result.num_negative_pics++] =
+          used_by_curr_pic_flag[k];
+    }
+  }
+  if (delta_rps < 0 && use_delta_flag[num_delta_pocs] &&
+      result.num_negative_pics < LENGTH(result.delta_poc_s0)) {
+    result.delta_poc_s0[result.num_negative_pics] = delta_rps;
+    result.used_by_curr_pic_s0[result.num_negative_pics++] =
+        used_by_curr_pic_flag[num_delta_pocs];
+  }
+  for (uint32_t j = 0; j < ref->num_negative_pics; j++) {
+    int32_t delta_poc = ref->delta_poc_s0[j] + delta_rps;
+    if (delta_poc < 0 && use_delta_flag[j]) {
+      if (result.num_negative_pics == LENGTH(result.delta_poc_s0)) break;
+      result.delta_poc_s0[result.num_negative_pics] = delta_poc;
+      result.used_by_curr_pic_s0[result.num_negative_pics++] =
+          used_by_curr_pic_flag[j];
+    }
+  }
+
+  for (uint32_t j = ref->num_negative_pics; j--;) {
+    int32_t delta_poc = ref->delta_poc_s0[j] + delta_rps;
+    if (delta_poc > 0 && use_delta_flag[j]) {
+      if (result.num_positive_pics == LENGTH(result.delta_poc_s1)) break;
+      result.delta_poc_s1[result.num_positive_pics] = delta_poc;
+      result.used_by_curr_pic_s1[result.num_positive_pics++] =
+          used_by_curr_pic_flag[j];
+    }
+  }
+  if (delta_rps > 0 && use_delta_flag[num_delta_pocs] &&
+      result.num_positive_pics < LENGTH(result.delta_poc_s1)) {
+    result.delta_poc_s1[result.num_positive_pics] = delta_rps;
+    result.used_by_curr_pic_s1[result.num_positive_pics++] =
+        used_by_curr_pic_flag[num_delta_pocs];
+  }
+  for (uint32_t j = 0; j < ref->num_positive_pics; j++) {
+    int32_t delta_poc = ref->delta_poc_s1[j] + delta_rps;
+    uint32_t k = ref->num_negative_pics + j;
+    if (delta_poc > 0 && use_delta_flag[k]) {
+      if (result.num_positive_pics == LENGTH(result.delta_poc_s1)) break;
+      result.delta_poc_s1[result.num_positive_pics] = delta_poc;
+      result.used_by_curr_pic_s1[result.num_positive_pics++] =
+          used_by_curr_pic_flag[k];
+    }
+  }
+
+  *rps = result;
+  return true;
+}
+
+// 7.3.2.1 Video parameter set RBSP syntax
+bool ParseVideoParameterSet(struct BitstreamReader* reader,
+                            struct VideoParameterSet* vps) {
+  *vps = (struct VideoParameterSet){0};
+  vps->vps_video_parameter_set_id = (uint8_t)BitstreamRead(reader, 4);
+  vps->vps_base_layer_internal_flag = BitstreamRead(reader, 1);
+  vps->vps_base_layer_available_flag = BitstreamRead(reader, 1);
+  vps->vps_max_layers_minus1 = (uint8_t)BitstreamRead(reader, 6);
+  vps->vps_max_sub_layers_minus1 = (uint8_t)BitstreamRead(reader, 3);
+  vps->vps_temporal_id_nesting_flag = BitstreamRead(reader, 1);
+  BitstreamSkip(reader, 16);  // vps_reserved_0xffff_16bits
+  if (vps->vps_max_sub_layers_minus1 > 6) {
+    fprintf(stderr, "Invalid number of sub-layers\n");
+    return false;
+  }
+  SkipProfileTierLevel(reader, vps->vps_max_sub_layers_minus1,
+                       &vps->general_profile_idc, &vps->general_level_idc);
+
+  bool vps_sub_layer_ordering_info_present_flag = BitstreamRead(reader, 1);
+  for (uint8_t i = vps_sub_layer_ordering_info_present_flag
+                       ? 0
+                       : vps->vps_max_sub_layers_minus1;
+       i <= vps->vps_max_sub_layers_minus1; i++) {
+    vps->vps_max_dec_pic_buffering_minus1 = BitstreamReadUE(reader);
+    vps->vps_max_num_reorder_pics = BitstreamReadUE(reader);
+    vps->vps_max_latency_increase_plus1 = BitstreamReadUE(reader);
+  }
+
+  vps->vps_max_layer_id = (uint8_t)BitstreamRead(reader, 6);
+  vps->vps_num_layer_sets_minus1 = BitstreamReadUE(reader);
+  if (vps->vps_num_layer_sets_minus1 > 1023) {
+    fprintf(stderr, "Invalid number of layer sets\n");
+    return false;
+  }
+  // layer_id_included_flag
+  BitstreamSkip(reader, (size_t)vps->vps_num_layer_sets_minus1 *
+                            (vps->vps_max_layer_id + 1u));
+
+  vps->vps_timing_info_present_flag = BitstreamRead(reader, 1);
+  if (vps->vps_timing_info_present_flag) {
+    vps->vps_num_units_in_tick = BitstreamRead(reader, 32);
+    vps->vps_time_scale = BitstreamRead(reader, 32);
+    vps->vps_poc_proportional_to_timing_flag = BitstreamRead(reader, 1);
+    if (vps->vps_poc_proportional_to_timing_flag)
+      vps->vps_num_ticks_poc_diff_one_minus1 = BitstreamReadUE(reader);
+    vps->vps_num_hrd_parameters = BitstreamReadUE(reader);
+  }
+
+  // Hrd parameters and extensions are of no interest here.
+  if (BitstreamExhausted(reader)) {
+    fprintf(stderr, "Truncated video parameter set\n");
+    return false;
+  }
+  return true;
+}
+
+// E.2.1 VUI parameters syntax
+static void ParseVuiParameters(struct BitstreamReader* reader,
+                               struct SeqParameterSet* sps) {
+  bool aspect_ratio_info_present_flag = BitstreamRead(reader, 1);
+  if (aspect_ratio_info_present_flag) {
+    uint8_t aspect_ratio_idc = (uint8_t)BitstreamRead(reader, 8);
+    if (aspect_ratio_idc == 255)
+      BitstreamSkip(reader, 32);  // sar_width, sar_height
+  }
+  bool overscan_info_present_flag = BitstreamRead(reader, 1);
+  if (overscan_info_present_flag)
+    BitstreamSkip(reader, 1);  // overscan_appropriate_flag
+
+  sps->video_signal_type_present_flag = BitstreamRead(reader, 1);
+  if (sps->video_signal_type_present_flag) {
+    sps->video_format = (uint8_t)BitstreamRead(reader, 3);
+    sps->video_full_range_flag = BitstreamRead(reader, 1);
+    sps->colour_description_present_flag = BitstreamRead(reader, 1);
+    if (sps->colour_description_present_flag) {
+      sps->colour_primaries = (uint8_t)BitstreamRead(reader, 8);
+      sps->transfer_characteristics = (uint8_t)BitstreamRead(reader, 8);
+      sps->matrix_coeffs = (uint8_t)BitstreamRead(reader, 8);
+    }
+  }
+  sps->chroma_loc_info_present_flag = BitstreamRead(reader, 1);
+  if (sps->chroma_loc_info_present_flag) {
+    sps->chroma_sample_loc_type_top_field = BitstreamReadUE(reader);
+    sps->chroma_sample_loc_type_bottom_field = BitstreamReadUE(reader);
+  }
+
+  BitstreamSkip(reader, 1);  // neutral_chroma_indication_flag
+  sps->field_seq_flag = BitstreamRead(reader, 1);
+  BitstreamSkip(reader, 1);  // frame_field_info_present_flag
+  bool default_display_window_flag = BitstreamRead(reader, 1);
+  if (default_display_window_flag) {
+    for (int i = 0; i < 4; i++) BitstreamReadUE(reader);
+  }
+
+  sps->vui_timing_info_present_flag = BitstreamRead(reader, 1);
+  if (sps->vui_timing_info_present_flag) {
+    sps->vui_num_units_in_tick = BitstreamRead(reader, 32);
+    sps->vui_time_scale = BitstreamRead(reader, 32);
+  }
+  // Hrd and bitstream restrictions are of no interest here.
+}
+
+// 7.3.2.2 Sequence parameter set RBSP syntax
+bool ParseSeqParameterSet(struct BitstreamReader* reader,
+                          struct SeqParameterSet* sps) {
+  *sps = (struct SeqParameterSet){0};
+  sps->sps_video_parameter_set_id = (uint8_t)BitstreamRead(reader, 4);
+  sps->sps_max_sub_layers_minus1 = (uint8_t)BitstreamRead(reader, 3);
+  BitstreamSkip(reader, 1);  // sps_temporal_id_nesting_flag
+  if (sps->sps_max_sub_layers_minus1 > 6) {
+    fprintf(stderr, "Invalid number of sub-layers\n");
+    return false;
+  }
+  SkipProfileTierLevel(reader, sps->sps_max_sub_layers_minus1,
+                       &sps->general_profile_idc, &sps->general_level_idc);
+
+  sps->sps_seq_parameter_set_id = BitstreamReadUE(reader);
+  if (sps->sps_seq_parameter_set_id >= 16) {
+    fprintf(stderr, "Invalid sequence parameter set id\n");
+    return false;
+  }
+  sps->chroma_format_idc = BitstreamReadUE(reader);
+  if (sps->chroma_format_idc == 3)
+    sps->separate_colour_plane_flag = BitstreamRead(reader, 1);
+  sps->pic_width_in_luma_samples = BitstreamReadUE(reader);
+  sps->pic_height_in_luma_samples = BitstreamReadUE(reader);
+  bool conformance_window_flag = BitstreamRead(reader, 1);
+  if (conformance_window_flag) {
+    sps->conf_win_left_offset = BitstreamReadUE(reader);
+    sps->conf_win_right_offset = BitstreamReadUE(reader);
+    sps->conf_win_top_offset = BitstreamReadUE(reader);
+    sps->conf_win_bottom_offset = BitstreamReadUE(reader);
+  }
+  sps->bit_depth_luma_minus8 = BitstreamReadUE(reader);
+  sps->bit_depth_chroma_minus8 = BitstreamReadUE(reader);
+  sps->log2_max_pic_order_cnt_lsb_minus4 = BitstreamReadUE(reader);
+  if (sps->log2_max_pic_order_cnt_lsb_minus4 > 12) {
+    fprintf(stderr, "Invalid picture order count size\n");
+    return false;
+  }
+
+  bool sps_sub_layer_ordering_info_present_flag = BitstreamRead(reader, 1);
+  for (uint8_t i = sps_sub_layer_ordering_info_present_flag
+                       ? 0
+                       : sps->sps_max_sub_layers_minus1;
+       i <= sps->sps_max_sub_layers_minus1; i++) {
+    sps->sps_max_dec_pic_buffering_minus1 = BitstreamReadUE(reader);
+    sps->sps_max_num_reorder_pics = BitstreamReadUE(reader);
+    sps->sps_max_latency_increase_plus1 = BitstreamReadUE(reader);
+  }
+  if (sps->sps_max_dec_pic_buffering_minus1 > 15 ||
+      sps->sps_max_num_reorder_pics > sps->sps_max_dec_pic_buffering_minus1) {
+    fprintf(stderr, "Invalid decoded picture buffer size\n");
+    return false;
+  }
+
+  sps->log2_min_luma_coding_block_size_minus3 = BitstreamReadUE(reader);
+  sps->log2_diff_max_min_luma_coding_block_size = BitstreamReadUE(reader);
+  sps->log2_min_luma_transform_block_size_minus2 = BitstreamReadUE(reader);
+  sps->log2_diff_max_min_luma_transform_block_size = BitstreamReadUE(reader);
+  sps->max_transform_hierarchy_depth_inter = BitstreamReadUE(reader);
+  sps->max_transform_hierarchy_depth_intra = BitstreamReadUE(reader);
+  if (sps->log2_min_luma_coding_block_size_minus3 +
+          sps->log2_diff_max_min_luma_coding_block_size > 3) {
+    fprintf(stderr, "Invalid coding tree block size\n");
+    return false;
+  }
+
+  sps->scaling_list_enabled_flag = BitstreamRead(reader, 1);
+  if (sps->scaling_list_enabled_flag) {
+    bool sps_scaling_list_data_present_flag = BitstreamRead(reader, 1);
+    if (sps_scaling_list_data_present_flag) SkipScalingListData(reader);
+  }
+  sps->amp_enabled_flag = BitstreamRead(reader, 1);
+  sps->sample_adaptive_offset_enabled_flag = BitstreamRead(reader, 1);
+  sps->pcm_enabled_flag = BitstreamRead(reader, 1);
+  if (sps->pcm_enabled_flag) {
+    sps->pcm_sample_bit_depth_luma_minus1 = (uint8_t)BitstreamRead(reader, 4);
+    sps->pcm_sample_bit_depth_chroma_minus1 =
+        (uint8_t)BitstreamRead(reader, 4);
+    sps->log2_min_pcm_luma_coding_block_size_minus3 = BitstreamReadUE(reader);
+    sps->log2_diff_max_min_pcm_luma_coding_block_size =
+        BitstreamReadUE(reader);
+    sps->pcm_loop_filter_disabled_flag = BitstreamRead(reader, 1);
+  }
+
+  sps->num_short_term_ref_pic_sets = BitstreamReadUE(reader);
+  if (sps->num_short_term_ref_pic_sets > LENGTH(sps->st_ref_pic_set)) {
+    fprintf(stderr, "Invalid number of short-term reference picture sets\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < sps->num_short_term_ref_pic_sets; i++) {
+    if (!ParseShortTermRefPicSet(reader, i, sps->num_short_term_ref_pic_sets,
+                                 sps->st_ref_pic_set,
+                                 &sps->st_ref_pic_set[i])) {
+      //LOG("Failed to parse short-term reference picture set");
+      return false;
+    }
+  }
+
+  sps->long_term_ref_pics_present_flag = BitstreamRead(reader, 1);
+  if (sps->long_term_ref_pics_present_flag) {
+    sps->num_long_term_ref_pics_sps = BitstreamReadUE(reader);
+    if (sps->num_long_term_ref_pics_sps >
+        LENGTH(sps->lt_ref_pic_poc_lsb_sps)) {
+      fprintf(stderr, "Invalid number of long-term reference pictures\n");
+      return false;
+    }
+    for (uint32_t i = 0; i < sps->num_long_term_ref_pics_sps; i++) {
+      sps->lt_ref_pic_poc_lsb_sps[i] = BitstreamRead(
+          reader, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+      sps->used_by_curr_pic_lt_sps_flag[i] = BitstreamRead(reader, 1);
+    }
+  }
+  sps->sps_temporal_mvp_enabled_flag = BitstreamRead(reader, 1);
+  sps->strong_intra_smoothing_enabled_flag = BitstreamRead(reader, 1);
+
+  if (BitstreamExhausted(reader)) {
+    fprintf(stderr, "Truncated sequence parameter set\n");
+    return false;
+  }
+
+  // Vui and extensions do not affect decoding process, so a truncated vui is
+  // reported as absent instead of failing the sps.
+  sps->vui_parameters_present_flag = BitstreamRead(reader, 1);
+  if (sps->vui_parameters_present_flag) {
+    ParseVuiParameters(reader, sps);
+    if (BitstreamExhausted(reader)) sps->vui_parameters_present_flag = 0;
+  }
+  return true;
+}
+
+// 7.3.2.3 Picture parameter set RBSP syntax
+bool ParsePicParameterSet(struct BitstreamReader* reader,
+                          struct PicParameterSet* pps) {
+  *pps = (struct PicParameterSet){0};
+  pps->pps_pic_parameter_set_id = BitstreamReadUE(reader);
+  pps->pps_seq_parameter_set_id = BitstreamReadUE(reader);
+  if (pps->pps_pic_parameter_set_id >= 64 ||
+      pps->pps_seq_parameter_set_id >= 16) {
+    fprintf(stderr, "Invalid picture parameter set id\n");
+    return false;
+  }
+  pps->dependent_slice_segments_enabled_flag = BitstreamRead(reader, 1);
+  pps->output_flag_present_flag = BitstreamRead(reader, 1);
+  pps->num_extra_slice_header_bits = (uint8_t)BitstreamRead(reader, 3);
+  pps->sign_data_hiding_enabled_flag = BitstreamRead(reader, 1);
+  pps->cabac_init_present_flag = BitstreamRead(reader, 1);
+  pps->num_ref_idx_l0_default_active_minus1 = BitstreamReadUE(reader);
+  pps->num_ref_idx_l1_default_active_minus1 = BitstreamReadUE(reader);
+  if (pps->num_ref_idx_l0_default_active_minus1 > 14 ||
+      pps->num_ref_idx_l1_default_active_minus1 > 14) {
+    fprintf(stderr, "Invalid default number of reference indices\n");
+    return false;
+  }
+  pps->init_qp_minus26 = BitstreamReadSE(reader);
+  pps->constrained_intra_pred_flag = BitstreamRead(reader, 1);
+  pps->transform_skip_enabled_flag = BitstreamRead(reader, 1);
+  pps->cu_qp_delta_enabled_flag = BitstreamRead(reader, 1);
+  if (pps->cu_qp_delta_enabled_flag)
+    pps->diff_cu_qp_delta_depth = BitstreamReadUE(reader);
+  pps->pps_cb_qp_offset = BitstreamReadSE(reader);
+  pps->pps_cr_qp_offset = BitstreamReadSE(reader);
+  pps->pps_slice_chroma_qp_offsets_present_flag = BitstreamRead(reader, 1);
+  pps->weighted_pred_flag = BitstreamRead(reader, 1);
+  pps->weighted_bipred_flag = BitstreamRead(reader, 1);
+  pps->transquant_bypass_enabled_flag = BitstreamRead(reader, 1);
+  pps->tiles_enabled_flag = BitstreamRead(reader, 1);
+  pps->entropy_coding_sync_enabled_flag = BitstreamRead(reader, 1);
+  pps->loop_filter_across_tiles_enabled_flag = 1;
+  if (pps->tiles_enabled_flag) {
+    pps->num_tile_columns_minus1 = BitstreamReadUE(reader);
+    pps->num_tile_rows_minus1 = BitstreamReadUE(reader);
+    if (pps->num_tile_columns_minus1 >= LENGTH(pps->column_width_minus1) ||
+        pps->num_tile_rows_minus1 >= LENGTH(pps->row_height_minus1)) {
+      fprintf(stderr, "Invalid number of tiles\n");
+      return false;
+    }
+    pps->uniform_spacing_flag = BitstreamRead(reader, 1);
+    if (!pps->uniform_spacing_flag) {
+      for (uint32_t i = 0; i < pps->num_tile_columns_minus1; i++)
+        pps->column_width_minus1[i] = BitstreamReadUE(reader);
+      for (uint32_t i = 0; i < pps->num_tile_rows_minus1; i++)
+        pps->row_height_minus1[i] = BitstreamReadUE(reader);
+    }
+    pps->loop_filter_across_tiles_enabled_flag = BitstreamRead(reader, 1);
+  }
+  pps->pps_loop_filter_across_slices_enabled_flag = BitstreamRead(reader, 1);
+  bool deblocking_filter_control_present_flag = BitstreamRead(reader, 1);
+  if (deblocking_filter_control_present_flag) {
+    pps->deblocking_filter_override_enabled_flag = BitstreamRead(reader, 1);
+    pps->pps_deblocking_filter_disabled_flag = BitstreamRead(reader, 1);
+    if (!pps->pps_deblocking_filter_disabled_flag) {
+      pps->pps_beta_offset_div2 = BitstreamReadSE(reader);
+      pps->pps_tc_offset_div2 = BitstreamReadSE(reader);
+    }
+  }
+  pps->pps_scaling_list_data_present_flag = BitstreamRead(reader, 1);
+  if (pps->pps_scaling_list_data_present_flag) SkipScalingListData(reader);
+  pps->lists_modification_present_flag = BitstreamRead(reader, 1);
+  pps->log2_parallel_merge_level_minus2 = BitstreamReadUE(reader);
+  pps->slice_segment_header_extension_present_flag = BitstreamRead(reader, 1);
+
+  // Range and other extensions are not supported for Main profile.
+  if (BitstreamExhausted(reader)) {
+    fprintf(stderr, "Truncated picture parameter set\n");
+    return false;
+  }
+  return true;
+}
+
+// 7.3.6.3 Weighted prediction parameters syntax
+static void ParsePredWeightTable(struct BitstreamReader* reader,
+                                 const struct SeqParameterSet* sps,
+                                 struct SliceSegmentHeader* slice) {
+  bool chroma = sps->chroma_format_idc != 0 && !sps->separate_colour_plane_flag;
+  slice->luma_log2_weight_denom = BitstreamReadUE(reader);
+  if (chroma) slice->delta_chroma_log2_weight_denom = BitstreamReadSE(reader);
+  int32_t chroma_log2_weight_denom = (int32_t)slice->luma_log2_weight_denom +
+                                     slice->delta_chroma_log2_weight_denom;
+  if (chroma_log2_weight_denom < 0 || chroma_log2_weight_denom > 7)
+    chroma_log2_weight_denom = 0;
+
+  for (int list = 0; list < (slice->slice_type == B ? 2 : 1); list++) {
+    uint32_t count = (list ? slice->num_ref_idx_l1_active_minus1
+                           : slice->num_ref_idx_l0_active_minus1) +
+                     1;
+    int8_t* delta_luma_weight =
+        list ? slice->delta_luma_weight_l1 : slice->delta_luma_weight_l0;
+    int8_t* luma_offset = list ? slice->luma_offset_l1 : slice->luma_offset_l0;
+    int8_t(*delta_chroma_weight)[2] =
+        list ? slice->delta_chroma_weight_l1 : slice->delta_chroma_weight_l0;
+    int8_t(*chroma_offset)[2] =
+        list ? slice->chroma_offset_l1 : slice->chroma_offset_l0;
+
+    bool luma_weight_flag[16];
+    bool chroma_weight_flag[16] = {0};
+    for (uint32_t i = 0; i < count; i++)
+      luma_weight_flag[i] = BitstreamRead(reader, 1);
+    if (chroma) {
+      for (uint32_t i = 0; i < count; i++)
+        chroma_weight_flag[i] = BitstreamRead(reader, 1);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      delta_luma_weight[i] = 0;
+      luma_offset[i] = 0;
+      if (luma_weight_flag[i]) {
+        delta_luma_weight[i] = (int8_t)BitstreamReadSE(reader);
+        luma_offset[i] = (int8_t)BitstreamReadSE(reader);
+      }
+      for (int j = 0; j < 2; j++) {
+        delta_chroma_weight[i][j] = 0;
+        chroma_offset[i][j] = 0;
+        if (!chroma_weight_flag[i]) continue;
+        delta_chroma_weight[i][j] = (int8_t)BitstreamReadSE(reader);
+        int32_t delta_chroma_offset = BitstreamReadSE(reader);
+        // 7.4.7.3 Equation 7-56
+        int32_t chroma_weight =
+            (1 << chroma_log2_weight_denom) + delta_chroma_weight[i][j];
+        int32_t value = 128 + delta_chroma_offset -
+                        ((128 * chroma_weight) >> chroma_log2_weight_denom);
+        chroma_offset[i][j] =
+            (int8_t)(value < -128 ? -128 : value > 127 ? 127 : value);
+      }
+    }
+  }
+}
+
+// 7.3.6.1 General slice segment header syntax
+bool ParseSliceSegmentHeader(struct BitstreamReader* reader,
+                             uint8_t nal_unit_type,
+                             const struct ParameterSets* parameter_sets,
+                             struct SliceSegmentHeader* slice) {
+  size_t header_start = reader->offset;
+  slice->nal_unit_type = nal_unit_type;
+  slice->first_slice_segment_in_pic_flag = BitstreamRead(reader, 1);
+  slice->no_output_of_prior_pics_flag = 0;
+  if (nal_unit_type >= BLA_W_LP && nal_unit_type <= RSV_IRAP_VCL23)
+    slice->no_output_of_prior_pics_flag = BitstreamRead(reader, 1);
+  slice->slice_pic_parameter_set_id = BitstreamReadUE(reader);
+  const struct PicParameterSet* pps =
+      slice->slice_pic_parameter_set_id < LENGTH(parameter_sets->pps)
+          ? parameter_sets->pps[slice->slice_pic_parameter_set_id]
+          : NULL;
+  const struct SeqParameterSet* sps =
+      pps ? parameter_sets->sps[pps->pps_seq_parameter_set_id] : NULL;
+  if (!sps) {
+    fprintf(stderr, "Slice references missing parameter sets\n");
+    return false;
+  }
+
+  uint32_t ctb_log2_size_y = sps->log2_min_luma_coding_block_size_minus3 +
+                             3 + sps->log2_diff_max_min_luma_coding_block_size;
+  uint32_t ctb_size_y = 1u << ctb_log2_size_y;
+  uint32_t pic_size_in_ctbs_y =
+      ((sps->pic_width_in_luma_samples + ctb_size_y - 1) >> ctb_log2_size_y) *
+      ((sps->pic_height_in_luma_samples + ctb_size_y - 1) >> ctb_log2_size_y);
+
+  slice->dependent_slice_segment_flag = 0;
+  slice->slice_segment_address = 0;
+  if (!slice->first_slice_segment_in_pic_flag) {
+    if (pps->dependent_slice_segments_enabled_flag)
+      slice->dependent_slice_segment_flag = BitstreamRead(reader, 1);
+    slice->slice_segment_address =
+        BitstreamRead(reader, CeilLog2(pic_size_in_ctbs_y));
+  }
+
+  if (!slice->dependent_slice_segment_flag) {
+    BitstreamSkip(reader, pps->num_extra_slice_header_bits);
+    slice->slice_type = BitstreamReadUE(reader);
+    if (slice->slice_type > I) {
+      fprintf(stderr, "Invalid slice type\n");
+      return false;
+    }
+    slice->pic_output_flag = 1;
+    if (pps->output_flag_present_flag)
+      slice->pic_output_flag = BitstreamRead(reader, 1);
+    slice->colour_plane_id = 0;
+    if (sps->separate_colour_plane_flag)
+      slice->colour_plane_id = (uint8_t)BitstreamRead(reader, 2);
+
+    uint32_t log2_max_poc_lsb = sps->log2_max_pic_order_cnt_lsb_minus4 + 4;
+    slice->slice_pic_order_cnt_lsb = 0;
+    slice->short_term_ref_pic_set_sps_flag = 0;
+    slice->st_ref_pic_set = (struct ShortTermRefPicSet){0};
+    slice->st_ref_pic_set_bits = 0;
+    slice->num_long_term_sps = 0;
+    slice->num_long_term_pics = 0;
+    slice->slice_temporal_mvp_enabled_flag = 0;
+    if (nal_unit_type != IDR_W_RADL && nal_unit_type != IDR_N_LP) {
+      slice->slice_pic_order_cnt_lsb = BitstreamRead(reader, log2_max_poc_lsb);
+      slice->short_term_ref_pic_set_sps_flag = BitstreamRead(reader, 1);
+      if (!slice->short_term_ref_pic_set_sps_flag) {
+        size_t st_rps_start = reader->offset;
+        if (!ParseShortTermRefPicSet(reader, sps->num_short_term_ref_pic_sets,
+                                     sps->num_short_term_ref_pic_sets,
+                                     sps->st_ref_pic_set,
+                                     &slice->st_ref_pic_set)) {
+          //LOG("Failed to parse short-term reference picture set");
+          return false;
+        }
+        slice->st_ref_pic_set_bits =
+            (uint32_t)(reader->offset - st_rps_start);
+      } else {
+        uint32_t short_term_ref_pic_set_idx = 0;
+        if (sps->num_short_term_ref_pic_sets > 1) {
+          short_term_ref_pic_set_idx = BitstreamRead(
+              reader, CeilLog2(sps->num_short_term_ref_pic_sets));
+        }
+        if (short_term_ref_pic_set_idx >= sps->num_short_term_ref_pic_sets) {
+          fprintf(stderr, "Invalid short-term reference picture set index\n");
+          return false;
+        }
+        slice->st_ref_pic_set =
+            sps->st_ref_pic_set[short_term_ref_pic_set_idx];
+      }
+
+      if (sps->long_term_ref_pics_present_flag) {
+        if (sps->num_long_term_ref_pics_sps > 0)
+          slice->num_long_term_sps = BitstreamReadUE(reader);
+        slice->num_long_term_pics = BitstreamReadUE(reader);
+        if (slice->num_long_term_sps > sps->num_long_term_ref_pics_sps ||
+            slice->num_long_term_sps + slice->num_long_term_pics >
+                LENGTH(slice->poc_lsb_lt)) {
+          fprintf(stderr, "Invalid number of long-term pictures\n");
+          return false;
+        }
+        for (uint32_t i = 0;
+             i < slice->num_long_term_sps + slice->num_long_term_pics; i++) {
+          if (i < slice->num_long_term_sps) {
+            uint32_t lt_idx_sps = 0;
+            if (sps->num_long_term_ref_pics_sps > 1) {
+              lt_idx_sps = BitstreamRead(
+                  reader, CeilLog2(sps->num_long_term_ref_pics_sps));
+            }
+            slice->poc_lsb_lt[i] = sps->lt_ref_pic_poc_lsb_sps[lt_idx_sps];
+            slice->used_by_curr_pic_lt[i] =
+                sps->used_by_curr_pic_lt_sps_flag[lt_idx_sps];
+          } else {
+            slice->poc_lsb_lt[i] = BitstreamRead(reader, log2_max_poc_lsb);
+            slice->used_by_curr_pic_lt[i] = BitstreamRead(reader, 1);
+          }
+          slice->delta_poc_msb_present_flag[i] = BitstreamRead(reader, 1);
+          uint32_t delta_poc_msb_cycle_lt = 0;
+          if (slice->delta_poc_msb_present_flag[i])
+            delta_poc_msb_cycle_lt = BitstreamReadUE(reader);
+          // 7.4.7.1 Equation 7-52
+          if (i != 0 && i != slice->num_long_term_sps)
+            delta_poc_msb_cycle_lt += slice->delta_poc_msb_cycle_lt[i - 1];
+          slice->delta_poc_msb_cycle_lt[i] = delta_poc_msb_cycle_lt;
+        }
+      }
+      if (sps->sps_temporal_mvp_enabled_flag)
+        slice->slice_temporal_mvp_enabled_flag = BitstreamRead(reader, 1);
+    }
+
+    // 7.4.7.2 Equation 7-55
+    slice->num_pic_total_curr = 0;
+    for (uint32_t i = 0; i < slice->st_ref_pic_set.num_negative_pics; i++)
+      slice->num_pic_total_curr += slice->st_ref_pic_set.used_by_curr_pic_s0[i];
+    for (uint32_t i = 0; i < slice->st_ref_pic_set.num_positive_pics; i++)
+      slice->num_pic_total_curr += slice->st_ref_pic_set.used_by_curr_pic_s1[i];
+    for (uint32_t i = 0;
+         i < slice->num_long_term_sps + slice->num_long_term_pics; i++)
+      slice->num_pic_total_curr += slice->used_by_curr_pic_lt[i];
+
+    slice->slice_sao_luma_flag = 0;
+    slice->slice_sao_chroma_flag = 0;
+    if (sps->sample_adaptive_offset_enabled_flag) {
+      slice->slice_sao_luma_flag = BitstreamRead(reader, 1);
+      if (sps->chroma_format_idc != 0 && !sps->separate_colour_plane_flag)
+        slice->slice_sao_chroma_flag = BitstreamRead(reader, 1);
+    }
+
+    slice->num_ref_idx_l0_active_minus1 = 0;
+    slice->num_ref_idx_l1_active_minus1 = 0;
+    slice->ref_pic_list_modification_flag_l0 = 0;
+    slice->ref_pic_list_modification_flag_l1 = 0;
+    slice->mvd_l1_zero_flag = 0;
+    slice->cabac_init_flag = 0;
+    slice->collocated_from_l0_flag = 1;
+    slice->collocated_ref_idx = 0;
+    slice->luma_log2_weight_denom = 0;
+    slice->delta_chroma_log2_weight_denom = 0;
+    slice->five_minus_max_num_merge_cand = 0;
+    if (slice->slice_type == P || slice->slice_type == B) {
+      slice->num_ref_idx_l0_active_minus1 =
+          pps->num_ref_idx_l0_default_active_minus1;
+      if (slice->slice_type == B) {
+        slice->num_ref_idx_l1_active_minus1 =
+            pps->num_ref_idx_l1_default_active_minus1;
+      }
+      bool num_ref_idx_active_override_flag = BitstreamRead(reader, 1);
+      if (num_ref_idx_active_override_flag) {
+        slice->num_ref_idx_l0_active_minus1 = BitstreamReadUE(reader);
+        if (slice->slice_type == B)
+          slice->num_ref_idx_l1_active_minus1 = BitstreamReadUE(reader);
+      }
+      if (slice->num_ref_idx_l0_active_minus1 > 14 ||
+          slice->num_ref_idx_l1_active_minus1 > 14) {
+        fprintf(stderr, "Invalid number of reference indices\n");
+        return false;
+      }
+
+      // 7.3.6.2 Reference picture list modification syntax
+      if (pps->lists_modification_present_flag &&
+          slice->num_pic_total_curr > 1) {
+        uint32_t list_entry_bits = CeilLog2(slice->num_pic_total_curr);
+        slice->ref_pic_list_modification_flag_l0 = BitstreamRead(reader, 1);
+        if (slice->ref_pic_list_modification_flag_l0) {
+          for (uint32_t i = 0; i <= slice->num_ref_idx_l0_active_minus1; i++)
+            slice->list_entry_l0[i] = BitstreamRead(reader, list_entry_bits);
+        }
+        if (slice->slice_type == B) {
+          slice->ref_pic_list_modification_flag_l1 = BitstreamRead(reader, 1);
+          if (slice->ref_pic_list_modification_flag_l1) {
+            for (uint32_t i = 0; i <= slice->num_ref_idx_l1_active_minus1;
+                 i++)
+              slice->list_entry_l1[i] = BitstreamRead(reader, list_entry_bits);
+          }
+        }
+      }
+
+      if (slice->slice_type == B)
+        slice->mvd_l1_zero_flag = BitstreamRead(reader, 1);
+      if (pps->cabac_init_present_flag)
+        slice->cabac_init_flag = BitstreamRead(reader, 1);
+      if (slice->slice_temporal_mvp_enabled_flag) {
+        if (slice->slice_type == B)
+          slice->collocated_from_l0_flag = BitstreamRead(reader, 1);
+        if ((slice->collocated_from_l0_flag &&
+             slice->num_ref_idx_l0_active_minus1 > 0) ||
+            (!slice->collocated_from_l0_flag &&
+             slice->num_ref_idx_l1_active_minus1 > 0))
+          slice->collocated_ref_idx = BitstreamReadUE(reader);
+      }
+      if ((pps->weighted_pred_flag && slice->slice_type == P) ||
+          (pps->weighted_bipred_flag && slice->slice_type == B))
+        ParsePredWeightTable(reader, sps, slice);
+      slice->five_minus_max_num_merge_cand = BitstreamReadUE(reader);
+    }
+
+    slice->slice_qp_delta = BitstreamReadSE(reader);
+    slice->slice_cb_qp_offset = 0;
+    slice->slice_cr_qp_offset = 0;
+    if (pps->pps_slice_chroma_qp_offsets_present_flag) {
+      slice->slice_cb_qp_offset = BitstreamReadSE(reader);
+      slice->slice_cr_qp_offset = BitstreamReadSE(reader);
+    }
+    bool deblocking_filter_override_flag = 0;
+    if (pps->deblocking_filter_override_enabled_flag)
+      deblocking_filter_override_flag = BitstreamRead(reader, 1);
+    slice->slice_deblocking_filter_disabled_flag =
+        pps->pps_deblocking_filter_disabled_flag;
+    slice->slice_beta_offset_div2 = pps->pps_beta_offset_div2;
+    slice->slice_tc_offset_div2 = pps->pps_tc_offset_div2;
+    if (deblocking_filter_override_flag) {
+      slice->slice_deblocking_filter_disabled_flag = BitstreamRead(reader, 1);
+      if (!slice->slice_deblocking_filter_disabled_flag) {
+        slice->slice_beta_offset_div2 = BitstreamReadSE(reader);
+        slice->slice_tc_offset_div2 = BitstreamReadSE(reader);
+      }
+    }
+    slice->slice_loop_filter_across_slices_enabled_flag =
+        pps->pps_loop_filter_across_slices_enabled_flag;
+    if (pps->pps_loop_filter_across_slices_enabled_flag &&
+        (slice->slice_sao_luma_flag || slice->slice_sao_chroma_flag ||
+         !slice->slice_deblocking_filter_disabled_flag)) {
+      slice->slice_loop_filter_across_slices_enabled_flag =
+          BitstreamRead(reader, 1);
+    }
+  }
+
+  slice->num_entry_point_offsets = 0;
+  if (pps->tiles_enabled_flag || pps->entropy_coding_sync_enabled_flag) {
+    slice->num_entry_point_offsets = BitstreamReadUE(reader);
+    if (slice->num_entry_point_offsets > pic_size_in_ctbs_y) {
+      fprintf(stderr, "Invalid number of entry points\n");
+      return false;
+    }
+    if (slice->num_entry_point_offsets > 0) {
+      uint32_t offset_len_minus1 = BitstreamReadUE(reader);
+      if (offset_len_minus1 > 31) {
+        fprintf(stderr, "Invalid entry point offset length\n");
+        return false;
+      }
+      BitstreamSkip(reader, (size_t)slice->num_entry_point_offsets *
+                                (offset_len_minus1 + 1));
+    }
+  }
+  if (pps->slice_segment_header_extension_present_flag) {
+    uint32_t slice_segment_header_extension_length = BitstreamReadUE(reader);
+    BitstreamSkip(reader, slice_segment_header_extension_length * 8);
+  }
+
+  // 7.3.2.12 Byte alignment syntax
+  BitstreamSkip(reader, 1);  // alignment_bit_equal_to_one
+  BitstreamSkip(reader, (8 - (reader->offset - header_start) % 8) % 8);
+  if (BitstreamExhausted(reader)) {
+    fprintf(stderr, "Truncated slice segment header\n");
+    return false;
+  }
+  slice->header_size = (uint32_t)((reader->offset - header_start) / 8);
+  return true;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_HEVCPARSE_H_
+#define STREAMER_HEVCPARSE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct BitstreamReader;
+
+// 7.4.8 Short-term reference picture set semantics, already derived
+struct ShortTermRefPicSet {
+  uint32_t num_negative_pics;
+  uint32_t num_positive_pics;
+  int32_t delta_poc_s0[16];
+  bool used_by_curr_pic_s0[16];
+  int32_t delta_poc_s1[16];
+  bool used_by_curr_pic_s1[16];
+};
+
+struct VideoParameterSet {
+  uint8_t vps_video_parameter_set_id;
+  bool vps_base_layer_internal_flag;
+  bool vps_base_layer_available_flag;
+  uint8_t vps_max_layers_minus1;
+  uint8_t vps_max_sub_layers_minus1;
+  bool vps_temporal_id_nesting_flag;
+  uint8_t general_profile_idc;
+  uint8_t general_level_idc;
+  // Only the highest sub-layer values are kept.
+  uint32_t vps_max_dec_pic_buffering_minus1;
+  uint32_t vps_max_num_reorder_pics;
+  uint32_t vps_max_latency_increase_plus1;
+  uint8_t vps_max_layer_id;
+  uint32_t vps_num_layer_sets_minus1;
+  bool vps_timing_info_present_flag;
+  uint32_t vps_num_units_in_tick;
+  uint32_t vps_time_scale;
+  bool vps_poc_proportional_to_timing_flag;
+  uint32_t vps_num_ticks_poc_diff_one_minus1;
+  uint32_t vps_num_hrd_parameters;
+};
+
+struct SeqParameterSet {
+  uint8_t sps_video_parameter_set_id;
+  uint8_t sps_max_sub_layers_minus1;
+  uint8_t general_profile_idc;
+  uint8_t general_level_idc;
+  uint32_t sps_seq_parameter_set_id;
+  uint32_t chroma_format_idc;
+  bool separate_colour_plane_flag;
+  uint32_t pic_width_in_luma_samples;
+  uint32_t pic_height_in_luma_samples;
+  uint32_t conf_win_left_offset;
+  uint32_t conf_win_right_offset;
+  uint32_t conf_win_top_offset;
+  uint32_t conf_win_bottom_offset;
+  uint32_t bit_depth_luma_minus8;
+  uint32_t bit_depth_chroma_minus8;
+  uint32_t log2_max_pic_order_cnt_lsb_minus4;
+  // Only the highest sub-layer values are kept.
+  uint32_t sps_max_dec_pic_buffering_minus1;
+  uint32_t sps_max_num_reorder_pics;
+  uint32_t sps_max_latency_increase_plus1;
+  uint32_t log2_min_luma_coding_block_size_minus3;
+  uint32_t log2_diff_max_min_luma_coding_block_size;
+  uint32_t log2_min_luma_transform_block_size_minus2;
+  uint32_t log2_diff_max_min_luma_transform_block_size;
+  uint32_t max_transform_hierarchy_depth_inter;
+  uint32_t max_transform_hierarchy_depth_intra;
+  bool scaling_list_enabled_flag;
+  bool amp_enabled_flag;
+  bool sample_adaptive_offset_enabled_flag;
+  bool pcm_enabled_flag;
+  uint8_t pcm_sample_bit_depth_luma_minus1;
+  uint8_t pcm_sample_bit_depth_chroma_minus1;
+  uint32_t log2_min_pcm_luma_coding_block_size_minus3;
+  uint32_t log2_diff_max_min_pcm_luma_coding_block_size;
+  bool pcm_loop_filter_disabled_flag;
+  uint32_t num_short_term_ref_pic_sets;
+  struct ShortTermRefPicSet st_ref_pic_set[64];
+  bool long_term_ref_pics_present_flag;
+  uint32_t num_long_term_ref_pics_sps;
+  uint32_t lt_ref_pic_poc_lsb_sps[32];
+  bool used_by_curr_pic_lt_sps_flag[32];
+  bool sps_temporal_mvp_enabled_flag;
+  bool strong_intra_smoothing_enabled_flag;
+  bool vui_parameters_present_flag;
+  // E.2.1 VUI parameters, up to and excluding hrd_parameters
+  bool video_signal_type_present_flag;
+  uint8_t video_format;
+  bool video_full_range_flag;
+  bool colour_description_present_flag;
+  uint8_t colour_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coeffs;
+  bool chroma_loc_info_present_flag;
+  uint32_t chroma_sample_loc_type_top_field;
+  uint32_t chroma_sample_loc_type_bottom_field;
+  bool field_seq_flag;
+  bool vui_timing_info_present_flag;
+  uint32_t vui_num_units_in_tick;
+  uint32_t vui_time_scale;
+};
+
+struct PicParameterSet {
+  uint32_t pps_pic_parameter_set_id;
+  uint32_t pps_seq_parameter_set_id;
+  bool dependent_slice_segments_enabled_flag;
+  bool output_flag_present_flag;
+  uint8_t num_extra_slice_header_bits;
+  bool sign_data_hiding_enabled_flag;
+  bool cabac_init_present_flag;
+  uint32_t num_ref_idx_l0_default_active_minus1;
+  uint32_t num_ref_idx_l1_default_active_minus1;
+  int32_t init_qp_minus26;
+  bool constrained_intra_pred_flag;
+  bool transform_skip_enabled_flag;
+  bool cu_qp_delta_enabled_flag;
+  uint32_t diff_cu_qp_delta_depth;
+  int32_t pps_cb_qp_offset;
+  int32_t pps_cr_qp_offset;
+  bool pps_slice_chroma_qp_offsets_present_flag;
+  bool weighted_pred_flag;
+  bool weighted_bipred_flag;
+  bool transquant_bypass_enabled_flag;
+  bool tiles_enabled_flag;
+  bool entropy_coding_sync_enabled_flag;
+  uint32_t num_tile_columns_minus1;
+  uint32_t num_tile_rows_minus1;
+  bool uniform_spacing_flag;
+  uint32_t column_width_minus1[20];
+  uint32_t row_height_minus1[22];
+  bool loop_filter_across_tiles_enabled_flag;
+  bool pps_loop_filter_across_slices_enabled_flag;
+  bool deblocking_filter_override_enabled_flag;
+  bool pps_deblocking_filter_disabled_flag;
+  int32_t pps_beta_offset_div2;
+  int32_t pps_tc_offset_div2;
+  bool pps_scaling_list_data_present_flag;
+  bool lists_modification_present_flag;
+  uint32_t log2_parallel_merge_level_minus2;
+  bool slice_segment_header_extension_present_flag;
+};
+
+// Parameter sets are referenced by id from slice headers.
+struct ParameterSets {
+  struct SeqParameterSet* sps[16];
+  struct PicParameterSet* pps[64];
+};
+
+struct SliceSegmentHeader {
+  uint8_t nal_unit_type;
+  bool first_slice_segment_in_pic_flag;
+  bool no_output_of_prior_pics_flag;
+  uint32_t slice_pic_parameter_set_id;
+  bool dependent_slice_segment_flag;
+  uint32_t slice_segment_address;
+  uint32_t slice_type;
+  bool pic_output_flag;
+  uint8_t colour_plane_id;
+  uint32_t slice_pic_order_cnt_lsb;
+  bool short_term_ref_pic_set_sps_flag;
+  struct ShortTermRefPicSet st_ref_pic_set;
+  uint32_t st_ref_pic_set_bits;
+  uint32_t num_long_term_sps;
+  uint32_t num_long_term_pics;
+  // 7.4.7.1 PocLsbLt, UsedByCurrPicLt and DeltaPocMsbCycleLt
+  uint32_t poc_lsb_lt[32];
+  bool used_by_curr_pic_lt[32];
+  bool delta_poc_msb_present_flag[32];
+  uint32_t delta_poc_msb_cycle_lt[32];
+  bool slice_temporal_mvp_enabled_flag;
+  bool slice_sao_luma_flag;
+  bool slice_sao_chroma_flag;
+  uint32_t num_ref_idx_l0_active_minus1;
+  uint32_t num_ref_idx_l1_active_minus1;
+  bool ref_pic_list_modification_flag_l0;
+  uint32_t list_entry_l0[16];
+  bool ref_pic_list_modification_flag_l1;
+  uint32_t list_entry_l1[16];
+  bool mvd_l1_zero_flag;
+  bool cabac_init_flag;
+  bool collocated_from_l0_flag;
+  uint32_t collocated_ref_idx;
+  uint32_t luma_log2_weight_denom;
+  int32_t delta_chroma_log2_weight_denom;
+  int8_t delta_luma_weight_l0[16];
+  int8_t luma_offset_l0[16];
+  int8_t delta_chroma_weight_l0[16][2];
+  // Derived ChromaOffsetL0, which is what va expects.
+  int8_t chroma_offset_l0[16][2];
+  int8_t delta_luma_weight_l1[16];
+  int8_t luma_offset_l1[16];
+  int8_t delta_chroma_weight_l1[16][2];
+  int8_t chroma_offset_l1[16][2];
+  uint32_t five_minus_max_num_merge_cand;
+  int32_t slice_qp_delta;
+  int32_t slice_cb_qp_offset;
+  int32_t slice_cr_qp_offset;
+  bool slice_deblocking_filter_disabled_flag;
+  int32_t slice_beta_offset_div2;
+  int32_t slice_tc_offset_div2;
+  bool slice_loop_filter_across_slices_enabled_flag;
+  uint32_t num_entry_point_offsets;
+  // 7.4.7.2 NumPicTotalCurr
+  uint32_t num_pic_total_curr;
+  // Size of the header in bytes of rbsp, including the byte_alignment().
+  uint32_t header_size;
+};
+
+// Readers are positioned right after the nal unit header. Dependent slice
+// segments inherit their fields from the previous contents of slice.
+bool ParseVideoParameterSet(struct BitstreamReader* reader,
+                            struct VideoParameterSet* vps);
+bool ParseSeqParameterSet(struct BitstreamReader* reader,
+                          struct SeqParameterSet* sps);
+bool ParsePicParameterSet(struct BitstreamReader* reader,
+                          struct PicParameterSet* pps);
+bool ParseSliceSegmentHeader(struct BitstreamReader* reader,
+                             uint8_t nal_unit_type,
+                             const struct ParameterSets* parameter_sets,
+                             struct SliceSegmentHeader* slice);
+
+#endif  // STREAMER_HEVCPARSE_H_
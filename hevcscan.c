@@ -0,0 +1,648 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitstream.h"
+#include "hevc.h"
+#include "hevcparse.h"
+#include "keyindex.h"
+#include "proto.h"
+#include "protoreader.h"
+
+// Slice headers only need a short prefix of the slice to be unescaped, which
+// keeps the scan bound by the storage rather than by the emulation prevention
+// removal. The whole unit is unescaped when the prefix turns out to be too
+// short, e.g. with many entry points.
+#define SLICE_HEADER_PREFIX 1024
+
+struct ScanFrame {
+  uint64_t index;
+  uint64_t offset;
+  uint64_t size;
+  // Bytes of the file taken by the frame, including any framing.
+  uint64_t span;
+  uint64_t pts;
+  bool has_pts;
+  bool keyframe;
+  bool has_vcl;
+  uint8_t nal_unit_type;
+  int slice_type;
+  uint32_t slice_pic_order_cnt_lsb;
+};
+
+struct ScanGop {
+  uint64_t offset;
+  uint64_t first_frame;
+  uint64_t frames;
+  uint64_t bytes;
+  bool keyframe;
+  char pattern[49];
+  size_t pattern_length;
+};
+
+struct ScanStats {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t keyframes;
+  uint64_t type_frames[3];
+  uint64_t type_bytes[3];
+  uint64_t type_max[3];
+  uint64_t closed_gops;
+  uint64_t gop_min;
+  uint64_t gop_max;
+  uint64_t gop_frames;
+  uint64_t first_pts;
+  uint64_t last_pts;
+  bool has_pts;
+};
+
+struct ScanContext {
+  bool records;
+  bool verbose;
+  double fps;
+  struct KeyIndexWriter* key_index_writer;
+  struct VideoParameterSet vps[16];
+  bool vps_valid[16];
+  struct SeqParameterSet sps[16];
+  struct PicParameterSet pps[64];
+  struct ParameterSets parameter_sets;
+  struct SliceSegmentHeader slice;
+  uint8_t* rbsp;
+  size_t rbsp_alloc;
+  struct ScanFrame frame;
+  bool frame_open;
+  struct ScanGop gop;
+  bool gop_open;
+  struct ScanStats stats;
+};
+
+static unsigned long long NanosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL +
+         (unsigned long long)ts.tv_nsec;
+}
+
+static bool IsIrap(uint8_t nal_unit_type) {
+  return nal_unit_type >= BLA_W_LP && nal_unit_type <= RSV_IRAP_VCL23;
+}
+
+static bool IsIdr(uint8_t nal_unit_type) {
+  return nal_unit_type == IDR_W_RADL || nal_unit_type == IDR_N_LP;
+}
+
+static char SliceTypeChar(int slice_type) {
+  switch (slice_type) {
+    case B:
+      return 'B';
+    case P:
+      return 'P';
+    case I:
+      return 'I';
+    default:
+      return '?';
+  }
+}
+
+// Returns the offset of the next start code prefix at or after offset, or
+// size if there is none.
+static size_t FindStartCode(const uint8_t* data, size_t size, size_t offset) {
+  while (offset + 3 <= size) {
+    const uint8_t* one = memchr(data + offset + 2, 1, size - offset - 2);
+    if (!one) break;
+    size_t position = (size_t)(one - data);
+    if (!data[position - 1] && !data[position - 2]) return position - 2;
+    offset = position - 1;
+  }
+  return size;
+}
+
+static bool Unescape(struct ScanContext* scan_context, const uint8_t* nal_data,
+                     size_t nal_size, struct BitstreamReader* reader) {
+  if (nal_size > scan_context->rbsp_alloc) {
+    uint8_t* rbsp = realloc(scan_context->rbsp, nal_size);
+    if (!rbsp) {
+      fprintf(stderr, "Failed to grow rbsp buffer: %s\n", strerror(errno));
+      return false;
+    }
+    scan_context->rbsp = rbsp;
+    scan_context->rbsp_alloc = nal_size;
+  }
+  struct Bitstream bitstream = {
+      .data = scan_context->rbsp,
+      .size = 0,
+  };
+  const struct Bitstream source = {
+      .data = (void*)(uintptr_t)nal_data,
+      .size = nal_size * 8,
+  };
+  BitstreamDeflate(&bitstream, &source);
+  *reader = (struct BitstreamReader){
+      .data = scan_context->rbsp,
+      .size = bitstream.size,
+      .offset = 16,  // nal_unit_header
+  };
+  return true;
+}
+
+static void PrintVideoParameterSet(const struct VideoParameterSet* vps) {
+  printf("vps %u: profile %u, level %u.%u, dpb %u, reorder %u",
+         vps->vps_video_parameter_set_id, vps->general_profile_idc,
+         vps->general_level_idc / 30, vps->general_level_idc % 30 / 3,
+         vps->vps_max_dec_pic_buffering_minus1 + 1,
+         vps->vps_max_num_reorder_pics);
+  if (vps->vps_timing_info_present_flag && vps->vps_num_units_in_tick) {
+    printf(", %.3f fps",
+           (double)vps->vps_time_scale / vps->vps_num_units_in_tick);
+  }
+  printf("\n");
+}
+
+static void PrintSeqParameterSet(const struct SeqParameterSet* sps) {
+  uint32_t sub_width = sps->chroma_format_idc == 1 ||
+                               sps->chroma_format_idc == 2
+                           ? 2
+                           : 1;
+  uint32_t sub_height = sps->chroma_format_idc == 1 ? 2 : 1;
+  uint32_t width = sps->pic_width_in_luma_samples -
+                   sub_width * (sps->conf_win_left_offset +
+                                sps->conf_win_right_offset);
+  uint32_t height = sps->pic_height_in_luma_samples -
+                    sub_height * (sps->conf_win_top_offset +
+                                  sps->conf_win_bottom_offset);
+  printf("sps %u: %ux%u (coded %ux%u), profile %u, level %u.%u, %u bit, "
+         "dpb %u, reorder %u",
+         sps->sps_seq_parameter_set_id, width, height,
+         sps->pic_width_in_luma_samples, sps->pic_height_in_luma_samples,
+         sps->general_profile_idc, sps->general_level_idc / 30,
+         sps->general_level_idc % 30 / 3, sps->bit_depth_luma_minus8 + 8,
+         sps->sps_max_dec_pic_buffering_minus1 + 1,
+         sps->sps_max_num_reorder_pics);
+  if (sps->vui_parameters_present_flag) {
+    if (sps->colour_description_present_flag) {
+      printf(", colour %u/%u/%u", sps->colour_primaries,
+             sps->transfer_characteristics, sps->matrix_coeffs);
+    }
+    if (sps->video_signal_type_present_flag)
+      printf(", %s range", sps->video_full_range_flag ? "full" : "limited");
+    if (sps->vui_timing_info_present_flag && sps->vui_num_units_in_tick) {
+      printf(", %.3f fps",
+             (double)sps->vui_time_scale / sps->vui_num_units_in_tick);
+    }
+  }
+  printf("\n");
+}
+
+static void CloseGop(struct ScanContext* scan_context, bool closed) {
+  struct ScanGop* gop = &scan_context->gop;
+  struct ScanStats* stats = &scan_context->stats;
+  printf("gop at offset %llu, frame %llu: %llu frames, %llu bytes, %s%.*s%s\n",
+         (unsigned long long)gop->offset,
+         (unsigned long long)gop->first_frame,
+         (unsigned long long)gop->frames, (unsigned long long)gop->bytes,
+         gop->keyframe ? "" : "no keyframe, ", (int)gop->pattern_length,
+         gop->pattern,
+         gop->frames > gop->pattern_length ? "..." : "");
+  if (closed && gop->keyframe) {
+    if (!stats->closed_gops || gop->frames < stats->gop_min)
+      stats->gop_min = gop->frames;
+    if (gop->frames > stats->gop_max) stats->gop_max = gop->frames;
+    stats->gop_frames += gop->frames;
+    stats->closed_gops++;
+  }
+  scan_context->gop_open = false;
+}
+
+static void FinishFrame(struct ScanContext* scan_context) {
+  struct ScanFrame* frame = &scan_context->frame;
+  struct ScanStats* stats = &scan_context->stats;
+  if (!scan_context->frame_open) return;
+  scan_context->frame_open = false;
+
+  if (scan_context->verbose) {
+    printf("frame %llu at offset %llu: %c%s, %llu bytes, nal %u, poc lsb %u",
+           (unsigned long long)frame->index,
+           (unsigned long long)frame->offset,
+           SliceTypeChar(frame->slice_type), frame->keyframe ? " key" : "",
+           (unsigned long long)frame->size, frame->nal_unit_type,
+           frame->slice_pic_order_cnt_lsb);
+    if (frame->has_pts) printf(", pts %llu", (unsigned long long)frame->pts);
+    printf("\n");
+  }
+
+  // Annex b streams carry no pts, those are derived from the frame rate so that
+  // indices of both kinds can be looked up by time.
+  if (frame->keyframe && scan_context->key_index_writer) {
+    uint64_t pts = frame->has_pts
+                       ? frame->pts
+                       : (uint64_t)((double)frame->index * 1e6 /
+                                    scan_context->fps);
+    KeyIndexWriterAppend(scan_context->key_index_writer, frame->offset, pts,
+                         (uint32_t)frame->span);
+  }
+
+  if (frame->keyframe && scan_context->gop_open)
+    CloseGop(scan_context, true);
+  if (!scan_context->gop_open) {
+    scan_context->gop = (struct ScanGop){
+        .offset = frame->offset,
+        .first_frame = frame->index,
+        .keyframe = frame->keyframe,
+    };
+    scan_context->gop_open = true;
+  }
+  struct ScanGop* gop = &scan_context->gop;
+  if (gop->pattern_length < sizeof(gop->pattern) - 1)
+    gop->pattern[gop->pattern_length++] = SliceTypeChar(frame->slice_type);
+  gop->frames++;
+  gop->bytes += frame->size;
+
+  stats->frames++;
+  stats->bytes += frame->size;
+  if (frame->keyframe) stats->keyframes++;
+  if (frame->slice_type >= B && frame->slice_type <= I) {
+    stats->type_frames[frame->slice_type]++;
+    stats->type_bytes[frame->slice_type] += frame->size;
+    if (frame->size > stats->type_max[frame->slice_type])
+      stats->type_max[frame->slice_type] = frame->size;
+  }
+  if (frame->has_pts) {
+    if (!stats->has_pts) stats->first_pts = frame->pts;
+    stats->last_pts = frame->pts;
+    stats->has_pts = true;
+  }
+}
+
+static void StartFrame(struct ScanContext* scan_context, uint64_t offset) {
+  // Annex b access units end where the next one starts.
+  if (!scan_context->records && scan_context->frame_open) {
+    scan_context->frame.size = offset - scan_context->frame.offset;
+    scan_context->frame.span = scan_context->frame.size;
+  }
+  FinishFrame(scan_context);
+  scan_context->frame = (struct ScanFrame){
+      .index = scan_context->stats.frames,
+      .offset = offset,
+      .slice_type = -1,
+  };
+  scan_context->frame_open = true;
+}
+
+static void ProcessParameterSet(struct ScanContext* scan_context,
+                                uint8_t nal_unit_type,
+                                struct BitstreamReader* reader) {
+  switch (nal_unit_type) {
+    case VPS_NUT: {
+      struct VideoParameterSet vps;
+      if (!ParseVideoParameterSet(reader, &vps)) return;
+      struct VideoParameterSet* slot =
+          &scan_context->vps[vps.vps_video_parameter_set_id];
+      bool* valid = &scan_context->vps_valid[vps.vps_video_parameter_set_id];
+      if (*valid && !memcmp(slot, &vps, sizeof(vps))) return;
+      *slot = vps;
+      *valid = true;
+      PrintVideoParameterSet(slot);
+      return;
+    }
+    case SPS_NUT: {
+      struct SeqParameterSet sps;
+      if (!ParseSeqParameterSet(reader, &sps)) return;
+      uint32_t id = sps.sps_seq_parameter_set_id;
+      struct SeqParameterSet* slot = &scan_context->sps[id];
+      if (scan_context->parameter_sets.sps[id] &&
+          !memcmp(slot, &sps, sizeof(sps)))
+        return;
+      *slot = sps;
+      scan_context->parameter_sets.sps[id] = slot;
+      if (sps.vui_timing_info_present_flag && sps.vui_num_units_in_tick) {
+        scan_context->fps =
+            (double)sps.vui_time_scale / sps.vui_num_units_in_tick;
+      }
+      PrintSeqParameterSet(slot);
+      return;
+    }
+    case PPS_NUT: {
+      struct PicParameterSet pps;
+      if (!ParsePicParameterSet(reader, &pps)) return;
+      uint32_t id = pps.pps_pic_parameter_set_id;
+      scan_context->pps[id] = pps;
+      scan_context->parameter_sets.pps[id] = &scan_context->pps[id];
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+static void ProcessSlice(struct ScanContext* scan_context,
+                         const uint8_t* nal_data, size_t nal_size,
+                         uint8_t nal_unit_type) {
+  struct ScanFrame* frame = &scan_context->frame;
+  frame->has_vcl = true;
+  if (IsIrap(nal_unit_type)) frame->keyframe = true;
+
+  // Only the first slice segment of a picture is parsed, the rest can not
+  // change anything that is reported.
+  if (nal_size < 3 || !(nal_data[2] & 0x80)) return;
+  frame->nal_unit_type = nal_unit_type;
+  size_t sizes[] = {nal_size < SLICE_HEADER_PREFIX ? nal_size
+                                                   : SLICE_HEADER_PREFIX,
+                    nal_size};
+  for (size_t i = 0; i < LENGTH(sizes); i++) {
+    if (i && sizes[i] == sizes[i - 1]) break;
+    struct BitstreamReader reader;
+    if (!Unescape(scan_context, nal_data, sizes[i], &reader)) return;
+    if (!ParseSliceSegmentHeader(&reader, nal_unit_type,
+                                 &scan_context->parameter_sets,
+                                 &scan_context->slice))
+      continue;
+    frame->slice_type = (int)scan_context->slice.slice_type;
+    frame->slice_pic_order_cnt_lsb =
+        IsIdr(nal_unit_type) ? 0 : scan_context->slice.slice_pic_order_cnt_lsb;
+    return;
+  }
+}
+
+// 7.4.2.4.4 Order of nal units and coded pictures and their association to
+// access units, only applies to annex b streams. Recordings carry one
+// access unit per record instead.
+static bool StartsAccessUnit(const uint8_t* nal_data, size_t nal_size,
+                             uint8_t nal_unit_type) {
+  if (nal_unit_type <= RSV_VCL31)
+    return nal_size >= 3 && nal_data[2] & 0x80;
+  return (nal_unit_type >= VPS_NUT && nal_unit_type <= AUD_NUT) ||
+         nal_unit_type == 39 || (nal_unit_type >= 41 && nal_unit_type <= 44) ||
+         (nal_unit_type >= 48 && nal_unit_type <= 55);
+}
+
+static void ProcessNalUnit(struct ScanContext* scan_context,
+                           const uint8_t* nal_data, size_t nal_size,
+                           uint64_t unit_offset) {
+  if (nal_size < 2) return;
+  uint8_t nal_unit_type = nal_data[0] >> 1 & 0x3f;
+  uint8_t nuh_layer_id = (nal_data[0] & 1) << 5 | nal_data[1] >> 3;
+  if (nuh_layer_id) return;
+
+  if (!scan_context->records &&
+      StartsAccessUnit(nal_data, nal_size, nal_unit_type) &&
+      (!scan_context->frame_open || scan_context->frame.has_vcl))
+    StartFrame(scan_context, unit_offset);
+  if (!scan_context->frame_open) return;
+
+  if (nal_unit_type <= RSV_VCL31) {
+    ProcessSlice(scan_context, nal_data, nal_size, nal_unit_type);
+  } else if (nal_unit_type >= VPS_NUT && nal_unit_type <= PPS_NUT) {
+    struct BitstreamReader reader;
+    if (!Unescape(scan_context, nal_data, nal_size, &reader)) return;
+    ProcessParameterSet(scan_context, nal_unit_type, &reader);
+  }
+}
+
+static void ScanNalUnits(struct ScanContext* scan_context, const uint8_t* data,
+                         size_t size, uint64_t base_offset) {
+  size_t unit_offset = 0;
+  for (size_t begin = FindStartCode(data, size, 0); begin < size;) {
+    size_t nal_begin = begin + 3;
+    size_t next = FindStartCode(data, size, nal_begin);
+    size_t nal_end = next;
+    // trailing_zero_8bits and zero_byte belong to the next unit.
+    while (nal_end > nal_begin && !data[nal_end - 1]) nal_end--;
+    ProcessNalUnit(scan_context, data + nal_begin, nal_end - nal_begin,
+                   base_offset + unit_offset);
+    unit_offset = nal_end;
+    begin = next;
+  }
+}
+
+static bool ScanAnnexB(struct ScanContext* scan_context, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  ScanNalUnits(scan_context, data, size, 0);
+  if (scan_context->frame_open) {
+    scan_context->frame.size = size - scan_context->frame.offset;
+    scan_context->frame.span = scan_context->frame.size;
+  }
+  munmap(data, size);
+  return true;
+}
+
+static bool ScanRecords(struct ScanContext* scan_context, const char* path) {
+  struct ProtoReader* proto_reader = ProtoReaderCreate(path);
+  if (!proto_reader) {
+    fprintf(stderr, "Failed to create proto reader\n");
+    return false;
+  }
+
+  // Only the first video stream is scanned, interleaved streams would otherwise
+  // mix their gops.
+  bool stream_known = false;
+  uint32_t stream_id = 0;
+  uint64_t offset = 0;
+  struct ProtoRecord proto_record;
+  while (ProtoReaderNext(proto_reader, &proto_record)) {
+    const struct Proto2* header = &proto_record.header;
+    uint64_t record_offset = offset;
+    offset += proto_record.record_size;
+    if (header->type != PROTO_TYPE_VIDEO) continue;
+    if (!stream_known) stream_id = header->stream_id;
+    stream_known = true;
+    if (header->stream_id != stream_id) continue;
+
+    if (header->fragment & PROTO_FRAGMENT_FIRST || !scan_context->frame_open) {
+      StartFrame(scan_context, record_offset);
+      scan_context->frame.keyframe = header->flags & PROTO_FLAG_KEYFRAME;
+      scan_context->frame.pts = header->pts;
+      scan_context->frame.has_pts = header->version >= PROTO_VERSION;
+    }
+    scan_context->frame.size += header->size;
+    scan_context->frame.span += proto_record.record_size;
+    ScanNalUnits(scan_context, proto_record.payload, header->size,
+                 record_offset);
+  }
+  ProtoReaderDestroy(proto_reader);
+  return true;
+}
+
+// Tells annex b streams from proto recordings by their first bytes.
+static bool IsAnnexB(const char* path, bool* annexb) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint8_t prefix[4] = {0xff, 0xff, 0xff, 0xff};
+  ssize_t result = read(fd, prefix, sizeof(prefix));
+  close(fd);
+  if (result < 0) {
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  *annexb = !prefix[0] && !prefix[1] &&
+            (prefix[2] == 1 || (!prefix[2] && prefix[3] == 1));
+  return true;
+}
+
+static void PrintSummary(const struct ScanContext* scan_context,
+                         double elapsed, uint64_t file_size) {
+  const struct ScanStats* stats = &scan_context->stats;
+  printf("%llu frames, %llu keyframes, %llu bytes\n",
+         (unsigned long long)stats->frames,
+         (unsigned long long)stats->keyframes,
+         (unsigned long long)stats->bytes);
+  for (int i = I; i >= B; i--) {
+    if (!stats->type_frames[i]) continue;
+    printf("%c frames: %llu, average %llu bytes, max %llu bytes\n",
+           SliceTypeChar(i), (unsigned long long)stats->type_frames[i],
+           (unsigned long long)(stats->type_bytes[i] / stats->type_frames[i]),
+           (unsigned long long)stats->type_max[i]);
+  }
+  if (stats->closed_gops) {
+    printf("gop length: min %llu, average %.1f, max %llu\n",
+           (unsigned long long)stats->gop_min,
+           (double)stats->gop_frames / (double)stats->closed_gops,
+           (unsigned long long)stats->gop_max);
+  }
+  // Recording pts are in microseconds.
+  if (stats->has_pts && stats->last_pts > stats->first_pts &&
+      stats->frames > 1) {
+    double duration = (double)(stats->last_pts - stats->first_pts) / 1e6 *
+                      (double)stats->frames / (double)(stats->frames - 1);
+    printf("duration %.3f s, %.3f fps, %.2f Mbps\n", duration,
+           (double)stats->frames / duration,
+           (double)stats->bytes * 8 / duration / 1e6);
+  }
+  printf("scanned %.2f MB in %.3f s, %.1f MB/s\n", (double)file_size / 1e6,
+         elapsed, elapsed > 0 ? (double)file_size / 1e6 / elapsed : 0);
+}
+
+static void Usage(const char* self) {
+  fprintf(stderr,
+          "Usage: %s [-f] [-i index] [-r fps] <recording|stream.h265>\n"
+          "  -f  report every frame, not only gops\n"
+          "  -i  write a key index sidecar for the scanned file\n"
+          "  -r  frame rate for streams without pts or vui timing "
+          "(default 60)\n",
+          self);
+}
+
+int main(int argc, char* argv[]) {
+  bool verbose = false;
+  const char* index_path = NULL;
+  double fps = 60;
+  for (int opt; (opt = getopt(argc, argv, "fi:r:")) != -1;) {
+    switch (opt) {
+      case 'f':
+        verbose = true;
+        break;
+      case 'i':
+        index_path = optarg;
+        break;
+      case 'r':
+        fps = strtod(optarg, NULL);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 1 || fps <= 0) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char* path = argv[optind];
+  bool annexb;
+  if (!IsAnnexB(path, &annexb)) {
+    fprintf(stderr, "Failed to detect input format\n");
+    return EXIT_FAILURE;
+  }
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct ScanContext* scan_context = calloc(1, sizeof(struct ScanContext));
+  if (!scan_context) {
+    fprintf(stderr, "Failed to allocate scan context: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  scan_context->records = !annexb;
+  scan_context->verbose = verbose;
+  scan_context->fps = fps;
+
+  int result = EXIT_FAILURE;
+  if (index_path) {
+    scan_context->key_index_writer = KeyIndexWriterCreate(index_path);
+    if (!scan_context->key_index_writer) {
+      fprintf(stderr, "Failed to create key index writer\n");
+      goto rollback_scan_context;
+    }
+  }
+  unsigned long long started = NanosNow();
+  if (annexb ? !ScanAnnexB(scan_context, path)
+             : !ScanRecords(scan_context, path)) {
+    fprintf(stderr, "Failed to scan %s\n", path);
+    goto rollback_scan_context;
+  }
+  FinishFrame(scan_context);
+  if (scan_context->gop_open) CloseGop(scan_context, false);
+  double elapsed = (double)(NanosNow() - started) / 1e9;
+  PrintSummary(scan_context, elapsed, (uint64_t)st.st_size);
+  result = EXIT_SUCCESS;
+
+  if (scan_context->key_index_writer &&
+      !KeyIndexWriterFlush(scan_context->key_index_writer)) {
+    fprintf(stderr, "Failed to flush key index\n");
+    result = EXIT_FAILURE;
+  }
+
+rollback_scan_context:
+  if (scan_context->key_index_writer)
+    KeyIndexWriterDestroy(scan_context->key_index_writer);
+  free(scan_context->rbsp);
+  free(scan_context);
+  return result;
+}
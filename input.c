@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define CARRY_SIZE 4096
+#define Y4M_SIGNATURE "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME"
+
+struct FrameInput {
+  int fd;
+  int shutdown;
+  struct InputFormat format;
+  size_t frame_size;
+
+  // Small reads for y4m headers go through the carry buffer, so that frame
+  // payloads can be read straight into ring slots.
+  uint8_t carry[CARRY_SIZE];
+  size_t carry_offset;
+  size_t carry_size;
+
+  uint8_t* slots;
+  size_t ring_size;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t head;
+  size_t tail;
+  bool eof;
+  bool failed;
+  bool stopping;
+  pthread_t thread;
+};
+
+static ssize_t ReadSome(struct FrameInput* frame_input, void* buffer,
+                        size_t size) {
+  for (;;) {
+    struct pollfd pfds[] = {
+        {.fd = frame_input->fd, .events = POLLIN},
+        {.fd = frame_input->shutdown, .events = POLLIN},
+    };
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to poll input: %s\n", strerror(errno));
+      return -1;
+    }
+    if (pfds[1].revents) return -1;
+
+    ssize_t result = read(frame_input->fd, buffer, size);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      fprintf(stderr, "Failed to read input: %s\n", strerror(errno));
+    }
+    return result;
+  }
+}
+
+static bool EnsureCarry(struct FrameInput* frame_input, size_t size) {
+  size_t available = frame_input->carry_size - frame_input->carry_offset;
+  if (available >= size) return true;
+  memmove(frame_input->carry, frame_input->carry + frame_input->carry_offset,
+          available);
+  frame_input->carry_offset = 0;
+  frame_input->carry_size = available;
+  while (frame_input->carry_size < size) {
+    ssize_t result =
+        ReadSome(frame_input, frame_input->carry + frame_input->carry_size,
+                 sizeof(frame_input->carry) - frame_input->carry_size);
+    if (result <= 0) return false;
+    frame_input->carry_size += (size_t)result;
+  }
+  return true;
+}
+
+// Returns line length without the terminating newline, or -1 at the end of
+// the stream or when the line does not fit.
+static int ReadLine(struct FrameInput* frame_input, char* line, size_t size) {
+  for (size_t length = 0; length < size; length++) {
+    if (!EnsureCarry(frame_input, 1)) return -1;
+    char c = (char)frame_input->carry[frame_input->carry_offset++];
+    if (c == '\n') {
+      line[length] = 0;
+      return (int)length;
+    }
+    line[length] = c;
+  }
+  fprintf(stderr, "Y4M header line is too long\n");
+  return -1;
+}
+
+// Returns 1 when the buffer was filled, 0 on a clean end of the stream
+// before the first byte, and -1 otherwise.
+static int ReadExact(struct FrameInput* frame_input, uint8_t* buffer,
+                     size_t size) {
+  size_t available = frame_input->carry_size - frame_input->carry_offset;
+  size_t carried = available < size ? available : size;
+  memcpy(buffer, frame_input->carry + frame_input->carry_offset, carried);
+  frame_input->carry_offset += carried;
+  for (size_t offset = carried; offset < size;) {
+    ssize_t result = ReadSome(frame_input, buffer + offset, size - offset);
+    if (result <= 0) {
+      if (!result && !offset) return 0;
+      if (!result) fprintf(stderr, "Truncated input frame\n");
+      return -1;
+    }
+    offset += (size_t)result;
+  }
+  return 1;
+}
+
+static bool ParseY4mHeader(const char* line, struct InputFormat* format) {
+  *format = (struct InputFormat){
+      .fps_num = 25,
+      .fps_den = 1,
+      .range = kNarrowRange,
+      .y4m = true,
+  };
+  char copy[256];
+  snprintf(copy, sizeof(copy), "%s", line + sizeof(Y4M_SIGNATURE) - 1);
+  char* saveptr;
+  for (char* token = strtok_r(copy, " ", &saveptr); token;
+       token = strtok_r(NULL, " ", &saveptr)) {
+    switch (token[0]) {
+      case 'W':
+        format->width = (uint32_t)strtoul(token + 1, NULL, 10);
+        break;
+      case 'H':
+        format->height = (uint32_t)strtoul(token + 1, NULL, 10);
+        break;
+      case 'F':
+        if (sscanf(token + 1, "%u:%u", &format->fps_num, &format->fps_den) !=
+                2 ||
+            !format->fps_den) {
+          fprintf(stderr, "Invalid y4m frame rate %s\n", token + 1);
+          return false;
+        }
+        break;
+      case 'I':
+        if (strcmp(token, "Ip") && strcmp(token, "I?")) {
+          fprintf(stderr, "Interlaced y4m input is not supported\n");
+          return false;
+        }
+        break;
+      case 'C':
+        if (strncmp(token + 1, "420", 3) ||
+            (token[4] && strcmp(token + 4, "jpeg") &&
+             strcmp(token + 4, "mpeg2") && strcmp(token + 4, "paldv"))) {
+          fprintf(stderr, "Unsupported y4m colorspace %s\n", token + 1);
+          return false;
+        }
+        break;
+      case 'X':
+        if (!strcmp(token, "XCOLORRANGE=FULL")) format->range = kFullRange;
+        if (!strcmp(token, "XCOLORRANGE=LIMITED")) format->range = kNarrowRange;
+        break;
+      default:
+        break;
+    }
+  }
+  if (!format->width || !format->height || format->width % 2 ||
+      format->height % 2) {
+    fprintf(stderr, "Invalid y4m frame size %ux%u\n", format->width,
+            format->height);
+    return false;
+  }
+  // Y4M does not carry the matrix, guess it the same way players do, based on
+  // the frame height.
+  format->colorspace = format->height >= 720 ? kItuRec709 : kItuRec601;
+  return true;
+}
+
+static int ReadFrame(struct FrameInput* frame_input, uint8_t* buffer) {
+  if (frame_input->format.y4m) {
+    char line[256];
+    if (!EnsureCarry(frame_input, 1)) return 0;
+    if (ReadLine(frame_input, line, sizeof(line)) < 0 ||
+        strncmp(line, Y4M_FRAME, sizeof(Y4M_FRAME) - 1)) {
+      fprintf(stderr, "Invalid y4m frame header\n");
+      return -1;
+    }
+  }
+  return ReadExact(frame_input, buffer, frame_input->frame_size);
+}
+
+static void* ReadAheadThread(void* arg) {
+  struct FrameInput* frame_input = arg;
+  for (;;) {
+    pthread_mutex_lock(&frame_input->mutex);
+    while (frame_input->head - frame_input->tail == frame_input->ring_size &&
+           !frame_input->stopping)
+      pthread_cond_wait(&frame_input->cond, &frame_input->mutex);
+    bool stopping = frame_input->stopping;
+    size_t slot = frame_input->head % frame_input->ring_size;
+    pthread_mutex_unlock(&frame_input->mutex);
+    if (stopping) return NULL;
+
+    int result = ReadFrame(
+        frame_input, frame_input->slots + slot * frame_input->frame_size);
+    pthread_mutex_lock(&frame_input->mutex);
+    if (result > 0) {
+      frame_input->head++;
+    } else {
+      frame_input->eof = true;
+      frame_input->failed = result < 0 && !frame_input->stopping;
+    }
+    pthread_cond_broadcast(&frame_input->cond);
+    pthread_mutex_unlock(&frame_input->mutex);
+    if (result <= 0) return NULL;
+  }
+}
+
+static bool DetectFormat(struct FrameInput* frame_input, uint32_t width,
+                         uint32_t height) {
+  size_t signature_size = sizeof(Y4M_SIGNATURE) - 1;
+  if (EnsureCarry(frame_input, signature_size) &&
+      !memcmp(frame_input->carry + frame_input->carry_offset, Y4M_SIGNATURE,
+              signature_size)) {
+    char line[256];
+    if (ReadLine(frame_input, line, sizeof(line)) < 0) {
+      fprintf(stderr, "Failed to read y4m header\n");
+      return false;
+    }
+    return ParseY4mHeader(line, &frame_input->format);
+  }
+
+  if (!width || !height || width % 2 || height % 2) {
+    fprintf(stderr, "Invalid raw frame size %ux%u\n", width, height);
+    return false;
+  }
+  frame_input->format = (struct InputFormat){
+      .width = width,
+      .height = height,
+      .fps_num = 30,
+      .fps_den = 1,
+      .colorspace = kItuRec709,
+      .range = kFullRange,
+  };
+  return true;
+}
+
+struct FrameInput* FrameInputCreate(const char* path, uint32_t width,
+                                    uint32_t height, size_t ring_size) {
+  struct FrameInput* frame_input = calloc(1, sizeof(struct FrameInput));
+  if (!frame_input) {
+    fprintf(stderr, "Failed to allocate frame input: %s\n", strerror(errno));
+    return NULL;
+  }
+  frame_input->ring_size = ring_size ? ring_size : 1;
+
+  frame_input->fd = strcmp(path, "-") ? open(path, O_RDONLY | O_CLOEXEC)
+                                      : dup(STDIN_FILENO);
+  if (frame_input->fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_frame_input;
+  }
+  posix_fadvise(frame_input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  frame_input->shutdown = eventfd(0, EFD_CLOEXEC);
+  if (frame_input->shutdown == -1) {
+    fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+    goto rollback_fd;
+  }
+
+  if (!DetectFormat(frame_input, width, height)) {
+    fprintf(stderr, "Failed to detect input format of %s\n", path);
+    goto rollback_shutdown;
+  }
+  frame_input->frame_size = (size_t)frame_input->format.width *
+                            frame_input->format.height * 3 / 2;
+
+  frame_input->slots =
+      malloc(frame_input->ring_size * frame_input->frame_size);
+  if (!frame_input->slots) {
+    fprintf(stderr, "Failed to allocate input ring: %s\n", strerror(errno));
+    goto rollback_shutdown;
+  }
+
+  pthread_mutex_init(&frame_input->mutex, NULL);
+  pthread_cond_init(&frame_input->cond, NULL);
+  if (pthread_create(&frame_input->thread, NULL, ReadAheadThread,
+                     frame_input)) {
+    fprintf(stderr, "Failed to create read-ahead thread\n");
+    goto rollback_slots;
+  }
+  return frame_input;
+
+rollback_slots:
+  pthread_cond_destroy(&frame_input->cond);
+  pthread_mutex_destroy(&frame_input->mutex);
+  free(frame_input->slots);
+rollback_shutdown:
+  close(frame_input->shutdown);
+rollback_fd:
+  close(frame_input->fd);
+rollback_frame_input:
+  free(frame_input);
+  return NULL;
+}
+
+const struct InputFormat* FrameInputGetFormat(
+    const struct FrameInput* frame_input) {
+  return &frame_input->format;
+}
+
+bool FrameInputAcquire(struct FrameInput* frame_input,
+                       struct InputFrame* input_frame) {
+  pthread_mutex_lock(&frame_input->mutex);
+  while (frame_input->head == frame_input->tail && !frame_input->eof)
+    pthread_cond_wait(&frame_input->cond, &frame_input->mutex);
+  bool result = frame_input->head != frame_input->tail;
+  size_t index = frame_input->tail;
+  pthread_mutex_unlock(&frame_input->mutex);
+  if (!result) return false;
+
+  size_t luma_size =
+      (size_t)frame_input->format.width * frame_input->format.height;
+  size_t slot_offset =
+      index % frame_input->ring_size * frame_input->frame_size;
+  const uint8_t* slot = frame_input->slots + slot_offset;
+  *input_frame = (struct InputFrame){
+      .y_data = slot,
+      .u_data = slot + luma_size,
+      .v_data = slot + luma_size + luma_size / 4,
+      .index = index,
+  };
+  return true;
+}
+
+void FrameInputRelease(struct FrameInput* frame_input) {
+  pthread_mutex_lock(&frame_input->mutex);
+  frame_input->tail++;
+  pthread_cond_broadcast(&frame_input->cond);
+  pthread_mutex_unlock(&frame_input->mutex);
+}
+
+size_t FrameInputQueued(struct FrameInput* frame_input) {
+  pthread_mutex_lock(&frame_input->mutex);
+  size_t queued = frame_input->head - frame_input->tail;
+  pthread_mutex_unlock(&frame_input->mutex);
+  return queued;
+}
+
+bool FrameInputFailed(struct FrameInput* frame_input) {
+  pthread_mutex_lock(&frame_input->mutex);
+  bool failed = frame_input->failed;
+  pthread_mutex_unlock(&frame_input->mutex);
+  return failed;
+}
+
+void FrameInputDestroy(struct FrameInput* frame_input) {
+  static const uint64_t one = 1;
+  pthread_mutex_lock(&frame_input->mutex);
+  frame_input->stopping = true;
+  pthread_cond_broadcast(&frame_input->cond);
+  pthread_mutex_unlock(&frame_input->mutex);
+  if (write(frame_input->shutdown, &one, sizeof(one)) != sizeof(one))
+    fprintf(stderr, "Failed to signal read-ahead thread: %s\n",
+            strerror(errno));
+  pthread_join(frame_input->thread, NULL);
+  pthread_cond_destroy(&frame_input->cond);
+  pthread_mutex_destroy(&frame_input->mutex);
+  free(frame_input->slots);
+  close(frame_input->shutdown);
+  close(frame_input->fd);
+  free(frame_input);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_INPUT_H_
+#define STREAMER_INPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "colorspace.h"
+
+struct InputFormat {
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps_num;
+  uint32_t fps_den;
+  enum YuvColorspace colorspace;
+  enum YuvRange range;
+  bool y4m;
+};
+
+// Planes are tightly packed yuv420p and stay valid until released.
+struct InputFrame {
+  const uint8_t* y_data;
+  const uint8_t* u_data;
+  const uint8_t* v_data;
+  uint64_t index;
+};
+
+struct FrameInput;
+
+// Path "-" reads stdin. Y4M streams are detected by their signature and
+// override the format, otherwise raw yuv420p frames of the given size are
+// expected. A read-ahead thread keeps up to ring_size frames queued.
+struct FrameInput* FrameInputCreate(const char* path, uint32_t width,
+                                    uint32_t height, size_t ring_size);
+const struct InputFormat* FrameInputGetFormat(
+    const struct FrameInput* frame_input);
+// Returns false at the end of the stream or on error, see FrameInputFailed.
+bool FrameInputAcquire(struct FrameInput* frame_input,
+                       struct InputFrame* input_frame);
+void FrameInputRelease(struct FrameInput* frame_input);
+size_t FrameInputQueued(struct FrameInput* frame_input);
+bool FrameInputFailed(struct FrameInput* frame_input);
+void FrameInputDestroy(struct FrameInput* frame_input);
+
+#endif  // STREAMER_INPUT_H_
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "jpeg.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+// Every coefficient takes at most a 16-bit code and 11 bits of magnitude, and
+// every byte of those might need stuffing.
+#define JPEG_MAX_BLOCK_SIZE (64 * 27 / 8 * 2)
+#define JPEG_MAX_HEADERS_SIZE 1024
+
+struct HuffmanSpec {
+  uint8_t bits[16];
+  uint8_t values[162];
+};
+
+struct HuffmanTable {
+  uint16_t codes[256];
+  uint8_t sizes[256];
+};
+
+struct BitWriter {
+  uint8_t* data;
+  size_t size;
+  uint32_t bits;
+  uint32_t count;
+};
+
+// Table K.1 and K.2
+static const uint8_t kLumaQuant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+static const uint8_t kChromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Figure A.6
+static const uint8_t kZigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Tables K.3 to K.6
+static const struct HuffmanSpec kLumaDc = {
+    .bits = {0, 1, 5, 1, 1, 1, 1, 1, 1},
+    .values = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11},
+};
+static const struct HuffmanSpec kChromaDc = {
+    .bits = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    .values = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11},
+};
+static const struct HuffmanSpec kLumaAc = {
+    .bits = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+    .values =
+        {
+            0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41,
+            0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+            0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+            0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a,
+            0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38,
+            0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53,
+            0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+            0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+            0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93,
+            0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7,
+            0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+            0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2,
+            0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+        },
+};
+static const struct HuffmanSpec kChromaAc = {
+    .bits = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+    .values =
+        {
+            0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12,
+            0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14,
+            0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15,
+            0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17,
+            0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37,
+            0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+            0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65,
+            0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+            0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+            0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+            0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5,
+            0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+            0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+            0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2,
+            0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+        },
+};
+
+static const struct HuffmanSpec* const kHuffmanSpecs[4] = {
+    &kLumaDc, &kLumaAc, &kChromaDc, &kChromaAc};
+static struct HuffmanTable huffman_tables[4];
+// Basis of the separable dct, scaled by C(u) / 2.
+static float dct_basis[8][8];
+static pthread_once_t jpeg_once = PTHREAD_ONCE_INIT;
+
+// Annex C, codes are assigned in the order of increasing length.
+static void BuildHuffmanTable(const struct HuffmanSpec* spec,
+                              struct HuffmanTable* table) {
+  uint16_t code = 0;
+  size_t index = 0;
+  for (uint8_t size = 1; size <= 16; size++) {
+    for (uint8_t i = 0; i < spec->bits[size - 1]; i++) {
+      uint8_t value = spec->values[index++];
+      table->codes[value] = code++;
+      table->sizes[value] = size;
+    }
+    code <<= 1;
+  }
+}
+
+static void JpegInit(void) {
+  for (size_t i = 0; i < LENGTH(kHuffmanSpecs); i++)
+    BuildHuffmanTable(kHuffmanSpecs[i], &huffman_tables[i]);
+  for (int u = 0; u < 8; u++) {
+    float scale = u ? 0.5f : 0.5f / sqrtf(2.f);
+    for (int x = 0; x < 8; x++)
+      dct_basis[u][x] = scale * cosf((float)((2 * x + 1) * u) * M_PI / 16);
+  }
+}
+
+static void WriteBits(struct BitWriter* writer, uint32_t bits, uint32_t count) {
+  writer->bits = writer->bits << count | (bits & ((1u << count) - 1));
+  writer->count += count;
+  while (writer->count >= 8) {
+    uint8_t byte = (uint8_t)(writer->bits >> (writer->count - 8));
+    writer->data[writer->size++] = byte;
+    if (byte == 0xff) writer->data[writer->size++] = 0;
+    writer->count -= 8;
+  }
+}
+
+static void WriteBytes(struct BitWriter* writer, const void* data,
+                       size_t size) {
+  memcpy(writer->data + writer->size, data, size);
+  writer->size += size;
+}
+
+static void WriteMarker(struct BitWriter* writer, uint8_t marker,
+                        uint16_t length) {
+  uint8_t header[] = {0xff, marker, (uint8_t)(length >> 8), (uint8_t)length};
+  WriteBytes(writer, header, length ? sizeof(header) : 2);
+}
+
+static void WriteHeaders(struct BitWriter* writer, uint32_t width,
+                         uint32_t height, const uint8_t* luma_quant,
+                         const uint8_t* chroma_quant) {
+  WriteMarker(writer, 0xd8, 0);  // SOI
+
+  static const uint8_t jfif[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1,
+                                 0, 0};
+  WriteMarker(writer, 0xe0, 2 + sizeof(jfif));  // APP0
+  WriteBytes(writer, jfif, sizeof(jfif));
+
+  WriteMarker(writer, 0xdb, 2 + 2 * 65);  // DQT
+  for (uint8_t i = 0; i < 2; i++) {
+    const uint8_t* quant = i ? chroma_quant : luma_quant;
+    writer->data[writer->size++] = i;
+    for (size_t j = 0; j < 64; j++)
+      writer->data[writer->size++] = quant[kZigzag[j]];
+  }
+
+  const uint8_t frame[] = {
+      8,  // Sample precision
+      (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8),
+      (uint8_t)width, 3,  // Components
+      1, 0x11, 0,         // Y, 1x1, table 0
+      2, 0x11, 1,         // Cb, 1x1, table 1
+      3, 0x11, 1,         // Cr, 1x1, table 1
+  };
+  WriteMarker(writer, 0xc0, 2 + sizeof(frame));  // SOF0
+  WriteBytes(writer, frame, sizeof(frame));
+
+  static const uint8_t classes[] = {0x00, 0x10, 0x01, 0x11};
+  for (size_t i = 0; i < LENGTH(kHuffmanSpecs); i++) {
+    size_t count = 0;
+    for (size_t j = 0; j < 16; j++) count += kHuffmanSpecs[i]->bits[j];
+    WriteMarker(writer, 0xc4, (uint16_t)(2 + 1 + 16 + count));  // DHT
+    writer->data[writer->size++] = classes[i];
+    WriteBytes(writer, kHuffmanSpecs[i]->bits, 16);
+    WriteBytes(writer, kHuffmanSpecs[i]->values, count);
+  }
+
+  static const uint8_t scan[] = {
+      3,           // Components
+      1, 0x00,     // Y, dc and ac tables 0
+      2, 0x11,     // Cb, dc and ac tables 1
+      3, 0x11,     // Cr, dc and ac tables 1
+      0, 63, 0,    // Spectral selection and approximation
+  };
+  WriteMarker(writer, 0xda, 2 + sizeof(scan));  // SOS
+  WriteBytes(writer, scan, sizeof(scan));
+}
+
+static uint32_t Magnitude(int32_t value) {
+  uint32_t absolute = (uint32_t)(value < 0 ? -value : value);
+  return absolute ? 32 - (uint32_t)__builtin_clz(absolute) : 0;
+}
+
+// F.1.2 Huffman encoding of the quantized coefficients
+static void EncodeBlock(struct BitWriter* writer, const float block[64],
+                        const uint8_t quant[64], int32_t* predictor,
+                        const struct HuffmanTable* dc,
+                        const struct HuffmanTable* ac) {
+  float rows[64];
+  for (int y = 0; y < 8; y++) {
+    for (int u = 0; u < 8; u++) {
+      float sum = 0;
+      for (int x = 0; x < 8; x++) sum += dct_basis[u][x] * block[y * 8 + x];
+      rows[y * 8 + u] = sum;
+    }
+  }
+  int32_t coefficients[64];
+  for (int v = 0; v < 8; v++) {
+    for (int u = 0; u < 8; u++) {
+      float sum = 0;
+      for (int y = 0; y < 8; y++) sum += dct_basis[v][y] * rows[y * 8 + u];
+      coefficients[v * 8 + u] = (int32_t)lroundf(sum / quant[v * 8 + u]);
+    }
+  }
+
+  int32_t diff = coefficients[0] - *predictor;
+  *predictor = coefficients[0];
+  uint32_t size = Magnitude(diff);
+  WriteBits(writer, dc->codes[size], dc->sizes[size]);
+  if (size) WriteBits(writer, (uint32_t)(diff < 0 ? diff - 1 : diff), size);
+
+  uint32_t run = 0;
+  for (size_t i = 1; i < 64; i++) {
+    int32_t value = coefficients[kZigzag[i]];
+    if (!value) {
+      run++;
+      continue;
+    }
+    for (; run >= 16; run -= 16)
+      WriteBits(writer, ac->codes[0xf0], ac->sizes[0xf0]);
+    size = Magnitude(value);
+    uint8_t symbol = (uint8_t)(run << 4 | size);
+    WriteBits(writer, ac->codes[symbol], ac->sizes[symbol]);
+    WriteBits(writer, (uint32_t)(value < 0 ? value - 1 : value), size);
+    run = 0;
+  }
+  if (run) WriteBits(writer, ac->codes[0x00], ac->sizes[0x00]);
+}
+
+size_t JpegMaxSize(uint32_t width, uint32_t height) {
+  size_t blocks = (size_t)((width + 7) / 8) * ((height + 7) / 8) * 3;
+  return JPEG_MAX_HEADERS_SIZE + blocks * JPEG_MAX_BLOCK_SIZE;
+}
+
+size_t JpegEncodeRgba(const void* rgba, uint32_t width, uint32_t height,
+                      size_t stride, uint8_t quality, void* buffer) {
+  pthread_once(&jpeg_once, JpegInit);
+  if (quality < 1) quality = 1;
+  if (quality > 100) quality = 100;
+  int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+  uint8_t quant[2][64];
+  for (size_t i = 0; i < 64; i++) {
+    int luma = (kLumaQuant[i] * scale + 50) / 100;
+    int chroma = (kChromaQuant[i] * scale + 50) / 100;
+    quant[0][i] = (uint8_t)(luma < 1 ? 1 : luma > 255 ? 255 : luma);
+    quant[1][i] = (uint8_t)(chroma < 1 ? 1 : chroma > 255 ? 255 : chroma);
+  }
+
+  struct BitWriter writer = {.data = buffer};
+  WriteHeaders(&writer, width, height, quant[0], quant[1]);
+
+  int32_t predictors[3] = {0};
+  for (uint32_t block_y = 0; block_y < height; block_y += 8) {
+    for (uint32_t block_x = 0; block_x < width; block_x += 8) {
+      // Edge blocks repeat the last row and column, which keeps the padding out
+      // of the high frequencies.
+      float planes[3][64];
+      for (uint32_t y = 0; y < 8; y++) {
+        uint32_t row = block_y + y < height ? block_y + y : height - 1;
+        const uint8_t* pixels = (const uint8_t*)rgba + row * stride;
+        for (uint32_t x = 0; x < 8; x++) {
+          uint32_t column = block_x + x < width ? block_x + x : width - 1;
+          const uint8_t* pixel = pixels + column * 4;
+          float r = pixel[0], g = pixel[1], b = pixel[2];
+          // JFIF full range rec601, level shifted by 128
+          planes[0][y * 8 + x] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+          planes[1][y * 8 + x] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+          planes[2][y * 8 + x] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+        }
+      }
+      for (size_t i = 0; i < 3; i++) {
+        size_t table = i ? 2 : 0;
+        EncodeBlock(&writer, planes[i], quant[i ? 1 : 0], &predictors[i],
+                    &huffman_tables[table], &huffman_tables[table + 1]);
+      }
+    }
+  }
+
+  // F.1.2.3 Pad the last byte with ones
+  if (writer.count) WriteBits(&writer, 0x7f, 8 - writer.count);
+  WriteMarker(&writer, 0xd9, 0);  // EOI
+  return writer.size;
+}
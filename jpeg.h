@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_JPEG_H_
+#define STREAMER_JPEG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper bound of the encoded size, for sizing the output buffer.
+size_t JpegMaxSize(uint32_t width, uint32_t height);
+
+// Baseline jfif with 4:4:4 sampling and the example tables of Annex K,
+// quality follows the libjpeg scale of 1 to 100. Alpha is ignored. Returns
+// the number of bytes written.
+size_t JpegEncodeRgba(const void* rgba, uint32_t width, uint32_t height,
+                      size_t stride, uint8_t quality, void* buffer);
+
+#endif  // STREAMER_JPEG_H_
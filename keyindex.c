@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "keyindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+// Keyframes are rare, so a second worth of pts between appends keeps the
+// sidecar close to the recording at the cost of a single write.
+#define KEY_INDEX_FLUSH_MICROS 1000000
+
+struct KeyIndexWriter {
+  int fd;
+  struct KeyIndexEntry entries[64];
+  size_t entries_count;
+  uint64_t flushed_pts;
+};
+
+struct KeyIndex {
+  const uint8_t* data;
+  size_t size;
+  const struct KeyIndexEntry* entries;
+  size_t entries_count;
+};
+
+static bool WriteAll(int fd, const void* data, size_t size) {
+  const uint8_t* ptr = data;
+  while (size) {
+    ssize_t result = write(fd, ptr, size);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write key index: %s\n", strerror(errno));
+      return false;
+    }
+    ptr += result;
+    size -= (size_t)result;
+  }
+  return true;
+}
+
+struct KeyIndexWriter* KeyIndexWriterCreate(const char* path) {
+  struct KeyIndexWriter* key_index_writer =
+      malloc(sizeof(struct KeyIndexWriter));
+  if (!key_index_writer) {
+    fprintf(stderr, "Failed to allocate key index writer: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  *key_index_writer = (struct KeyIndexWriter){0};
+
+  key_index_writer->fd =
+      open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (key_index_writer->fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_key_index_writer;
+  }
+
+  const struct KeyIndexHeader header = {
+      .magic = KEY_INDEX_MAGIC,
+      .version = KEY_INDEX_VERSION,
+      .entry_size = sizeof(struct KeyIndexEntry),
+  };
+  if (!WriteAll(key_index_writer->fd, &header, sizeof(header))) {
+    fprintf(stderr, "Failed to write key index header\n");
+    goto rollback_fd;
+  }
+  return key_index_writer;
+
+rollback_fd:
+  close(key_index_writer->fd);
+rollback_key_index_writer:
+  free(key_index_writer);
+  return NULL;
+}
+
+bool KeyIndexWriterAppend(struct KeyIndexWriter* key_index_writer,
+                          uint64_t offset, uint64_t pts, uint32_t size) {
+  if (!key_index_writer->entries_count) key_index_writer->flushed_pts = pts;
+  key_index_writer->entries[key_index_writer->entries_count++] =
+      (struct KeyIndexEntry){
+          .offset = offset,
+          .pts = pts,
+          .size = size,
+      };
+  if (key_index_writer->entries_count < LENGTH(key_index_writer->entries) &&
+      pts - key_index_writer->flushed_pts < KEY_INDEX_FLUSH_MICROS)
+    return true;
+  return KeyIndexWriterFlush(key_index_writer);
+}
+
+bool KeyIndexWriterFlush(struct KeyIndexWriter* key_index_writer) {
+  size_t size =
+      key_index_writer->entries_count * sizeof(struct KeyIndexEntry);
+  key_index_writer->entries_count = 0;
+  return WriteAll(key_index_writer->fd, key_index_writer->entries, size);
+}
+
+void KeyIndexWriterDestroy(struct KeyIndexWriter* key_index_writer) {
+  KeyIndexWriterFlush(key_index_writer);
+  close(key_index_writer->fd);
+  free(key_index_writer);
+}
+
+struct KeyIndex* KeyIndexCreate(const char* path) {
+  struct KeyIndex* key_index = malloc(sizeof(struct KeyIndex));
+  if (!key_index) {
+    fprintf(stderr, "Failed to allocate key index: %s\n", strerror(errno));
+    return NULL;
+  }
+  *key_index = (struct KeyIndex){0};
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_key_index;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    goto rollback_fd;
+  }
+  if ((size_t)st.st_size < sizeof(struct KeyIndexHeader)) {
+    fprintf(stderr, "Key index %s is truncated\n", path);
+    goto rollback_fd;
+  }
+
+  key_index->size = (size_t)st.st_size;
+  void* data = mmap(NULL, key_index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    goto rollback_fd;
+  }
+  key_index->data = data;
+
+  const struct KeyIndexHeader* header = data;
+  if (header->magic != KEY_INDEX_MAGIC ||
+      header->version != KEY_INDEX_VERSION ||
+      header->entry_size != sizeof(struct KeyIndexEntry)) {
+    fprintf(stderr, "Key index %s has unsupported format\n", path);
+    goto rollback_data;
+  }
+  key_index->entries =
+      (const void*)(key_index->data + sizeof(struct KeyIndexHeader));
+  key_index->entries_count =
+      (key_index->size - sizeof(struct KeyIndexHeader)) /
+      sizeof(struct KeyIndexEntry);
+  close(fd);
+  return key_index;
+
+rollback_data:
+  munmap(data, key_index->size);
+rollback_fd:
+  close(fd);
+rollback_key_index:
+  free(key_index);
+  return NULL;
+}
+
+size_t KeyIndexCount(const struct KeyIndex* key_index) {
+  return key_index->entries_count;
+}
+
+const struct KeyIndexEntry* KeyIndexEntries(const struct KeyIndex* key_index) {
+  return key_index->entries;
+}
+
+size_t KeyIndexLookup(const struct KeyIndex* key_index, uint64_t pts) {
+  size_t begin = 0;
+  size_t end = key_index->entries_count;
+  while (end - begin > 1) {
+    size_t middle = begin + (end - begin) / 2;
+    if (key_index->entries[middle].pts <= pts)
+      begin = middle;
+    else
+      end = middle;
+  }
+  return begin;
+}
+
+void KeyIndexDestroy(struct KeyIndex* key_index) {
+  munmap((void*)(uintptr_t)key_index->data, key_index->size);
+  free(key_index);
+}
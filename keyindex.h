@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_KEYINDEX_H_
+#define STREAMER_KEYINDEX_H_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY_INDEX_MAGIC 0x58494b53u  // "SKIX"
+#define KEY_INDEX_VERSION 1
+
+// Sidecar starts with a header, followed by fixed size entries sorted by
+// pts, so it can be mapped and binary searched as is. A torn trailing entry
+// left by an interrupted append is ignored by readers.
+struct KeyIndexHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entry_size;
+  uint64_t reserved;
+};
+
+static_assert(sizeof(struct KeyIndexHeader) == 16 * sizeof(uint8_t),
+              "Suspicious key index header struct size");
+
+// Offset and size cover the whole keyframe record, including its framing.
+struct KeyIndexEntry {
+  uint64_t offset;
+  uint64_t pts;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(struct KeyIndexEntry) == 24 * sizeof(uint8_t),
+              "Suspicious key index entry struct size");
+
+struct KeyIndexWriter;
+struct KeyIndex;
+
+// Entries are batched and appended without fsync, the sidecar is exactly as
+// durable as the recording it describes.
+struct KeyIndexWriter* KeyIndexWriterCreate(const char* path);
+bool KeyIndexWriterAppend(struct KeyIndexWriter* key_index_writer,
+                          uint64_t offset, uint64_t pts, uint32_t size);
+bool KeyIndexWriterFlush(struct KeyIndexWriter* key_index_writer);
+void KeyIndexWriterDestroy(struct KeyIndexWriter* key_index_writer);
+
+struct KeyIndex* KeyIndexCreate(const char* path);
+size_t KeyIndexCount(const struct KeyIndex* key_index);
+const struct KeyIndexEntry* KeyIndexEntries(const struct KeyIndex* key_index);
+// Returns the position of the last keyframe at or before pts, or zero if pts
+// precedes all of them.
+size_t KeyIndexLookup(const struct KeyIndex* key_index, uint64_t pts);
+void KeyIndexDestroy(struct KeyIndex* key_index);
+
+#endif  // STREAMER_KEYINDEX_H_
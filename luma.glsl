@@ -16,10 +16,23 @@
  */
 
 uniform sampler2D img_input;
+uniform sampler2D img_cursor;
 uniform mediump mat3 colorspace;
 uniform mediump vec3 ranges[2];
 
 varying mediump vec2 texcoord;
+varying highp vec4 cursor;
+
+// Cursor is premultiplied like drm planes are by default, and is placed in
+// source texture coordinates, offset first and size second.
+mediump vec3 blend_cursor(in highp vec2 coord, in mediump vec3 rgb) {
+  highp vec2 cursor_coord = (coord - cursor.xy) / cursor.zw;
+  if (any(lessThan(cursor_coord, vec2(0.0))) ||
+      any(greaterThan(cursor_coord, vec2(1.0))))
+    return rgb;
+  mediump vec4 argb = texture2D(img_cursor, cursor_coord);
+  return argb.rgb + rgb * (1.0 - argb.a);
+}
 
 mediump vec3 rgb2yuv(in mediump vec3 rgb) {
   mediump vec3 yuv = colorspace * rgb.rgb + vec3(0.0, 0.5, 0.5);
@@ -27,7 +40,7 @@ mediump vec3 rgb2yuv(in mediump vec3 rgb) {
 }
 
 void main() {
-  mediump vec4 rgb = texture2D(img_input, texcoord);
-  mediump vec3 yuv = rgb2yuv(rgb.rgb);
+  mediump vec3 rgb = texture2D(img_input, texcoord).rgb;
+  mediump vec3 yuv = rgb2yuv(blend_cursor(texcoord, rgb));
   gl_FragColor = vec4(yuv.x, 0.0, 0.0, 1.0);
 }
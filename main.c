@@ -1,119 +1,426 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <netdb.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "bench.h"
+#include "capacity.h"
+#include "capture.h"
+#include "cenc.h"
 #include "encode.h"
+#include "fdinfo.h"
+#include "fec.h"
 #include "gpu.h"
+#include "input.h"
+#include "keyindex.h"
 #include "colorspace.h"
+#include "decode.h"
+#include "directio.h"
+#include "metrics.h"
+#include "preview.h"
+#include "proto.h"
+#include "recorder.h"
+#include "shmring.h"
+#include "startup.h"
+#include "synth.h"
+#include "trace.h"
+#include "worker.h"
+
+#include <drm_fourcc.h>
+#include <va/va.h>
 
 /**
- * 读取一帧 YUV420P 数据
- * @param fp 文件指针
- * @param width 图像宽度
- * @param height 图像高度
- * @param y_data Y分量数据缓冲区
- * @param u_data U分量数据缓冲区
- * @param v_data V分量数据缓冲区
- * @return 成功返回0，失败返回-1
+ * 关闭输入并释放内存
  */
-int read_yuv420p_frame(FILE *fp, int width, int height, 
-                       unsigned char *y_data, 
-                       unsigned char *u_data, 
-                       unsigned char *v_data) {
-    if (!fp || !y_data || !u_data || !v_data) {
-        fprintf(stderr, "Invalid parameters\n");
-        return -1;
+void close_input(struct FrameInput *frame_input, struct ShmConsumer *shm_consumer,
+                 unsigned char *synth_frame, struct SynthSource *synth_source,
+                 struct DecodeContext *decode_context, int hevc_fd,
+                 struct CaptureContext *capture_context) {
+    if (frame_input) FrameInputDestroy(frame_input);
+    if (shm_consumer) ShmConsumerDestroy(shm_consumer);
+    if (synth_frame) free(synth_frame);
+    if (synth_source) SynthSourceDestroy(synth_source);
+    if (decode_context) DecodeContextDestroy(decode_context);
+    if (hevc_fd > STDIN_FILENO) close(hevc_fd);
+    if (capture_context) CaptureContextDestroy(capture_context);
+}
+
+/**
+ * 解码下一帧：解码器需要更多数据时从文件读取并推送，读到结尾后冲刷剩余帧
+ */
+static bool decode_next_frame(struct DecodeContext* decode_context, int fd,
+                              bool *eof, struct DecodedFrame* decoded_frame) {
+    static unsigned char chunk[64 * 1024];
+    while (!DecodeContextAcquire(decode_context, decoded_frame)) {
+        if (*eof || DecodeContextFailed(decode_context)) return false;
+        ssize_t result = read(fd, chunk, sizeof(chunk));
+        if (result == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read hevc input: %s\n", strerror(errno));
+            return false;
+        }
+        if (result == 0) {
+            *eof = true;
+            DecodeContextFlush(decode_context);
+            continue;
+        }
+        if (!DecodeContextPush(decode_context, chunk, (size_t)result, 0))
+            return false;
     }
+    return true;
+}
 
-    int y_size = width * height;
-    int u_size = y_size / 4;
-    int v_size = y_size / 4;
+/**
+ * 每个FEC分片一个数据报，头和分片数据一起发送
+ */
+static bool send_fec_datagram(void *user, const struct iovec *iov,
+                              size_t count) {
+    struct msghdr msg = {.msg_iov = (struct iovec *)iov, .msg_iovlen = count};
+    if (sendmsg(*(int *)user, &msg, MSG_NOSIGNAL) < 0) {
+        // 接收端未启动时连接型UDP套接字会报告拒绝，丢弃即可
+        if (errno == ECONNREFUSED || errno == ENOBUFS || errno == EAGAIN)
+            return true;
+        fprintf(stderr, "Failed to send datagram: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-    // 读取 Y 分量
-    if (fread(y_data, 1, y_size, fp) != y_size) {
-        if (feof(fp)) {
-            return -1; // 文件结束
-        }
-        fprintf(stderr, "Failed to read Y component\n");
-        return -1;
+/**
+ * 关闭录制输出（不含输出文件本身），直接写入的尾部和索引在此落盘
+ */
+static void close_recorder_outputs(struct RecorderOutputs *outputs,
+                                   int udp_fd) {
+    if (outputs->direct_writer) DirectWriterDestroy(outputs->direct_writer);
+    if (outputs->key_index_writer)
+        KeyIndexWriterDestroy(outputs->key_index_writer);
+    if (outputs->cenc_context) CencContextDestroy(outputs->cenc_context);
+    if (outputs->fec_encoder) FecEncoderDestroy(outputs->fec_encoder);
+    if (udp_fd != -1) close(udp_fd);
+}
+
+/**
+ * 解析合成帧复杂度（0..3），拒绝未知级别
+ */
+static bool parse_synth_complexity(const char *value,
+                                   enum SynthComplexity *complexity) {
+    char *end;
+    errno = 0;
+    long level = strtol(value, &end, 10);
+    if (errno || end == value || *end || level < kSynthGradient ||
+        level > kSynthNoise) {
+        fprintf(stderr, "Invalid synthetic complexity %s\n", value);
+        return false;
     }
+    *complexity = (enum SynthComplexity)level;
+    return true;
+}
 
-    // 读取 U 分量
-    if (fread(u_data, 1, u_size, fp) != u_size) {
-        fprintf(stderr, "Failed to read U component\n");
+/**
+ * 解析外部码控QP（HEVC 1..51，AV1 base_qindex 1..255），拒绝越界值
+ */
+static bool parse_qp(const char *value, enum EncodeCodec codec, uint8_t *qp) {
+    long max_qp = codec == kEncodeCodecAv1 ? ENCODE_AV1_MAX_QINDEX
+                                           : ENCODE_HEVC_MAX_QP;
+    char *end;
+    errno = 0;
+    long level = strtol(value, &end, 10);
+    if (errno || end == value || *end || level < 1 || level > max_qp) {
+        fprintf(stderr, "Invalid qp %s, expected 1..%ld\n", value, max_qp);
+        return false;
+    }
+    *qp = (uint8_t)level;
+    return true;
+}
+
+/**
+ * 解析32位十六进制AES-128密钥
+ */
+static bool parse_cenc_key(const char *hex, uint8_t key[CENC_KEY_SIZE]) {
+    if (strlen(hex) != CENC_KEY_SIZE * 2) return false;
+    for (size_t i = 0; i < CENC_KEY_SIZE; i++) {
+        unsigned byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return false;
+        key[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+/**
+ * 打开连接型UDP套接字，地址格式为 host:port
+ */
+static int open_udp_output(const char *address) {
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (!colon || (size_t)(colon - address) >= sizeof(host)) {
+        fprintf(stderr, "Invalid udp address %s\n", address);
         return -1;
     }
+    memcpy(host, address, colon - address);
+    host[colon - address] = 0;
 
-    // 读取 V 分量
-    if (fread(v_data, 1, v_size, fp) != v_size) {
-        fprintf(stderr, "Failed to read V component\n");
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *result;
+    int error = getaddrinfo(host, colon + 1, &hints, &result);
+    if (error) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", address,
+                gai_strerror(error));
         return -1;
     }
+    int fd = -1;
+    for (struct addrinfo *it = result; it; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC,
+                    it->ai_protocol);
+        if (fd == -1) continue;
+        if (!connect(fd, it->ai_addr, it->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd == -1)
+        fprintf(stderr, "Failed to connect to %s: %s\n", address,
+                strerror(errno));
+    return fd;
+}
 
-    return 0;
+/**
+ * 解析FEC配置：xor 或 rs[:P帧冗余百分比[:关键帧冗余百分比]]
+ */
+static bool parse_fec_config(const char *spec, struct FecConfig *config) {
+    // 分片加上FEC头、UDP和IP头不超过常见的1500字节MTU
+    *config = (struct FecConfig){
+        .scheme = kFecSchemeReedSolomon,
+        .shard_size = 1200,
+        .parity_percent = 10,
+        .keyframe_parity_percent = 50,
+    };
+    if (!spec) return true;
+    if (!strcmp(spec, "xor")) {
+        config->scheme = kFecSchemeXor;
+        return true;
+    }
+    unsigned parity = config->parity_percent;
+    unsigned keyframe_parity = config->keyframe_parity_percent;
+    if (strncmp(spec, "rs", 2) ||
+        (spec[2] && sscanf(spec + 2, ":%u:%u", &parity, &keyframe_parity) < 1) ||
+        parity > 100 || keyframe_parity > 100) {
+        fprintf(stderr, "Invalid fec config %s\n", spec);
+        return false;
+    }
+    config->parity_percent = (uint8_t)parity;
+    config->keyframe_parity_percent = (uint8_t)keyframe_parity;
+    return true;
 }
 
 /**
- * 打开YUV文件并分配内存
- * @param input_file 输入文件路径
- * @param width 图像宽度
- * @param height 图像高度
- * @param fp 文件指针（输出参数）
- * @param y_data Y分量缓冲区（输出参数）
- * @param u_data U分量缓冲区（输出参数）
- * @param v_data V分量缓冲区（输出参数）
- * @return 成功返回0，失败返回-1
+ * 缩略图回调（预览线程中调用），先写临时文件再改名，读者不会看到半张图
  */
-int open_yuv_file(const char *input_file, int width, int height,
-                  FILE **fp, unsigned char **y_data, 
-                  unsigned char **u_data, unsigned char **v_data) {
-    printf("Opening YUV420P file: %s (%dx%d)\n", input_file, width, height);
-
-    *fp = fopen(input_file, "rb");
-    if (!*fp) {
-        fprintf(stderr, "Failed to open file: %s\n", input_file);
-        return -1;
+static void write_preview_file(void *user, const struct PreviewImage *image) {
+    const char *path = user;
+    char temp_path[512];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create preview: %s\n", strerror(errno));
+        return;
+    }
+    bool complete = write(fd, image->data, image->size) == (ssize_t)image->size;
+    close(fd);
+    if (!complete || rename(temp_path, path)) {
+        fprintf(stderr, "Failed to write preview: %s\n", strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+/**
+ * 导入生产者注册的dmabuf为GPU帧（文件描述符被复制，原描述符仍归共享内存环所有）
+ */
+static struct GpuFrame* import_shm_buffer(struct GpuContext* gpu_context,
+                                          const struct ShmRingBuffer* buffer) {
+    struct GpuFramePlane planes[4];
+    for (uint32_t i = 0; i < buffer->nplanes; i++) {
+        planes[i] = (struct GpuFramePlane){
+            .dmabuf_fd = buffer->planes[i].dmabuf_fd,
+            .pitch = buffer->planes[i].pitch,
+            .offset = buffer->planes[i].offset,
+            .modifier = buffer->planes[i].modifier,
+        };
     }
+    return GpuContextImportFrame(gpu_context, buffer->width, buffer->height,
+                                 buffer->fourcc, buffer->nplanes, planes);
+}
 
-    // 分配YUV数据缓冲区
-    int y_size = width * height;
-    int u_size = y_size / 4;
-    int v_size = y_size / 4;
+/**
+ * GPU转换到编码器输入帧，时间线上与编码器事件使用相同的会话ID和帧号
+ */
+static bool convert_frame(struct GpuContext* gpu_context,
+                          struct EncodeContext* encode_context,
+                          const struct GpuFrame* from,
+                          const struct GpuCursor* cursor,
+                          const struct GpuRect* damage) {
+    uint32_t trace_session = EncodeContextGetSessionId(encode_context);
+    uint64_t trace_frame = EncodeContextGetFrameCounter(encode_context);
+    TraceBegin("convert", trace_session, trace_frame);
+    bool result = GpuContextConvertFrame(gpu_context, from,
+                                         EncodeContextGetFrame(encode_context),
+                                         cursor, damage);
+    TraceEnd("convert", trace_session, trace_frame);
+    return result;
+}
 
-    *y_data = (unsigned char *)malloc(y_size);
-    *u_data = (unsigned char *)malloc(u_size);
-    *v_data = (unsigned char *)malloc(v_size);
+/**
+ * 取得共享内存环缓冲区对应的GPU帧，生产者重新注册过的缓冲区需重新导入
+ */
+static struct GpuFrame* get_shm_frame(struct GpuContext* gpu_context,
+                                      struct GpuFrame** shm_frames,
+                                      uint32_t id,
+                                      const struct ShmRingBuffer* buffer,
+                                      bool fresh) {
+    if (fresh && shm_frames[id]) {
+        GpuContextDestroyFrame(gpu_context, shm_frames[id]);
+        shm_frames[id] = NULL;
+    }
+    if (!shm_frames[id])
+        shm_frames[id] = import_shm_buffer(gpu_context, buffer);
+    return shm_frames[id];
+}
 
-    if (!*y_data || !*u_data || !*v_data) {
-        fprintf(stderr, "Failed to allocate memory\n");
-        if (*y_data) free(*y_data);
-        if (*u_data) free(*u_data);
-        if (*v_data) free(*v_data);
-        fclose(*fp);
+/**
+ * 多进程模式：共享内存环中的dmabuf帧交给独立的编码进程，驱动崩溃只影响该进程，
+ * 监督者重启它并以IDR帧继续。输入必须为dmabuf帧（yuv槽位跳过）
+ */
+static int run_workers(const char *socket_path, const char *output_file,
+                       enum EncodeCodec codec, enum YuvColorspace colorspace,
+                       enum YuvRange range, int max_frames, bool proto2) {
+    printf("等待生产者连接: %s\n", socket_path);
+    struct ShmConsumer *shm_consumer = ShmConsumerCreate(socket_path);
+    if (!shm_consumer) return -1;
+    struct WorkerConfig worker_config = {
+        .colorspace = colorspace,
+        .range = range,
+        .codec = codec,
+    };
+    ShmConsumerGetSize(shm_consumer, &worker_config.width,
+                       &worker_config.height);
+    struct WorkerSession *worker_session = WorkerSessionCreate(&worker_config);
+    if (!worker_session) {
+        ShmConsumerDestroy(shm_consumer);
+        return -1;
+    }
+    int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (output_fd == -1) {
+        fprintf(stderr, "Failed to create output file: %s\n", strerror(errno));
+        WorkerSessionDestroy(worker_session);
+        ShmConsumerDestroy(shm_consumer);
         return -1;
     }
+    printf("编码进程已启动 (%ux%u)\n", worker_config.width,
+           worker_config.height);
 
-    return 0;
+    int encoded_frames = 0;
+    int failed_frames = 0;
+    struct ShmRingFrame shm_frame;
+    for (int frame_num = 0; frame_num < max_frames &&
+                            ShmConsumerAcquire(shm_consumer, &shm_frame);
+         frame_num++) {
+        bool success = false;
+        if (!shm_frame.buffer) {
+            fprintf(stderr, "第%d帧不是dmabuf帧，已跳过\n", frame_num + 1);
+        } else if (!shm_frame.buffer_fresh ||
+                   WorkerSessionRegisterBuffer(worker_session,
+                                               shm_frame.buffer_id,
+                                               shm_frame.buffer)) {
+            success = WorkerSessionEncode(
+                worker_session, shm_frame.buffer_id, shm_frame.pts,
+                frame_num % 30 == 0,
+                proto2 ? WriteEncodedFrame2 : WriteEncodedFrame, &output_fd);
+        }
+        ShmConsumerRelease(shm_consumer);
+        if (success) {
+            encoded_frames++;
+        } else {
+            failed_frames++;
+        }
+    }
+
+    // 往返时间减去进程内实际耗时，即跨进程传递的开销
+    struct WorkerStats worker_stats;
+    WorkerSessionGetStats(worker_session, &worker_stats);
+    printf("\n📊 多进程编码结果:\n");
+    printf("  • 成功编码: %d 帧, 失败: %d 帧\n", encoded_frames, failed_frames);
+    printf("  • 进程重启: %llu 次, 丢失: %llu 帧\n",
+           (unsigned long long)worker_stats.restarts,
+           (unsigned long long)worker_stats.lost);
+    if (worker_stats.frames) {
+        double roundtrip =
+            (double)worker_stats.roundtrip_micros / worker_stats.frames;
+        double in_worker =
+            (double)worker_stats.worker_micros / worker_stats.frames;
+        printf("  • 平均往返: %.1f 微秒, 进程内: %.1f 微秒, "
+               "跨进程开销: %.1f 微秒/帧\n",
+               roundtrip, in_worker, roundtrip - in_worker);
+    }
+
+    close(output_fd);
+    WorkerSessionDestroy(worker_session);
+    ShmConsumerDestroy(shm_consumer);
+    return encoded_frames > 0 ? 0 : 1;
+}
+
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+/**
+ * SIGUSR1处理：请求在下一帧开始前导出时间线
+ */
+static void on_trace_signal(int signum) {
+    (void)signum;
+    trace_dump_requested = 1;
 }
 
 /**
- * 关闭文件并释放内存
+ * 获取单调时钟时间（微秒）
  */
-void close_yuv_file(FILE *fp, unsigned char *y_data, 
-                    unsigned char *u_data, unsigned char *v_data) {
-    if (y_data) free(y_data);
-    if (u_data) free(u_data);
-    if (v_data) free(v_data);
-    if (fp) fclose(fp);
+static unsigned long long micros_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * 创建设备容量模型并加载校准结果（不存在时返回未校准的模型），同一设备上的
+ * 其他进程通过设备级登记文件共享会话负载（STREAMER_CAPACITY_REGISTRY 指定路径）
+ */
+static struct CapacityModel* create_capacity_model(const char *capacity_file,
+                                                   bool *calibrated) {
+    struct CapacityModel *capacity_model =
+        CapacityModelCreate(ENCODE_RENDER_NODE);
+    if (!capacity_model) return NULL;
+    char registry_path[256];
+    const char *registry = getenv("STREAMER_CAPACITY_REGISTRY");
+    if (!registry) {
+        snprintf(registry_path, sizeof(registry_path),
+                 "/tmp/streamer-capacity-%s",
+                 strrchr(ENCODE_RENDER_NODE, '/') + 1);
+        registry = registry_path;
+    }
+    // 登记文件不可用时只统计本进程的会话
+    CapacityModelShare(capacity_model, registry);
+    *calibrated = access(capacity_file, R_OK) == 0 &&
+                  CapacityModelLoad(capacity_model, capacity_file);
+    return capacity_model;
 }
 
 /**
@@ -124,49 +431,306 @@ int main(int argc, char *argv[]) {
     // 编码前100帧
     const char *input_file = "test.yuv";
     const char *output_file = "output.h265";
+    const char *capacity_file = "capacity.txt";
+    bool calibrate = argc > 1 && !strcmp(argv[1], "--calibrate");
     int width = 3840;
     int height = 2160;
+    // 输入：原始YUV420P文件、Y4M文件，或 "-" 表示从标准输入/管道读取，
+    // hevc:<文件> 为硬件解码后转码（hevc:- 从标准输入读取），
+    // v4l2:<设备> 为采集卡输入（STREAMER_V4L2_DMABUF=1 使用dma-heap缓冲）
+    if (argc > 1 && strncmp(argv[1], "--", 2)) input_file = argv[1];
     int max_frames = 100; // 编码前100帧
+
+    // 编码格式（设置 STREAMER_CODEC=av1 使用AV1，默认HEVC）
+    const char *codec_name = getenv("STREAMER_CODEC");
+    enum EncodeCodec codec = kEncodeCodecHevc;
+    if (codec_name && !strcmp(codec_name, "av1")) {
+        codec = kEncodeCodecAv1;
+        output_file = "output.av1";
+    }
+
+    // 扩展性基准测试：--bench <最大会话数> [--standin] [--admit]，
+    // --admit 时所有会话共享同一容量模型，像真实会话一样准入、降级或拒绝
+    if (argc > 2 && !strcmp(argv[1], "--bench")) {
+        struct BenchConfig bench_config = {
+            .width = width,
+            .height = height,
+            .max_sessions = strtoul(argv[2], NULL, 10),
+            .frames = max_frames,
+            .complexity = kSynthText,
+            .codec = codec,
+        };
+        bool admit = false;
+        for (int i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "--standin")) bench_config.standin = true;
+            if (!strcmp(argv[i], "--admit")) admit = true;
+        }
+        const char *bench_complexity = getenv("STREAMER_SYNTH");
+        if (bench_complexity &&
+            !parse_synth_complexity(bench_complexity, &bench_config.complexity))
+            return 1;
+        if (admit) {
+            bool calibrated = false;
+            bench_config.capacity_model =
+                create_capacity_model(capacity_file, &calibrated);
+            if (!bench_config.capacity_model) return 1;
+            if (!calibrated)
+                printf("未找到校准结果 %s，会话不计入设备负载\n", capacity_file);
+        }
+        bool result = BenchRun(&bench_config);
+        if (bench_config.capacity_model)
+            CapacityModelDestroy(bench_config.capacity_model);
+        return result ? 0 : 1;
+    }
+
+    // 输出记录格式（设置 STREAMER_PROTO=2 写入带流ID和PTS的v2头），
+    // 默认v1以兼容现有接收端
+    const char *proto_version = getenv("STREAMER_PROTO");
+    bool proto2 = false;
+    if (proto_version) {
+        if (strcmp(proto_version, "1") && strcmp(proto_version, "2")) {
+            fprintf(stderr, "Unsupported proto version %s\n", proto_version);
+            return -1;
+        }
+        proto2 = !strcmp(proto_version, "2");
+    }
+
+    // 外部码控（设置 STREAMER_QP=<qp> 按帧指定QP），此时编码P帧
+    const char *qp_value = getenv("STREAMER_QP");
+    struct EncodeFrameControl frame_control = {0};
+    if (qp_value && !parse_qp(qp_value, codec, &frame_control.qp)) return -1;
+
+    // 输入色彩空间与范围，默认BT.709全范围（共享内存环输入不携带色彩信息），
+    // 打开输入时按输入格式更新
+    enum YuvColorspace colorspace = kItuRec709;
+    enum YuvRange range = kFullRange;
+
+    // 多进程编码：--workers <套接字>，在任何GPU/VA初始化之前分支
+    if (argc > 2 && !strcmp(argv[1], "--workers"))
+        return run_workers(argv[2], output_file, codec, colorspace, range,
+                           max_frames, proto2);
+
+    // 合成帧源（设置 STREAMER_SYNTH=0..3 代替 test.yuv：渐变/文字/颗粒/噪声）
+    const char *synth_complexity = getenv("STREAMER_SYNTH");
+    struct SynthSource* synth_source = NULL;
+    if (synth_complexity) {
+        enum SynthComplexity complexity;
+        if (!parse_synth_complexity(synth_complexity, &complexity)) return -1;
+        synth_source = SynthSourceCreate(width, height, complexity);
+        if (!synth_source) return -1;
+        input_file = "synthetic";
+    }
     
-    printf("=== Intel Hardware HEVC Encoder ===\n");
+    printf("=== Intel Hardware %s Encoder ===\n",
+           codec == kEncodeCodecAv1 ? "AV1" : "HEVC");
     printf("输入文件: %s\n", input_file);
     printf("输出文件: %s\n", output_file);
-    printf("分辨率: %dx%d\n", width, height);
     printf("最大帧数: %d\n", max_frames);
     
-    FILE *fp = NULL;
-    unsigned char *y_data = NULL;
-    unsigned char *u_data = NULL;
-    unsigned char *v_data = NULL;
-
-    // 1. 打开YUV文件并分配内存
-    printf("\n1. 打开YUV文件并分配内存...\n");
-    if (open_yuv_file(input_file, width, height, &fp, &y_data, &u_data, &v_data) != 0) {
+    struct FrameInput *frame_input = NULL;
+    struct ShmConsumer *shm_consumer = NULL;
+    struct GpuFrame *shm_frames[SHM_RING_MAX_BUFFERS] = {NULL};
+    // 上一帧也由共享内存环转换时，生产者报告的损坏区域才适用于编码器输入
+    bool shm_converted = false;
+    unsigned char *synth_frame = NULL;
+    struct DecodeContext *decode_context = NULL;
+    int hevc_fd = -1;
+    bool hevc_eof = false;
+    bool decoded_pending = false;
+    struct DecodedFrame decoded_frame;
+    struct GpuFrame *decode_frames[20] = {NULL};
+    struct EncodeSurface *encode_surfaces[20] = {NULL};
+    struct CaptureContext *capture_context = NULL;
+    struct CapturedFrame captured_frame;
+    struct GpuFrame *capture_frames[CAPTURE_MAX_BUFFERS] = {NULL};
+    struct EncodeSurface *capture_surfaces[CAPTURE_MAX_BUFFERS] = {NULL};
+    bool capture_direct = false;
+
+    // 1. 打开输入（预读线程在后台填充帧缓冲环，shm:<套接字> 为共享内存环）
+    printf("\n1. 打开输入...\n");
+    if (!synth_source && !strncmp(input_file, "shm:", 4)) {
+        printf("等待生产者连接: %s\n", input_file + 4);
+        shm_consumer = ShmConsumerCreate(input_file + 4);
+        if (!shm_consumer) {
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        uint32_t shm_width, shm_height;
+        ShmConsumerGetSize(shm_consumer, &shm_width, &shm_height);
+        width = (int)shm_width;
+        height = (int)shm_height;
+    } else if (!synth_source && !strncmp(input_file, "hevc:", 5)) {
+        // 解码首帧以确定分辨率，该帧留作第一帧编码
+        const char *hevc_path = input_file + 5;
+        hevc_fd = strcmp(hevc_path, "-") ? open(hevc_path, O_RDONLY)
+                                          : STDIN_FILENO;
+        if (hevc_fd == -1) {
+            fprintf(stderr, "Failed to open hevc input: %s\n", strerror(errno));
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        decode_context = DecodeContextCreate(false);
+        if (!decode_context ||
+            !decode_next_frame(decode_context, hevc_fd, &hevc_eof,
+                               &decoded_frame)) {
+            fprintf(stderr, "Failed to decode first hevc frame\n");
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        decoded_pending = true;
+        width = (int)decoded_frame.crop_width;
+        height = (int)decoded_frame.crop_height;
+        // 未解析VUI，按BT.709有限范围处理
+        colorspace = kItuRec709;
+        range = kNarrowRange;
+    } else if (!synth_source && !strncmp(input_file, "v4l2:", 5)) {
+        // 分辨率沿用设备当前设置（如HDMI采集卡检测到的信号）
+        struct CaptureConfig capture_config = {
+            .buffer_count = 4,
+            .memory = getenv("STREAMER_V4L2_DMABUF") ? kCaptureMemoryDmabuf
+                                                     : kCaptureMemoryMmap,
+        };
+        capture_context = CaptureContextCreate(input_file + 5, &capture_config);
+        if (!capture_context) {
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        const struct CaptureFormat *capture_format =
+            CaptureContextGetFormat(capture_context);
+        width = (int)capture_format->width;
+        height = (int)capture_format->height;
+        colorspace = capture_format->colorspace;
+        range = capture_format->range;
+        // NV12先尝试由编码器直接读取采集缓冲，失败后改走GPU转换
+        capture_direct = capture_format->fourcc == DRM_FORMAT_NV12;
+        printf("V4L2采集: %.4s, %s\n", (const char *)&capture_format->fourcc,
+               capture_config.memory == kCaptureMemoryDmabuf ? "DMABUF"
+                                                              : "MMAP");
+    } else if (synth_source) {
+        synth_frame = (unsigned char *)malloc((size_t)width * height * 3 / 2);
+        if (!synth_frame) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+    } else {
+        frame_input = FrameInputCreate(input_file, width, height, 4);
+        if (!frame_input) {
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        const struct InputFormat *input_format = FrameInputGetFormat(frame_input);
+        width = input_format->width;
+        height = input_format->height;
+        colorspace = input_format->colorspace;
+        range = input_format->range;
+        if (input_format->y4m) {
+            printf("Y4M输入: %u/%u fps, %s, %s\n",
+                   input_format->fps_num, input_format->fps_den,
+                   colorspace == kItuRec709 ? "BT.709" : "BT.601",
+                   range == kFullRange ? "全范围" : "有限范围");
+        }
+    }
+    printf("输入打开成功 (分辨率: %dx%d)\n", width, height);
+
+    // 2. 容量检查（准入控制），在初始化GPU和VA之前拒绝超额会话
+    printf("\n2. 容量检查...\n");
+    // 编码器没有速度预设，吞吐量按编码格式区分
+    struct CapacityKey capacity_key = {
+        .entrypoint = EncodeCodecEntrypoint(codec),
+        .preset = (uint32_t)codec,
+    };
+    bool calibrated = false;
+    struct CapacityModel* capacity_model =
+        create_capacity_model(capacity_file, &calibrated);
+    if (!capacity_model) {
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
         return -1;
     }
-    printf("YUV文件打开成功\n");
+    uint64_t capacity_ticket = 0;
+    // 降级会话按准入的帧率限速，零表示不限速
+    unsigned long long frame_interval = 0;
+    if (!calibrate && calibrated) {
+        // 容量不足以支持30fps时降级，低于15fps则拒绝
+        double session_fps = 30.0;
+        enum CapacityVerdict verdict = CapacityModelAdmit(
+            capacity_model, &capacity_key, width, height, 15.0, &session_fps,
+            &capacity_ticket);
+        if (verdict == kCapacityRejected) {
+            fprintf(stderr, "设备容量不足，拒绝会话\n");
+            CapacityModelDestroy(capacity_model);
+            close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                        decode_context, hevc_fd, capture_context);
+            return -1;
+        }
+        if (verdict == kCapacityDowngraded) {
+            printf("设备容量不足，会话降级到 %.1f fps\n", session_fps);
+            frame_interval = (unsigned long long)(1e6 / session_fps);
+        }
+    }
+    struct CapacityLoad capacity_load;
+    CapacityModelGetLoad(capacity_model, &capacity_load);
+    printf("设备负载: %.1f%% / %.1f%% (%zu 个会话)\n",
+           capacity_load.used * 100, capacity_load.budget * 100,
+           capacity_load.sessions);
 
-    // 2. 创建GPU上下文
-    printf("\n2. 创建GPU上下文...\n");
-    struct GpuContext* gpu_context = GpuContextCreate(kItuRec709, kFullRange);
-    if (!gpu_context) {
-        fprintf(stderr, "Failed to create GPU context\n");
-        close_yuv_file(fp, y_data, u_data, v_data);
+    // 3. 创建GPU与编码上下文：EGL/着色器编译与VA初始化并行进行，
+    // 两者完成后再导出输入表面的dmabuf并导入EGL（STREAMER_SERIAL_INIT=1 顺序初始化）
+    printf("\n3. 创建GPU与编码上下文...\n");
+    unsigned long long startup_started = micros_now();
+    struct StartupConfig startup_config = {
+        .width = width,
+        .height = height,
+        .colorspace = colorspace,
+        .range = range,
+        .codec = codec,
+        .sequential = getenv("STREAMER_SERIAL_INIT") != NULL,
+    };
+    struct GpuContext* gpu_context = NULL;
+    struct EncodeContext* encode_context = NULL;
+    struct StartupTimings startup_timings;
+    if (!StartupCreateContexts(&startup_config, &gpu_context, &encode_context,
+                               &startup_timings)) {
+        if (capacity_ticket)
+            CapacityModelRelease(capacity_model, capacity_ticket);
+        CapacityModelDestroy(capacity_model);
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
         return -1;
     }
-    printf("GPU上下文创建成功\n");
+    printf("上下文创建成功 (%s, GPU %.1fms, VA %.1fms, 等待 %.1fms, "
+           "导入 %.1fms, 共 %.1fms)\n",
+           startup_config.sequential ? "顺序" : "并行",
+           startup_timings.gpu_micros / 1000.0,
+           startup_timings.va_micros / 1000.0,
+           startup_timings.join_micros / 1000.0,
+           startup_timings.bind_micros / 1000.0,
+           startup_timings.total_micros / 1000.0);
 
-    // 3. 创建编码上下文
-    printf("\n3. 创建编码上下文...\n");
-    struct EncodeContext* encode_context = EncodeContextCreate(
-        gpu_context, width, height, kItuRec709, kFullRange);
-    if (!encode_context) {
-        fprintf(stderr, "Failed to create encode context\n");
+    // 校准模式：测量设备吞吐量并保存容量模型
+    if (calibrate) {
+        printf("\n校准设备吞吐量...\n");
+        int ret = -1;
+        if (CapacityModelCalibrate(capacity_model, &capacity_key,
+                                   encode_context, width, height, 60) &&
+            CapacityModelSave(capacity_model, capacity_file)) {
+            printf("校准结果已保存到: %s\n", capacity_file);
+            ret = 0;
+        }
+        EncodeContextDestroy(encode_context);
+        CapacityModelDestroy(capacity_model);
         GpuContextDestroy(gpu_context);
-        close_yuv_file(fp, y_data, u_data, v_data);
-        return -1;
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
+        return ret;
     }
-    printf("编码上下文创建成功\n");
 
     // 4. 获取编码器输入帧
     printf("\n4. 获取编码器输入帧...\n");
@@ -174,8 +738,10 @@ int main(int argc, char *argv[]) {
     if (!encoded_frame) {
         fprintf(stderr, "Failed to get encoder input frame\n");
         EncodeContextDestroy(encode_context);
+        CapacityModelDestroy(capacity_model);
         GpuContextDestroy(gpu_context);
-        close_yuv_file(fp, y_data, u_data, v_data);
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
         return -1;
     }
     printf("编码器输入帧获取成功 (分辨率: %dx%d)\n", 
@@ -187,20 +753,170 @@ int main(int argc, char *argv[]) {
     if (output_fd == -1) {
         fprintf(stderr, "Failed to create output file: %s\n", strerror(errno));
         EncodeContextDestroy(encode_context);
+        CapacityModelDestroy(capacity_model);
+        GpuContextDestroy(gpu_context);
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
+        return -1;
+    }
+    printf("输出文件创建成功 (proto v%d)\n", proto2 ? 2 : 1);
+
+    // 关键帧索引旁车文件，创建失败时仅录制不建索引
+    char index_file[256];
+    snprintf(index_file, sizeof(index_file), "%s.idx", output_file);
+    int udp_fd = -1;
+    struct RecorderOutputs recorder_outputs = {
+        .fd = output_fd,
+        .proto2 = proto2,
+        .key_index_writer = KeyIndexWriterCreate(index_file),
+        .fec_send = send_fec_datagram,
+        .fec_user = &udp_fd,
+    };
+    // 直接写入（设置 STREAMER_DIRECT=1），文件系统不支持时退回页缓存写入
+    if (getenv("STREAMER_DIRECT")) {
+        recorder_outputs.direct_writer = DirectWriterCreate(output_file);
+        if (recorder_outputs.direct_writer) {
+            printf("输出文件以O_DIRECT写入\n");
+        } else {
+            fprintf(stderr,
+                    "Failed to create direct writer, using page cache\n");
+        }
+    }
+    // 负载加密（设置 STREAMER_CENC_KEY=<32位十六进制>），仅支持HEVC，
+    // 子样本表是v2头的扩展，需要同时设置 STREAMER_PROTO=2
+    const char *cenc_key = getenv("STREAMER_CENC_KEY");
+    if (cenc_key) {
+        uint8_t key[CENC_KEY_SIZE];
+        if (codec != kEncodeCodecHevc) {
+            fprintf(stderr, "Encryption is only supported for hevc\n");
+        } else if (!proto2) {
+            fprintf(stderr, "Encryption requires proto version 2\n");
+        } else if (!parse_cenc_key(cenc_key, key)) {
+            fprintf(stderr, "Invalid encryption key\n");
+        } else {
+            recorder_outputs.cenc_context = CencContextCreate(key);
+            if (recorder_outputs.cenc_context) printf("负载以AES-CTR加密\n");
+        }
+    }
+    // UDP输出（设置 STREAMER_UDP=host:port），STREAMER_FEC 选择纠错方式
+    const char *udp_address = getenv("STREAMER_UDP");
+    struct FecConfig fec_config;
+    if (udp_address && parse_fec_config(getenv("STREAMER_FEC"), &fec_config)) {
+        udp_fd = open_udp_output(udp_address);
+        if (udp_fd != -1) {
+            recorder_outputs.fec_encoder = FecEncoderCreate(&fec_config);
+            if (recorder_outputs.fec_encoder) {
+                printf("UDP输出: %s (冗余 %u%%/%u%%)\n", udp_address,
+                       fec_config.parity_percent,
+                       fec_config.keyframe_parity_percent);
+            } else {
+                close(udp_fd);
+                udp_fd = -1;
+            }
+        }
+    }
+    if (recorder_outputs.key_index_writer) {
+        printf("关键帧索引: %s\n", index_file);
+    } else {
+        fprintf(stderr, "Failed to create key index, seeking will scan\n");
+    }
+    // 录制输出：每帧一条proto记录写入文件（或直接写入），同一记录再经FEC发送
+    struct Recorder *recorder = RecorderCreate(&recorder_outputs);
+    if (!recorder) {
+        close_recorder_outputs(&recorder_outputs, udp_fd);
+        close(output_fd);
+        EncodeContextDestroy(encode_context);
+        CapacityModelDestroy(capacity_model);
         GpuContextDestroy(gpu_context);
-        close_yuv_file(fp, y_data, u_data, v_data);
+        close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                    decode_context, hevc_fd, capture_context);
         return -1;
     }
-    printf("输出文件创建成功\n");
 
     // 6. 开始编码过程 - 编码100帧
     printf("\n6. 开始编码YUV帧 (目标: %d帧)...\n", max_frames);
     
+    // GPU引擎利用率采样（失败不影响编码），编码、解码与GPU转换
+    // 各自打开渲染节点，是不同的DRM客户端，利用率需要累加
+    int sampled_fds[] = {
+        EncodeContextGetRenderNode(encode_context),
+        decode_context ? DecodeContextGetRenderNode(decode_context) : -1,
+        GpuContextGetRenderNode(gpu_context),
+    };
+    struct EngineSampler* engine_samplers[LENGTH(sampled_fds)] = {NULL};
+    for (size_t i = 0; i < LENGTH(sampled_fds); i++) {
+        if (sampled_fds[i] != -1)
+            engine_samplers[i] = EngineSamplerCreate(sampled_fds[i]);
+    }
+
+    // 实时指标导出（设置 STREAMER_METRICS=unix:/path 或 tcp:host:port 启用）
+    struct MetricsSession* metrics_session = MetricsSessionCreate("main");
+    struct MetricsServer* metrics_server = NULL;
+    const char *metrics_address = getenv("STREAMER_METRICS");
+    if (metrics_session) {
+        EncodeContextSetMetrics(encode_context, metrics_session);
+        if (metrics_address) {
+            metrics_server = MetricsServerCreate(metrics_address);
+            if (metrics_server &&
+                !MetricsServerRegister(metrics_server, metrics_session)) {
+                MetricsServerDestroy(metrics_server);
+                metrics_server = NULL;
+            }
+            // 运行期间按秒采样引擎利用率并作为仪表导出，使用独立的采样器，
+            // 退出时的汇总仍覆盖整个编码过程
+            for (size_t i = 0; metrics_server && i < LENGTH(sampled_fds); i++) {
+                if (sampled_fds[i] == -1) continue;
+                struct EngineSampler *engine_sampler =
+                    EngineSamplerCreate(sampled_fds[i]);
+                if (engine_sampler &&
+                    !MetricsServerAddEngineSampler(metrics_server,
+                                                   engine_sampler))
+                    EngineSamplerDestroy(engine_sampler);
+            }
+        }
+    }
+
+    // 流水线时间线（设置 STREAMER_TRACE=<文件> 启用，kill -USR1 可随时导出）
+    const char *trace_path = getenv("STREAMER_TRACE");
+    if (trace_path) {
+        signal(SIGUSR1, on_trace_signal);
+        TraceStart();
+    }
+    // 读取阶段与编码器事件使用相同的会话ID和帧号，便于在时间线上关联
+    uint32_t trace_session = EncodeContextGetSessionId(encode_context);
+
+    // 缩略图（设置 STREAMER_PREVIEW=<文件>，.jpg/.jpeg 输出JPEG，否则为原始RGBA）
+    // 每30帧由GPU缩小到1/4并异步读回，忙时丢弃，不阻塞编码
+    const char *preview_path = getenv("STREAMER_PREVIEW");
+    struct PreviewContext *preview_context = NULL;
+    if (preview_path) {
+        const char *extension = strrchr(preview_path, '.');
+        bool jpeg = extension && (!strcasecmp(extension, ".jpg") ||
+                                  !strcasecmp(extension, ".jpeg"));
+        struct PreviewConfig preview_config = {
+            .width = width / 4 ? (uint32_t)width / 4 : 1,
+            .height = height / 4 ? (uint32_t)height / 4 : 1,
+            .interval = 30,
+            .format = jpeg ? kPreviewFormatJpeg : kPreviewFormatRgba,
+            .quality = 75,
+        };
+        preview_context = PreviewContextCreate(
+            gpu_context, &preview_config, write_preview_file,
+            (void *)preview_path);
+        if (preview_context) {
+            printf("缩略图: %s (%ux%u, 每%u帧)\n", preview_path,
+                   preview_config.width, preview_config.height,
+                   preview_config.interval);
+        }
+    }
+
     struct timespec start_time, end_time;
     clock_gettime(CLOCK_MONOTONIC, &start_time);
+    unsigned long long pace_deadline = micros_now();
     
     int encoded_frames = 0;
     int keyframes = 0;
+    unsigned long long first_frame_micros = 0;
     int failed_frames = 0;
     
     for (int frame_num = 0; frame_num < max_frames; frame_num++) {
@@ -211,28 +927,208 @@ int main(int argc, char *argv[]) {
         }
         
         printf("编码帧 %d/%d... ", frame_num + 1, max_frames);
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            if (TraceDump(trace_path)) printf("\n📝 时间线已导出: %s\n", trace_path);
+        }
         
-        // 从文件读取YUV帧
-        int ret = read_yuv420p_frame(fp, width, height, y_data, u_data, v_data);
-        if (ret != 0) {
-            if (feof(fp)) {
-                printf("\n📄 已到达文件结尾 (共读取%d帧)\n", frame_num);
-                break;
-            } else {
+        // 获取下一帧（合成帧或预读环中的帧）
+        unsigned long long stage_started = micros_now();
+        uint64_t trace_frame = EncodeContextGetFrameCounter(encode_context);
+        TraceBegin("read", trace_session, trace_frame);
+        struct InputFrame input_frame;
+        struct ShmRingFrame shm_frame = {0};
+        bool have_frame = true;
+        if (synth_source) {
+            size_t luma_size = (size_t)width * height;
+            SynthSourceFill(synth_source, frame_num, synth_frame,
+                            synth_frame + luma_size,
+                            synth_frame + luma_size + luma_size / 4);
+            input_frame = (struct InputFrame){
+                .y_data = synth_frame,
+                .u_data = synth_frame + luma_size,
+                .v_data = synth_frame + luma_size + luma_size / 4,
+                .index = (uint64_t)frame_num,
+            };
+        } else if (decode_context) {
+            if (!decoded_pending)
+                have_frame = decode_next_frame(decode_context, hevc_fd,
+                                               &hevc_eof, &decoded_frame);
+            decoded_pending = false;
+            input_frame = (struct InputFrame){.index = (uint64_t)frame_num};
+        } else if (capture_context) {
+            have_frame = CaptureContextAcquire(capture_context, &captured_frame);
+            input_frame = (struct InputFrame){.index = captured_frame.sequence};
+        } else if (shm_consumer) {
+            if (metrics_session)
+                MetricsSessionQueueDepth(metrics_session,
+                                         (uint32_t)ShmConsumerQueued(shm_consumer));
+            have_frame = ShmConsumerAcquire(shm_consumer, &shm_frame);
+            input_frame = (struct InputFrame){
+                .y_data = shm_frame.y_data,
+                .u_data = shm_frame.u_data,
+                .v_data = shm_frame.v_data,
+                .index = shm_frame.sequence,
+            };
+        } else {
+            if (metrics_session)
+                MetricsSessionQueueDepth(metrics_session,
+                                         (uint32_t)FrameInputQueued(frame_input));
+            have_frame = FrameInputAcquire(frame_input, &input_frame);
+        }
+        TraceEnd("read", trace_session, trace_frame);
+        if (!have_frame) {
+            if (capture_context ||
+                (frame_input && FrameInputFailed(frame_input)) ||
+                (decode_context && DecodeContextFailed(decode_context))) {
                 fprintf(stderr, "\n❌ 第%d帧：读取YUV数据失败\n", frame_num + 1);
                 failed_frames++;
-                continue;
+                if (metrics_session) MetricsSessionDrop(metrics_session);
+            } else {
+                printf("\n📄 已到达输入结尾 (共读取%d帧)\n", frame_num);
             }
+            break;
         }
+        if (metrics_session)
+            MetricsSessionStage(metrics_session, kMetricsStageRead,
+                                micros_now() - stage_started);
         
-        // 直接将YUV数据写入编码器表面
+        // 直接将YUV数据写入编码器表面（dmabuf帧由GPU转换，不经过CPU）
         printf("写入... ");
-        if (!EncodeContextWriteYuvData(encode_context, y_data, u_data, v_data, width, height)) {
+        stage_started = micros_now();
+        enum MetricsStage write_stage = kMetricsStageUpload;
+        bool written;
+        bool previewable = true;
+        if (shm_frame.buffer) {
+            struct GpuFrame *from = get_shm_frame(
+                gpu_context, shm_frames, shm_frame.buffer_id,
+                shm_frame.buffer, shm_frame.buffer_fresh);
+            struct GpuCursor cursor = {
+                .x = shm_frame.cursor.x,
+                .y = shm_frame.cursor.y,
+            };
+            if (shm_frame.cursor_buffer)
+                cursor.image = get_shm_frame(
+                    gpu_context, shm_frames, shm_frame.cursor.buffer_id,
+                    shm_frame.cursor_buffer, shm_frame.cursor_fresh);
+            const struct GpuRect *damage = NULL;
+            struct GpuRect shm_damage;
+            if (shm_converted && shm_frame.damage) {
+                shm_damage = (struct GpuRect){
+                    .x = shm_frame.damage->x,
+                    .y = shm_frame.damage->y,
+                    .width = shm_frame.damage->width,
+                    .height = shm_frame.damage->height,
+                };
+                damage = &shm_damage;
+            }
+            write_stage = kMetricsStageConvert;
+            // 光标导入失败时仍转换画面，只是不绘制光标
+            written = from &&
+                convert_frame(gpu_context, encode_context, from,
+                              cursor.image ? &cursor : NULL, damage);
+        } else if (decode_context) {
+            // 尺寸一致时编码器直接读取解码表面，否则经GPU转换缩放
+            uint32_t id = decoded_frame.index;
+            if (decoded_frame.fresh) {
+                if (decode_frames[id]) {
+                    GpuContextDestroyFrame(gpu_context, decode_frames[id]);
+                    decode_frames[id] = NULL;
+                }
+                if (encode_surfaces[id]) {
+                    EncodeContextDestroySurface(encode_context,
+                                                encode_surfaces[id]);
+                    encode_surfaces[id] = NULL;
+                }
+            }
+            if (decoded_frame.crop_width == (uint32_t)width &&
+                decoded_frame.crop_height == (uint32_t)height) {
+                if (!encode_surfaces[id])
+                    encode_surfaces[id] = EncodeContextImportSurface(
+                        encode_context, decoded_frame.width,
+                        decoded_frame.height, decoded_frame.fourcc,
+                        decoded_frame.nplanes, decoded_frame.planes);
+                if (encode_surfaces[id])
+                    EncodeContextSetSurface(encode_context, encode_surfaces[id]);
+                written = encode_surfaces[id] != NULL;
+                previewable = false;
+            } else {
+                // 只采样裁剪区域，缩放由转换着色器完成（解码器保留原描述符）
+                if (!decode_frames[id])
+                    decode_frames[id] = GpuContextImportFrame(
+                        gpu_context, decoded_frame.crop_width,
+                        decoded_frame.crop_height, decoded_frame.fourcc,
+                        decoded_frame.nplanes, decoded_frame.planes);
+                write_stage = kMetricsStageConvert;
+                written = decode_frames[id] &&
+                    convert_frame(gpu_context, encode_context,
+                                  decode_frames[id], NULL, NULL);
+            }
+        } else if (capture_context) {
+            // 采集缓冲按索引缓存导入结果，缓冲重新分配后重新导入
+            uint32_t id = captured_frame.index;
+            if (captured_frame.fresh) {
+                if (capture_frames[id]) {
+                    GpuContextDestroyFrame(gpu_context, capture_frames[id]);
+                    capture_frames[id] = NULL;
+                }
+                if (capture_surfaces[id]) {
+                    EncodeContextDestroySurface(encode_context,
+                                                capture_surfaces[id]);
+                    capture_surfaces[id] = NULL;
+                }
+            }
+            const struct CaptureFormat *capture_format =
+                CaptureContextGetFormat(capture_context);
+            if (capture_direct && !capture_surfaces[id]) {
+                capture_surfaces[id] = EncodeContextImportSurface(
+                    encode_context, capture_format->width,
+                    capture_format->height, capture_format->fourcc,
+                    captured_frame.nplanes, captured_frame.planes);
+                if (!capture_surfaces[id]) {
+                    fprintf(stderr, "编码器无法直接读取采集缓冲，改用GPU转换\n");
+                    capture_direct = false;
+                }
+            }
+            if (capture_direct) {
+                EncodeContextSetSurface(encode_context, capture_surfaces[id]);
+                written = true;
+                previewable = false;
+            } else {
+                if (!capture_frames[id])
+                    capture_frames[id] = GpuContextImportFrame(
+                        gpu_context, capture_format->width,
+                        capture_format->height, capture_format->fourcc,
+                        captured_frame.nplanes, captured_frame.planes);
+                write_stage = kMetricsStageConvert;
+                written = capture_frames[id] &&
+                    convert_frame(gpu_context, encode_context,
+                                  capture_frames[id], NULL, NULL);
+            }
+        } else {
+            written = EncodeContextWriteYuvData(
+                encode_context, input_frame.y_data, input_frame.u_data,
+                input_frame.v_data, width, height);
+        }
+        if (frame_input) FrameInputRelease(frame_input);
+        if (shm_consumer) ShmConsumerRelease(shm_consumer);
+        shm_converted = shm_frame.buffer && written;
+        if (!written) {
+            if (decode_context) DecodeContextRelease(decode_context);
+            if (capture_context) CaptureContextRelease(capture_context);
             fprintf(stderr, "❌ 写入失败\n");
             failed_frames++;
+            if (metrics_session) MetricsSessionDrop(metrics_session);
             continue;
         }
+        if (metrics_session)
+            MetricsSessionStage(metrics_session, write_stage,
+                                micros_now() - stage_started);
         printf("✓ ");
+        if (preview_context && previewable)
+            PreviewContextSubmit(preview_context,
+                                 EncodeContextGetFrame(encode_context),
+                                 input_frame.index);
         
         // 获取时间戳（微秒级别）
         unsigned long long timestamp;
@@ -243,13 +1139,35 @@ int main(int argc, char *argv[]) {
         // 编码帧
         printf("编码... ");
         bool is_keyframe = (frame_num % 30 == 0); // 每30帧一个关键帧
-        bool success = EncodeContextEncodeFrame(encode_context, output_fd, timestamp);
+        struct EncodeFrameResult frame_result;
+        bool success =
+            qp_value ? EncodeContextEncodeFrameControlled(
+                           encode_context, timestamp, &frame_control,
+                           RecorderWriteFrame, recorder, &frame_result)
+                     : EncodeContextEncodeFrameToSink(encode_context, timestamp,
+                                                      RecorderWriteFrame,
+                                                      recorder);
+        if (success && qp_value)
+            is_keyframe = frame_result.type == kEncodeFrameTypeIntra;
+        if (decode_context) {
+            EncodeContextSetSurface(encode_context, NULL);
+            DecodeContextRelease(decode_context);
+        }
+        if (capture_context) {
+            EncodeContextSetSurface(encode_context, NULL);
+            CaptureContextRelease(capture_context);
+        }
         
         if (success) {
+            if (!encoded_frames)
+                first_frame_micros = micros_now() - startup_started;
             encoded_frames++;
             if (is_keyframe) keyframes++;
             printf("✅");
             if (is_keyframe) printf(" 🔑关键帧");
+            if (qp_value)
+                printf(" QP%u %u字节", frame_result.qp, frame_result.size);
+            if (qp_value && frame_result.weighted) printf(" 加权预测");
             
             // 每10帧显示进度统计
             if ((frame_num + 1) % 10 == 0) {
@@ -260,22 +1178,54 @@ int main(int argc, char *argv[]) {
         } else {
             fprintf(stderr, "❌ 编码失败\n");
             failed_frames++;
+            if (metrics_session) MetricsSessionDrop(metrics_session);
             // 继续尝试下一帧，不要立即退出
             continue;
         }
         
-        // 小延迟以模拟真实场景
-        usleep(1000); // 1ms
+        if (frame_interval) {
+            // 落后时不追赶，避免突发超出准入的设备负载
+            pace_deadline += frame_interval;
+            unsigned long long now = micros_now();
+            if (pace_deadline > now)
+                usleep((useconds_t)(pace_deadline - now));
+            else
+                pace_deadline = now;
+        } else {
+            // 小延迟以模拟真实场景
+            usleep(1000); // 1ms
+        }
     }
     
     clock_gettime(CLOCK_MONOTONIC, &end_time);
+    // 预览线程可能仍在读回编码器输入帧，先于编码器销毁
+    struct PreviewStats preview_stats = {0};
+    if (preview_context) {
+        PreviewContextGetStats(preview_context, &preview_stats);
+        PreviewContextDestroy(preview_context);
+    }
+    double utilization[kDrmEngineCount] = {0};
+    bool has_utilization = false;
+    for (size_t i = 0; i < LENGTH(engine_samplers); i++) {
+        double client_utilization[kDrmEngineCount];
+        if (!engine_samplers[i] ||
+            !EngineSamplerSample(engine_samplers[i], client_utilization))
+            continue;
+        for (size_t j = 0; j < kDrmEngineCount; j++) {
+            utilization[j] += client_utilization[j];
+            if (utilization[j] > 1) utilization[j] = 1;
+        }
+        has_utilization = true;
+    }
     
     // 计算性能统计
     double elapsed_time = (end_time.tv_sec - start_time.tv_sec) + 
                          (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
     double fps = encoded_frames > 0 ? encoded_frames / elapsed_time : 0;
     
-    // 关闭输出文件
+    // 关闭输出文件，直接写入的尾部和索引先落盘
+    RecorderDestroy(recorder);
+    close_recorder_outputs(&recorder_outputs, udp_fd);
     close(output_fd);
     
     // 输出测试结果
@@ -294,6 +1244,22 @@ int main(int argc, char *argv[]) {
     if (encoded_frames > 0) {
         printf("  • 编码速度: %.2f FPS\n", fps);
         printf("  • 平均帧延迟: %.2f 毫秒\n", (elapsed_time / encoded_frames) * 1000);
+        printf("  • 首帧时间: %.2f 毫秒 (自上下文初始化开始)\n",
+               first_frame_micros / 1000.0);
+    }
+    if (has_utilization) {
+        printf("  • 视频引擎利用率: %.1f%%\n", utilization[kDrmEngineVideo] * 100);
+        printf("  • 渲染引擎利用率: %.1f%%\n", utilization[kDrmEngineRender] * 100);
+    }
+    if (capture_context) {
+        printf("  • 采集丢帧: %llu 帧\n",
+               (unsigned long long)CaptureContextDropped(capture_context));
+    }
+    if (preview_path && preview_stats.submitted) {
+        printf("  • 缩略图: 提交%llu张, 输出%llu张, 丢弃%llu张\n",
+               (unsigned long long)preview_stats.submitted,
+               (unsigned long long)preview_stats.delivered,
+               (unsigned long long)preview_stats.dropped);
     }
     
     // 检查输出文件大小
@@ -309,11 +1275,41 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (trace_path) {
+        TraceStop();
+        if (TraceDump(trace_path)) printf("  • 时间线文件: %s\n", trace_path);
+    }
+
     // 清理资源
     printf("\n7. 清理资源...\n");
+    if (metrics_server) MetricsServerDestroy(metrics_server);
+    if (metrics_session) MetricsSessionDestroy(metrics_session);
+    for (size_t i = 0; i < LENGTH(engine_samplers); i++) {
+        if (engine_samplers[i]) EngineSamplerDestroy(engine_samplers[i]);
+    }
+    for (size_t i = 0; i < LENGTH(encode_surfaces); i++) {
+        if (encode_surfaces[i])
+            EncodeContextDestroySurface(encode_context, encode_surfaces[i]);
+    }
+    for (size_t i = 0; i < LENGTH(capture_surfaces); i++) {
+        if (capture_surfaces[i])
+            EncodeContextDestroySurface(encode_context, capture_surfaces[i]);
+    }
     EncodeContextDestroy(encode_context);
+    for (size_t i = 0; i < LENGTH(shm_frames); i++) {
+        if (shm_frames[i]) GpuContextDestroyFrame(gpu_context, shm_frames[i]);
+    }
+    for (size_t i = 0; i < LENGTH(decode_frames); i++) {
+        if (decode_frames[i]) GpuContextDestroyFrame(gpu_context, decode_frames[i]);
+    }
+    for (size_t i = 0; i < LENGTH(capture_frames); i++) {
+        if (capture_frames[i]) GpuContextDestroyFrame(gpu_context, capture_frames[i]);
+    }
+    if (capacity_ticket) CapacityModelRelease(capacity_model, capacity_ticket);
+    CapacityModelDestroy(capacity_model);
     GpuContextDestroy(gpu_context);
-    close_yuv_file(fp, y_data, u_data, v_data);
+    close_input(frame_input, shm_consumer, synth_frame, synth_source,
+                decode_context, hevc_fd, capture_context);
     
     printf("\n=== 编码完成 ===\n");
     
@@ -0,0 +1,600 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdinfo.h"
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+// Fdinfo counters are only meaningful over intervals much longer than a frame.
+#define METRICS_ENGINE_PERIOD_MS 1000
+
+static const uint64_t kBucketsMicros[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+};
+
+static const char* const kStageNames[kMetricsStageCount] = {
+    [kMetricsStageRead] = "read",
+    [kMetricsStageUpload] = "upload",
+    [kMetricsStageConvert] = "convert",
+    [kMetricsStageSubmit] = "submit",
+    [kMetricsStageSync] = "sync",
+    [kMetricsStageWrite] = "write",
+};
+
+struct MetricsHistogram {
+  atomic_uint_least64_t buckets[LENGTH(kBucketsMicros) + 1];
+  atomic_uint_least64_t sum;
+};
+
+struct MetricsSession {
+  // Name escaped for use as a label value, every character takes at most two.
+  char label[128];
+  atomic_uint_least64_t frames;
+  atomic_uint_least64_t bytes;
+  atomic_uint_least64_t keyframes;
+  atomic_uint_least64_t drops;
+  atomic_uint_least32_t queue_depth;
+  struct MetricsHistogram stages[kMetricsStageCount];
+};
+
+// Clients are served from the same thread without ever blocking on any of
+// them, and the ones that do not complete the exchange in time are dropped.
+struct MetricsClient {
+  int fd;
+  uint64_t deadline;
+  char* reply;
+  size_t reply_size;
+  size_t reply_offset;
+};
+
+struct MetricsServer {
+  char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  int listener;
+  int shutdown;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  struct MetricsSession* sessions[32];
+  struct MetricsClient clients[16];
+
+  struct EngineSampler* engine_samplers[4];
+  uint64_t next_engine_sample;
+  bool has_utilization;
+  double utilization[kDrmEngineCount];
+};
+
+// Every counter has a single writer, so there is no need to pay for a locked
+// read-modify-write. Relaxed load and store are plain movs on x86.
+static void Increment(atomic_uint_least64_t* counter, uint64_t delta) {
+  uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, value + delta, memory_order_relaxed);
+}
+
+static uint64_t Load(atomic_uint_least64_t* counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+struct MetricsSession* MetricsSessionCreate(const char* name) {
+  struct MetricsSession* metrics_session =
+      calloc(1, sizeof(struct MetricsSession));
+  if (!metrics_session) {
+    fprintf(stderr, "Failed to allocate metrics session: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  // Label values escape backslash, double quote and line feed, see the
+  // Prometheus text exposition format.
+  char* label = metrics_session->label;
+  for (size_t i = 0; name[i] && i < 63; i++) {
+    switch (name[i]) {
+      case '\\':
+      case '"':
+        *label++ = '\\';
+        *label++ = name[i];
+        break;
+      case '\n':
+        *label++ = '\\';
+        *label++ = 'n';
+        break;
+      default:
+        *label++ = name[i];
+        break;
+    }
+  }
+  *label = 0;
+  return metrics_session;
+}
+
+void MetricsSessionFrame(struct MetricsSession* metrics_session, uint32_t size,
+                         bool keyframe) {
+  Increment(&metrics_session->frames, 1);
+  Increment(&metrics_session->bytes, size);
+  if (keyframe) Increment(&metrics_session->keyframes, 1);
+}
+
+void MetricsSessionDrop(struct MetricsSession* metrics_session) {
+  Increment(&metrics_session->drops, 1);
+}
+
+void MetricsSessionStage(struct MetricsSession* metrics_session,
+                         enum MetricsStage stage, uint64_t micros) {
+  struct MetricsHistogram* histogram = &metrics_session->stages[stage];
+  size_t bucket = 0;
+  while (bucket < LENGTH(kBucketsMicros) && micros > kBucketsMicros[bucket])
+    bucket++;
+  Increment(&histogram->buckets[bucket], 1);
+  Increment(&histogram->sum, micros);
+}
+
+void MetricsSessionQueueDepth(struct MetricsSession* metrics_session,
+                              uint32_t depth) {
+  atomic_store_explicit(&metrics_session->queue_depth, depth,
+                        memory_order_relaxed);
+}
+
+void MetricsSessionDestroy(struct MetricsSession* metrics_session) {
+  free(metrics_session);
+}
+
+static void WriteCounter(FILE* out, const char* name, const char* help,
+                         struct MetricsSession* const* sessions, size_t count,
+                         size_t offset) {
+  fprintf(out, "# HELP streamer_%s %s\n# TYPE streamer_%s counter\n", name,
+          help, name);
+  for (size_t i = 0; i < count; i++) {
+    if (!sessions[i]) continue;
+    atomic_uint_least64_t* counter =
+        (atomic_uint_least64_t*)((uint8_t*)sessions[i] + offset);
+    fprintf(out, "streamer_%s{session=\"%s\"} %lu\n", name, sessions[i]->label,
+            (unsigned long)Load(counter));
+  }
+}
+
+static void WriteSessions(FILE* out, struct MetricsSession* const* sessions,
+                          size_t count) {
+  WriteCounter(out, "frames_total", "Encoded frames.", sessions, count,
+               offsetof(struct MetricsSession, frames));
+  WriteCounter(out, "bytes_total", "Encoded bytes.", sessions, count,
+               offsetof(struct MetricsSession, bytes));
+  WriteCounter(out, "keyframes_total", "Encoded IDR frames.", sessions, count,
+               offsetof(struct MetricsSession, keyframes));
+  WriteCounter(out, "drops_total", "Dropped or failed frames.", sessions,
+               count, offsetof(struct MetricsSession, drops));
+
+  fprintf(out,
+          "# HELP streamer_queue_depth Frames waiting in the input queue.\n"
+          "# TYPE streamer_queue_depth gauge\n");
+  for (size_t i = 0; i < count; i++) {
+    if (!sessions[i]) continue;
+    fprintf(out, "streamer_queue_depth{session=\"%s\"} %u\n",
+            sessions[i]->label,
+            (unsigned)atomic_load_explicit(&sessions[i]->queue_depth,
+                                           memory_order_relaxed));
+  }
+
+  fprintf(out,
+          "# HELP streamer_stage_seconds Pipeline stage latency.\n"
+          "# TYPE streamer_stage_seconds histogram\n");
+  for (size_t i = 0; i < count; i++) {
+    if (!sessions[i]) continue;
+    for (size_t j = 0; j < kMetricsStageCount; j++) {
+      struct MetricsHistogram* histogram = &sessions[i]->stages[j];
+      uint64_t cumulative = 0;
+      for (size_t k = 0; k < LENGTH(histogram->buckets); k++) {
+        cumulative += Load(&histogram->buckets[k]);
+        if (k < LENGTH(kBucketsMicros)) {
+          fprintf(out,
+                  "streamer_stage_seconds_bucket{session=\"%s\",stage=\"%s\","
+                  "le=\"%g\"} %lu\n",
+                  sessions[i]->label, kStageNames[j],
+                  (double)kBucketsMicros[k] / 1e6, (unsigned long)cumulative);
+        } else {
+          fprintf(out,
+                  "streamer_stage_seconds_bucket{session=\"%s\",stage=\"%s\","
+                  "le=\"+Inf\"} %lu\n",
+                  sessions[i]->label, kStageNames[j],
+                  (unsigned long)cumulative);
+        }
+      }
+      fprintf(out,
+              "streamer_stage_seconds_sum{session=\"%s\",stage=\"%s\"} %g\n"
+              "streamer_stage_seconds_count{session=\"%s\",stage=\"%s\"} %lu\n",
+              sessions[i]->label, kStageNames[j],
+              (double)Load(&histogram->sum) / 1e6, sessions[i]->label,
+              kStageNames[j], (unsigned long)cumulative);
+    }
+  }
+}
+
+static void WriteEngines(FILE* out,
+                         const struct MetricsServer* metrics_server) {
+  if (!metrics_server->has_utilization) return;
+  fprintf(out,
+          "# HELP streamer_engine_utilization Busy fraction of gpu engines "
+          "over the last second.\n"
+          "# TYPE streamer_engine_utilization gauge\n");
+  for (size_t i = 0; i < kDrmEngineCount; i++) {
+    fprintf(out, "streamer_engine_utilization{engine=\"%s\"} %g\n",
+            DrmEngineName(i), metrics_server->utilization[i]);
+  }
+}
+
+static uint64_t MillisNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void DropClient(struct MetricsClient* client) {
+  close(client->fd);
+  free(client->reply);
+  *client = (struct MetricsClient){.fd = -1};
+}
+
+static void AcceptClient(struct MetricsServer* metrics_server) {
+  int fd = accept(metrics_server->listener, NULL, NULL);
+  if (fd == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "Failed to accept metrics client: %s\n",
+              strerror(errno));
+    }
+    return;
+  }
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) || fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+    fprintf(stderr, "Failed to configure metrics client: %s\n",
+            strerror(errno));
+    close(fd);
+    return;
+  }
+  for (size_t i = 0; i < LENGTH(metrics_server->clients); i++) {
+    struct MetricsClient* client = &metrics_server->clients[i];
+    if (client->fd != -1) continue;
+    *client = (struct MetricsClient){
+        .fd = fd,
+        .deadline = MillisNow() + 1000,
+    };
+    return;
+  }
+  fprintf(stderr, "Too many metrics clients\n");
+  close(fd);
+}
+
+static bool PrepareReply(struct MetricsServer* metrics_server,
+                         struct MetricsClient* client) {
+  char* body = NULL;
+  size_t body_size = 0;
+  FILE* out = open_memstream(&body, &body_size);
+  if (!out) {
+    fprintf(stderr, "Failed to open memstream: %s\n", strerror(errno));
+    return false;
+  }
+  pthread_mutex_lock(&metrics_server->mutex);
+  WriteSessions(out, metrics_server->sessions,
+                LENGTH(metrics_server->sessions));
+  WriteEngines(out, metrics_server);
+  pthread_mutex_unlock(&metrics_server->mutex);
+  fclose(out);
+
+  char header[160];
+  int header_size = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n",
+                             body_size);
+  client->reply = malloc((size_t)header_size + body_size);
+  if (!client->reply) {
+    fprintf(stderr, "Failed to allocate metrics reply: %s\n",
+            strerror(errno));
+    free(body);
+    return false;
+  }
+  memcpy(client->reply, header, (size_t)header_size);
+  memcpy(client->reply + header_size, body, body_size);
+  client->reply_size = (size_t)header_size + body_size;
+  free(body);
+  return true;
+}
+
+// Returns false once the client is done with, successfully or not.
+static bool ServeClient(struct MetricsServer* metrics_server,
+                        struct MetricsClient* client) {
+  if (!client->reply) {
+    // Request is not even parsed, every request gets the same reply.
+    char request[1024];
+    ssize_t result = recv(client->fd, request, sizeof(request), 0);
+    if (result < 0) return errno == EAGAIN || errno == EINTR;
+    if (result == 0 || !PrepareReply(metrics_server, client)) return false;
+  }
+  while (client->reply_offset < client->reply_size) {
+    ssize_t result = send(client->fd, client->reply + client->reply_offset,
+                          client->reply_size - client->reply_offset,
+                          MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EINTR) return true;
+      fprintf(stderr, "Failed to write metrics: %s\n", strerror(errno));
+      return false;
+    }
+    client->reply_offset += (size_t)result;
+  }
+  return false;
+}
+
+// Different drm clients of the process use the same engines, so their
+// utilization adds up, but can not exceed the whole engine.
+static void SampleEngines(struct MetricsServer* metrics_server) {
+  double utilization[kDrmEngineCount] = {0};
+  bool sampled = false;
+  pthread_mutex_lock(&metrics_server->mutex);
+  for (size_t i = 0; i < LENGTH(metrics_server->engine_samplers); i++) {
+    double client_utilization[kDrmEngineCount];
+    if (!metrics_server->engine_samplers[i] ||
+        !EngineSamplerSample(metrics_server->engine_samplers[i],
+                             client_utilization))
+      continue;
+    for (size_t j = 0; j < kDrmEngineCount; j++) {
+      utilization[j] += client_utilization[j];
+      if (utilization[j] > 1) utilization[j] = 1;
+    }
+    sampled = true;
+  }
+  if (sampled) {
+    memcpy(metrics_server->utilization, utilization, sizeof(utilization));
+    metrics_server->has_utilization = true;
+  }
+  pthread_mutex_unlock(&metrics_server->mutex);
+}
+
+static void* MetricsServerThread(void* arg) {
+  struct MetricsServer* metrics_server = arg;
+  struct pollfd pfds[2 + LENGTH(metrics_server->clients)];
+  struct MetricsClient* polled[LENGTH(metrics_server->clients)];
+  for (;;) {
+    pfds[0] = (struct pollfd){.fd = metrics_server->listener, .events = POLLIN};
+    pfds[1] = (struct pollfd){.fd = metrics_server->shutdown, .events = POLLIN};
+    nfds_t nfds = 2;
+    uint64_t now = MillisNow();
+    if (now >= metrics_server->next_engine_sample) {
+      SampleEngines(metrics_server);
+      metrics_server->next_engine_sample = now + METRICS_ENGINE_PERIOD_MS;
+    }
+    int timeout = (int)(metrics_server->next_engine_sample - now);
+    for (size_t i = 0; i < LENGTH(metrics_server->clients); i++) {
+      struct MetricsClient* client = &metrics_server->clients[i];
+      if (client->fd == -1) continue;
+      if (client->deadline <= now) {
+        DropClient(client);
+        continue;
+      }
+      int remaining = (int)(client->deadline - now);
+      if (remaining < timeout) timeout = remaining;
+      polled[nfds - 2] = client;
+      pfds[nfds++] = (struct pollfd){
+          .fd = client->fd,
+          .events = client->reply ? POLLOUT : POLLIN,
+      };
+    }
+
+    if (poll(pfds, nfds, timeout) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to poll metrics sockets: %s\n",
+              strerror(errno));
+      return NULL;
+    }
+    if (pfds[1].revents) return NULL;
+    for (nfds_t i = 2; i < nfds; i++) {
+      if (pfds[i].revents && !ServeClient(metrics_server, polled[i - 2]))
+        DropClient(polled[i - 2]);
+    }
+    if (pfds[0].revents) AcceptClient(metrics_server);
+  }
+}
+
+static int CreateUnixListener(struct MetricsServer* metrics_server,
+                              const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Unix socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    fprintf(stderr, "Failed to create unix socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "Failed to bind %s: %s\n", path, strerror(errno));
+    close(listener);
+    return -1;
+  }
+  strcpy(metrics_server->unix_path, path);
+  return listener;
+}
+
+static int CreateTcpListener(const char* address) {
+  const char* colon = strrchr(address, ':');
+  if (!colon || colon == address) {
+    fprintf(stderr, "Malformed tcp address: %s\n", address);
+    return -1;
+  }
+  char host[256];
+  snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_PASSIVE,
+  };
+  struct addrinfo* result;
+  int error = getaddrinfo(host, colon + 1, &hints, &result);
+  if (error) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", address,
+            gai_strerror(error));
+    return -1;
+  }
+
+  int listener = -1;
+  for (struct addrinfo* it = result; it; it = it->ai_next) {
+    listener = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC,
+                      it->ai_protocol);
+    if (listener == -1) continue;
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (!bind(listener, it->ai_addr, it->ai_addrlen)) break;
+    close(listener);
+    listener = -1;
+  }
+  freeaddrinfo(result);
+  if (listener == -1)
+    fprintf(stderr, "Failed to bind %s: %s\n", address, strerror(errno));
+  return listener;
+}
+
+struct MetricsServer* MetricsServerCreate(const char* address) {
+  struct MetricsServer* metrics_server =
+      calloc(1, sizeof(struct MetricsServer));
+  if (!metrics_server) {
+    fprintf(stderr, "Failed to allocate metrics server: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+
+  if (!strncmp(address, "unix:", 5)) {
+    metrics_server->listener =
+        CreateUnixListener(metrics_server, address + 5);
+  } else if (!strncmp(address, "tcp:", 4)) {
+    metrics_server->listener = CreateTcpListener(address + 4);
+  } else {
+    fprintf(stderr, "Unsupported metrics address: %s\n", address);
+    metrics_server->listener = -1;
+  }
+  if (metrics_server->listener == -1) goto rollback_metrics_server;
+
+  if (listen(metrics_server->listener, 8)) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+    goto rollback_listener;
+  }
+
+  metrics_server->shutdown = eventfd(0, EFD_CLOEXEC);
+  if (metrics_server->shutdown == -1) {
+    fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+    goto rollback_listener;
+  }
+
+  for (size_t i = 0; i < LENGTH(metrics_server->clients); i++)
+    metrics_server->clients[i].fd = -1;
+  metrics_server->next_engine_sample = MillisNow() + METRICS_ENGINE_PERIOD_MS;
+  pthread_mutex_init(&metrics_server->mutex, NULL);
+  int error = pthread_create(&metrics_server->thread, NULL,
+                             MetricsServerThread, metrics_server);
+  if (error) {
+    fprintf(stderr, "Failed to create metrics thread: %s\n", strerror(error));
+    goto rollback_shutdown;
+  }
+  return metrics_server;
+
+rollback_shutdown:
+  pthread_mutex_destroy(&metrics_server->mutex);
+  close(metrics_server->shutdown);
+rollback_listener:
+  close(metrics_server->listener);
+  if (*metrics_server->unix_path) unlink(metrics_server->unix_path);
+rollback_metrics_server:
+  free(metrics_server);
+  return NULL;
+}
+
+bool MetricsServerRegister(struct MetricsServer* metrics_server,
+                           struct MetricsSession* metrics_session) {
+  bool result = false;
+  pthread_mutex_lock(&metrics_server->mutex);
+  for (size_t i = 0; i < LENGTH(metrics_server->sessions); i++) {
+    if (metrics_server->sessions[i]) continue;
+    metrics_server->sessions[i] = metrics_session;
+    result = true;
+    break;
+  }
+  pthread_mutex_unlock(&metrics_server->mutex);
+  if (!result) fprintf(stderr, "Too many metrics sessions\n");
+  return result;
+}
+
+void MetricsServerUnregister(struct MetricsServer* metrics_server,
+                             struct MetricsSession* metrics_session) {
+  pthread_mutex_lock(&metrics_server->mutex);
+  for (size_t i = 0; i < LENGTH(metrics_server->sessions); i++) {
+    if (metrics_server->sessions[i] == metrics_session)
+      metrics_server->sessions[i] = NULL;
+  }
+  pthread_mutex_unlock(&metrics_server->mutex);
+}
+
+bool MetricsServerAddEngineSampler(struct MetricsServer* metrics_server,
+                                   struct EngineSampler* engine_sampler) {
+  bool result = false;
+  pthread_mutex_lock(&metrics_server->mutex);
+  for (size_t i = 0; i < LENGTH(metrics_server->engine_samplers); i++) {
+    if (metrics_server->engine_samplers[i]) continue;
+    metrics_server->engine_samplers[i] = engine_sampler;
+    result = true;
+    break;
+  }
+  pthread_mutex_unlock(&metrics_server->mutex);
+  if (!result) fprintf(stderr, "Too many engine samplers\n");
+  return result;
+}
+
+void MetricsServerDestroy(struct MetricsServer* metrics_server) {
+  static const uint64_t one = 1;
+  if (write(metrics_server->shutdown, &one, sizeof(one)) != sizeof(one))
+    fprintf(stderr, "Failed to signal metrics thread: %s\n", strerror(errno));
+  pthread_join(metrics_server->thread, NULL);
+  for (size_t i = 0; i < LENGTH(metrics_server->clients); i++) {
+    if (metrics_server->clients[i].fd != -1)
+      DropClient(&metrics_server->clients[i]);
+  }
+  for (size_t i = 0; i < LENGTH(metrics_server->engine_samplers); i++) {
+    if (metrics_server->engine_samplers[i])
+      EngineSamplerDestroy(metrics_server->engine_samplers[i]);
+  }
+  pthread_mutex_destroy(&metrics_server->mutex);
+  close(metrics_server->shutdown);
+  close(metrics_server->listener);
+  if (*metrics_server->unix_path) unlink(metrics_server->unix_path);
+  free(metrics_server);
+}
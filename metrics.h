@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_METRICS_H_
+#define STREAMER_METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum MetricsStage {
+  kMetricsStageRead = 0,
+  kMetricsStageUpload,
+  kMetricsStageConvert,
+  kMetricsStageSubmit,
+  kMetricsStageSync,
+  kMetricsStageWrite,
+  kMetricsStageCount,
+};
+
+struct EngineSampler;
+struct MetricsSession;
+struct MetricsServer;
+
+// Session counters are updated with relaxed atomics by the single thread
+// driving the session, and read by the server thread without any locking.
+struct MetricsSession* MetricsSessionCreate(const char* name);
+void MetricsSessionFrame(struct MetricsSession* metrics_session, uint32_t size,
+                         bool keyframe);
+void MetricsSessionDrop(struct MetricsSession* metrics_session);
+void MetricsSessionStage(struct MetricsSession* metrics_session,
+                         enum MetricsStage stage, uint64_t micros);
+void MetricsSessionQueueDepth(struct MetricsSession* metrics_session,
+                              uint32_t depth);
+void MetricsSessionDestroy(struct MetricsSession* metrics_session);
+
+// Address is either unix:<path> or tcp:<host>:<port>.
+struct MetricsServer* MetricsServerCreate(const char* address);
+bool MetricsServerRegister(struct MetricsServer* metrics_server,
+                           struct MetricsSession* metrics_session);
+void MetricsServerUnregister(struct MetricsServer* metrics_server,
+                             struct MetricsSession* metrics_session);
+// Samplers are read once a second on the server thread, and utilization of all
+// of them is summed up into per-engine gauges. Takes ownership of the sampler
+// on success.
+bool MetricsServerAddEngineSampler(struct MetricsServer* metrics_server,
+                                   struct EngineSampler* engine_sampler);
+void MetricsServerDestroy(struct MetricsServer* metrics_server);
+
+#endif  // STREAMER_METRICS_H_
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "preview.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu.h"
+#include "jpeg.h"
+
+struct PreviewContext {
+  struct GpuContext* gpu_context;
+  struct PreviewConfig config;
+  PreviewCallback callback;
+  void* user;
+
+  struct GpuReadback* gpu_readback;
+  void* pixels;
+  void* encoded;
+  uint64_t frames;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending;
+  bool stopping;
+  uint64_t sequence;
+  struct PreviewStats stats;
+  pthread_t thread;
+};
+
+static void DeliverPreview(struct PreviewContext* preview_context,
+                           uint64_t sequence) {
+  const struct PreviewConfig* config = &preview_context->config;
+  struct PreviewImage image = {
+      .format = config->format,
+      .width = config->width,
+      .height = config->height,
+      .sequence = sequence,
+      .data = preview_context->pixels,
+      .size = (size_t)config->width * config->height * 4,
+  };
+  if (config->format == kPreviewFormatJpeg) {
+    image.data = preview_context->encoded;
+    image.size = JpegEncodeRgba(preview_context->pixels, config->width,
+                                config->height, (size_t)config->width * 4,
+                                config->quality, preview_context->encoded);
+  }
+  preview_context->callback(preview_context->user, &image);
+}
+
+static void* PreviewThread(void* arg) {
+  struct PreviewContext* preview_context = arg;
+  // Waiting for the fence and mapping the pixel buffer need a current context,
+  // the one owned by the encoding thread is not available.
+  struct GpuContext* shared_context =
+      GpuContextCreateShared(preview_context->gpu_context);
+  if (!shared_context)
+    fprintf(stderr, "Failed to create shared gpu context for previews\n");
+
+  for (;;) {
+    pthread_mutex_lock(&preview_context->mutex);
+    while (!preview_context->pending && !preview_context->stopping)
+      pthread_cond_wait(&preview_context->cond, &preview_context->mutex);
+    bool pending = preview_context->pending;
+    uint64_t sequence = preview_context->sequence;
+    pthread_mutex_unlock(&preview_context->mutex);
+    // A started readback holds a fence, finish it even when stopping, so that
+    // destruction never races with the gpu.
+    if (!pending) break;
+
+    bool delivered =
+        shared_context &&
+        GpuContextFinishReadback(shared_context, preview_context->gpu_readback,
+                                 preview_context->pixels);
+    if (delivered) DeliverPreview(preview_context, sequence);
+
+    pthread_mutex_lock(&preview_context->mutex);
+    preview_context->pending = false;
+    if (delivered)
+      preview_context->stats.delivered++;
+    else
+      preview_context->stats.dropped++;
+    pthread_mutex_unlock(&preview_context->mutex);
+  }
+
+  if (shared_context) GpuContextDestroy(shared_context);
+  return NULL;
+}
+
+struct PreviewContext* PreviewContextCreate(struct GpuContext* gpu_context,
+                                            const struct PreviewConfig* config,
+                                            PreviewCallback callback,
+                                            void* user) {
+  if (!config->width || !config->height || !config->interval) {
+    fprintf(stderr, "Invalid preview configuration %ux%u every %u frames\n",
+            config->width, config->height, config->interval);
+    return NULL;
+  }
+  struct PreviewContext* preview_context =
+      calloc(1, sizeof(struct PreviewContext));
+  if (!preview_context) {
+    fprintf(stderr, "Failed to allocate preview context: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  preview_context->gpu_context = gpu_context;
+  preview_context->config = *config;
+  preview_context->callback = callback;
+  preview_context->user = user;
+
+  preview_context->gpu_readback =
+      GpuContextCreateReadback(gpu_context, config->width, config->height);
+  if (!preview_context->gpu_readback) {
+    fprintf(stderr, "Failed to create preview readback\n");
+    goto rollback_preview_context;
+  }
+
+  preview_context->pixels = malloc((size_t)config->width * config->height * 4);
+  if (!preview_context->pixels) {
+    fprintf(stderr, "Failed to allocate preview pixels: %s\n",
+            strerror(errno));
+    goto rollback_gpu_readback;
+  }
+  if (config->format == kPreviewFormatJpeg) {
+    preview_context->encoded =
+        malloc(JpegMaxSize(config->width, config->height));
+    if (!preview_context->encoded) {
+      fprintf(stderr, "Failed to allocate preview buffer: %s\n",
+              strerror(errno));
+      goto rollback_pixels;
+    }
+  }
+
+  pthread_mutex_init(&preview_context->mutex, NULL);
+  pthread_cond_init(&preview_context->cond, NULL);
+  if (pthread_create(&preview_context->thread, NULL, PreviewThread,
+                     preview_context)) {
+    fprintf(stderr, "Failed to create preview thread\n");
+    goto rollback_sync;
+  }
+  return preview_context;
+
+rollback_sync:
+  pthread_cond_destroy(&preview_context->cond);
+  pthread_mutex_destroy(&preview_context->mutex);
+  free(preview_context->encoded);
+rollback_pixels:
+  free(preview_context->pixels);
+rollback_gpu_readback:
+  GpuContextDestroyReadback(gpu_context, preview_context->gpu_readback);
+rollback_preview_context:
+  free(preview_context);
+  return NULL;
+}
+
+bool PreviewContextSubmit(struct PreviewContext* preview_context,
+                          const struct GpuFrame* gpu_frame, uint64_t sequence) {
+  if (preview_context->frames++ % preview_context->config.interval) return true;
+
+  pthread_mutex_lock(&preview_context->mutex);
+  preview_context->stats.submitted++;
+  bool busy = preview_context->pending;
+  if (busy) preview_context->stats.dropped++;
+  pthread_mutex_unlock(&preview_context->mutex);
+  // The previous readback is still owned by the preview thread. Dropping this
+  // one keeps the cost per stream bounded by a single downscale, and never
+  // stalls encoding behind a slow callback.
+  if (busy) return true;
+
+  if (!GpuContextStartReadback(preview_context->gpu_context, gpu_frame,
+                               preview_context->gpu_readback)) {
+    fprintf(stderr, "Failed to start preview readback\n");
+    pthread_mutex_lock(&preview_context->mutex);
+    preview_context->stats.dropped++;
+    pthread_mutex_unlock(&preview_context->mutex);
+    return false;
+  }
+
+  pthread_mutex_lock(&preview_context->mutex);
+  preview_context->pending = true;
+  preview_context->sequence = sequence;
+  pthread_cond_broadcast(&preview_context->cond);
+  pthread_mutex_unlock(&preview_context->mutex);
+  return true;
+}
+
+void PreviewContextGetStats(struct PreviewContext* preview_context,
+                            struct PreviewStats* stats) {
+  pthread_mutex_lock(&preview_context->mutex);
+  *stats = preview_context->stats;
+  pthread_mutex_unlock(&preview_context->mutex);
+}
+
+void PreviewContextDestroy(struct PreviewContext* preview_context) {
+  pthread_mutex_lock(&preview_context->mutex);
+  preview_context->stopping = true;
+  pthread_cond_broadcast(&preview_context->cond);
+  pthread_mutex_unlock(&preview_context->mutex);
+  pthread_join(preview_context->thread, NULL);
+  pthread_cond_destroy(&preview_context->cond);
+  pthread_mutex_destroy(&preview_context->mutex);
+  free(preview_context->encoded);
+  free(preview_context->pixels);
+  GpuContextDestroyReadback(preview_context->gpu_context,
+                            preview_context->gpu_readback);
+  free(preview_context);
+}
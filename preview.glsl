@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+uniform sampler2D img_luma;
+uniform sampler2D img_chroma;
+uniform mediump mat3 colorspace;
+uniform mediump vec3 ranges[2];
+
+varying mediump vec2 texcoord;
+varying mediump vec2 texel;
+
+mediump vec3 yuv2rgb(in mediump vec3 yuv) {
+  mediump vec3 full = (yuv - ranges[0]) / ranges[1] - vec3(0.0, 0.5, 0.5);
+  return clamp(colorspace * full, 0.0, 1.0);
+}
+
+mediump vec3 sample_yuv(in mediump vec2 coord) {
+  return vec3(texture2D(img_luma, coord).r, texture2D(img_chroma, coord).rg);
+}
+
+void main() {
+  // Texel is the size of a destination pixel, four bilinear taps within it
+  // average sixteen source pixels at up to a quarter of the resolution.
+  mediump vec2 offset = texel * 0.25;
+  mediump vec3 yuv = sample_yuv(texcoord - offset) +
+                     sample_yuv(texcoord + offset) +
+                     sample_yuv(texcoord + vec2(offset.x, -offset.y)) +
+                     sample_yuv(texcoord + vec2(-offset.x, offset.y));
+  gl_FragColor = vec4(yuv2rgb(yuv / 4.0), 1.0);
+}
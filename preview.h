@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_PREVIEW_H_
+#define STREAMER_PREVIEW_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct GpuContext;
+struct GpuFrame;
+
+enum PreviewFormat {
+  kPreviewFormatRgba = 0,
+  kPreviewFormatJpeg,
+};
+
+struct PreviewConfig {
+  uint32_t width;
+  uint32_t height;
+  // Every interval-th submitted frame becomes a preview.
+  uint32_t interval;
+  enum PreviewFormat format;
+  // Jpeg quality in the 1-100 range, ignored for rgba.
+  uint8_t quality;
+};
+
+struct PreviewImage {
+  enum PreviewFormat format;
+  uint32_t width;
+  uint32_t height;
+  uint64_t sequence;
+  const void* data;
+  size_t size;
+};
+
+struct PreviewStats {
+  uint64_t submitted;
+  uint64_t delivered;
+  uint64_t dropped;
+};
+
+// Callback is invoked on the preview thread, image data is only valid until
+// it returns.
+typedef void (*PreviewCallback)(void* user, const struct PreviewImage* image);
+
+struct PreviewContext;
+
+// Must be created and submitted to on the thread owning the gpu context.
+// Submitting only queues a gpu downscale and readback, waiting for the gpu,
+// compression and the callback all happen on the preview thread. At most one
+// preview is in flight, frames arriving while it is busy are dropped.
+struct PreviewContext* PreviewContextCreate(struct GpuContext* gpu_context,
+                                            const struct PreviewConfig* config,
+                                            PreviewCallback callback,
+                                            void* user);
+bool PreviewContextSubmit(struct PreviewContext* preview_context,
+                          const struct GpuFrame* gpu_frame, uint64_t sequence);
+void PreviewContextGetStats(struct PreviewContext* preview_context,
+                            struct PreviewStats* stats);
+void PreviewContextDestroy(struct PreviewContext* preview_context);
+
+#endif  // STREAMER_PREVIEW_H_
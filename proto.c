@@ -20,7 +20,6 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/uio.h>
 #include <unistd.h>
 
 //#include "toolbox/utils.h"
@@ -29,21 +28,39 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static bool DrainBuffers(int fd, struct iovec* iovec, int count) {
-  for (;;) {
+  while (count) {
     ssize_t result = writev(fd, iovec, count);
     if (result < 0) {
       if (errno == EINTR) continue;
       //LOG("Failed to write (%s)", strerror(errno));
       return false;
     }
-    for (int i = 0; i < count; i++) {
-      size_t delta = MIN((size_t)result, iovec[i].iov_len);
-      iovec[i].iov_base = (uint8_t*)iovec[i].iov_base + delta;
-      iovec[i].iov_len -= delta;
+    for (; count; iovec++, count--) {
+      size_t delta = MIN((size_t)result, iovec->iov_len);
+      iovec->iov_base = (uint8_t*)iovec->iov_base + delta;
+      iovec->iov_len -= delta;
       result -= delta;
+      if (iovec->iov_len) break;
     }
-    if (!result) return true;
   }
+  return true;
+}
+
+static bool WriteHeaderv(int fd, const void* header, size_t header_size,
+                         const struct iovec* iov, size_t count) {
+  struct iovec iovec[16];
+  if (count >= LENGTH(iovec)) {
+    fprintf(stderr, "Too many payload buffers (%zu)\n", count);
+    return false;
+  }
+  iovec[0] = (struct iovec){.iov_base = UNCONST(header),
+                            .iov_len = header_size};
+  memcpy(iovec + 1, iov, count * sizeof(struct iovec));
+  if (!DrainBuffers(fd, iovec, (int)count + 1)) {
+    //LOG("Failed to drain buffers");
+    return false;
+  }
+  return true;
 }
 
 bool WriteProto(int fd, const struct Proto* proto, const void* data) {
@@ -57,3 +74,81 @@ bool WriteProto(int fd, const struct Proto* proto, const void* data) {
   }
   return true;
 }
+
+bool WriteProtov(int fd, const struct Proto* proto, const struct iovec* iov,
+                 size_t count) {
+  return WriteHeaderv(fd, proto, sizeof(struct Proto), iov, count);
+}
+
+bool WriteProto2(int fd, const struct Proto2* proto, const struct iovec* iov,
+                 size_t count) {
+  return WriteHeaderv(fd, proto, proto->header_size, iov, count);
+}
+
+static size_t ParseProto1(const void* buffer, size_t size,
+                          struct Proto2* proto) {
+  struct Proto proto1;
+  if (size < sizeof(proto1)) return 0;
+  memcpy(&proto1, buffer, sizeof(proto1));
+  *proto = (struct Proto2){
+      .marker = PROTO_MARKER,
+      .version = 1,
+      .header_size = sizeof(struct Proto),
+      .type = proto1.type,
+      .flags = proto1.flags,
+      .size = proto1.size,
+      .latency = proto1.latency,
+      .fragment = PROTO_FRAGMENT_WHOLE,
+  };
+  return sizeof(struct Proto);
+}
+
+size_t ParseProto(const void* buffer, size_t size, struct Proto2* proto) {
+  uint32_t marker;
+  if (size < sizeof(marker)) return 0;
+  memcpy(&marker, buffer, sizeof(marker));
+  if (marker != PROTO_MARKER) return ParseProto1(buffer, size, proto);
+
+  if (size < sizeof(struct Proto2)) return 0;
+  memcpy(proto, buffer, sizeof(struct Proto2));
+  if (proto->version < PROTO_VERSION ||
+      proto->header_size < sizeof(struct Proto2)) {
+    fprintf(stderr, "Invalid proto header (version %u, size %u)\n",
+            proto->version, proto->header_size);
+    return 0;
+  }
+  return size < proto->header_size ? 0 : proto->header_size;
+}
+
+static bool ReadBuffer(int fd, void* buffer, size_t size) {
+  for (uint8_t* ptr = buffer; size;) {
+    ssize_t result = read(fd, ptr, size);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to read proto: %s\n", strerror(errno));
+      return false;
+    }
+    if (!result) return false;
+    ptr += result;
+    size -= (size_t)result;
+  }
+  return true;
+}
+
+bool ReadProto(int fd, struct Proto2* proto) {
+  uint8_t buffer[UINT8_MAX];
+  if (!ReadBuffer(fd, buffer, sizeof(struct Proto))) return false;
+  if (ParseProto(buffer, sizeof(struct Proto), proto)) return true;
+
+  // Version 2 header is read in two steps, first the fixed part that knows the
+  // full header size, then the extensions to be skipped.
+  if (!ReadBuffer(fd, buffer + sizeof(struct Proto),
+                  sizeof(struct Proto2) - sizeof(struct Proto)))
+    return false;
+  if (ParseProto(buffer, sizeof(struct Proto2), proto)) return true;
+  if (proto->version < PROTO_VERSION ||
+      proto->header_size < sizeof(struct Proto2))
+    return false;
+  return ReadBuffer(fd, buffer + sizeof(struct Proto2),
+                    proto->header_size - sizeof(struct Proto2));
+}
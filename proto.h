@@ -19,8 +19,10 @@
 #define STREAMER_PROTO_H_
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 // Utility macro for array length
 #ifndef LENGTH
@@ -32,6 +34,16 @@
 #define PROTO_TYPE_AUDIO 2
 
 #define PROTO_FLAG_KEYFRAME 1
+#define PROTO_FLAG_ENCRYPTED 2
+
+// Version 1 headers start with the payload size, which is never allowed to take
+// this value, so it unambiguously marks later versions.
+#define PROTO_MARKER 0xffffffffu
+#define PROTO_VERSION 2
+
+#define PROTO_FRAGMENT_FIRST 1
+#define PROTO_FRAGMENT_LAST 2
+#define PROTO_FRAGMENT_WHOLE (PROTO_FRAGMENT_FIRST | PROTO_FRAGMENT_LAST)
 
 struct Proto {
   uint32_t size;
@@ -44,6 +56,37 @@ struct Proto {
 static_assert(sizeof(struct Proto) == 8 * sizeof(uint8_t),
               "Suspicious proto struct size");
 
+// Header_size covers the fixed part and any extensions that follow it, so
+// readers skip extensions they do not know about.
+struct Proto2 {
+  uint32_t marker;
+  uint8_t version;
+  uint8_t header_size;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t stream_id;
+  uint32_t size;
+  uint64_t pts;
+  uint32_t sequence;
+  uint16_t latency;
+  uint8_t fragment;
+  uint8_t reserved;
+};
+
+static_assert(sizeof(struct Proto2) == 32 * sizeof(uint8_t),
+              "Suspicious proto2 struct size");
+
 bool WriteProto(int fd, const struct Proto* proto, const void* data);
+bool WriteProtov(int fd, const struct Proto* proto, const struct iovec* iov,
+                 size_t count);
+bool WriteProto2(int fd, const struct Proto2* proto, const struct iovec* iov,
+                 size_t count);
+
+// Both versions are returned as struct Proto2, version 1 headers report a
+// single whole fragment on stream zero. ParseProto returns the number of
+// header bytes consumed, or zero if the buffer does not hold a full valid
+// header.
+size_t ParseProto(const void* buffer, size_t size, struct Proto2* proto);
+bool ReadProto(int fd, struct Proto2* proto);
 
 #endif  // STREAMER_PROTO_H_
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "protoreader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct ProtoReader {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+};
+
+struct ProtoReader* ProtoReaderCreate(const char* path) {
+  struct ProtoReader* proto_reader = malloc(sizeof(struct ProtoReader));
+  if (!proto_reader) {
+    fprintf(stderr, "Failed to allocate proto reader: %s\n", strerror(errno));
+    return NULL;
+  }
+  *proto_reader = (struct ProtoReader){0};
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_proto_reader;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    goto rollback_fd;
+  }
+  if (!st.st_size) {
+    fprintf(stderr, "Recording %s is empty\n", path);
+    goto rollback_fd;
+  }
+
+  proto_reader->size = (size_t)st.st_size;
+  void* data = mmap(NULL, proto_reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    goto rollback_fd;
+  }
+  // Records are consumed strictly in order, let the kernel read ahead
+  // aggressively and drop pages behind.
+  madvise(data, proto_reader->size, MADV_SEQUENTIAL);
+  proto_reader->data = data;
+  close(fd);
+  return proto_reader;
+
+rollback_fd:
+  close(fd);
+rollback_proto_reader:
+  free(proto_reader);
+  return NULL;
+}
+
+bool ProtoReaderNext(struct ProtoReader* proto_reader,
+                     struct ProtoRecord* proto_record) {
+  const uint8_t* record = proto_reader->data + proto_reader->offset;
+  size_t available = proto_reader->size - proto_reader->offset;
+  if (!available) return false;
+
+  size_t header_size = ParseProto(record, available, &proto_record->header);
+  if (!header_size || available - header_size < proto_record->header.size) {
+    fprintf(stderr, "Truncated proto record at offset %zu\n",
+            proto_reader->offset);
+    return false;
+  }
+
+  proto_record->record = record;
+  proto_record->record_size = header_size + proto_record->header.size;
+  proto_record->payload = record + header_size;
+  proto_reader->offset += proto_record->record_size;
+  return true;
+}
+
+void ProtoReaderRewind(struct ProtoReader* proto_reader) {
+  proto_reader->offset = 0;
+}
+
+bool ProtoReaderSeek(struct ProtoReader* proto_reader, size_t offset) {
+  if (offset > proto_reader->size) {
+    fprintf(stderr, "Seek offset %zu is past the end of recording\n", offset);
+    return false;
+  }
+  proto_reader->offset = offset;
+  return true;
+}
+
+void ProtoReaderDestroy(struct ProtoReader* proto_reader) {
+  munmap((void*)(uintptr_t)proto_reader->data, proto_reader->size);
+  free(proto_reader);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_PROTOREADER_H_
+#define STREAMER_PROTOREADER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "proto.h"
+
+// Record and payload point into the mapped file and stay valid until the
+// reader is destroyed.
+struct ProtoRecord {
+  struct Proto2 header;
+  const void* record;
+  size_t record_size;
+  const void* payload;
+};
+
+struct ProtoReader;
+
+struct ProtoReader* ProtoReaderCreate(const char* path);
+bool ProtoReaderNext(struct ProtoReader* proto_reader,
+                     struct ProtoRecord* proto_record);
+void ProtoReaderRewind(struct ProtoReader* proto_reader);
+// Offset must point at a record boundary, e.g. one taken from a key index.
+bool ProtoReaderSeek(struct ProtoReader* proto_reader, size_t offset);
+void ProtoReaderDestroy(struct ProtoReader* proto_reader);
+
+#endif  // STREAMER_PROTOREADER_H_
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "recorder.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cenc.h"
+#include "directio.h"
+#include "encode.h"
+#include "keyindex.h"
+#include "proto.h"
+
+struct Recorder {
+  struct RecorderOutputs outputs;
+  // Encrypted payloads are written to plain files from here, mapped coded
+  // buffers are never modified.
+  uint8_t* buffer;
+  size_t buffer_alloc;
+};
+
+// Header of a record as it goes out, the v2 subsample table follows the
+// fixed part immediately.
+struct RecordHeader {
+  struct Proto2 proto;
+  struct CencExtension cenc;
+};
+
+static_assert(offsetof(struct RecordHeader, cenc) == sizeof(struct Proto2),
+              "Cenc extension does not follow the proto header");
+
+struct Recorder* RecorderCreate(const struct RecorderOutputs* outputs) {
+  if (outputs->cenc_context && !outputs->proto2) {
+    fprintf(stderr, "Encryption requires proto version 2\n");
+    return NULL;
+  }
+  struct Recorder* recorder = malloc(sizeof(struct Recorder));
+  if (!recorder) {
+    fprintf(stderr, "Failed to allocate recorder: %s\n", strerror(errno));
+    return NULL;
+  }
+  *recorder = (struct Recorder){.outputs = *outputs};
+  return recorder;
+}
+
+// Packs the v2 header and gathers it along with the payload, returns the
+// number of iovs or zero on failure. Payloads are encrypted later, while
+// outputs copy them.
+static size_t PackFrame2(struct Recorder* recorder,
+                         const struct EncodedFrame* frame,
+                         struct RecordHeader* header, struct iovec* iov) {
+  PackEncodedFrameProto2(frame, &header->proto);
+  if (recorder->outputs.cenc_context) {
+    if (!CencContextPrepare(recorder->outputs.cenc_context, frame->segments,
+                            frame->nsegments, &header->cenc)) {
+      fprintf(stderr, "Failed to encrypt frame %u\n", frame->sequence);
+      return 0;
+    }
+    header->proto.flags |= PROTO_FLAG_ENCRYPTED;
+    header->proto.header_size += CencExtensionSize(&header->cenc);
+  }
+  iov[0] = (struct iovec){.iov_base = &header->proto,
+                          .iov_len = header->proto.header_size};
+  memcpy(iov + 1, frame->segments, frame->nsegments * sizeof(struct iovec));
+  return frame->nsegments + 1;
+}
+
+// Plain files are written straight from the segments, so encrypted payloads
+// take a copy into the bounce buffer.
+static bool WriteEncrypted(struct Recorder* recorder,
+                           const struct RecordHeader* header,
+                           const struct EncodedFrame* frame) {
+  if (frame->size > recorder->buffer_alloc) {
+    uint8_t* buffer = realloc(recorder->buffer, frame->size);
+    if (!buffer) {
+      fprintf(stderr, "Failed to grow bounce buffer: %s\n", strerror(errno));
+      return false;
+    }
+    recorder->buffer = buffer;
+    recorder->buffer_alloc = frame->size;
+  }
+  CencContextBeginCopy(recorder->outputs.cenc_context, &header->cenc, 0);
+  for (size_t i = 0, offset = 0; i < frame->nsegments;
+       offset += frame->segments[i++].iov_len) {
+    CencContextCopy(recorder->outputs.cenc_context, recorder->buffer + offset,
+                    frame->segments[i].iov_base, frame->segments[i].iov_len);
+  }
+  const struct iovec iov = {.iov_base = recorder->buffer,
+                            .iov_len = frame->size};
+  return WriteProto2(recorder->outputs.fd, &header->proto, &iov, 1);
+}
+
+bool RecorderWriteFrame(void* user, const struct EncodedFrame* frame) {
+  struct Recorder* recorder = user;
+  const struct RecorderOutputs* outputs = &recorder->outputs;
+  struct Proto proto1;
+  struct RecordHeader header;
+  struct iovec iov[LENGTH(frame->segments) + 1];
+  size_t count;
+  if (outputs->proto2) {
+    count = PackFrame2(recorder, frame, &header, iov);
+    if (!count) return false;
+  } else {
+    PackEncodedFrameProto(frame, &proto1);
+    iov[0] = (struct iovec){.iov_base = &proto1, .iov_len = sizeof(proto1)};
+    memcpy(iov + 1, frame->segments, frame->nsegments * sizeof(struct iovec));
+    count = frame->nsegments + 1;
+  }
+
+  off_t offset = -1;
+  if (frame->keyframe && outputs->key_index_writer) {
+    offset = outputs->direct_writer
+                 ? (off_t)DirectWriterOffset(outputs->direct_writer)
+                 : lseek(outputs->fd, 0, SEEK_CUR);
+  }
+  // Encryption implies proto version 2, see RecorderCreate.
+  struct CencContext* cenc_context = outputs->cenc_context;
+  bool result;
+  if (outputs->direct_writer) {
+    if (cenc_context)
+      CencContextBeginCopy(cenc_context, &header.cenc, iov[0].iov_len);
+    result = DirectWriterWrite(outputs->direct_writer, iov, count,
+                               cenc_context ? CencContextCopy : NULL,
+                               cenc_context);
+  } else if (cenc_context) {
+    result = WriteEncrypted(recorder, &header, frame);
+  } else if (outputs->proto2) {
+    result = WriteProto2(outputs->fd, &header.proto, iov + 1, count - 1);
+  } else {
+    result = WriteProtov(outputs->fd, &proto1, iov + 1, count - 1);
+  }
+  if (!result) {
+    fprintf(stderr, "Failed to write frame %u\n", frame->sequence);
+    return false;
+  }
+
+  if (offset >= 0) {
+    KeyIndexWriterAppend(outputs->key_index_writer, (uint64_t)offset,
+                         frame->pts, (uint32_t)(iov[0].iov_len + frame->size));
+  }
+  uint8_t flags = outputs->proto2 ? header.proto.flags : proto1.flags;
+  if (outputs->fec_encoder) {
+    if (cenc_context)
+      CencContextBeginCopy(cenc_context, &header.cenc, iov[0].iov_len);
+    if (!FecEncoderEncode(outputs->fec_encoder, iov, count, flags,
+                          cenc_context ? CencContextCopy : NULL, cenc_context,
+                          outputs->fec_send, outputs->fec_user))
+      fprintf(stderr, "Failed to send frame %u\n", frame->sequence);
+  }
+  return true;
+}
+
+void RecorderDestroy(struct Recorder* recorder) {
+  free(recorder->buffer);
+  free(recorder);
+}
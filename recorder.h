@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_RECORDER_H_
+#define STREAMER_RECORDER_H_
+
+#include <stdbool.h>
+
+#include "fec.h"
+
+struct CencContext;
+struct DirectWriter;
+struct EncodedFrame;
+struct KeyIndexWriter;
+
+// Destinations of a recording, any of them but the file may be absent. The
+// fd is only written when there is no direct writer. Outputs are borrowed and
+// have to outlive the recorder.
+struct RecorderOutputs {
+  int fd;
+  bool proto2;
+  struct DirectWriter* direct_writer;
+  struct KeyIndexWriter* key_index_writer;
+  struct FecEncoder* fec_encoder;
+  FecSend fec_send;
+  void* fec_user;
+  // Subsample tables are a proto2 header extension, so encryption requires
+  // proto2 records.
+  struct CencContext* cenc_context;
+};
+
+struct Recorder;
+
+struct Recorder* RecorderCreate(const struct RecorderOutputs* outputs);
+// Sink for EncodeContextEncodeFrameToSink, user is the recorder. Frames are
+// written as a single record to every output. Key index and network outputs
+// are best effort and never fail the frame.
+bool RecorderWriteFrame(void* user, const struct EncodedFrame* frame);
+void RecorderDestroy(struct Recorder* recorder);
+
+#endif  // STREAMER_RECORDER_H_
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "keyindex.h"
+#include "protoreader.h"
+
+struct ReplayTarget {
+  int fd;
+  unsigned long long bytes;
+};
+
+static unsigned long long NanosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL +
+         (unsigned long long)ts.tv_nsec;
+}
+
+static int ConnectUnix(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Unix socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create unix socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "Failed to connect %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int ConnectTcp(const char* address) {
+  const char* colon = strrchr(address, ':');
+  if (!colon || colon == address) {
+    fprintf(stderr, "Malformed tcp address: %s\n", address);
+    return -1;
+  }
+  char host[256];
+  snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo* result;
+  int error = getaddrinfo(host, colon + 1, &hints, &result);
+  if (error) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", address,
+            gai_strerror(error));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* it = result; it; it = it->ai_next) {
+    fd = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC,
+                it->ai_protocol);
+    if (fd == -1) continue;
+    if (!connect(fd, it->ai_addr, it->ai_addrlen)) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  if (fd == -1)
+    fprintf(stderr, "Failed to connect %s: %s\n", address, strerror(errno));
+  return fd;
+}
+
+static int Connect(const char* address) {
+  if (!strncmp(address, "unix:", 5)) return ConnectUnix(address + 5);
+  if (!strncmp(address, "tcp:", 4)) return ConnectTcp(address + 4);
+  fprintf(stderr, "Unsupported address: %s\n", address);
+  return -1;
+}
+
+static bool SendRecord(struct ReplayTarget* target,
+                       const struct ProtoRecord* proto_record) {
+  const uint8_t* ptr = proto_record->record;
+  size_t size = proto_record->record_size;
+  while (size) {
+    ssize_t result = send(target->fd, ptr, size, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to send record: %s\n", strerror(errno));
+      return false;
+    }
+    ptr += result;
+    size -= (size_t)result;
+  }
+  target->bytes += proto_record->record_size;
+  return true;
+}
+
+// Version 2 records carry the original pts, so pacing is exact. Version 1
+// records only know their encode latency, so those are spread evenly at the
+// configured frame rate instead.
+static unsigned long long RecordOffset(const struct ProtoRecord* proto_record,
+                                       unsigned long long* first_pts,
+                                       unsigned long long index,
+                                       double fps) {
+  if (proto_record->header.version < PROTO_VERSION)
+    return (unsigned long long)((double)index * 1e9 / fps);
+  if (!index) *first_pts = proto_record->header.pts;
+  if (proto_record->header.pts < *first_pts) return 0;
+  return (proto_record->header.pts - *first_pts) * 1000ULL;
+}
+
+// Seeking snaps back to the closest keyframe, so that receivers can start
+// decoding from the first replayed record.
+static bool SeekRecording(struct ProtoReader* proto_reader,
+                          const char* recording, double start,
+                          size_t* start_offset) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.idx", recording);
+  struct KeyIndex* key_index = KeyIndexCreate(path);
+  if (!key_index) {
+    fprintf(stderr, "Failed to open key index\n");
+    return false;
+  }
+
+  bool result = false;
+  if (!KeyIndexCount(key_index)) {
+    fprintf(stderr, "Key index %s is empty\n", path);
+    goto rollback_key_index;
+  }
+  const struct KeyIndexEntry* entries = KeyIndexEntries(key_index);
+  uint64_t pts = entries[0].pts + (uint64_t)(start * 1e6);
+  const struct KeyIndexEntry* entry =
+      &entries[KeyIndexLookup(key_index, pts)];
+  if (!ProtoReaderSeek(proto_reader, entry->offset)) {
+    fprintf(stderr, "Failed to seek recording\n");
+    goto rollback_key_index;
+  }
+  printf("Starting from keyframe at %.3f s, offset %llu\n",
+         (double)(entry->pts - entries[0].pts) / 1e6,
+         (unsigned long long)entry->offset);
+  *start_offset = entry->offset;
+  result = true;
+
+rollback_key_index:
+  KeyIndexDestroy(key_index);
+  return result;
+}
+
+static void Usage(const char* self) {
+  fprintf(stderr,
+          "Usage: %s [-n sockets] [-x speed] [-r fps] [-s seconds] [-l] "
+          "<recording> <unix:path|tcp:host:port>\n"
+          "  -n  number of connections to replay to (default 1)\n"
+          "  -x  pacing multiplier, 0 sends as fast as possible (default 1)\n"
+          "  -r  frame rate for version 1 recordings (default 60)\n"
+          "  -s  start from the keyframe at or before this many seconds,\n"
+          "      looked up in <recording>.idx\n"
+          "  -l  loop the recording until interrupted\n",
+          self);
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = 1;
+  double speed = 1;
+  double fps = 60;
+  double start = -1;
+  bool loop = false;
+  for (int opt; (opt = getopt(argc, argv, "n:x:r:s:l")) != -1;) {
+    switch (opt) {
+      case 'n':
+        count = strtoul(optarg, NULL, 10);
+        break;
+      case 'x':
+        speed = strtod(optarg, NULL);
+        break;
+      case 'r':
+        fps = strtod(optarg, NULL);
+        break;
+      case 's':
+        start = strtod(optarg, NULL);
+        break;
+      case 'l':
+        loop = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2 || !count || speed < 0 || fps <= 0) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_FAILURE;
+  struct ProtoReader* proto_reader = ProtoReaderCreate(argv[optind]);
+  if (!proto_reader) {
+    fprintf(stderr, "Failed to create proto reader\n");
+    return EXIT_FAILURE;
+  }
+  size_t start_offset = 0;
+  if (start >= 0 &&
+      !SeekRecording(proto_reader, argv[optind], start, &start_offset)) {
+    fprintf(stderr, "Failed to seek to %.3f s\n", start);
+    goto rollback_proto_reader;
+  }
+
+  struct ReplayTarget* targets = calloc(count, sizeof(struct ReplayTarget));
+  if (!targets) {
+    fprintf(stderr, "Failed to allocate targets: %s\n", strerror(errno));
+    goto rollback_proto_reader;
+  }
+  size_t connected = 0;
+  for (; connected < count; connected++) {
+    targets[connected].fd = Connect(argv[optind + 1]);
+    if (targets[connected].fd == -1) {
+      fprintf(stderr, "Failed to connect target %zu\n", connected);
+      goto rollback_targets;
+    }
+  }
+
+  size_t alive = count;
+  unsigned long long records = 0;
+  unsigned long long max_lag = 0;
+  unsigned long long started = NanosNow();
+  unsigned long long loop_started = started;
+  do {
+    struct ProtoRecord proto_record;
+    unsigned long long first_pts = 0;
+    for (unsigned long long index = 0;
+         alive && ProtoReaderNext(proto_reader, &proto_record); index++) {
+      unsigned long long offset =
+          RecordOffset(&proto_record, &first_pts, index, fps);
+      if (speed > 0) {
+        unsigned long long deadline =
+            loop_started + (unsigned long long)((double)offset / speed);
+        struct timespec ts = {.tv_sec = (time_t)(deadline / 1000000000ULL),
+                              .tv_nsec = (long)(deadline % 1000000000ULL)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR) {
+        }
+        unsigned long long lag = NanosNow() - deadline;
+        if (lag > max_lag) max_lag = lag;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        if (targets[i].fd == -1) continue;
+        if (!SendRecord(&targets[i], &proto_record)) {
+          fprintf(stderr, "Dropping target %zu\n", i);
+          close(targets[i].fd);
+          targets[i].fd = -1;
+          alive--;
+        }
+      }
+      records++;
+    }
+    ProtoReaderSeek(proto_reader, start_offset);
+    loop_started = NanosNow();
+  } while (loop && alive && records);
+
+  double elapsed = (double)(NanosNow() - started) / 1e9;
+  unsigned long long bytes = 0;
+  for (size_t i = 0; i < count; i++) bytes += targets[i].bytes;
+  printf("Replayed %llu records to %zu targets in %.3f s\n", records, count,
+         elapsed);
+  printf("Throughput %.2f Mbps, max pacing lag %.3f ms\n",
+         elapsed > 0 ? (double)bytes * 8 / elapsed / 1e6 : 0,
+         (double)max_lag / 1e6);
+  if (alive) result = EXIT_SUCCESS;
+
+rollback_targets:
+  for (size_t i = 0; i < connected; i++) {
+    if (targets[i].fd != -1) close(targets[i].fd);
+  }
+  free(targets);
+rollback_proto_reader:
+  ProtoReaderDestroy(proto_reader);
+  return result;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+static uint64_t NanosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Consumers touch every byte of every frame, the same as the upload into a va
+// surface would, so that both transports pay for reading.
+static uint64_t Checksum(const uint8_t* data, size_t size) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    sum += word;
+  }
+  return sum;
+}
+
+static void Report(const char* name, size_t frames, size_t frame_size,
+                   uint64_t elapsed, uint64_t total_latency,
+                   uint64_t max_latency) {
+  double seconds = (double)elapsed / 1e9;
+  printf("%s: %.1f fps, %.2f GiB/s, latency avg %.3f ms, max %.3f ms\n",
+         name, (double)frames / seconds,
+         (double)frames * (double)frame_size / seconds / (1 << 30),
+         (double)total_latency / (double)frames / 1e6,
+         (double)max_latency / 1e6);
+}
+
+static int RunShmProducer(const char* socket_path, uint32_t width,
+                          uint32_t height, size_t frames) {
+  struct ShmProducer* shm_producer =
+      ShmProducerCreate(socket_path, width, height, 4);
+  if (!shm_producer) return EXIT_FAILURE;
+  size_t frame_size = (size_t)width * height * 3 / 2;
+  for (size_t i = 0; i < frames; i++) {
+    uint8_t* slot = ShmProducerAcquire(shm_producer);
+    if (!slot) break;
+    memset(slot, (int)i, frame_size);
+    if (!ShmProducerPublish(shm_producer, NanosNow())) break;
+  }
+  ShmProducerDestroy(shm_producer);
+  return EXIT_SUCCESS;
+}
+
+static bool BenchShm(uint32_t width, uint32_t height, size_t frames) {
+  char socket_path[64];
+  snprintf(socket_path, sizeof(socket_path), "/tmp/shmbench-%d.sock",
+           getpid());
+  pid_t child = fork();
+  if (child == -1) {
+    fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+    return false;
+  }
+  if (!child) {
+    // Give the consumer a moment to start listening.
+    for (int i = 0; i < 100 && access(socket_path, F_OK); i++) usleep(10000);
+    _exit(RunShmProducer(socket_path, width, height, frames));
+  }
+
+  struct ShmConsumer* shm_consumer = ShmConsumerCreate(socket_path);
+  if (!shm_consumer) {
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    return false;
+  }
+  size_t frame_size = (size_t)width * height * 3 / 2;
+  size_t received = 0;
+  uint64_t total_latency = 0, max_latency = 0, checksum = 0;
+  uint64_t started = NanosNow();
+  struct ShmRingFrame frame;
+  while (ShmConsumerAcquire(shm_consumer, &frame)) {
+    uint64_t latency = NanosNow() - frame.pts;
+    checksum += Checksum(frame.y_data, frame_size);
+    ShmConsumerRelease(shm_consumer);
+    total_latency += latency;
+    if (latency > max_latency) max_latency = latency;
+    received++;
+  }
+  uint64_t elapsed = NanosNow() - started;
+  ShmConsumerDestroy(shm_consumer);
+  waitpid(child, NULL, 0);
+  if (received != frames) {
+    fprintf(stderr, "Received %zu of %zu frames\n", received, frames);
+    return false;
+  }
+  Report("shm ring", received, frame_size, elapsed, total_latency,
+         max_latency);
+  return checksum != 0;
+}
+
+static bool BenchPipe(uint32_t width, uint32_t height, size_t frames) {
+  int fds[2];
+  if (pipe(fds)) {
+    fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+    return false;
+  }
+  size_t frame_size = (size_t)width * height * 3 / 2;
+  size_t record_size = sizeof(uint64_t) + frame_size;
+  uint8_t* buffer = malloc(record_size);
+  if (!buffer) {
+    fprintf(stderr, "Failed to allocate frame: %s\n", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  pid_t child = fork();
+  if (child == -1) {
+    fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    free(buffer);
+    return false;
+  }
+  if (!child) {
+    close(fds[0]);
+    for (size_t i = 0; i < frames; i++) {
+      memset(buffer + sizeof(uint64_t), (int)i, frame_size);
+      uint64_t pts = NanosNow();
+      memcpy(buffer, &pts, sizeof(pts));
+      for (size_t offset = 0; offset < record_size;) {
+        ssize_t result = write(fds[1], buffer + offset, record_size - offset);
+        if (result < 0 && errno != EINTR) _exit(EXIT_FAILURE);
+        if (result > 0) offset += (size_t)result;
+      }
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  size_t received = 0;
+  uint64_t total_latency = 0, max_latency = 0, checksum = 0;
+  uint64_t started = NanosNow();
+  for (bool eof = false; !eof;) {
+    for (size_t offset = 0; offset < record_size;) {
+      ssize_t result = read(fds[0], buffer + offset, record_size - offset);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) {
+        eof = true;
+        break;
+      }
+      offset += (size_t)result;
+    }
+    if (eof) break;
+    uint64_t pts;
+    memcpy(&pts, buffer, sizeof(pts));
+    uint64_t latency = NanosNow() - pts;
+    checksum += Checksum(buffer + sizeof(uint64_t), frame_size);
+    total_latency += latency;
+    if (latency > max_latency) max_latency = latency;
+    received++;
+  }
+  uint64_t elapsed = NanosNow() - started;
+  close(fds[0]);
+  free(buffer);
+  waitpid(child, NULL, 0);
+  if (received != frames) {
+    fprintf(stderr, "Received %zu of %zu frames\n", received, frames);
+    return false;
+  }
+  Report("pipe", received, frame_size, elapsed, total_latency, max_latency);
+  return checksum != 0;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t width = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 3840;
+  uint32_t height = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 2160;
+  size_t frames = argc > 3 ? strtoul(argv[3], NULL, 10) : 300;
+  if (!width || !height || width % 2 || height % 2 || !frames) {
+    fprintf(stderr, "Usage: %s [width] [height] [frames]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  printf("Handing over %zu frames of %ux%u yuv420p\n", frames, width, height);
+  if (!BenchPipe(width, height, frames)) return EXIT_FAILURE;
+  if (!BenchShm(width, height, frames)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// memfd_create and sealing are only declared for gnu builds.
+#define _GNU_SOURCE
+
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define SHM_RING_MAGIC 0x474e4952u  // "RING"
+#define SHM_RING_VERSION 2
+#define SHM_RING_NO_BUFFER UINT32_MAX
+#define SHM_RING_FLAG_DAMAGE 1u
+#define SHM_RING_PAGE 4096
+
+enum ShmRingMessageType {
+  kShmRingHello = 0,
+  kShmRingBuffer,
+};
+
+struct ShmRingMessage {
+  uint32_t type;
+  uint32_t buffer_id;
+  struct ShmRingBuffer buffer;
+};
+
+struct ShmRingSlot {
+  uint64_t sequence;
+  uint64_t pts;
+  uint32_t buffer_id;
+  uint32_t flags;
+  struct ShmRingRect damage;
+  struct ShmRingCursor cursor;
+};
+
+// Head is only written by the producer and tail only by the consumer, keep them
+// on separate cache lines to avoid false sharing.
+struct ShmRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t slot_count;
+  uint64_t slot_size;
+  uint64_t slots_offset;
+  alignas(64) atomic_uint_fast64_t head;
+  alignas(64) atomic_uint_fast64_t tail;
+  alignas(64) struct ShmRingSlot slots[];
+};
+
+struct ShmRing {
+  int sock;
+  int ready;
+  int free;
+  struct ShmRingHeader* header;
+  size_t mapping_size;
+};
+
+struct ShmProducer {
+  struct ShmRing ring;
+  uint64_t head;
+};
+
+// The producer can write to the shared header at any time, so the consumer
+// works with its own copy of the validated geometry.
+struct ShmRingGeometry {
+  uint32_t width;
+  uint32_t height;
+  uint32_t slot_count;
+  uint64_t slot_size;
+  uint64_t slots_offset;
+};
+
+struct ShmConsumer {
+  struct ShmRing ring;
+  struct ShmRingGeometry geometry;
+  uint64_t tail;
+  bool hangup;
+  struct ShmRingRect damage;
+  bool registered[SHM_RING_MAX_BUFFERS];
+  bool fresh[SHM_RING_MAX_BUFFERS];
+  struct ShmRingBuffer buffers[SHM_RING_MAX_BUFFERS];
+};
+
+static bool SendMessage(int sock, const struct ShmRingMessage* message,
+                        const int* fds, size_t nfds) {
+  char control[CMSG_SPACE(sizeof(int) * 4)] = {0};
+  struct iovec iov = {.iov_base = (void*)(uintptr_t)message,
+                      .iov_len = sizeof(*message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = nfds ? control : NULL,
+      .msg_controllen = nfds ? CMSG_SPACE(sizeof(int) * nfds) : 0,
+  };
+  if (nfds) {
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  for (;;) {
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*message)) return true;
+    if (errno == EINTR) continue;
+    fprintf(stderr, "Failed to send ring message: %s\n", strerror(errno));
+    return false;
+  }
+}
+
+// Returns 1 on success, 0 on hangup and -1 on error.
+static int ReceiveMessage(int sock, struct ShmRingMessage* message, int* fds,
+                          size_t* nfds) {
+  char control[CMSG_SPACE(sizeof(int) * 4)];
+  struct iovec iov = {.iov_base = message, .iov_len = sizeof(*message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  ssize_t result;
+  do {
+    result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (result < 0 && errno == EINTR);
+  if (result <= 0) {
+    if (result < 0)
+      fprintf(stderr, "Failed to receive ring message: %s\n", strerror(errno));
+    return result < 0 ? -1 : 0;
+  }
+
+  *nfds = 0;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds + *nfds, CMSG_DATA(cmsg), count * sizeof(int));
+    *nfds += count;
+  }
+  if (result != sizeof(*message) || (msg.msg_flags & MSG_CTRUNC)) {
+    fprintf(stderr, "Malformed ring message\n");
+    for (size_t i = 0; i < *nfds; i++) close(fds[i]);
+    return -1;
+  }
+  return 1;
+}
+
+static bool Signal(int fd) {
+  static const uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) == sizeof(one)) return true;
+  fprintf(stderr, "Failed to signal ring: %s\n", strerror(errno));
+  return false;
+}
+
+// Returns false when the peer hung up or polling failed.
+static bool WaitForSignal(int fd, int sock) {
+  struct pollfd pfds[] = {
+      {.fd = fd, .events = POLLIN},
+      {.fd = sock, .events = POLLIN},
+  };
+  for (;;) {
+    if (poll(pfds, LENGTH(pfds), -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to poll ring: %s\n", strerror(errno));
+      return false;
+    }
+    if (pfds[0].revents) {
+      uint64_t value;
+      return read(fd, &value, sizeof(value)) == sizeof(value);
+    }
+    if (pfds[1].revents & (POLLHUP | POLLERR)) return false;
+    return true;
+  }
+}
+
+static void ShmRingRelease(struct ShmRing* ring) {
+  if (ring->header) munmap(ring->header, ring->mapping_size);
+  if (ring->free != -1) close(ring->free);
+  if (ring->ready != -1) close(ring->ready);
+  if (ring->sock != -1) close(ring->sock);
+}
+
+struct ShmProducer* ShmProducerCreate(const char* socket_path, uint32_t width,
+                                      uint32_t height, uint32_t slot_count) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path) || !slot_count ||
+      slot_count > SHM_RING_MAX_SLOTS || !width || !height ||
+      width > SHM_RING_MAX_DIMENSION || height > SHM_RING_MAX_DIMENSION ||
+      width % 2 || height % 2) {
+    fprintf(stderr, "Invalid ring parameters\n");
+    return NULL;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  struct ShmProducer* shm_producer = malloc(sizeof(struct ShmProducer));
+  if (!shm_producer) {
+    fprintf(stderr, "Failed to allocate producer: %s\n", strerror(errno));
+    return NULL;
+  }
+  *shm_producer = (struct ShmProducer){
+      .ring = {.sock = -1, .ready = -1, .free = -1},
+  };
+  struct ShmRing* ring = &shm_producer->ring;
+
+  size_t frame_size = (size_t)width * height * 3 / 2;
+  size_t slot_size =
+      (frame_size + SHM_RING_PAGE - 1) & ~(size_t)(SHM_RING_PAGE - 1);
+  size_t slots_offset = sizeof(struct ShmRingHeader) +
+                        slot_count * sizeof(struct ShmRingSlot);
+  slots_offset = (slots_offset + SHM_RING_PAGE - 1) &
+                 ~(size_t)(SHM_RING_PAGE - 1);
+  ring->mapping_size = slots_offset + slot_count * slot_size;
+
+  int memfd = memfd_create("streamer-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd == -1) {
+    fprintf(stderr, "Failed to create memfd: %s\n", strerror(errno));
+    goto rollback_shm_producer;
+  }
+  // Sealing the size guarantees the consumer never gets SIGBUS from a ring that
+  // was truncated under its feet.
+  if (ftruncate(memfd, (off_t)ring->mapping_size) ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+    fprintf(stderr, "Failed to size memfd: %s\n", strerror(errno));
+    goto rollback_memfd;
+  }
+  ring->header = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, memfd, 0);
+  if (ring->header == MAP_FAILED) {
+    fprintf(stderr, "Failed to map memfd: %s\n", strerror(errno));
+    ring->header = NULL;
+    goto rollback_memfd;
+  }
+  *ring->header = (struct ShmRingHeader){
+      .magic = SHM_RING_MAGIC,
+      .version = SHM_RING_VERSION,
+      .width = width,
+      .height = height,
+      .slot_count = slot_count,
+      .slot_size = slot_size,
+      .slots_offset = slots_offset,
+  };
+
+  ring->ready = eventfd(0, EFD_CLOEXEC);
+  ring->free = eventfd(0, EFD_CLOEXEC);
+  ring->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ring->ready == -1 || ring->free == -1 || ring->sock == -1) {
+    fprintf(stderr, "Failed to create ring fds: %s\n", strerror(errno));
+    goto rollback_memfd;
+  }
+  if (connect(ring->sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "Failed to connect %s: %s\n", socket_path,
+            strerror(errno));
+    goto rollback_memfd;
+  }
+
+  struct ShmRingMessage message = {.type = kShmRingHello};
+  int fds[] = {memfd, ring->ready, ring->free};
+  if (!SendMessage(ring->sock, &message, fds, LENGTH(fds))) {
+    fprintf(stderr, "Failed to send ring hello\n");
+    goto rollback_memfd;
+  }
+  close(memfd);
+  return shm_producer;
+
+rollback_memfd:
+  close(memfd);
+rollback_shm_producer:
+  ShmRingRelease(ring);
+  free(shm_producer);
+  return NULL;
+}
+
+uint8_t* ShmProducerAcquire(struct ShmProducer* shm_producer) {
+  struct ShmRing* ring = &shm_producer->ring;
+  struct ShmRingHeader* header = ring->header;
+  while (shm_producer->head -
+             atomic_load_explicit(&header->tail, memory_order_acquire) >=
+         header->slot_count) {
+    if (!WaitForSignal(ring->free, ring->sock)) {
+      fprintf(stderr, "Consumer went away\n");
+      return NULL;
+    }
+  }
+  size_t slot = shm_producer->head % header->slot_count;
+  return (uint8_t*)header + header->slots_offset + slot * header->slot_size;
+}
+
+static bool PublishSlot(struct ShmProducer* shm_producer, uint32_t buffer_id,
+                        uint64_t pts, const struct ShmRingRect* damage,
+                        const struct ShmRingCursor* cursor) {
+  struct ShmRingHeader* header = shm_producer->ring.header;
+  header->slots[shm_producer->head % header->slot_count] =
+      (struct ShmRingSlot){
+          .sequence = shm_producer->head,
+          .pts = pts,
+          .buffer_id = buffer_id,
+          .flags = damage ? SHM_RING_FLAG_DAMAGE : 0,
+          .damage = damage ? *damage : (struct ShmRingRect){0},
+          .cursor = cursor ? *cursor
+                           : (struct ShmRingCursor){SHM_RING_NO_BUFFER, 0, 0},
+      };
+  shm_producer->head++;
+  atomic_store_explicit(&header->head, shm_producer->head,
+                        memory_order_release);
+  return Signal(shm_producer->ring.ready);
+}
+
+bool ShmProducerPublish(struct ShmProducer* shm_producer, uint64_t pts) {
+  return PublishSlot(shm_producer, SHM_RING_NO_BUFFER, pts, NULL, NULL);
+}
+
+bool ShmProducerRegisterBuffer(struct ShmProducer* shm_producer,
+                               uint32_t buffer_id,
+                               const struct ShmRingBuffer* buffer) {
+  if (buffer_id >= SHM_RING_MAX_BUFFERS || !buffer->nplanes ||
+      buffer->nplanes > LENGTH(buffer->planes)) {
+    fprintf(stderr, "Invalid ring buffer %u\n", buffer_id);
+    return false;
+  }
+  struct ShmRingMessage message = {
+      .type = kShmRingBuffer,
+      .buffer_id = buffer_id,
+      .buffer = *buffer,
+  };
+  int fds[LENGTH(buffer->planes)];
+  for (size_t i = 0; i < buffer->nplanes; i++) {
+    fds[i] = buffer->planes[i].dmabuf_fd;
+    message.buffer.planes[i].dmabuf_fd = -1;
+  }
+  return SendMessage(shm_producer->ring.sock, &message, fds, buffer->nplanes);
+}
+
+bool ShmProducerPublishBuffer(struct ShmProducer* shm_producer,
+                              uint32_t buffer_id, uint64_t pts,
+                              const struct ShmRingRect* damage,
+                              const struct ShmRingCursor* cursor) {
+  if (buffer_id >= SHM_RING_MAX_BUFFERS ||
+      (cursor && cursor->buffer_id >= SHM_RING_MAX_BUFFERS)) {
+    fprintf(stderr, "Invalid ring buffer %u\n", buffer_id);
+    return false;
+  }
+  if (!ShmProducerAcquire(shm_producer)) return false;
+  return PublishSlot(shm_producer, buffer_id, pts, damage, cursor);
+}
+
+void ShmProducerDestroy(struct ShmProducer* shm_producer) {
+  ShmRingRelease(&shm_producer->ring);
+  free(shm_producer);
+}
+
+static bool MapConsumerRing(struct ShmConsumer* shm_consumer, int memfd) {
+  struct ShmRing* ring = &shm_consumer->ring;
+  struct stat st;
+  if (fstat(memfd, &st) || (size_t)st.st_size < sizeof(struct ShmRingHeader)) {
+    fprintf(stderr, "Invalid ring memfd\n");
+    return false;
+  }
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+  if (fcntl(memfd, F_GET_SEALS) != seals) {
+    fprintf(stderr, "Ring memfd is not sealed\n");
+    return false;
+  }
+  ring->mapping_size = (size_t)st.st_size;
+  ring->header = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, memfd, 0);
+  if (ring->header == MAP_FAILED) {
+    fprintf(stderr, "Failed to map ring: %s\n", strerror(errno));
+    ring->header = NULL;
+    return false;
+  }
+
+  // Validation works on the copy, so the producer can not change the
+  // geometry after it was checked.
+  const struct ShmRingHeader* header = ring->header;
+  bool valid = header->magic == SHM_RING_MAGIC &&
+               header->version == SHM_RING_VERSION;
+  struct ShmRingGeometry geometry = {
+      .width = header->width,
+      .height = header->height,
+      .slot_count = header->slot_count,
+      .slot_size = header->slot_size,
+      .slots_offset = header->slots_offset,
+  };
+  if (!valid || !geometry.width || !geometry.height ||
+      geometry.width > SHM_RING_MAX_DIMENSION ||
+      geometry.height > SHM_RING_MAX_DIMENSION || !geometry.slot_count ||
+      geometry.slot_count > SHM_RING_MAX_SLOTS) {
+    fprintf(stderr, "Invalid ring header\n");
+    return false;
+  }
+  // Capped dimensions and slot count can not overflow the products below,
+  // while the slot size is only ever divided by.
+  uint64_t frame_size = (uint64_t)geometry.width * geometry.height * 3 / 2;
+  if (geometry.slot_size < frame_size ||
+      geometry.slot_size > ring->mapping_size ||
+      geometry.slots_offset < sizeof(struct ShmRingHeader) +
+                                  geometry.slot_count *
+                                      sizeof(struct ShmRingSlot) ||
+      geometry.slots_offset > ring->mapping_size ||
+      geometry.slot_count > (ring->mapping_size - geometry.slots_offset) /
+                                geometry.slot_size) {
+    fprintf(stderr, "Invalid ring header\n");
+    return false;
+  }
+  shm_consumer->geometry = geometry;
+  return true;
+}
+
+static bool HandleMessage(struct ShmConsumer* shm_consumer) {
+  struct ShmRingMessage message;
+  int fds[4];
+  size_t nfds = 0;
+  int result = ReceiveMessage(shm_consumer->ring.sock, &message, fds, &nfds);
+  if (result <= 0) {
+    shm_consumer->hangup = true;
+    return result == 0;
+  }
+
+  uint32_t id = message.buffer_id;
+  if (message.type != kShmRingBuffer || id >= SHM_RING_MAX_BUFFERS ||
+      message.buffer.nplanes != nfds) {
+    fprintf(stderr, "Unexpected ring message\n");
+    for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    return false;
+  }
+  struct ShmRingBuffer* buffer = &shm_consumer->buffers[id];
+  if (shm_consumer->registered[id]) {
+    for (size_t i = 0; i < buffer->nplanes; i++)
+      close(buffer->planes[i].dmabuf_fd);
+  }
+  *buffer = message.buffer;
+  for (size_t i = 0; i < nfds; i++) buffer->planes[i].dmabuf_fd = fds[i];
+  shm_consumer->registered[id] = true;
+  shm_consumer->fresh[id] = true;
+  return true;
+}
+
+struct ShmConsumer* ShmConsumerCreate(const char* socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Unix socket path is too long: %s\n", socket_path);
+    return NULL;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  struct ShmConsumer* shm_consumer = calloc(1, sizeof(struct ShmConsumer));
+  if (!shm_consumer) {
+    fprintf(stderr, "Failed to allocate consumer: %s\n", strerror(errno));
+    return NULL;
+  }
+  struct ShmRing* ring = &shm_consumer->ring;
+  *ring = (struct ShmRing){.sock = -1, .ready = -1, .free = -1};
+
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    goto rollback_shm_consumer;
+  }
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listener, 1)) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+            strerror(errno));
+    goto rollback_listener;
+  }
+  ring->sock = accept(listener, NULL, NULL);
+  if (ring->sock == -1) {
+    fprintf(stderr, "Failed to accept producer: %s\n", strerror(errno));
+    goto rollback_listener;
+  }
+  close(listener);
+  unlink(socket_path);
+
+  struct ShmRingMessage message;
+  int fds[4];
+  size_t nfds = 0;
+  if (ReceiveMessage(ring->sock, &message, fds, &nfds) <= 0 ||
+      message.type != kShmRingHello || nfds != 3) {
+    fprintf(stderr, "Failed to receive ring hello\n");
+    for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    goto rollback_shm_consumer;
+  }
+  ring->ready = fds[1];
+  ring->free = fds[2];
+  bool mapped = MapConsumerRing(shm_consumer, fds[0]);
+  close(fds[0]);
+  if (!mapped) {
+    fprintf(stderr, "Failed to map producer ring\n");
+    goto rollback_shm_consumer;
+  }
+  shm_consumer->tail =
+      atomic_load_explicit(&ring->header->tail, memory_order_relaxed);
+  if (atomic_load_explicit(&ring->header->head, memory_order_relaxed) -
+          shm_consumer->tail >
+      shm_consumer->geometry.slot_count) {
+    fprintf(stderr, "Invalid initial ring position\n");
+    goto rollback_shm_consumer;
+  }
+  return shm_consumer;
+
+rollback_listener:
+  close(listener);
+  unlink(socket_path);
+rollback_shm_consumer:
+  ShmRingRelease(ring);
+  free(shm_consumer);
+  return NULL;
+}
+
+void ShmConsumerGetSize(const struct ShmConsumer* shm_consumer,
+                        uint32_t* width, uint32_t* height) {
+  *width = shm_consumer->geometry.width;
+  *height = shm_consumer->geometry.height;
+}
+
+// Registration is sent before the buffer is first published, but the socket
+// and the ring signal race, so catch up if needed.
+static bool AcquireBuffer(struct ShmConsumer* shm_consumer, uint32_t buffer_id,
+                          const struct ShmRingBuffer** buffer, bool* fresh) {
+  if (buffer_id >= SHM_RING_MAX_BUFFERS) {
+    fprintf(stderr, "Invalid ring buffer id %u\n", buffer_id);
+    return false;
+  }
+  while (!shm_consumer->registered[buffer_id]) {
+    if (shm_consumer->hangup || !HandleMessage(shm_consumer)) {
+      fprintf(stderr, "Ring buffer %u was never registered\n", buffer_id);
+      return false;
+    }
+  }
+  *buffer = &shm_consumer->buffers[buffer_id];
+  *fresh = shm_consumer->fresh[buffer_id];
+  shm_consumer->fresh[buffer_id] = false;
+  return true;
+}
+
+bool ShmConsumerAcquire(struct ShmConsumer* shm_consumer,
+                        struct ShmRingFrame* shm_ring_frame) {
+  struct ShmRing* ring = &shm_consumer->ring;
+  struct ShmRingHeader* header = ring->header;
+  const struct ShmRingGeometry* geometry = &shm_consumer->geometry;
+  uint64_t head;
+  while ((head = atomic_load_explicit(&header->head, memory_order_acquire)) ==
+         shm_consumer->tail) {
+    if (shm_consumer->hangup) return false;
+    struct pollfd pfds[] = {
+        {.fd = ring->ready, .events = POLLIN},
+        {.fd = ring->sock, .events = POLLIN},
+    };
+    if (poll(pfds, LENGTH(pfds), -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to poll ring: %s\n", strerror(errno));
+      return false;
+    }
+    if (pfds[0].revents) {
+      uint64_t value;
+      if (read(ring->ready, &value, sizeof(value)) != sizeof(value)) {
+        fprintf(stderr, "Failed to read ring signal: %s\n", strerror(errno));
+        return false;
+      }
+    }
+    if (pfds[1].revents && !HandleMessage(shm_consumer)) return false;
+  }
+
+  // Head comes from shared memory, a producer can never run further ahead
+  // than the ring size, so anything else is a broken or hostile producer.
+  if (head - shm_consumer->tail > geometry->slot_count) {
+    fprintf(stderr, "Invalid ring head %llu for tail %llu\n",
+            (unsigned long long)head, (unsigned long long)shm_consumer->tail);
+    return false;
+  }
+  size_t index = shm_consumer->tail % geometry->slot_count;
+  struct ShmRingSlot slot = header->slots[index];
+  *shm_ring_frame = (struct ShmRingFrame){
+      .sequence = slot.sequence,
+      .pts = slot.pts,
+      .buffer_id = slot.buffer_id,
+      .cursor = slot.cursor,
+  };
+  if (slot.buffer_id == SHM_RING_NO_BUFFER) {
+    size_t luma_size = (size_t)geometry->width * geometry->height;
+    const uint8_t* data = (const uint8_t*)header + geometry->slots_offset +
+                          index * geometry->slot_size;
+    shm_ring_frame->y_data = data;
+    shm_ring_frame->u_data = data + luma_size;
+    shm_ring_frame->v_data = data + luma_size + luma_size / 4;
+    return true;
+  }
+
+  if (!AcquireBuffer(shm_consumer, slot.buffer_id, &shm_ring_frame->buffer,
+                     &shm_ring_frame->buffer_fresh))
+    return false;
+  if (slot.flags & SHM_RING_FLAG_DAMAGE) {
+    shm_consumer->damage = slot.damage;
+    shm_ring_frame->damage = &shm_consumer->damage;
+  }
+  if (slot.cursor.buffer_id != SHM_RING_NO_BUFFER &&
+      !AcquireBuffer(shm_consumer, slot.cursor.buffer_id,
+                     &shm_ring_frame->cursor_buffer,
+                     &shm_ring_frame->cursor_fresh))
+    return false;
+  return true;
+}
+
+void ShmConsumerRelease(struct ShmConsumer* shm_consumer) {
+  shm_consumer->tail++;
+  atomic_store_explicit(&shm_consumer->ring.header->tail, shm_consumer->tail,
+                        memory_order_release);
+  Signal(shm_consumer->ring.free);
+}
+
+size_t ShmConsumerQueued(const struct ShmConsumer* shm_consumer) {
+  uint64_t queued = atomic_load_explicit(&shm_consumer->ring.header->head,
+                                         memory_order_relaxed) -
+                    shm_consumer->tail;
+  return queued > shm_consumer->geometry.slot_count
+             ? shm_consumer->geometry.slot_count
+             : (size_t)queued;
+}
+
+void ShmConsumerDestroy(struct ShmConsumer* shm_consumer) {
+  for (size_t i = 0; i < LENGTH(shm_consumer->buffers); i++) {
+    if (!shm_consumer->registered[i]) continue;
+    for (size_t j = 0; j < shm_consumer->buffers[i].nplanes; j++)
+      close(shm_consumer->buffers[i].planes[j].dmabuf_fd);
+  }
+  ShmRingRelease(&shm_consumer->ring);
+  free(shm_consumer);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_SHMRING_H_
+#define STREAMER_SHMRING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_MAX_BUFFERS 32
+// Rings beyond these limits are rejected on both sides, which keeps the sizes
+// derived from a ring header far away from overflowing.
+#define SHM_RING_MAX_DIMENSION 16384
+#define SHM_RING_MAX_SLOTS 256
+
+// Dmabuf frame layout, registered once per buffer by the producer.
+struct ShmRingBuffer {
+  uint32_t width;
+  uint32_t height;
+  uint32_t fourcc;
+  uint32_t nplanes;
+  struct ShmRingPlane {
+    int dmabuf_fd;
+    uint32_t pitch;
+    uint32_t offset;
+    uint64_t modifier;
+  } planes[4];
+};
+
+// Rectangles are in pixels of the frame.
+struct ShmRingRect {
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+// Cursor is a registered premultiplied argb buffer, blended over the frame
+// with its top left corner at x and y.
+struct ShmRingCursor {
+  uint32_t buffer_id;
+  int32_t x;
+  int32_t y;
+};
+
+// Either planes point into the shared ring, or buffer refers to one of the
+// registered dmabufs. Both stay valid until the frame is released. Buffer is
+// fresh on its first use after (re)registration, so imports can be cached by
+// buffer id. Dmabuf frames might come with damage, the part of the frame
+// that changed since the previous one, NULL if all of it might have, and a
+// cursor buffer, NULL for none, which is fresh the same way.
+struct ShmRingFrame {
+  uint64_t sequence;
+  uint64_t pts;
+  const uint8_t* y_data;
+  const uint8_t* u_data;
+  const uint8_t* v_data;
+  uint32_t buffer_id;
+  const struct ShmRingBuffer* buffer;
+  bool buffer_fresh;
+  const struct ShmRingRect* damage;
+  struct ShmRingCursor cursor;
+  const struct ShmRingBuffer* cursor_buffer;
+  bool cursor_fresh;
+};
+
+struct ShmProducer;
+struct ShmConsumer;
+
+// Producer side, usable without any gpu or va dependencies. Slots hold
+// tightly packed yuv420p frames.
+struct ShmProducer* ShmProducerCreate(const char* socket_path, uint32_t width,
+                                      uint32_t height, uint32_t slot_count);
+uint8_t* ShmProducerAcquire(struct ShmProducer* shm_producer);
+bool ShmProducerPublish(struct ShmProducer* shm_producer, uint64_t pts);
+// Dmabuf contents must stay intact until the slot used to publish them is
+// handed out by ShmProducerAcquire again.
+bool ShmProducerRegisterBuffer(struct ShmProducer* shm_producer,
+                               uint32_t buffer_id,
+                               const struct ShmRingBuffer* buffer);
+// Damage is the part of the frame that changed since the previously published
+// one, NULL for all of it. Cursor is NULL for none.
+bool ShmProducerPublishBuffer(struct ShmProducer* shm_producer,
+                              uint32_t buffer_id, uint64_t pts,
+                              const struct ShmRingRect* damage,
+                              const struct ShmRingCursor* cursor);
+void ShmProducerDestroy(struct ShmProducer* shm_producer);
+
+// Consumer side, waits for a single producer to connect.
+struct ShmConsumer* ShmConsumerCreate(const char* socket_path);
+void ShmConsumerGetSize(const struct ShmConsumer* shm_consumer,
+                        uint32_t* width, uint32_t* height);
+// Returns false once the producer disconnected and the ring is drained.
+bool ShmConsumerAcquire(struct ShmConsumer* shm_consumer,
+                        struct ShmRingFrame* shm_ring_frame);
+void ShmConsumerRelease(struct ShmConsumer* shm_consumer);
+size_t ShmConsumerQueued(const struct ShmConsumer* shm_consumer);
+void ShmConsumerDestroy(struct ShmConsumer* shm_consumer);
+
+#endif  // STREAMER_SHMRING_H_
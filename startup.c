@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "startup.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "gpu.h"
+
+struct GpuStartup {
+  const struct StartupConfig* config;
+  struct GpuContext* gpu_context;
+  uint64_t micros;
+};
+
+static uint64_t MicrosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void* GpuStartupThread(void* arg) {
+  struct GpuStartup* gpu_startup = arg;
+  uint64_t started = MicrosNow();
+  gpu_startup->gpu_context = GpuContextCreate(gpu_startup->config->colorspace,
+                                              gpu_startup->config->range);
+  // Egl context can only be current on a single thread, so it is handed over to
+  // the joining thread released.
+  if (gpu_startup->gpu_context)
+    GpuContextReleaseCurrent(gpu_startup->gpu_context);
+  gpu_startup->micros = MicrosNow() - started;
+  return NULL;
+}
+
+static struct EncodeContext* CreateUnbound(const struct StartupConfig* config,
+                                           uint64_t* micros) {
+  uint64_t started = MicrosNow();
+  struct EncodeContext* encode_context =
+      EncodeContextCreateUnbound(config->width, config->height,
+                                 config->colorspace, config->range,
+                                 config->codec);
+  *micros = MicrosNow() - started;
+  return encode_context;
+}
+
+bool StartupCreateContexts(const struct StartupConfig* config,
+                           struct GpuContext** gpu_context,
+                           struct EncodeContext** encode_context,
+                           struct StartupTimings* timings) {
+  uint64_t started = MicrosNow();
+  *timings = (struct StartupTimings){0};
+  struct GpuStartup gpu_startup = {.config = config};
+
+  struct EncodeContext* unbound = NULL;
+  if (config->sequential) {
+    GpuStartupThread(&gpu_startup);
+    unbound = CreateUnbound(config, &timings->va_micros);
+  } else {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, GpuStartupThread, &gpu_startup)) {
+      fprintf(stderr, "Failed to create gpu startup thread\n");
+      return false;
+    }
+    unbound = CreateUnbound(config, &timings->va_micros);
+    uint64_t joining = MicrosNow();
+    pthread_join(thread, NULL);
+    timings->join_micros = MicrosNow() - joining;
+  }
+  timings->gpu_micros = gpu_startup.micros;
+
+  if (!gpu_startup.gpu_context) {
+    fprintf(stderr, "Failed to create gpu context\n");
+    goto rollback_unbound;
+  }
+  if (!GpuContextMakeCurrent(gpu_startup.gpu_context)) goto rollback_gpu;
+  if (!unbound) {
+    fprintf(stderr, "Failed to create encode context\n");
+    goto rollback_gpu;
+  }
+
+  uint64_t binding = MicrosNow();
+  if (!EncodeContextBindGpu(unbound, gpu_startup.gpu_context)) {
+    fprintf(stderr, "Failed to import encoder input into gpu context\n");
+    goto rollback_gpu;
+  }
+  timings->bind_micros = MicrosNow() - binding;
+  timings->total_micros = MicrosNow() - started;
+  *gpu_context = gpu_startup.gpu_context;
+  *encode_context = unbound;
+  return true;
+
+rollback_gpu:
+  GpuContextDestroy(gpu_startup.gpu_context);
+rollback_unbound:
+  if (unbound) EncodeContextDestroy(unbound);
+  return false;
+}
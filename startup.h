@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_STARTUP_H_
+#define STREAMER_STARTUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "colorspace.h"
+#include "encode.h"
+
+struct GpuContext;
+
+struct StartupConfig {
+  uint32_t width;
+  uint32_t height;
+  enum YuvColorspace colorspace;
+  enum YuvRange range;
+  enum EncodeCodec codec;
+  // Runs both initializations one after another on the calling thread, for
+  // comparison and for drivers that misbehave when initialized in parallel.
+  bool sequential;
+};
+
+struct StartupTimings {
+  uint64_t gpu_micros;
+  uint64_t va_micros;
+  // Waiting for the slower side, after the calling thread is done.
+  uint64_t join_micros;
+  // Exporting the input surface and importing it into egl.
+  uint64_t bind_micros;
+  uint64_t total_micros;
+};
+
+// Creates the gpu and encode contexts of a session. Gpu initialization (gbm,
+// egl and shader compilation) runs on a helper thread, concurrently with va
+// initialization on the calling thread. Binding them together waits for
+// both. On success the gpu context is current on the calling thread.
+bool StartupCreateContexts(const struct StartupConfig* config,
+                           struct GpuContext** gpu_context,
+                           struct EncodeContext** encode_context,
+                           struct StartupTimings* timings);
+
+#endif  // STREAMER_STARTUP_H_
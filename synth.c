@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "synth.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+#define GLYPH_SCALE 8
+
+struct SynthSource {
+  uint32_t width;
+  uint32_t height;
+  enum SynthComplexity complexity;
+};
+
+// 5x7 digits, one byte per row with the leftmost pixel in bit 4.
+static const uint8_t kDigits[10][GLYPH_HEIGHT] = {
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e},
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e},
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f},
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e},
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02},
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e},
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e},
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e},
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c},
+};
+
+struct SynthSource* SynthSourceCreate(uint32_t width, uint32_t height,
+                                      enum SynthComplexity complexity) {
+  if (!width || !height || width % 2 || height % 2) {
+    fprintf(stderr, "Invalid synthetic frame size %ux%u\n", width, height);
+    return NULL;
+  }
+  struct SynthSource* synth_source = malloc(sizeof(struct SynthSource));
+  if (!synth_source) {
+    fprintf(stderr, "Failed to allocate synth source: %s\n", strerror(errno));
+    return NULL;
+  }
+  *synth_source = (struct SynthSource){
+      .width = width,
+      .height = height,
+      .complexity = complexity,
+  };
+  return synth_source;
+}
+
+static uint32_t NoiseSeed(uint64_t frame, uint32_t row) {
+  uint32_t seed = (uint32_t)(frame * 0x9e3779b97f4a7c15ull >> 32) ^
+                  (row * 0x85ebca6bu);
+  return seed ? seed : 1;
+}
+
+#ifdef __SSE2__
+
+static inline __m128i Xorshift(__m128i* state) {
+  __m128i x = *state;
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  return *state = x;
+}
+
+static void FillRow(uint8_t* row, uint32_t width, uint8_t base, uint8_t step,
+                    enum SynthComplexity complexity, uint32_t seed) {
+  uint8_t ramp[16];
+  for (uint32_t i = 0; i < LENGTH(ramp); i++)
+    ramp[i] = (uint8_t)(base + i * step);
+  __m128i value = _mm_loadu_si128((const __m128i*)ramp);
+  const __m128i advance = _mm_set1_epi8((char)(step * 16));
+  const __m128i grain = _mm_set1_epi8(0x0f);
+  __m128i state = _mm_setr_epi32((int)seed, (int)(seed * 3 + 1),
+                                 (int)(seed * 5 + 2), (int)(seed * 7 + 3));
+
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i pixels = value;
+    if (complexity == kSynthNoise) {
+      pixels = Xorshift(&state);
+    } else if (complexity == kSynthGrain) {
+      pixels = _mm_adds_epu8(pixels, _mm_and_si128(Xorshift(&state), grain));
+    }
+    _mm_storeu_si128((__m128i*)(row + x), pixels);
+    value = _mm_add_epi8(value, advance);
+  }
+  for (; x < width; x++) row[x] = (uint8_t)(base + x * step);
+}
+
+#else  // __SSE2__
+
+static void FillRow(uint8_t* row, uint32_t width, uint8_t base, uint8_t step,
+                    enum SynthComplexity complexity, uint32_t seed) {
+  for (uint32_t x = 0; x < width; x++) {
+    uint8_t pixel = (uint8_t)(base + x * step);
+    if (complexity >= kSynthGrain) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      if (complexity == kSynthNoise) {
+        pixel = (uint8_t)seed;
+      } else {
+        unsigned sum = pixel + (seed & 0x0f);
+        pixel = (uint8_t)(sum > UINT8_MAX ? UINT8_MAX : sum);
+      }
+    }
+    row[x] = pixel;
+  }
+}
+
+#endif  // __SSE2__
+
+static void DrawText(const struct SynthSource* synth_source, uint64_t frame,
+                     uint8_t* y_data) {
+  char text[24];
+  int length = snprintf(text, sizeof(text), "%020llu",
+                        (unsigned long long)frame);
+  uint32_t glyph_advance = (GLYPH_WIDTH + 1) * GLYPH_SCALE;
+  uint32_t text_width = (uint32_t)length * glyph_advance;
+  uint32_t text_height = GLYPH_HEIGHT * GLYPH_SCALE;
+  if (text_height > synth_source->height) return;
+
+  // Text scrolls right to left by a few pixels per frame and wraps around, so
+  // that motion search has something to lock onto.
+  uint32_t scroll = (uint32_t)(frame * 4 % (synth_source->width + text_width));
+  uint32_t top = (synth_source->height - text_height) / 2;
+  for (uint32_t gy = 0; gy < text_height; gy++) {
+    uint8_t* row = y_data + (size_t)(top + gy) * synth_source->width;
+    for (uint32_t tx = 0; tx < text_width; tx++) {
+      uint32_t glyph = tx / glyph_advance;
+      uint32_t gx = tx % glyph_advance / GLYPH_SCALE;
+      if (gx >= GLYPH_WIDTH) continue;
+      uint8_t bits = kDigits[text[glyph] - '0'][gy / GLYPH_SCALE];
+      if (!(bits & (0x10 >> gx))) continue;
+      int64_t x = (int64_t)synth_source->width + tx - scroll;
+      if (x >= 0 && x < synth_source->width) row[x] = 235;
+    }
+  }
+}
+
+void SynthSourceFill(struct SynthSource* synth_source, uint64_t frame,
+                     uint8_t* y_data, uint8_t* u_data, uint8_t* v_data) {
+  uint32_t width = synth_source->width;
+  uint32_t height = synth_source->height;
+  enum SynthComplexity complexity = synth_source->complexity;
+  for (uint32_t y = 0; y < height; y++) {
+    FillRow(y_data + (size_t)y * width, width, (uint8_t)(y + frame * 2), 1,
+            complexity, NoiseSeed(frame, y));
+  }
+  if (complexity >= kSynthText && complexity != kSynthNoise)
+    DrawText(synth_source, frame, y_data);
+
+  // Chroma keeps the gradient even at the noise level, pure noise in all planes
+  // is no harder for the encoder than in luma alone.
+  uint32_t chroma_width = width / 2;
+  uint32_t chroma_height = height / 2;
+  for (uint32_t y = 0; y < chroma_height; y++) {
+    FillRow(u_data + (size_t)y * chroma_width, chroma_width, (uint8_t)frame,
+            2, kSynthGradient, 0);
+    memset(v_data + (size_t)y * chroma_width, (uint8_t)(y * 2 - frame),
+           chroma_width);
+  }
+}
+
+void SynthSourceDestroy(struct SynthSource* synth_source) {
+  free(synth_source);
+}
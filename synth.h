@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_SYNTH_H_
+#define STREAMER_SYNTH_H_
+
+#include <stdint.h>
+
+// Text is drawn over the gradient, and grain is added on top of both. Noise
+// replaces all of that in luma, while chroma keeps the gradient.
+enum SynthComplexity {
+  kSynthGradient = 0,
+  kSynthText,
+  kSynthGrain,
+  kSynthNoise,
+};
+
+struct SynthSource;
+
+struct SynthSource* SynthSourceCreate(uint32_t width, uint32_t height,
+                                      enum SynthComplexity complexity);
+// Fills tightly packed yuv420p planes, same layout as test.yuv frames.
+void SynthSourceFill(struct SynthSource* synth_source, uint64_t frame,
+                     uint8_t* y_data, uint8_t* u_data, uint8_t* v_data);
+void SynthSourceDestroy(struct SynthSource* synth_source);
+
+#endif  // STREAMER_SYNTH_H_
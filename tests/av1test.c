@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <va/va.h>
+
+#include "av1.h"
+#include "bitstream.h"
+
+// Expected bytes were cross-checked by decoding them field by field against
+// the syntax tables of the AV1 specification. Parameters mirror the ones the
+// encoder uses for a 1080p stream.
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+#define LENGTH(x) (sizeof(x) / sizeof *(x))
+
+static bool SameBytes(const struct Bitstream* bitstream, const uint8_t* bytes,
+                      size_t size) {
+  if (bitstream->size != size * 8) {
+    fprintf(stderr, "Expected %zu bits, got %zu\n", size * 8, bitstream->size);
+    return false;
+  }
+  if (!memcmp(bitstream->data, bytes, size)) return true;
+  fprintf(stderr, "Got:");
+  const uint8_t* data = bitstream->data;
+  for (size_t i = 0; i < size; i++) fprintf(stderr, " %02x", data[i]);
+  fprintf(stderr, "\n");
+  return false;
+}
+
+static void MakeSeq(VAEncSequenceParameterBufferAV1* seq) {
+  *seq = (VAEncSequenceParameterBufferAV1){
+      .seq_profile = 0,
+      .seq_level_idx = 13,
+      .seq_tier = 0,
+      .intra_period = 120,
+      .ip_period = 1,
+      .seq_fields.bits =
+          {
+              .enable_order_hint = 1,
+              .enable_cdef = 1,
+              .subsampling_x = 1,
+              .subsampling_y = 1,
+          },
+      .order_hint_bits_minus_1 = 7,
+  };
+}
+
+static void MakePic(VAEncPictureParameterBufferAV1* pic, bool key_frame) {
+  struct TileInfo tile_info;
+  DeriveUniformTileInfo(1920, 1080, 0, &tile_info);
+  *pic = (VAEncPictureParameterBufferAV1){
+      .frame_width_minus_1 = 1920 - 1,
+      .frame_height_minus_1 = 1080 - 1,
+      .primary_ref_frame = 7,
+      .refresh_frame_flags = 0xff,
+      .picture_flags.bits.frame_type = KEY_FRAME,
+      .filter_level = {15, 15},
+      .filter_level_u = 15,
+      .filter_level_v = 15,
+      .base_qindex = 128,
+      .mode_control_flags.bits.tx_mode = 2,
+      .tile_cols = tile_info.tile_cols,
+      .tile_rows = tile_info.tile_rows,
+      .cdef_damping_minus_3 = 2,
+  };
+  if (!key_frame) {
+    pic->picture_flags.bits.frame_type = INTER_FRAME;
+    pic->order_hint = 1;
+    pic->primary_ref_frame = 0;
+    pic->refresh_frame_flags = 1u << 1;
+  }
+}
+
+static void TestTileInfo(void) {
+  struct TileInfo tile_info;
+  DeriveUniformTileInfo(1920, 1080, 0, &tile_info);
+  CHECK(tile_info.tile_cols_log2 == 0 && tile_info.tile_rows_log2 == 0);
+  CHECK(tile_info.tile_cols == 1 && tile_info.tile_rows == 1);
+  CHECK(tile_info.width_in_sbs_minus_1[0] == 29);
+  CHECK(tile_info.height_in_sbs_minus_1[0] == 16);
+
+  // 64 superblocks of 64 pixels exceed MAX_TILE_WIDTH.
+  DeriveUniformTileInfo(4096 + 64, 2160, 0, &tile_info);
+  CHECK(tile_info.tile_cols_log2 == 1 && tile_info.tile_cols == 2);
+  CHECK(tile_info.width_in_sbs_minus_1[0] == 32);
+  CHECK(tile_info.width_in_sbs_minus_1[1] == 31);
+}
+
+static void TestTemporalDelimiter(void) {
+  static const uint8_t kExpected[] = {0x12, 0x00};
+  char buffer[16];
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  PackTemporalDelimiterObu(&bitstream);
+  CHECK(SameBytes(&bitstream, kExpected, LENGTH(kExpected)));
+}
+
+static void TestSequenceHeader(void) {
+  static const uint8_t kExpected[] = {
+      0x0a, 0x0e, 0x00, 0x00, 0x00, 0x6a, 0xab, 0xbf,
+      0xc3, 0x70, 0x08, 0x74, 0x40, 0x80, 0x80, 0x41,
+  };
+  VAEncSequenceParameterBufferAV1 seq;
+  MakeSeq(&seq);
+  const struct MoreSequenceHeader msh = {
+      .max_frame_width_minus_1 = 1920 - 1,
+      .max_frame_height_minus_1 = 1080 - 1,
+      .color_description_present_flag = 1,
+      .color_primaries = 2,
+      .transfer_characteristics = 2,
+      .matrix_coefficients = 1,
+      .color_range = 0,
+      .chroma_sample_position = 0,
+  };
+  char buffer[64];
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  CHECK(PackSequenceHeaderObu(&bitstream, &seq, &msh));
+  CHECK(SameBytes(&bitstream, kExpected, LENGTH(kExpected)));
+}
+
+static void TestKeyFrameHeader(void) {
+  static const uint8_t kExpected[] = {
+      0x1a, 0x8a, 0x80, 0x80, 0x00, 0x10, 0x00, 0x90,
+      0x00, 0x1e, 0x79, 0xe7, 0x84, 0x00, 0x05,
+  };
+  VAEncSequenceParameterBufferAV1 seq;
+  MakeSeq(&seq);
+  VAEncPictureParameterBufferAV1 pic;
+  MakePic(&pic, true);
+
+  // A temporal delimiter in front shifts every offset by its two bytes.
+  char buffer[256];
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  PackTemporalDelimiterObu(&bitstream);
+  struct FrameHeaderOffsets offsets;
+  CHECK(PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+  CHECK(bitstream.size >= 16);
+  bitstream.data = buffer + 2;
+  bitstream.size -= 16;
+  CHECK(SameBytes(&bitstream, kExpected, LENGTH(kExpected)));
+  CHECK(offsets.byte_offset_frame_hdr_obu_size == 3);
+  CHECK(offsets.size_in_bits_frame_hdr_obu == LENGTH(kExpected) * 8);
+  // Delimiter, obu header with four byte size, 19 bits of header before it.
+  CHECK(offsets.bit_offset_qindex == 16 + 40 + 19);
+  CHECK(offsets.bit_offset_segmentation == offsets.bit_offset_qindex + 12);
+  CHECK(offsets.bit_offset_loopfilter_params ==
+        offsets.bit_offset_segmentation + 2);
+}
+
+static void TestInterFrameHeader(void) {
+  static const uint8_t kExpected[] = {
+      0x1a, 0x90, 0x80, 0x80, 0x00, 0x30, 0x02, 0x00, 0x80, 0x00, 0x00,
+      0x01, 0x20, 0x00, 0x3c, 0xf3, 0xcf, 0x08, 0x00, 0x08, 0x02,
+  };
+  VAEncSequenceParameterBufferAV1 seq;
+  MakeSeq(&seq);
+  VAEncPictureParameterBufferAV1 pic;
+  MakePic(&pic, false);
+  char buffer[256];
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  struct FrameHeaderOffsets offsets;
+  CHECK(PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+  CHECK(SameBytes(&bitstream, kExpected, LENGTH(kExpected)));
+}
+
+static void TestUnsupported(void) {
+  VAEncSequenceParameterBufferAV1 seq;
+  MakeSeq(&seq);
+  VAEncPictureParameterBufferAV1 pic;
+  char buffer[256];
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  struct FrameHeaderOffsets offsets;
+
+  MakePic(&pic, true);
+  pic.segments.seg_flags.bits.segmentation_enabled = 1;
+  CHECK(!PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+
+  seq.seq_fields.bits.enable_superres = 1;
+  MakePic(&pic, true);
+  pic.picture_flags.bits.use_superres = 1;
+  CHECK(!PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+
+  MakeSeq(&seq);
+  seq.seq_fields.bits.enable_restoration = 1;
+  MakePic(&pic, true);
+  CHECK(!PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+
+  MakeSeq(&seq);
+  MakePic(&pic, false);
+  pic.mode_control_flags.bits.reference_mode = 1;
+  CHECK(!PackFrameHeaderObu(&bitstream, &seq, &pic, &offsets));
+}
+
+int main(void) {
+  TestTileInfo();
+  TestTemporalDelimiter();
+  TestSequenceHeader();
+  TestKeyFrameHeader();
+  TestInterFrameHeader();
+  TestUnsupported();
+  return g_failed ? 1 : 0;
+}
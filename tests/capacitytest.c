@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capacity.h"
+
+// Rates are picked so that a 30 fps session costs a quarter of the device,
+// and the default budget of 0.9 fits three of them with room for a fourth
+// at 18 fps. Other processes are forked children sharing the registry file,
+// which is created in the working directory.
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define DEVICE "/dev/dri/renderD128"
+#define REGISTRY "capacitytest.sessions"
+#define CALIBRATION "capacitytest.txt"
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+static const struct CapacityKey kKey = {.entrypoint = 1, .preset = 2};
+static const struct CapacityKey kOtherKey = {.entrypoint = 1, .preset = 3};
+
+static bool Near(double a, double b) { return fabs(a - b) < 1e-6; }
+
+static struct CapacityModel* CreateModel(bool shared) {
+  struct CapacityModel* capacity_model = CapacityModelCreate(DEVICE);
+  if (!capacity_model) return NULL;
+  CapacityModelSetRate(capacity_model, &kKey, (double)WIDTH * HEIGHT * 120);
+  if (shared && !CapacityModelShare(capacity_model, REGISTRY)) {
+    CapacityModelDestroy(capacity_model);
+    return NULL;
+  }
+  return capacity_model;
+}
+
+static enum CapacityVerdict Admit(struct CapacityModel* capacity_model,
+                                  const struct CapacityKey* key,
+                                  double min_fps, double* fps,
+                                  uint64_t* ticket) {
+  *fps = 30;
+  return CapacityModelAdmit(capacity_model, key, WIDTH, HEIGHT, min_fps, fps,
+                            ticket);
+}
+
+static void TestAdmit(void) {
+  struct CapacityModel* capacity_model = CreateModel(false);
+  if (!capacity_model) {
+    g_failed = true;
+    return;
+  }
+  double fps;
+  uint64_t tickets[5] = {0};
+  for (size_t i = 0; i < 3; i++) {
+    CHECK(Admit(capacity_model, &kKey, 15, &fps, &tickets[i]) ==
+          kCapacityAdmitted);
+    CHECK(fps == 30);
+    CHECK(tickets[i]);
+  }
+
+  // The fourth session only fits at a lower rate, and a fifth one would not
+  // reach the minimum.
+  CHECK(Admit(capacity_model, &kKey, 20, &fps, &tickets[3]) ==
+        kCapacityRejected);
+  CHECK(Admit(capacity_model, &kKey, 0, &fps, &tickets[3]) ==
+        kCapacityRejected);
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &tickets[3]) ==
+        kCapacityDowngraded);
+  CHECK(Near(fps, 18));
+  CHECK(Admit(capacity_model, &kKey, 1, &fps, &tickets[4]) ==
+        kCapacityRejected);
+  CHECK(fps == 30);
+
+  struct CapacityLoad load;
+  CapacityModelGetLoad(capacity_model, &load);
+  CHECK(load.sessions == 4);
+  CHECK(Near(load.budget, 0.9));
+  CHECK(Near(load.used, 0.9));
+
+  // Uncalibrated sessions are admitted without being accounted for.
+  CHECK(Admit(capacity_model, &kOtherKey, 15, &fps, &tickets[4]) ==
+        kCapacityAdmitted);
+  CHECK(fps == 30);
+  CapacityModelRelease(capacity_model, tickets[4]);
+
+  // Released sessions make room again.
+  CapacityModelRelease(capacity_model, tickets[0]);
+  CapacityModelRelease(capacity_model, tickets[3]);
+  CapacityModelGetLoad(capacity_model, &load);
+  CHECK(load.sessions == 2);
+  CHECK(Near(load.used, 0.5));
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &tickets[0]) ==
+        kCapacityAdmitted);
+  CHECK(fps == 30);
+  CapacityModelDestroy(capacity_model);
+}
+
+static void TestSaveLoad(void) {
+  struct CapacityModel* saved = CreateModel(false);
+  struct CapacityModel* loaded = CapacityModelCreate(DEVICE);
+  struct CapacityModel* other = CapacityModelCreate("/dev/dri/renderD129");
+  if (!saved || !loaded || !other) {
+    g_failed = true;
+    goto rollback;
+  }
+  CHECK(CapacityModelSave(saved, CALIBRATION));
+  CHECK(CapacityModelLoad(loaded, CALIBRATION));
+  CHECK(CapacityModelLoad(other, CALIBRATION));
+  unlink(CALIBRATION);
+
+  // Calibration only applies to the device it was taken on.
+  double fps;
+  uint64_t ticket;
+  for (size_t i = 0; i < 3; i++)
+    CHECK(Admit(loaded, &kKey, 15, &fps, &ticket) == kCapacityAdmitted);
+  CHECK(Admit(loaded, &kKey, 15, &fps, &ticket) == kCapacityDowngraded);
+  for (size_t i = 0; i < 4; i++)
+    CHECK(Admit(other, &kKey, 15, &fps, &ticket) == kCapacityAdmitted);
+
+rollback:
+  if (other) CapacityModelDestroy(other);
+  if (loaded) CapacityModelDestroy(loaded);
+  if (saved) CapacityModelDestroy(saved);
+}
+
+// Child admits two sessions, reports the verdicts and holds them until the
+// parent closes the pipe.
+static void RunChild(int report, int hold) {
+  struct CapacityModel* capacity_model = CreateModel(true);
+  char verdicts[2] = {-1, -1};
+  double fps;
+  uint64_t ticket;
+  for (size_t i = 0; capacity_model && i < 2; i++)
+    verdicts[i] = (char)Admit(capacity_model, &kKey, 15, &fps, &ticket);
+  if (write(report, verdicts, sizeof(verdicts)) != sizeof(verdicts))
+    _exit(1);
+  char byte;
+  while (read(hold, &byte, 1) > 0) continue;
+  _exit(0);
+}
+
+static void TestShared(void) {
+  unlink(REGISTRY);
+  int report[2], hold[2];
+  if (pipe(report) || pipe(hold)) {
+    g_failed = true;
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    g_failed = true;
+    return;
+  }
+  if (!pid) {
+    close(report[0]);
+    close(hold[1]);
+    RunChild(report[1], hold[0]);
+  }
+  close(report[1]);
+  close(hold[0]);
+
+  char verdicts[2] = {-1, -1};
+  CHECK(read(report[0], verdicts, sizeof(verdicts)) == sizeof(verdicts));
+  CHECK(verdicts[0] == kCapacityAdmitted);
+  CHECK(verdicts[1] == kCapacityAdmitted);
+  close(report[0]);
+
+  // Sessions of the child count against the same device.
+  struct CapacityModel* capacity_model = CreateModel(true);
+  if (!capacity_model) {
+    g_failed = true;
+    close(hold[1]);
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  struct CapacityLoad load;
+  CapacityModelGetLoad(capacity_model, &load);
+  CHECK(load.sessions == 2);
+  CHECK(Near(load.used, 0.5));
+  double fps;
+  uint64_t ticket;
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &ticket) == kCapacityAdmitted);
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &ticket) ==
+        kCapacityDowngraded);
+  CHECK(Near(fps, 18));
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &ticket) == kCapacityRejected);
+
+  // Sessions of exited processes no longer count.
+  close(hold[1]);
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && !WEXITSTATUS(status));
+  CapacityModelGetLoad(capacity_model, &load);
+  CHECK(load.sessions == 2);
+  CHECK(Near(load.used, 0.4));
+  CHECK(Admit(capacity_model, &kKey, 15, &fps, &ticket) == kCapacityAdmitted);
+  CHECK(fps == 30);
+  CapacityModelDestroy(capacity_model);
+  unlink(REGISTRY);
+}
+
+int main(void) {
+  TestAdmit();
+  TestSaveLoad();
+  TestShared();
+  return g_failed ? 1 : 0;
+}
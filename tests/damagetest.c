@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "damage.h"
+
+// Targets and cursor images are only compared by address, so any distinct
+// objects do.
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+static bool Equal(const struct GpuRect* a, int32_t x, int32_t y,
+                  uint32_t width, uint32_t height) {
+  return a->x == x && a->y == y && a->width == width && a->height == height;
+}
+
+static void TestClip(void) {
+  struct GpuRect result;
+  CHECK(DamageClipRect(&(struct GpuRect){-8, -4, 16, 16}, 64, 32, &result));
+  CHECK(Equal(&result, 0, 0, 8, 12));
+  CHECK(DamageClipRect(&(struct GpuRect){60, 30, 16, 16}, 64, 32, &result));
+  CHECK(Equal(&result, 60, 30, 4, 2));
+  CHECK(DamageClipRect(&(struct GpuRect){-8, -8, 128, 128}, 64, 32, &result));
+  CHECK(Equal(&result, 0, 0, 64, 32));
+  CHECK(!DamageClipRect(&(struct GpuRect){64, 0, 16, 16}, 64, 32, &result));
+  CHECK(!DamageClipRect(&(struct GpuRect){-16, 0, 16, 16}, 64, 32, &result));
+  CHECK(!DamageClipRect(&(struct GpuRect){8, 8, 0, 16}, 64, 32, &result));
+  // Far out coordinates must not wrap around into the frame.
+  CHECK(!DamageClipRect(&(struct GpuRect){INT32_MAX, 0, UINT32_MAX, 16}, 64,
+                        32, &result));
+}
+
+static void TestAccumulate(void) {
+  struct DamageHistory history = {0};
+  struct GpuRect rects[DAMAGE_MAX_RECTS];
+  int a = 0, b = 0;
+
+  // Unknown targets are converted whole, whatever the damage says.
+  const struct GpuRect damage = {8, 8, 4, 4};
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL, &damage,
+                            rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 64, 32));
+  CHECK(DamageHistoryUpdate(&history, &b, 64, 32, NULL, NULL, &damage,
+                            rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 64, 32));
+
+  // Source changed while converting into b, so a is behind there.
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 1);
+  CHECK(Equal(&rects[0], 8, 8, 4, 4));
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 0);
+
+  // Damage of conversions into a still applies to b, and the other way round.
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL,
+                            &(struct GpuRect){0, 0, 4, 4}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 4, 4));
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL,
+                            &(struct GpuRect){60, 28, 8, 8}, rects) == 1);
+  CHECK(Equal(&rects[0], 60, 28, 4, 4));
+  CHECK(DamageHistoryUpdate(&history, &b, 64, 32, NULL, NULL,
+                            &(struct GpuRect){16, 16, 4, 4}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 64, 32));
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 1);
+  CHECK(Equal(&rects[0], 16, 16, 4, 4));
+
+  // Unknown damage redraws everything, so does a size change.
+  CHECK(DamageHistoryUpdate(&history, &a, 64, 32, NULL, NULL, NULL, rects) ==
+        1);
+  CHECK(Equal(&rects[0], 0, 0, 64, 32));
+  CHECK(DamageHistoryUpdate(&history, &a, 32, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 32, 32));
+
+  // Forgotten targets are redrawn whole.
+  DamageHistoryForget(&history, &a);
+  CHECK(DamageHistoryUpdate(&history, &a, 32, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 32, 32));
+}
+
+static void TestEviction(void) {
+  struct DamageHistory history = {0};
+  struct GpuRect rects[DAMAGE_MAX_RECTS];
+  int targets[DAMAGE_MAX_TARGETS + 1] = {0};
+  for (size_t i = 0; i < DAMAGE_MAX_TARGETS + 1; i++) {
+    CHECK(DamageHistoryUpdate(&history, &targets[i], 64, 32, NULL, NULL,
+                              &(struct GpuRect){0}, rects) == 1);
+  }
+  // The least recently used target made room for the last one.
+  CHECK(DamageHistoryUpdate(&history, &targets[DAMAGE_MAX_TARGETS], 64, 32,
+                            NULL, NULL, &(struct GpuRect){0}, rects) == 0);
+  CHECK(DamageHistoryUpdate(&history, &targets[1], 64, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 0);
+  CHECK(DamageHistoryUpdate(&history, &targets[0], 64, 32, NULL, NULL,
+                            &(struct GpuRect){0}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 0, 64, 32));
+}
+
+static void TestCursor(void) {
+  struct DamageHistory history = {0};
+  struct GpuRect rects[DAMAGE_MAX_RECTS];
+  int target = 0, cursor = 0, other = 0;
+  const struct GpuRect none = {0};
+
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){4, 4, 8, 8}, NULL, rects) == 1);
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){4, 4, 8, 8}, &none, rects) == 0);
+
+  // Moving the cursor redraws where it was and where it is, along with the
+  // damage, but far apart rects stay separate.
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){40, 40, 8, 8},
+                            &(struct GpuRect){0, 48, 16, 16}, rects) == 3);
+  CHECK(Equal(&rects[0], 0, 48, 16, 16));
+  CHECK(Equal(&rects[1], 4, 4, 8, 8));
+  CHECK(Equal(&rects[2], 40, 40, 8, 8));
+
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){8, 8, 8, 8}, &none, rects) == 2);
+  CHECK(Equal(&rects[0], 40, 40, 8, 8));
+  CHECK(Equal(&rects[1], 8, 8, 8, 8));
+
+  // Overlapping rects are merged, and merging one might make it overlap
+  // another.
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){2, 10, 8, 8},
+                            &(struct GpuRect){0, 6, 4, 4}, rects) == 1);
+  CHECK(Equal(&rects[0], 0, 6, 16, 12));
+
+  // Rects are clipped to the frame.
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &cursor,
+                            &(struct GpuRect){60, -4, 8, 8}, &none,
+                            rects) == 2);
+  CHECK(Equal(&rects[0], 2, 10, 8, 8));
+  CHECK(Equal(&rects[1], 60, 0, 4, 4));
+
+  // A different image at the same place is a change too, and so is a
+  // forgotten one.
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &other,
+                            &(struct GpuRect){60, -4, 8, 8}, &none,
+                            rects) == 1);
+  CHECK(Equal(&rects[0], 60, 0, 4, 4));
+  DamageHistoryForget(&history, &other);
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, &other,
+                            &(struct GpuRect){60, -4, 8, 8}, &none,
+                            rects) == 1);
+  CHECK(Equal(&rects[0], 60, 0, 4, 4));
+
+  // Hiding the cursor redraws where it was.
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, NULL, NULL, &none,
+                            rects) == 1);
+  CHECK(Equal(&rects[0], 60, 0, 4, 4));
+  CHECK(DamageHistoryUpdate(&history, &target, 64, 64, NULL, NULL, &none,
+                            rects) == 0);
+}
+
+int main(void) {
+  TestClip();
+  TestAccumulate();
+  TestEviction();
+  TestCursor();
+  return g_failed ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fade.h"
+
+// Every kernel is checked against plain sums, then weights are estimated for
+// synthetic fades with known brightness and contrast changes.
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+#define WIDTH 333
+#define HEIGHT 37
+#define STRIDE 352
+
+static uint32_t g_random = 1;
+
+static uint32_t Random(void) {
+  g_random = g_random * 1103515245 + 12345;
+  return g_random >> 1;
+}
+
+static bool SameStats(const struct FadePlaneStats* a,
+                      const struct FadePlaneStats* b) {
+  return a->count == b->count && a->sum == b->sum && a->squares == b->squares;
+}
+
+// Odd width and stride exercise the kernel tails, samples past the width must
+// not be counted.
+static void TestKernels(void) {
+  static uint8_t plane[HEIGHT][STRIDE];
+  struct FadePlaneStats planar = {0}, even = {0}, odd = {0};
+  for (size_t y = 0; y < HEIGHT; y++) {
+    for (size_t x = 0; x < STRIDE; x++) {
+      uint8_t sample = (uint8_t)Random();
+      plane[y][x] = sample;
+      if (x >= WIDTH) continue;
+      planar.count++;
+      planar.sum += sample;
+      planar.squares += (uint64_t)sample * sample;
+      if (x >= WIDTH / 2 * 2) continue;
+      struct FadePlaneStats* stats = x % 2 ? &odd : &even;
+      stats->count++;
+      stats->sum += sample;
+      stats->squares += (uint64_t)sample * sample;
+    }
+  }
+
+  static const enum FadeKernel kernels[] = {
+      kFadeKernelScalar,
+      kFadeKernelSse2,
+      kFadeKernelAvx2,
+  };
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+    if (!FadeSetKernel(kernels[i])) {
+      fprintf(stderr, "Skipping fade kernel %d\n", kernels[i]);
+      continue;
+    }
+    struct FadePlaneStats stats = {0};
+    FadeStatsAddPlane(&stats, plane, STRIDE, WIDTH, HEIGHT);
+    CHECK(SameStats(&stats, &planar));
+    struct FadePlaneStats first = {0}, second = {0};
+    FadeStatsAddInterleaved(&first, &second, plane, STRIDE, WIDTH / 2, HEIGHT);
+    CHECK(SameStats(&first, &even));
+    CHECK(SameStats(&second, &odd));
+  }
+  FadeSetKernel(kFadeKernelScalar);
+}
+
+// Luma of the current frame is the reference scaled by scale and shifted by
+// shift, chroma is flat in both.
+static void MakeFade(struct FadeStats* current, struct FadeStats* reference,
+                     double scale, double shift) {
+  static uint8_t luma[2][HEIGHT][STRIDE];
+  static uint8_t chroma[HEIGHT / 2][STRIDE / 2];
+  for (size_t y = 0; y < HEIGHT; y++) {
+    for (size_t x = 0; x < STRIDE; x++) {
+      uint8_t sample = (uint8_t)(32 + (x * 7 + y * 13) % 160);
+      luma[0][y][x] = (uint8_t)lround(sample * scale + shift);
+      luma[1][y][x] = sample;
+    }
+  }
+  for (size_t y = 0; y < HEIGHT / 2; y++) {
+    for (size_t x = 0; x < STRIDE / 2; x++) chroma[y][x] = 128;
+  }
+  struct FadeStats* stats[] = {current, reference};
+  for (size_t i = 0; i < 2; i++) {
+    *stats[i] = (struct FadeStats){0};
+    FadeStatsAddPlane(&stats[i]->planes[0], luma[i], STRIDE, WIDTH, HEIGHT);
+    for (size_t j = 1; j < 3; j++) {
+      FadeStatsAddPlane(&stats[i]->planes[j], chroma, STRIDE / 2, WIDTH / 2,
+                        HEIGHT / 2);
+    }
+  }
+}
+
+static void CheckIdentityChroma(const struct FadeWeights* weights) {
+  for (size_t i = 1; i < 3; i++) {
+    CHECK(weights->weights[i] == 1 << FADE_LOG2_WEIGHT_DENOM);
+    CHECK(weights->offsets[i] == 0);
+  }
+}
+
+static void TestWeights(void) {
+  struct FadeStats current, reference;
+  struct FadeWeights weights;
+
+  // Fade to black at three quarters of the contrast, plus a lift that keeps
+  // the offset away from zero.
+  MakeFade(&current, &reference, 0.75, 10);
+  CHECK(FadeEstimateWeights(&current, &reference, &weights));
+  CHECK(weights.log2_denom == FADE_LOG2_WEIGHT_DENOM);
+  CHECK(abs(weights.weights[0] - 48) <= 1);
+  CHECK(abs(weights.offsets[0] - 10) <= 1);
+  CheckIdentityChroma(&weights);
+
+  // Brightening without a contrast change only takes an offset.
+  MakeFade(&current, &reference, 1, 24);
+  CHECK(FadeEstimateWeights(&current, &reference, &weights));
+  CHECK(weights.weights[0] == 1 << FADE_LOG2_WEIGHT_DENOM);
+  CHECK(weights.offsets[0] == 24);
+  CheckIdentityChroma(&weights);
+
+  // Same frame, nothing to weight.
+  MakeFade(&current, &reference, 1, 0);
+  CHECK(!FadeEstimateWeights(&current, &reference, &weights));
+  CHECK(weights.weights[0] == 1 << FADE_LOG2_WEIGHT_DENOM);
+  CHECK(weights.offsets[0] == 0);
+  CheckIdentityChroma(&weights);
+}
+
+int main(void) {
+  TestKernels();
+  TestWeights();
+  return g_failed ? 1 : 0;
+}
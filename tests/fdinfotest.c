@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fdinfo.h"
+
+// Fixtures follow the fdinfo output of the i915 and xe drivers. Each pair is
+// two samples of the same client, the i915 ones taken one second apart.
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+static bool ParseFixture(const char* dir, const char* name,
+                         struct DrmFdinfo* fdinfo) {
+  *fdinfo = (struct DrmFdinfo){0};
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    g_failed = true;
+    return false;
+  }
+  char text[4096];
+  size_t size = fread(text, 1, sizeof(text), file);
+  fclose(file);
+  return DrmFdinfoParse(text, size, fdinfo);
+}
+
+static bool Near(double a, double b) { return fabs(a - b) < 1e-9; }
+
+static void TestI915(const char* dir) {
+  struct DrmFdinfo prev, next;
+  CHECK(ParseFixture(dir, "fdinfo-i915-0.txt", &prev));
+  CHECK(ParseFixture(dir, "fdinfo-i915-1.txt", &next));
+  CHECK(prev.client_id == 42);
+
+  const struct DrmFdinfoEngine* render = &prev.engines[kDrmEngineRender];
+  CHECK(render->present && !render->cycles);
+  CHECK(render->busy == 2317584103);
+  CHECK(render->capacity == 1);
+  const struct DrmFdinfoEngine* video = &prev.engines[kDrmEngineVideo];
+  CHECK(video->present && video->busy == 8837715920);
+  CHECK(video->capacity == 2);
+  CHECK(prev.engines[kDrmEngineVideoEnhance].present);
+  CHECK(!prev.engines[kDrmEngineCompute].present);
+
+  prev.timestamp_ns = 1000000000;
+  next.timestamp_ns = 2000000000;
+  double utilization[kDrmEngineCount];
+  DrmFdinfoUtilization(&prev, &next, utilization);
+  CHECK(Near(utilization[kDrmEngineRender], 0.1));
+  CHECK(Near(utilization[kDrmEngineVideo], 0.45));
+  CHECK(Near(utilization[kDrmEngineCopy], 0));
+  CHECK(Near(utilization[kDrmEngineCompute], 0));
+}
+
+static void TestXe(const char* dir) {
+  struct DrmFdinfo prev, next;
+  CHECK(ParseFixture(dir, "fdinfo-xe-0.txt", &prev));
+  CHECK(ParseFixture(dir, "fdinfo-xe-1.txt", &next));
+  CHECK(prev.client_id == 19);
+
+  const struct DrmFdinfoEngine* render = &prev.engines[kDrmEngineRender];
+  CHECK(render->present && render->cycles);
+  CHECK(render->busy == 28257900);
+  CHECK(render->total == 7655183225);
+  CHECK(prev.engines[kDrmEngineVideo].capacity == 2);
+  CHECK(prev.engines[kDrmEngineVideoEnhance].capacity == 2);
+  CHECK(prev.engines[kDrmEngineCompute].present);
+
+  // Cycles carry their own time base, sampling timestamps do not matter.
+  double utilization[kDrmEngineCount];
+  DrmFdinfoUtilization(&prev, &next, utilization);
+  CHECK(Near(utilization[kDrmEngineRender], 0.5));
+  CHECK(Near(utilization[kDrmEngineVideo], 0.25));
+  CHECK(Near(utilization[kDrmEngineCopy], 0));
+}
+
+static void TestMalformed(void) {
+  static const char kNotDrm[] = "pos:\t0\nflags:\t02\nmnt_id:\t24\n";
+  struct DrmFdinfo fdinfo;
+  CHECK(!DrmFdinfoParse(kNotDrm, sizeof(kNotDrm) - 1, &fdinfo));
+
+  // Truncated reads end mid-line, the last complete value still counts.
+  static const char kTruncated[] =
+      "drm-client-id:\t7\ndrm-engine-render:\t100 ns\ndrm-engine-vid";
+  CHECK(DrmFdinfoParse(kTruncated, sizeof(kTruncated) - 1, &fdinfo));
+  CHECK(fdinfo.client_id == 7);
+  CHECK(fdinfo.engines[kDrmEngineRender].busy == 100);
+  CHECK(!fdinfo.engines[kDrmEngineVideo].present);
+
+  // Counters going backwards, e.g. after a client id reuse, are ignored.
+  struct DrmFdinfo prev = {.timestamp_ns = 0};
+  struct DrmFdinfo next = {.timestamp_ns = 1000};
+  prev.engines[kDrmEngineVideo] =
+      (struct DrmFdinfoEngine){.present = true, .busy = 500, .capacity = 1};
+  next.engines[kDrmEngineVideo] =
+      (struct DrmFdinfoEngine){.present = true, .busy = 100, .capacity = 1};
+  double utilization[kDrmEngineCount];
+  DrmFdinfoUtilization(&prev, &next, utilization);
+  CHECK(Near(utilization[kDrmEngineVideo], 0));
+}
+
+int main(int argc, char* argv[]) {
+  const char* dir = argc > 1 ? argv[1] : ".";
+  TestI915(dir);
+  TestXe(dir);
+  TestMalformed();
+  return g_failed ? 1 : 0;
+}
@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <va/va.h>
+
+#include "bitstream.h"
+#include "decode.h"
+#include "hevc.h"
+#include "hevcparse.h"
+
+// Everything the hevc packers emit is read back with the word-based reader
+// and compared with what went in. The same packers then produce a stream for
+// the stand-in decoder, which needs no gpu.
+
+static bool g_failed;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+#ifndef LENGTH
+#define LENGTH(x) (sizeof(x) / sizeof *(x))
+#endif
+
+static uint32_t g_random = 1;
+
+static uint32_t Random(void) {
+  g_random = g_random * 1103515245 + 12345;
+  return g_random >> 1;
+}
+
+enum FieldKind {
+  kFieldFixed,
+  kFieldUE,
+  kFieldSE,
+};
+
+struct Field {
+  enum FieldKind kind;
+  size_t size;
+  uint32_t value;
+};
+
+static void TestFields(void) {
+  // Field count and sizes are picked so that the stream does not end on a
+  // byte boundary, and the reader goes through its bytewise tail path.
+  static struct Field fields[4096];
+  static uint8_t buffer[65536];
+  memset(buffer, 0, sizeof(buffer));
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  for (size_t i = 0; i < LENGTH(fields); i++) {
+    struct Field* field = &fields[i];
+    field->kind = (enum FieldKind)(Random() % 3);
+    uint32_t magnitude = Random() % 31;
+    field->value = Random() & ((1u << magnitude) - 1);
+    switch (field->kind) {
+      case kFieldFixed:
+        field->size = 1 + Random() % 32;
+        if (field->size < 32) field->value &= (1u << field->size) - 1;
+        BitstreamAppend(&bitstream, field->size, field->value);
+        break;
+      case kFieldUE:
+        BitstreamAppendUE(&bitstream, field->value);
+        break;
+      case kFieldSE:
+        field->value >>= 1;
+        if (Random() & 1) field->value = -field->value;
+        BitstreamAppendSE(&bitstream, (int32_t)field->value);
+        break;
+    }
+  }
+  BitstreamAppend(&bitstream, 3, 5);
+
+  struct BitstreamReader reader = {
+      .data = buffer,
+      .size = bitstream.size,
+      .offset = 0,
+  };
+  size_t mismatches = 0;
+  for (size_t i = 0; i < LENGTH(fields); i++) {
+    const struct Field* field = &fields[i];
+    uint32_t value = 0;
+    switch (field->kind) {
+      case kFieldFixed:
+        value = BitstreamRead(&reader, field->size);
+        break;
+      case kFieldUE:
+        value = BitstreamReadUE(&reader);
+        break;
+      case kFieldSE:
+        value = (uint32_t)BitstreamReadSE(&reader);
+        break;
+    }
+    mismatches += value != field->value;
+  }
+  CHECK(mismatches == 0);
+  CHECK(BitstreamRead(&reader, 3) == 5);
+  CHECK(!BitstreamExhausted(&reader));
+  CHECK(BitstreamRead(&reader, 32) == 0);
+  CHECK(BitstreamReadUE(&reader) == 0);
+  CHECK(BitstreamExhausted(&reader));
+}
+
+static void TestShortFields(void) {
+  // Every offset of a short stream goes through the bytewise path.
+  static const uint8_t kData[] = {0xa5, 0x0f, 0x81};
+  for (size_t offset = 0; offset < 24; offset++) {
+    struct BitstreamReader reader = {
+        .data = kData,
+        .size = 21,
+        .offset = offset,
+    };
+    uint32_t expected = 0;
+    for (size_t i = offset; i < 21 && i < offset + 8; i++)
+      expected |= (uint32_t)((kData[i / 8] >> (7 - i % 8)) & 1)
+                  << (7 - (i - offset));
+    CHECK(BitstreamRead(&reader, 8) == expected);
+  }
+}
+
+// Strips the start code and emulation prevention, and positions the reader
+// right after the nal unit header the way the decoder does.
+static uint8_t Unescape(const struct Bitstream* nal_unit, uint8_t* rbsp,
+                        struct BitstreamReader* reader) {
+  const uint8_t* data = nal_unit->data;
+  CHECK(nal_unit->size % 8 == 0);
+  CHECK(!data[0] && !data[1] && !data[2] && data[3] == 1);
+  const struct Bitstream source = {
+      .data = (void*)(uintptr_t)(data + 4),
+      .size = nal_unit->size - 32,
+  };
+  struct Bitstream bitstream = {.data = rbsp, .size = 0};
+  BitstreamDeflate(&bitstream, &source);
+  *reader = (struct BitstreamReader){
+      .data = rbsp,
+      .size = bitstream.size,
+      .offset = 16,
+  };
+  return rbsp[0] >> 1 & 0x3f;
+}
+
+static void MakeParameters(VAEncSequenceParameterBufferHEVC* seq,
+                           VAEncPictureParameterBufferHEVC* pic) {
+  *seq = (VAEncSequenceParameterBufferHEVC){
+      .general_profile_idc = 1,
+      .general_level_idc = 120,
+      .intra_period = 120,
+      .intra_idr_period = 120,
+      .ip_period = 1,
+      .pic_width_in_luma_samples = 1920,
+      .pic_height_in_luma_samples = 1088,
+      .seq_fields.bits =
+          {
+              .chroma_format_idc = 1,
+              .amp_enabled_flag = 1,
+              .sample_adaptive_offset_enabled_flag = 1,
+              .sps_temporal_mvp_enabled_flag = 1,
+              .low_delay_seq = 1,
+          },
+      .log2_min_luma_coding_block_size_minus3 = 0,
+      .log2_diff_max_min_luma_coding_block_size = 3,
+      .log2_min_transform_block_size_minus2 = 0,
+      .log2_diff_max_min_transform_block_size = 3,
+      .max_transform_hierarchy_depth_inter = 2,
+      .max_transform_hierarchy_depth_intra = 2,
+      .vui_parameters_present_flag = 1,
+      .vui_fields.bits =
+          {
+              .vui_timing_info_present_flag = 1,
+              .bitstream_restriction_flag = 1,
+              .motion_vectors_over_pic_boundaries_flag = 1,
+              .restricted_ref_pic_lists_flag = 1,
+              .log2_max_mv_length_horizontal = 15,
+              .log2_max_mv_length_vertical = 15,
+          },
+      .vui_num_units_in_tick = 1,
+      .vui_time_scale = 60,
+  };
+  *pic = (VAEncPictureParameterBufferHEVC){
+      .collocated_ref_pic_index = 0,
+      .pic_init_qp = 30,
+      .pps_cb_qp_offset = -2,
+      .pps_cr_qp_offset = 3,
+      .pic_fields.bits =
+          {
+              .reference_pic_flag = 1,
+              .transform_skip_enabled_flag = 1,
+              .weighted_pred_flag = 1,
+              .pps_loop_filter_across_slices_enabled_flag = 1,
+          },
+  };
+}
+
+static void TestParameterSets(void) {
+  VAEncSequenceParameterBufferHEVC seq;
+  VAEncPictureParameterBufferHEVC pic;
+  MakeParameters(&seq, &pic);
+  uint8_t buffer[256];
+  uint8_t rbsp[256];
+  struct BitstreamReader reader;
+
+  const struct MoreVideoParameters mvp = {
+      .vps_max_dec_pic_buffering_minus1 = 1,
+      .vps_max_num_reorder_pics = 0,
+  };
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  PackVideoParameterSetNalUnit(&bitstream, &seq, &mvp);
+  CHECK(Unescape(&bitstream, rbsp, &reader) == VPS_NUT);
+  struct VideoParameterSet vps;
+  CHECK(ParseVideoParameterSet(&reader, &vps));
+  CHECK(!BitstreamExhausted(&reader));
+  CHECK(vps.general_profile_idc == 1 && vps.general_level_idc == 120);
+  CHECK(vps.vps_max_dec_pic_buffering_minus1 == 1);
+  CHECK(vps.vps_max_num_reorder_pics == 0);
+  CHECK(vps.vps_timing_info_present_flag);
+  CHECK(vps.vps_num_units_in_tick == 1 && vps.vps_time_scale == 60);
+
+  const struct MoreSeqParameters msp = {
+      .conf_win_bottom_offset = 4,
+      .sps_max_dec_pic_buffering_minus1 = 1,
+      .video_signal_type_present_flag = 1,
+      .video_full_range_flag = 1,
+      .colour_description_present_flag = 1,
+      .colour_primaries = 1,
+      .transfer_characteristics = 13,
+      .matrix_coeffs = 6,
+      .chroma_loc_info_present_flag = 1,
+      .chroma_sample_loc_type_top_field = 2,
+      .chroma_sample_loc_type_bottom_field = 3,
+  };
+  bitstream.size = 0;
+  PackSeqParameterSetNalUnit(&bitstream, &seq, &msp);
+  CHECK(Unescape(&bitstream, rbsp, &reader) == SPS_NUT);
+  struct SeqParameterSet sps;
+  CHECK(ParseSeqParameterSet(&reader, &sps));
+  CHECK(!BitstreamExhausted(&reader));
+  CHECK(sps.chroma_format_idc == 1);
+  CHECK(sps.pic_width_in_luma_samples == 1920);
+  CHECK(sps.pic_height_in_luma_samples == 1088);
+  CHECK(sps.conf_win_bottom_offset == 4 && !sps.conf_win_top_offset);
+  CHECK(sps.sps_max_dec_pic_buffering_minus1 == 1);
+  CHECK(sps.log2_diff_max_min_luma_coding_block_size == 3);
+  CHECK(sps.log2_diff_max_min_luma_transform_block_size == 3);
+  CHECK(sps.max_transform_hierarchy_depth_inter == 2);
+  CHECK(sps.amp_enabled_flag && sps.sample_adaptive_offset_enabled_flag);
+  CHECK(!sps.pcm_enabled_flag && !sps.long_term_ref_pics_present_flag);
+  CHECK(sps.sps_temporal_mvp_enabled_flag);
+  CHECK(sps.vui_parameters_present_flag);
+  CHECK(sps.video_signal_type_present_flag && sps.video_full_range_flag);
+  CHECK(sps.colour_primaries == 1 && sps.transfer_characteristics == 13 &&
+        sps.matrix_coeffs == 6);
+  CHECK(sps.chroma_sample_loc_type_top_field == 2);
+  CHECK(sps.chroma_sample_loc_type_bottom_field == 3);
+  CHECK(sps.vui_timing_info_present_flag);
+  CHECK(sps.vui_num_units_in_tick == 1 && sps.vui_time_scale == 60);
+
+  bitstream.size = 0;
+  PackPicParameterSetNalUnit(&bitstream, &pic);
+  CHECK(Unescape(&bitstream, rbsp, &reader) == PPS_NUT);
+  struct PicParameterSet pps;
+  CHECK(ParsePicParameterSet(&reader, &pps));
+  CHECK(!BitstreamExhausted(&reader));
+  CHECK(pps.init_qp_minus26 == 4);
+  CHECK(pps.pps_cb_qp_offset == -2 && pps.pps_cr_qp_offset == 3);
+  CHECK(pps.transform_skip_enabled_flag && pps.weighted_pred_flag);
+  CHECK(!pps.weighted_bipred_flag && !pps.tiles_enabled_flag);
+  CHECK(pps.pps_loop_filter_across_slices_enabled_flag);
+}
+
+static void TestSliceHeaders(void) {
+  VAEncSequenceParameterBufferHEVC seq;
+  VAEncPictureParameterBufferHEVC pic;
+  MakeParameters(&seq, &pic);
+  uint8_t buffer[256];
+  uint8_t rbsp[256];
+  struct BitstreamReader reader;
+
+  const struct MoreSeqParameters msp = {0};
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  PackSeqParameterSetNalUnit(&bitstream, &seq, &msp);
+  Unescape(&bitstream, rbsp, &reader);
+  struct SeqParameterSet sps;
+  CHECK(ParseSeqParameterSet(&reader, &sps));
+  bitstream.size = 0;
+  PackPicParameterSetNalUnit(&bitstream, &pic);
+  Unescape(&bitstream, rbsp, &reader);
+  struct PicParameterSet pps;
+  CHECK(ParsePicParameterSet(&reader, &pps));
+  const struct ParameterSets parameter_sets = {
+      .sps = {&sps},
+      .pps = {&pps},
+  };
+
+  VAEncSliceParameterBufferHEVC slice = {
+      .slice_type = I,
+      .max_num_merge_cand = 5,
+      .slice_qp_delta = -3,
+      .slice_fields.bits =
+          {
+              .slice_temporal_mvp_enabled_flag = 1,
+              .slice_sao_luma_flag = 1,
+              .slice_sao_chroma_flag = 0,
+          },
+  };
+  pic.nal_unit_type = IDR_W_RADL;
+  const struct MoreSliceParamerters idr_msp = {
+      .first_slice_segment_in_pic_flag = 1,
+  };
+  struct SliceHeaderOffsets offsets;
+  bitstream.size = 0;
+  PackSliceSegmentHeaderNalUnit(&bitstream, &seq, &pic, &slice, &idr_msp,
+                                &offsets);
+  CHECK(offsets.pred_weight_table_bit_length == 0);
+  CHECK(Unescape(&bitstream, rbsp, &reader) == IDR_W_RADL);
+  struct SliceSegmentHeader header;
+  CHECK(ParseSliceSegmentHeader(&reader, IDR_W_RADL, &parameter_sets,
+                                &header));
+  CHECK(header.first_slice_segment_in_pic_flag);
+  CHECK(header.slice_type == I);
+  CHECK(header.slice_qp_delta == -3);
+  CHECK(header.slice_sao_luma_flag && !header.slice_sao_chroma_flag);
+  CHECK(header.num_pic_total_curr == 0);
+  CHECK(header.header_size * 8 == reader.offset - 16);
+
+  // P slice referring to the previous picture, with explicit weights.
+  pic.nal_unit_type = TRAIL_R;
+  pic.decoded_curr_pic.pic_order_cnt = 5;
+  slice.slice_type = P;
+  slice.slice_qp_delta = 2;
+  slice.luma_log2_weight_denom = 6;
+  slice.delta_chroma_log2_weight_denom = -1;
+  slice.ref_pic_list0[0].pic_order_cnt = 4;
+  slice.delta_luma_weight_l0[0] = -7;
+  slice.luma_offset_l0[0] = 12;
+  slice.delta_chroma_weight_l0[0][0] = 3;
+  slice.chroma_offset_l0[0][0] = -5;
+  slice.delta_chroma_weight_l0[0][1] = 0;
+  slice.chroma_offset_l0[0][1] = 9;
+  const struct NegativePics negative_pics[] = {
+      {.delta_poc_s0_minus1 = 0, .used_by_curr_pic_s0_flag = 1},
+  };
+  const struct MoreSliceParamerters p_msp = {
+      .first_slice_segment_in_pic_flag = 1,
+      .num_negative_pics = LENGTH(negative_pics),
+      .negative_pics = negative_pics,
+  };
+  bitstream.size = 0;
+  PackSliceSegmentHeaderNalUnit(&bitstream, &seq, &pic, &slice, &p_msp,
+                                &offsets);
+  CHECK(Unescape(&bitstream, rbsp, &reader) == TRAIL_R);
+  CHECK(ParseSliceSegmentHeader(&reader, TRAIL_R, &parameter_sets, &header));
+  CHECK(header.slice_type == P);
+  CHECK(header.slice_pic_order_cnt_lsb == 5);
+  CHECK(header.st_ref_pic_set.num_negative_pics == 1);
+  CHECK(header.st_ref_pic_set.delta_poc_s0[0] == -1);
+  CHECK(header.st_ref_pic_set.used_by_curr_pic_s0[0]);
+  CHECK(header.num_pic_total_curr == 1);
+  CHECK(header.slice_temporal_mvp_enabled_flag);
+  CHECK(header.num_ref_idx_l0_active_minus1 == 0);
+  CHECK(header.luma_log2_weight_denom == 6);
+  CHECK(header.delta_chroma_log2_weight_denom == -1);
+  CHECK(header.delta_luma_weight_l0[0] == -7);
+  CHECK(header.luma_offset_l0[0] == 12);
+  CHECK(header.delta_chroma_weight_l0[0][0] == 3);
+  CHECK(header.chroma_offset_l0[0][0] == -5);
+  CHECK(header.delta_chroma_weight_l0[0][1] == 0);
+  CHECK(header.chroma_offset_l0[0][1] == 9);
+  CHECK(header.five_minus_max_num_merge_cand == 0);
+  CHECK(header.slice_qp_delta == 2);
+  CHECK(header.header_size * 8 == reader.offset - 16);
+
+  // The table is reported in bits from the start of the nal unit header.
+  CHECK(offsets.pred_weight_table_bit_length > 0);
+  struct BitstreamReader table = {
+      .data = rbsp,
+      .size = offsets.pred_weight_table_bit_offset +
+              offsets.pred_weight_table_bit_length,
+      .offset = offsets.pred_weight_table_bit_offset,
+  };
+  CHECK(BitstreamReadUE(&table) == 6);
+  CHECK(BitstreamReadSE(&table) == -1);
+}
+
+#define STREAM_FRAMES 24
+
+// Parameter sets, then an IDR followed by P frames each referring to the
+// previous one. Slice data is filler without start code emulation.
+static size_t PackStream(uint8_t* buffer, size_t frame_offsets[]) {
+  VAEncSequenceParameterBufferHEVC seq;
+  VAEncPictureParameterBufferHEVC pic;
+  MakeParameters(&seq, &pic);
+  pic.pic_fields.bits.weighted_pred_flag = 0;
+  const struct MoreVideoParameters mvp = {
+      .vps_max_dec_pic_buffering_minus1 = 1,
+  };
+  const struct MoreSeqParameters msp = {
+      .conf_win_bottom_offset = 4,
+      .sps_max_dec_pic_buffering_minus1 = 1,
+  };
+  struct Bitstream bitstream = {.data = buffer, .size = 0};
+  PackVideoParameterSetNalUnit(&bitstream, &seq, &mvp);
+  PackSeqParameterSetNalUnit(&bitstream, &seq, &msp);
+  PackPicParameterSetNalUnit(&bitstream, &pic);
+
+  const struct NegativePics negative_pics[] = {
+      {.delta_poc_s0_minus1 = 0, .used_by_curr_pic_s0_flag = 1},
+  };
+  for (size_t i = 0; i < STREAM_FRAMES; i++) {
+    if (i) frame_offsets[i] = bitstream.size / 8;
+    pic.nal_unit_type = i ? TRAIL_R : IDR_W_RADL;
+    pic.decoded_curr_pic.pic_order_cnt = (int32_t)i;
+    const VAEncSliceParameterBufferHEVC slice = {
+        .slice_type = i ? P : I,
+        .max_num_merge_cand = 5,
+        .slice_fields.bits.slice_temporal_mvp_enabled_flag = 1,
+    };
+    const struct MoreSliceParamerters slice_msp = {
+        .first_slice_segment_in_pic_flag = 1,
+        .num_negative_pics = i ? LENGTH(negative_pics) : 0,
+        .negative_pics = negative_pics,
+    };
+    struct SliceHeaderOffsets offsets;
+    PackSliceSegmentHeaderNalUnit(&bitstream, &seq, &pic, &slice, &slice_msp,
+                                  &offsets);
+    for (size_t j = 0; j < 100 + i * 37; j++)
+      BitstreamAppend(&bitstream, 8, 0x11 + (uint32_t)(i + j) % 0xee);
+  }
+  frame_offsets[0] = 0;
+  return bitstream.size / 8;
+}
+
+struct Decoded {
+  size_t count;
+  int32_t pic_order_cnt[STREAM_FRAMES + 1];
+  uint64_t pts[STREAM_FRAMES + 1];
+  bool keyframe[STREAM_FRAMES + 1];
+};
+
+static void Drain(struct DecodeContext* decode_context,
+                  struct Decoded* decoded) {
+  struct DecodedFrame frame;
+  while (DecodeContextAcquire(decode_context, &frame)) {
+    CHECK(frame.crop_width == 1920 && frame.crop_height == 1080);
+    CHECK(!frame.nplanes);
+    if (decoded->count < LENGTH(decoded->pic_order_cnt)) {
+      decoded->pic_order_cnt[decoded->count] = frame.pic_order_cnt;
+      decoded->pts[decoded->count] = frame.pts;
+      decoded->keyframe[decoded->count] = frame.keyframe;
+    }
+    decoded->count++;
+    DecodeContextRelease(decode_context);
+  }
+  CHECK(!DecodeContextFailed(decode_context));
+}
+
+// Pushes the stream in chunks cut at the given offsets, each one with the
+// index of the chunk as pts.
+static void DecodeStream(const uint8_t* stream, const size_t* cuts,
+                         size_t cuts_count, struct Decoded* decoded) {
+  *decoded = (struct Decoded){0};
+  struct DecodeContext* decode_context = DecodeContextCreate(true);
+  CHECK(decode_context);
+  if (!decode_context) return;
+  for (size_t i = 0; i + 1 < cuts_count; i++) {
+    CHECK(DecodeContextPush(decode_context, stream + cuts[i],
+                            cuts[i + 1] - cuts[i], i));
+    Drain(decode_context, decoded);
+  }
+  DecodeContextFlush(decode_context);
+  Drain(decode_context, decoded);
+  DecodeContextDestroy(decode_context);
+}
+
+static void CheckPictureOrder(const struct Decoded* decoded) {
+  CHECK(decoded->count == STREAM_FRAMES);
+  for (size_t i = 0; i < decoded->count && i < STREAM_FRAMES; i++) {
+    CHECK(decoded->pic_order_cnt[i] == (int32_t)i);
+    CHECK(decoded->keyframe[i] == !i);
+  }
+}
+
+static void TestStandinDecode(void) {
+  static uint8_t stream[65536];
+  size_t frame_offsets[STREAM_FRAMES];
+  size_t stream_size = PackStream(stream, frame_offsets);
+  struct Decoded decoded;
+
+  // One push per frame, pts must follow the frames.
+  size_t cuts[STREAM_FRAMES + 1];
+  for (size_t i = 0; i < STREAM_FRAMES; i++) cuts[i] = frame_offsets[i];
+  cuts[STREAM_FRAMES] = stream_size;
+  DecodeStream(stream, cuts, LENGTH(cuts), &decoded);
+  CheckPictureOrder(&decoded);
+  for (size_t i = 0; i < decoded.count && i < STREAM_FRAMES; i++)
+    CHECK(decoded.pts[i] == i);
+
+  // The whole stream in a single push.
+  const size_t whole[] = {0, stream_size};
+  DecodeStream(stream, whole, LENGTH(whole), &decoded);
+  CheckPictureOrder(&decoded);
+
+  // Small pushes splitting start codes and nal units at every position.
+  static size_t dribble[65536];
+  size_t dribble_count = 0;
+  for (size_t offset = 0; offset < stream_size;
+       offset += 1 + dribble_count % 13)
+    dribble[dribble_count++] = offset;
+  dribble[dribble_count++] = stream_size;
+  DecodeStream(stream, dribble, dribble_count, &decoded);
+  CheckPictureOrder(&decoded);
+}
+
+int main(void) {
+  TestFields();
+  TestShortFields();
+  TestParameterSets();
+  TestSliceHeaders();
+  TestStandinDecode();
+  return g_failed ? 1 : 0;
+}
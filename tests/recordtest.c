@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <va/va.h>
+
+#include "bitstream.h"
+#include "cenc.h"
+#include "directio.h"
+#include "encode.h"
+#include "fec.h"
+#include "hevc.h"
+#include "keyindex.h"
+#include "proto.h"
+#include "protoreader.h"
+#include "recorder.h"
+
+// Frames go through the recorder into every output it supports, and are read
+// back with the same parsers receivers use. Files are created in the working
+// directory, since O_DIRECT is not available on every filesystem, e.g. tmpfs.
+// Encrypted records are decrypted by a separate context, as a receiver would.
+
+#define FRAMES 12
+#define FRAME_SIZE 5000
+
+static bool g_failed;
+static struct CencContext* g_decrypt_context;
+
+#define CHECK(x)                                                  \
+  do {                                                            \
+    if (!(x)) {                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #x);                                      \
+      g_failed = true;                                            \
+    }                                                             \
+  } while (0)
+
+static uint32_t g_random = 1;
+
+static uint32_t Random(void) {
+  g_random = g_random * 1103515245 + 12345;
+  return g_random >> 1;
+}
+
+struct TestFrame {
+  struct EncodedFrame frame;
+  uint8_t payload[FRAME_SIZE];
+  // Bytes up to the end of the slice segment header, which stay clear.
+  size_t slice_data_offset;
+};
+
+// Payload is split into segments of varying size, same as a coded buffer
+// that the driver returned in pieces.
+static void MakeFrame(struct TestFrame* test_frame, uint32_t sequence) {
+  for (size_t i = 0; i < sizeof(test_frame->payload); i++)
+    test_frame->payload[i] = (uint8_t)Random();
+  uint32_t size = FRAME_SIZE - sequence * 97;
+  uint32_t split = size / 3 + sequence;
+  test_frame->frame = (struct EncodedFrame){
+      .segments = {{.iov_base = test_frame->payload, .iov_len = split},
+                   {.iov_base = test_frame->payload + split,
+                    .iov_len = size - split}},
+      .nsegments = 2,
+      .size = size,
+      .keyframe = sequence % 4 == 0,
+      .pts = 1000000 + sequence * 16667ull,
+      .stream_id = 7,
+      .sequence = sequence,
+      .latency = (uint16_t)(sequence + 100),
+  };
+}
+
+// Every fourth frame is an idr with parameter sets, the rest are p frames.
+// Slice data is filler without start code emulation.
+static void MakeHevcFrame(struct TestFrame* test_frame, uint32_t sequence) {
+  VAEncSequenceParameterBufferHEVC seq = {
+      .general_profile_idc = 1,
+      .general_level_idc = 120,
+      .intra_period = 4,
+      .intra_idr_period = 4,
+      .ip_period = 1,
+      .pic_width_in_luma_samples = 1920,
+      .pic_height_in_luma_samples = 1088,
+      .seq_fields.bits.chroma_format_idc = 1,
+      .seq_fields.bits.sample_adaptive_offset_enabled_flag = 1,
+      .seq_fields.bits.low_delay_seq = 1,
+      .log2_diff_max_min_luma_coding_block_size = 3,
+      .log2_diff_max_min_transform_block_size = 3,
+      .max_transform_hierarchy_depth_inter = 2,
+      .max_transform_hierarchy_depth_intra = 2,
+  };
+  bool idr = sequence % 4 == 0;
+  VAEncPictureParameterBufferHEVC pic = {
+      .pic_init_qp = 30,
+      .nal_unit_type = idr ? IDR_W_RADL : TRAIL_R,
+      .decoded_curr_pic.pic_order_cnt = (int32_t)(sequence % 4),
+      .pic_fields.bits.reference_pic_flag = 1,
+  };
+  struct Bitstream bitstream = {.data = test_frame->payload, .size = 0};
+  if (idr) {
+    const struct MoreVideoParameters mvp = {0};
+    const struct MoreSeqParameters msp = {0};
+    PackVideoParameterSetNalUnit(&bitstream, &seq, &mvp);
+    PackSeqParameterSetNalUnit(&bitstream, &seq, &msp);
+    PackPicParameterSetNalUnit(&bitstream, &pic);
+  }
+  const VAEncSliceParameterBufferHEVC slice = {
+      .slice_type = idr ? I : P,
+      .max_num_merge_cand = 5,
+  };
+  const struct NegativePics negative_pics[] = {
+      {.delta_poc_s0_minus1 = 0, .used_by_curr_pic_s0_flag = 1},
+  };
+  const struct MoreSliceParamerters slice_msp = {
+      .first_slice_segment_in_pic_flag = 1,
+      .num_negative_pics = idr ? 0 : LENGTH(negative_pics),
+      .negative_pics = negative_pics,
+  };
+  struct SliceHeaderOffsets offsets;
+  PackSliceSegmentHeaderNalUnit(&bitstream, &seq, &pic, &slice, &slice_msp,
+                                &offsets);
+  test_frame->slice_data_offset = bitstream.size / 8;
+  for (uint32_t i = 0; i < 300 + sequence * 53; i++)
+    BitstreamAppend(&bitstream, 8, 0x11 + (Random() % 0xee));
+
+  // Segments are split inside the slice segment header.
+  uint32_t size = (uint32_t)(bitstream.size / 8);
+  uint32_t split = (uint32_t)test_frame->slice_data_offset - 3;
+  test_frame->frame = (struct EncodedFrame){
+      .segments = {{.iov_base = test_frame->payload, .iov_len = split},
+                   {.iov_base = test_frame->payload + split,
+                    .iov_len = size - split}},
+      .nsegments = 2,
+      .size = size,
+      .keyframe = idr,
+      .pts = 2000000 + sequence * 16667ull,
+      .stream_id = 9,
+      .sequence = sequence,
+      .latency = (uint16_t)(sequence + 200),
+  };
+}
+
+// Checks the subsample layout and returns the decrypted payload.
+static const void* DecryptRecord(const struct Proto2* header,
+                                 const void* record, const void* payload,
+                                 const struct TestFrame* test_frame) {
+  static uint8_t buffer[FRAME_SIZE];
+  struct CencExtension extension = {0};
+  size_t extension_size = header->header_size - sizeof(struct Proto2);
+  CHECK(header->flags & PROTO_FLAG_ENCRYPTED);
+  CHECK(extension_size <= sizeof(extension) && header->size <= FRAME_SIZE);
+  if (extension_size > sizeof(extension) || header->size > FRAME_SIZE)
+    return payload;
+  memcpy(&extension, (const uint8_t*)record + sizeof(struct Proto2),
+         extension_size);
+  CHECK(CencExtensionSize(&extension) == extension_size);
+
+  // A single slice, the slice segment header and everything before it is
+  // clear, and the protected range is whole aes blocks.
+  size_t covered = 0;
+  bool encrypted = false;
+  for (size_t i = 0; i < extension.subsample_count; i++) {
+    const struct CencSubsample* subsample = extension.subsamples + i;
+    CHECK(subsample->encrypted % 16 == 0);
+    if (subsample->encrypted) {
+      CHECK(!encrypted);
+      CHECK(covered + subsample->clear >= test_frame->slice_data_offset);
+      CHECK(covered + subsample->clear < test_frame->slice_data_offset + 16);
+      encrypted = true;
+    }
+    covered += subsample->clear + subsample->encrypted;
+  }
+  CHECK(encrypted);
+  CHECK(covered == header->size);
+  CHECK(header->size != test_frame->frame.size ||
+        memcmp(payload, test_frame->payload, header->size));
+
+  memcpy(buffer, payload, header->size);
+  const struct iovec iov = {.iov_base = buffer, .iov_len = header->size};
+  CHECK(CencContextDecrypt(g_decrypt_context, &extension, &iov, 1));
+  return buffer;
+}
+
+static void CheckRecord(const struct Proto2* header, const void* record,
+                        const void* payload,
+                        const struct TestFrame* test_frame, bool proto2) {
+  const struct EncodedFrame* frame = &test_frame->frame;
+  CHECK(header->size == frame->size);
+  CHECK(header->type == PROTO_TYPE_VIDEO);
+  CHECK(!!(header->flags & PROTO_FLAG_KEYFRAME) == frame->keyframe);
+  CHECK(header->latency == frame->latency);
+  CHECK(header->fragment == PROTO_FRAGMENT_WHOLE);
+  if (proto2) {
+    CHECK(header->version == PROTO_VERSION);
+    CHECK(test_frame->slice_data_offset ||
+          header->header_size == sizeof(struct Proto2));
+    CHECK(header->stream_id == frame->stream_id);
+    CHECK(header->pts == frame->pts);
+    CHECK(header->sequence == frame->sequence);
+  } else {
+    CHECK(header->version == 1);
+  }
+  if (test_frame->slice_data_offset)
+    payload = DecryptRecord(header, record, payload, test_frame);
+  CHECK(header->size != frame->size ||
+        !memcmp(payload, test_frame->payload, frame->size));
+}
+
+struct FecChannel {
+  struct FecDecoder* fec_decoder;
+  const struct TestFrame* expected;
+  bool proto2;
+  bool drop_first;
+  size_t records;
+};
+
+// Drops the first shard of every other record, which is the one carrying the
+// proto header, so that the header goes through recovery as well.
+static bool ReceiveDatagram(void* user, const struct iovec* iov,
+                            size_t count) {
+  struct FecChannel* channel = user;
+  uint8_t datagram[sizeof(struct FecHeader) + 1200];
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (size + iov[i].iov_len > sizeof(datagram)) return false;
+    memcpy(datagram + size, iov[i].iov_base, iov[i].iov_len);
+    size += iov[i].iov_len;
+  }
+  struct FecHeader fec_header;
+  memcpy(&fec_header, datagram, sizeof(fec_header));
+  if (channel->drop_first && !fec_header.block && !fec_header.index)
+    return true;
+
+  const void* record;
+  size_t record_size;
+  if (!FecDecoderPush(channel->fec_decoder, datagram, size, &record,
+                      &record_size))
+    return true;
+  struct Proto2 header;
+  size_t header_size = ParseProto(record, record_size, &header);
+  CHECK(header_size);
+  CHECK(record_size == header_size + header.size);
+  if (header_size && record_size == header_size + header.size) {
+    CheckRecord(&header, record, (const uint8_t*)record + header_size,
+                channel->expected, channel->proto2);
+  }
+  channel->records++;
+  return true;
+}
+
+static void CheckRecording(const char* path, const struct TestFrame* frames,
+                           bool proto2) {
+  struct ProtoReader* proto_reader = ProtoReaderCreate(path);
+  CHECK(proto_reader);
+  if (!proto_reader) return;
+  struct ProtoRecord proto_record;
+  size_t records = 0;
+  while (ProtoReaderNext(proto_reader, &proto_record)) {
+    CHECK(records < FRAMES);
+    if (records == FRAMES) break;
+    CheckRecord(&proto_record.header, proto_record.record,
+                proto_record.payload, &frames[records], proto2);
+    records++;
+  }
+  CHECK(records == FRAMES);
+
+  // Every keyframe is indexed with the offset and size of its record.
+  char index_path[256];
+  snprintf(index_path, sizeof(index_path), "%s.idx", path);
+  struct KeyIndex* key_index = KeyIndexCreate(index_path);
+  CHECK(key_index);
+  if (key_index) {
+    CHECK(KeyIndexCount(key_index) == (FRAMES + 3) / 4);
+    const struct KeyIndexEntry* entries = KeyIndexEntries(key_index);
+    for (size_t i = 0; i < KeyIndexCount(key_index); i++) {
+      const struct TestFrame* test_frame = &frames[i * 4];
+      CHECK(entries[i].pts == test_frame->frame.pts);
+      CHECK(ProtoReaderSeek(proto_reader, entries[i].offset));
+      CHECK(ProtoReaderNext(proto_reader, &proto_record));
+      CHECK(proto_record.record_size == entries[i].size);
+      CheckRecord(&proto_record.header, proto_record.record,
+                  proto_record.payload, test_frame, proto2);
+    }
+    KeyIndexDestroy(key_index);
+  }
+  ProtoReaderDestroy(proto_reader);
+}
+
+static void TestRecorder(const struct TestFrame* frames, bool proto2,
+                         bool direct, struct CencContext* cenc_context) {
+  char path[64];
+  snprintf(path, sizeof(path), "recordtest-v%d-%s%s.bin", proto2 ? 2 : 1,
+           direct ? "direct" : "file", cenc_context ? "-cenc" : "");
+  char index_path[sizeof(path) + 4];
+  snprintf(index_path, sizeof(index_path), "%s.idx", path);
+
+  FILE* file = fopen(path, "w");
+  CHECK(file);
+  if (!file) return;
+  struct DirectWriter* direct_writer = NULL;
+  if (direct) {
+    direct_writer = DirectWriterCreate(path);
+    if (!direct_writer) {
+      fprintf(stderr, "Skipping direct io, not supported in %s\n", path);
+      fclose(file);
+      unlink(path);
+      return;
+    }
+  }
+  const struct FecConfig fec_config = {
+      .scheme = kFecSchemeReedSolomon,
+      .shard_size = 1200,
+      .parity_percent = 25,
+      .keyframe_parity_percent = 50,
+  };
+  struct FecChannel channel = {
+      .fec_decoder = FecDecoderCreate(),
+      .proto2 = proto2,
+  };
+  struct RecorderOutputs outputs = {
+      .fd = fileno(file),
+      .proto2 = proto2,
+      .direct_writer = direct_writer,
+      .key_index_writer = KeyIndexWriterCreate(index_path),
+      .fec_encoder = FecEncoderCreate(&fec_config),
+      .fec_send = ReceiveDatagram,
+      .fec_user = &channel,
+      .cenc_context = cenc_context,
+  };
+  CHECK(channel.fec_decoder);
+  CHECK(outputs.key_index_writer);
+  CHECK(outputs.fec_encoder);
+  struct Recorder* recorder = RecorderCreate(&outputs);
+  CHECK(recorder);
+  if (channel.fec_decoder && outputs.key_index_writer && outputs.fec_encoder &&
+      recorder) {
+    for (size_t i = 0; i < FRAMES; i++) {
+      channel.expected = &frames[i];
+      channel.drop_first = i % 2;
+      CHECK(RecorderWriteFrame(recorder, &frames[i].frame));
+    }
+    CHECK(channel.records == FRAMES);
+  }
+
+  if (recorder) RecorderDestroy(recorder);
+  if (outputs.fec_encoder) FecEncoderDestroy(outputs.fec_encoder);
+  if (outputs.key_index_writer)
+    KeyIndexWriterDestroy(outputs.key_index_writer);
+  if (direct_writer) DirectWriterDestroy(direct_writer);
+  if (channel.fec_decoder) FecDecoderDestroy(channel.fec_decoder);
+  fclose(file);
+  CheckRecording(path, frames, proto2);
+  unlink(index_path);
+  unlink(path);
+}
+
+static void TestEncryptedRecorder(void) {
+  static const uint8_t key[CENC_KEY_SIZE] = {
+      0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+      0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+  };
+  struct CencContext* cenc_context = CencContextCreate(key);
+  g_decrypt_context = CencContextCreate(key);
+  if (!cenc_context || !g_decrypt_context) {
+    fprintf(stderr, "Skipping encryption, no aes instructions\n");
+    if (cenc_context) CencContextDestroy(cenc_context);
+    if (g_decrypt_context) CencContextDestroy(g_decrypt_context);
+    return;
+  }
+
+  static struct TestFrame frames[FRAMES];
+  static uint8_t pristine[FRAMES][FRAME_SIZE];
+  for (uint32_t i = 0; i < FRAMES; i++) {
+    MakeHevcFrame(&frames[i], i);
+    memcpy(pristine[i], frames[i].payload, FRAME_SIZE);
+  }
+  TestRecorder(frames, true, false, cenc_context);
+  TestRecorder(frames, true, true, cenc_context);
+  // Coded buffers are only ever read.
+  for (uint32_t i = 0; i < FRAMES; i++)
+    CHECK(!memcmp(pristine[i], frames[i].payload, FRAME_SIZE));
+  CencContextDestroy(g_decrypt_context);
+  CencContextDestroy(cenc_context);
+}
+
+int main(void) {
+  static struct TestFrame frames[FRAMES];
+  for (uint32_t i = 0; i < FRAMES; i++) MakeFrame(&frames[i], i);
+  TestRecorder(frames, false, false, NULL);
+  TestRecorder(frames, true, false, NULL);
+  TestRecorder(frames, false, true, NULL);
+  TestRecorder(frames, true, true, NULL);
+  TestEncryptedRecorder();
+  return g_failed ? 1 : 0;
+}
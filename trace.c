@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Power of two, so that ring positions can be masked instead of divided.
+#define TRACE_RING_SIZE (1u << 16)
+
+struct TraceEvent {
+  uint64_t timestamp_ns;
+  const char* name;
+  uint64_t frame;
+  uint32_t session;
+  char phase;
+};
+
+// Slots are read while their owner might be overwriting them, so every field
+// is accessed atomically. Relaxed accesses are still plain movs on x86.
+struct TraceSlot {
+  atomic_uint_least64_t timestamp_ns;
+  _Atomic(const char*) name;
+  atomic_uint_least64_t frame;
+  atomic_uint_least32_t session;
+  atomic_char phase;
+};
+
+// Every thread owns its ring and is the only writer to it, and the head works
+// as the sequence of a seqlock. Slots are written after a release fence that
+// follows the previous head store, and published by a release store of the
+// new head. The dumping thread copies slots, then issues an acquire fence and
+// rereads the head. Any slot it saw being overwritten is then behind the
+// reread head, so such entries are dropped instead of being dumped torn.
+struct TraceRing {
+  struct TraceRing* next;
+  pid_t tid;
+  atomic_uint_fast64_t head;
+  struct TraceSlot slots[TRACE_RING_SIZE];
+};
+
+atomic_bool trace_enabled;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing* trace_rings;
+static _Thread_local struct TraceRing* thread_ring;
+static _Thread_local bool thread_ring_failed;
+
+static struct TraceRing* CreateThreadRing(void) {
+  struct TraceRing* ring = calloc(1, sizeof(struct TraceRing));
+  if (!ring) {
+    fprintf(stderr, "Failed to allocate trace ring: %s\n", strerror(errno));
+    thread_ring_failed = true;
+    return NULL;
+  }
+  ring->tid = (pid_t)syscall(SYS_gettid);
+
+  // Rings are never freed, so that events of finished threads are still
+  // available for dumping.
+  pthread_mutex_lock(&trace_mutex);
+  ring->next = trace_rings;
+  trace_rings = ring;
+  pthread_mutex_unlock(&trace_mutex);
+  return ring;
+}
+
+void TraceRecord(const char* name, char phase, uint32_t session,
+                 uint64_t frame) {
+  struct TraceRing* ring = thread_ring;
+  if (!ring) {
+    if (thread_ring_failed) return;
+    ring = thread_ring = CreateThreadRing();
+    if (!ring) return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t timestamp_ns =
+      (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct TraceSlot* slot = &ring->slots[head & (TRACE_RING_SIZE - 1)];
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&slot->timestamp_ns, timestamp_ns,
+                        memory_order_relaxed);
+  atomic_store_explicit(&slot->name, name, memory_order_relaxed);
+  atomic_store_explicit(&slot->frame, frame, memory_order_relaxed);
+  atomic_store_explicit(&slot->session, session, memory_order_relaxed);
+  atomic_store_explicit(&slot->phase, phase, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void TraceStart(void) {
+  atomic_store_explicit(&trace_enabled, true, memory_order_relaxed);
+}
+
+void TraceStop(void) {
+  atomic_store_explicit(&trace_enabled, false, memory_order_relaxed);
+}
+
+static void LoadSlot(struct TraceSlot* slot, struct TraceEvent* event) {
+  *event = (struct TraceEvent){
+      .timestamp_ns =
+          atomic_load_explicit(&slot->timestamp_ns, memory_order_relaxed),
+      .name = atomic_load_explicit(&slot->name, memory_order_relaxed),
+      .frame = atomic_load_explicit(&slot->frame, memory_order_relaxed),
+      .session = atomic_load_explicit(&slot->session, memory_order_relaxed),
+      .phase = atomic_load_explicit(&slot->phase, memory_order_relaxed),
+  };
+}
+
+static bool DumpRing(FILE* file, struct TraceRing* ring,
+                     struct TraceEvent* events, bool* first) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  for (uint64_t i = tail; i < head; i++)
+    LoadSlot(&ring->slots[i & (TRACE_RING_SIZE - 1)], &events[i - tail]);
+
+  // The owner kept recording while events were copied. With the head reread
+  // as new_head, the owner might be writing the slot of event new_head, which
+  // held event new_head - TRACE_RING_SIZE, so the oldest valid one is next.
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t new_head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t valid =
+      new_head >= TRACE_RING_SIZE ? new_head - TRACE_RING_SIZE + 1 : 0;
+  for (uint64_t i = valid > tail ? valid : tail; i < head; i++) {
+    const struct TraceEvent* event = &events[i - tail];
+    if (fprintf(file,
+                "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+                "\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"session\":%u,\"frame\":%llu}}",
+                *first ? "" : ",", event->name, event->phase,
+                (unsigned long long)(event->timestamp_ns / 1000),
+                (unsigned long long)(event->timestamp_ns % 1000), getpid(),
+                ring->tid, event->session,
+                (unsigned long long)event->frame) < 0)
+      return false;
+    *first = false;
+  }
+  return true;
+}
+
+bool TraceDump(const char* path) {
+  struct TraceEvent* events =
+      malloc(TRACE_RING_SIZE * sizeof(struct TraceEvent));
+  if (!events) {
+    fprintf(stderr, "Failed to allocate trace events: %s\n", strerror(errno));
+    return false;
+  }
+
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    goto rollback_events;
+  }
+
+  bool first = true;
+  bool result =
+      fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file) >= 0;
+  pthread_mutex_lock(&trace_mutex);
+  for (struct TraceRing* ring = trace_rings; ring && result;
+       ring = ring->next) {
+    result = DumpRing(file, ring, events, &first);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  result = result && fputs("\n]}\n", file) >= 0;
+  if (fclose(file) || !result) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    goto rollback_events;
+  }
+  free(events);
+  return true;
+
+rollback_events:
+  free(events);
+  return false;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_TRACE_H_
+#define STREAMER_TRACE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+extern atomic_bool trace_enabled;
+
+// Event names must be string literals, only the pointer is stored.
+void TraceRecord(const char* name, char phase, uint32_t session,
+                 uint64_t frame);
+
+// Tracing is always compiled in, so the disabled path must cost no more than a
+// single relaxed load and a predictable branch.
+static inline void TraceBegin(const char* name, uint32_t session,
+                              uint64_t frame) {
+  if (__builtin_expect(
+          atomic_load_explicit(&trace_enabled, memory_order_relaxed), 0))
+    TraceRecord(name, 'B', session, frame);
+}
+
+static inline void TraceEnd(const char* name, uint32_t session,
+                            uint64_t frame) {
+  if (__builtin_expect(
+          atomic_load_explicit(&trace_enabled, memory_order_relaxed), 0))
+    TraceRecord(name, 'E', session, frame);
+}
+
+void TraceStart(void);
+void TraceStop(void);
+
+// Writes events recorded so far by all threads in Chrome trace JSON format,
+// which is also accepted by the Perfetto UI.
+bool TraceDump(const char* path);
+
+#endif  // STREAMER_TRACE_H_
@@ -16,11 +16,17 @@
  */
 
 attribute vec2 position;
+attribute vec2 sample_step;
+attribute vec4 cursor_rect;
 
 varying vec2 texcoord;
+varying vec2 texel;
+varying vec4 cursor;
 
 void main() {
   texcoord = position;
+  texel = sample_step;
+  cursor = cursor_rect;
   mat4 transform_matrix =
       mat4(vec4(2.0, 0.0, 0.0, 0.0), vec4(0.0, 2.0, 0.0, 0.0),
            vec4(0.0, 0.0, 2.0, 0.0), vec4(-1.0, -1.0, 0.0, 1.0));
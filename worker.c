@@ -0,0 +1,708 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// close_range is only declared for gnu builds.
+#define _GNU_SOURCE
+
+#include "worker.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpu.h"
+#include "shmring.h"
+#include "startup.h"
+#include "trace.h"
+
+#define WORKER_RING_PAGE 4096
+#define WORKER_SOCKET_FD 3
+// Startup compiles shaders and initializes va, which takes a while on a cold
+// driver cache. Frames are expected to be way faster.
+#define WORKER_STARTUP_TIMEOUT_MS 10000
+#define WORKER_FRAME_TIMEOUT_MS 2000
+
+enum WorkerMessageType {
+  kWorkerConfigure = 0,
+  kWorkerBuffer,
+  kWorkerFrame,
+  kWorkerReady,
+  kWorkerDone,
+};
+
+struct WorkerMessage {
+  uint32_t type;
+  uint32_t buffer_id;
+  uint64_t pts;
+  bool force_intra;
+  bool success;
+  uint32_t micros;
+  struct WorkerConfig config;
+  struct ShmRingBuffer buffer;
+};
+
+// Head is only written by the worker and tail only by the supervisor, keep them
+// on separate cache lines to avoid false sharing.
+struct CodedRingHeader {
+  uint64_t capacity;
+  alignas(64) atomic_uint_fast64_t head;
+  alignas(64) atomic_uint_fast64_t tail;
+};
+
+// Records are 8-byte aligned. One that does not fit before the end of the
+// ring is preceded by a wrap record, or by padding too small to hold one.
+struct CodedRecord {
+  uint32_t size;
+  uint32_t sequence;
+  uint16_t latency;
+  uint8_t keyframe;
+  uint8_t wrap;
+  uint64_t pts;
+};
+
+struct WorkerProcess {
+  struct CodedRingHeader* ring;
+  struct GpuContext* gpu_context;
+  struct EncodeContext* encode_context;
+  struct WorkerConfig config;
+  bool registered[SHM_RING_MAX_BUFFERS];
+  struct ShmRingBuffer buffers[SHM_RING_MAX_BUFFERS];
+  struct GpuFrame* gpu_frames[SHM_RING_MAX_BUFFERS];
+  struct EncodeSurface* surfaces[SHM_RING_MAX_BUFFERS];
+};
+
+struct WorkerSession {
+  struct WorkerConfig config;
+  uint32_t stream_id;
+  pid_t pid;
+  int sock;
+  struct CodedRingHeader* ring;
+  size_t ring_size;
+  uint64_t tail;
+  bool registered[SHM_RING_MAX_BUFFERS];
+  struct ShmRingBuffer buffers[SHM_RING_MAX_BUFFERS];
+  bool intra_pending;
+  struct WorkerStats stats;
+};
+
+static uint64_t MicrosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static size_t Align8(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static uint8_t* RingData(struct CodedRingHeader* ring) {
+  return (uint8_t*)ring + WORKER_RING_PAGE;
+}
+
+static bool SendMessage(int sock, const struct WorkerMessage* message,
+                        const int* fds, size_t nfds) {
+  char control[CMSG_SPACE(sizeof(int) * 4)] = {0};
+  struct iovec iov = {.iov_base = (void*)(uintptr_t)message,
+                      .iov_len = sizeof(*message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = nfds ? control : NULL,
+      .msg_controllen = nfds ? CMSG_SPACE(sizeof(int) * nfds) : 0,
+  };
+  if (nfds) {
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  for (;;) {
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*message)) return true;
+    if (errno == EINTR) continue;
+    fprintf(stderr, "Failed to send worker message: %s\n", strerror(errno));
+    return false;
+  }
+}
+
+// Returns 1 on success, 0 on hangup or timeout and -1 on error.
+static int ReceiveMessage(int sock, int timeout, struct WorkerMessage* message,
+                          int* fds, size_t* nfds) {
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  for (;;) {
+    int result = poll(&pfd, 1, timeout);
+    if (result > 0) break;
+    if (!result) return 0;
+    if (errno == EINTR) continue;
+    fprintf(stderr, "Failed to poll worker socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  char control[CMSG_SPACE(sizeof(int) * 4)];
+  struct iovec iov = {.iov_base = message, .iov_len = sizeof(*message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  ssize_t result;
+  do {
+    result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (result < 0 && errno == EINTR);
+  if (result <= 0) {
+    // Reset is how a peer killed with unread messages hangs up.
+    if (result < 0 && errno != ECONNRESET)
+      fprintf(stderr, "Failed to receive worker message: %s\n",
+              strerror(errno));
+    return result < 0 && errno != ECONNRESET ? -1 : 0;
+  }
+
+  *nfds = 0;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds + *nfds, CMSG_DATA(cmsg), count * sizeof(int));
+    *nfds += count;
+  }
+  if (result != sizeof(*message) || (msg.msg_flags & MSG_CTRUNC)) {
+    fprintf(stderr, "Malformed worker message\n");
+    for (size_t i = 0; i < *nfds; i++) close(fds[i]);
+    return -1;
+  }
+  return 1;
+}
+
+static void ClosePlanes(struct ShmRingBuffer* buffer) {
+  for (size_t i = 0; i < buffer->nplanes; i++) {
+    if (buffer->planes[i].dmabuf_fd != -1) close(buffer->planes[i].dmabuf_fd);
+    buffer->planes[i].dmabuf_fd = -1;
+  }
+}
+
+static void ForgetImports(struct WorkerProcess* worker, uint32_t buffer_id) {
+  if (worker->gpu_frames[buffer_id]) {
+    GpuContextDestroyFrame(worker->gpu_context, worker->gpu_frames[buffer_id]);
+    worker->gpu_frames[buffer_id] = NULL;
+  }
+  if (worker->surfaces[buffer_id]) {
+    EncodeContextDestroySurface(worker->encode_context,
+                                worker->surfaces[buffer_id]);
+    worker->surfaces[buffer_id] = NULL;
+  }
+}
+
+static void GetBufferPlanes(const struct ShmRingBuffer* buffer,
+                            struct GpuFramePlane planes[4]) {
+  for (uint32_t i = 0; i < buffer->nplanes; i++) {
+    planes[i] = (struct GpuFramePlane){
+        .dmabuf_fd = buffer->planes[i].dmabuf_fd,
+        .pitch = buffer->planes[i].pitch,
+        .offset = buffer->planes[i].offset,
+        .modifier = buffer->planes[i].modifier,
+    };
+  }
+}
+
+static struct GpuFrame* ImportGpuFrame(struct GpuContext* gpu_context,
+                                       const struct ShmRingBuffer* buffer) {
+  struct GpuFramePlane planes[4];
+  GetBufferPlanes(buffer, planes);
+  return GpuContextImportFrame(gpu_context, buffer->width, buffer->height,
+                               buffer->fourcc, buffer->nplanes, planes);
+}
+
+static struct EncodeSurface* ImportSurface(
+    struct EncodeContext* encode_context, const struct ShmRingBuffer* buffer) {
+  struct GpuFramePlane planes[4];
+  GetBufferPlanes(buffer, planes);
+  return EncodeContextImportSurface(encode_context, buffer->width,
+                                    buffer->height, buffer->fourcc,
+                                    buffer->nplanes, planes);
+}
+
+static bool WriteCodedRecord(void* user, const struct EncodedFrame* frame) {
+  struct WorkerProcess* worker = user;
+  struct CodedRingHeader* ring = worker->ring;
+  uint64_t capacity = ring->capacity;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  size_t need = sizeof(struct CodedRecord) + Align8(frame->size);
+  size_t offset = head % capacity;
+  size_t pad = offset + need > capacity ? capacity - offset : 0;
+  if (capacity - (head - tail) < pad + need) {
+    fprintf(stderr, "Coded frame of %u bytes does not fit the ring\n",
+            frame->size);
+    return false;
+  }
+  if (pad >= sizeof(struct CodedRecord)) {
+    static const struct CodedRecord wrap = {.wrap = 1};
+    memcpy(RingData(ring) + offset, &wrap, sizeof(wrap));
+  }
+  head += pad;
+
+  uint8_t* target = RingData(ring) + head % capacity;
+  struct CodedRecord record = {
+      .size = frame->size,
+      .sequence = frame->sequence,
+      .latency = frame->latency,
+      .keyframe = frame->keyframe,
+      .pts = frame->pts,
+  };
+  memcpy(target, &record, sizeof(record));
+  target += sizeof(record);
+  for (size_t i = 0; i < frame->nsegments; i++) {
+    memcpy(target, frame->segments[i].iov_base, frame->segments[i].iov_len);
+    target += frame->segments[i].iov_len;
+  }
+  atomic_store_explicit(&ring->head, head + need, memory_order_release);
+  return true;
+}
+
+static bool EncodeInWorker(struct WorkerProcess* worker,
+                           const struct WorkerMessage* message) {
+  uint32_t id = message->buffer_id;
+  if (id >= SHM_RING_MAX_BUFFERS || !worker->registered[id]) {
+    fprintf(stderr, "Worker buffer %u is not registered\n", id);
+    return false;
+  }
+  const struct ShmRingBuffer* buffer = &worker->buffers[id];
+
+  // Nv12 of the session size is what va encodes from, so such buffers skip the
+  // conversion pass, same as decoded frames do.
+  bool direct = buffer->fourcc == DRM_FORMAT_NV12 &&
+                buffer->width == worker->config.width &&
+                buffer->height == worker->config.height;
+  if (direct) {
+    if (!worker->surfaces[id])
+      worker->surfaces[id] = ImportSurface(worker->encode_context, buffer);
+    if (!worker->surfaces[id]) {
+      fprintf(stderr, "Failed to import worker buffer %u\n", id);
+      return false;
+    }
+    EncodeContextSetSurface(worker->encode_context, worker->surfaces[id]);
+  } else {
+    if (!worker->gpu_frames[id])
+      worker->gpu_frames[id] = ImportGpuFrame(worker->gpu_context, buffer);
+    uint32_t trace_session = EncodeContextGetSessionId(worker->encode_context);
+    uint64_t trace_frame = EncodeContextGetFrameCounter(worker->encode_context);
+    TraceBegin("convert", trace_session, trace_frame);
+    bool converted =
+        worker->gpu_frames[id] &&
+        GpuContextConvertFrame(worker->gpu_context, worker->gpu_frames[id],
+                               EncodeContextGetFrame(worker->encode_context),
+                               NULL, NULL);
+    TraceEnd("convert", trace_session, trace_frame);
+    if (!converted) {
+      fprintf(stderr, "Failed to convert worker buffer %u\n", id);
+      return false;
+    }
+  }
+
+  struct EncodeFrameControl control = {.force_intra = message->force_intra};
+  bool result = EncodeContextEncodeFrameControlled(
+      worker->encode_context, message->pts, &control, WriteCodedRecord, worker,
+      NULL);
+  if (direct) EncodeContextSetSurface(worker->encode_context, NULL);
+  return result;
+}
+
+static bool HandleBuffer(struct WorkerProcess* worker,
+                         const struct WorkerMessage* message, const int* fds,
+                         size_t nfds) {
+  uint32_t id = message->buffer_id;
+  if (id >= SHM_RING_MAX_BUFFERS || message->buffer.nplanes != nfds ||
+      !nfds || nfds > LENGTH(message->buffer.planes)) {
+    fprintf(stderr, "Invalid worker buffer %u\n", id);
+    return false;
+  }
+  ForgetImports(worker, id);
+  if (worker->registered[id]) ClosePlanes(&worker->buffers[id]);
+  worker->buffers[id] = message->buffer;
+  for (size_t i = 0; i < nfds; i++)
+    worker->buffers[id].planes[i].dmabuf_fd = fds[i];
+  worker->registered[id] = true;
+  return true;
+}
+
+static int WorkerMain(int sock, struct CodedRingHeader* ring) {
+  // Orphaned workers would keep the device busy for nothing.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() == 1) return EXIT_FAILURE;
+
+  struct WorkerProcess worker = {.ring = ring};
+  struct WorkerMessage message;
+  int fds[4];
+  size_t nfds = 0;
+  if (ReceiveMessage(sock, -1, &message, fds, &nfds) <= 0 ||
+      message.type != kWorkerConfigure || nfds) {
+    fprintf(stderr, "Failed to receive worker configuration\n");
+    for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    return EXIT_FAILURE;
+  }
+  worker.config = message.config;
+
+  struct StartupConfig startup_config = {
+      .width = worker.config.width,
+      .height = worker.config.height,
+      .colorspace = worker.config.colorspace,
+      .range = worker.config.range,
+      .codec = worker.config.codec,
+  };
+  struct StartupTimings startup_timings;
+  bool started =
+      StartupCreateContexts(&startup_config, &worker.gpu_context,
+                            &worker.encode_context, &startup_timings);
+  message = (struct WorkerMessage){.type = kWorkerReady, .success = started};
+  if (!SendMessage(sock, &message, NULL, 0) || !started) {
+    fprintf(stderr, "Failed to start worker\n");
+    goto rollback_contexts;
+  }
+
+  for (;;) {
+    int result = ReceiveMessage(sock, -1, &message, fds, &nfds);
+    if (result <= 0) break;
+    switch (message.type) {
+      case kWorkerBuffer:
+        if (!HandleBuffer(&worker, &message, fds, nfds)) {
+          for (size_t i = 0; i < nfds; i++) close(fds[i]);
+        }
+        break;
+      case kWorkerFrame: {
+        uint64_t frame_started = MicrosNow();
+        bool success = EncodeInWorker(&worker, &message);
+        message = (struct WorkerMessage){
+            .type = kWorkerDone,
+            .success = success,
+            .micros = (uint32_t)(MicrosNow() - frame_started),
+        };
+        if (!SendMessage(sock, &message, NULL, 0)) goto rollback_buffers;
+        break;
+      }
+      default:
+        fprintf(stderr, "Unexpected worker message %u\n", message.type);
+        for (size_t i = 0; i < nfds; i++) close(fds[i]);
+        break;
+    }
+  }
+
+rollback_buffers:
+  for (uint32_t i = 0; i < SHM_RING_MAX_BUFFERS; i++) {
+    if (!worker.registered[i]) continue;
+    ForgetImports(&worker, i);
+    ClosePlanes(&worker.buffers[i]);
+  }
+  EncodeContextDestroy(worker.encode_context);
+  GpuContextDestroy(worker.gpu_context);
+  return EXIT_SUCCESS;
+
+rollback_contexts:
+  if (started) {
+    EncodeContextDestroy(worker.encode_context);
+    GpuContextDestroy(worker.gpu_context);
+  }
+  return EXIT_FAILURE;
+}
+
+static void ReapWorker(struct WorkerSession* worker_session, bool kill_first) {
+  if (worker_session->sock != -1) close(worker_session->sock);
+  worker_session->sock = -1;
+  if (worker_session->pid == -1) return;
+  if (kill_first) kill(worker_session->pid, SIGKILL);
+  int status = 0;
+  while (waitpid(worker_session->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL) {
+    fprintf(stderr, "Worker %d was killed by signal %d\n",
+            worker_session->pid, WTERMSIG(status));
+  }
+  worker_session->pid = -1;
+}
+
+static bool RegisterWithWorker(struct WorkerSession* worker_session,
+                               uint32_t buffer_id) {
+  const struct ShmRingBuffer* buffer = &worker_session->buffers[buffer_id];
+  struct WorkerMessage message = {
+      .type = kWorkerBuffer,
+      .buffer_id = buffer_id,
+      .buffer = *buffer,
+  };
+  int fds[LENGTH(buffer->planes)];
+  for (size_t i = 0; i < buffer->nplanes; i++) {
+    fds[i] = buffer->planes[i].dmabuf_fd;
+    message.buffer.planes[i].dmabuf_fd = -1;
+  }
+  return SendMessage(worker_session->sock, &message, fds, buffer->nplanes);
+}
+
+static bool SpawnWorker(struct WorkerSession* worker_session) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+    fprintf(stderr, "Failed to create worker socket: %s\n", strerror(errno));
+    return false;
+  }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "Failed to fork worker: %s\n", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  if (!pid) {
+    // The worker keeps the ring mapping, but must not keep sockets of other
+    // sessions, or their workers never see a hangup.
+    if (dup2(sv[1], WORKER_SOCKET_FD) == -1) _exit(EXIT_FAILURE);
+    close_range(WORKER_SOCKET_FD + 1, ~0u, 0);
+    _exit(WorkerMain(WORKER_SOCKET_FD, worker_session->ring));
+  }
+  close(sv[1]);
+  worker_session->pid = pid;
+  worker_session->sock = sv[0];
+
+  // Whatever the previous worker left in the ring is gone along with the frame
+  // it was encoding.
+  worker_session->tail =
+      atomic_load_explicit(&worker_session->ring->head, memory_order_relaxed);
+  atomic_store_explicit(&worker_session->ring->tail, worker_session->tail,
+                        memory_order_relaxed);
+
+  struct WorkerMessage message = {
+      .type = kWorkerConfigure,
+      .config = worker_session->config,
+  };
+  if (!SendMessage(worker_session->sock, &message, NULL, 0)) goto rollback_pid;
+  int fds[4];
+  size_t nfds = 0;
+  if (ReceiveMessage(worker_session->sock, WORKER_STARTUP_TIMEOUT_MS, &message,
+                     fds, &nfds) <= 0 ||
+      message.type != kWorkerReady || !message.success || nfds) {
+    fprintf(stderr, "Worker failed to start\n");
+    for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    goto rollback_pid;
+  }
+  for (uint32_t i = 0; i < SHM_RING_MAX_BUFFERS; i++) {
+    if (worker_session->registered[i] && !RegisterWithWorker(worker_session, i))
+      goto rollback_pid;
+  }
+  worker_session->intra_pending = true;
+  return true;
+
+rollback_pid:
+  ReapWorker(worker_session, true);
+  return false;
+}
+
+static bool DrainCodedRing(struct WorkerSession* worker_session,
+                           EncodeSink sink, void* user) {
+  struct CodedRingHeader* ring = worker_session->ring;
+  uint64_t capacity = ring->capacity;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  bool result = true;
+  while (worker_session->tail != head) {
+    uint64_t tail = worker_session->tail;
+    size_t offset = tail % capacity;
+    struct CodedRecord record = {.wrap = 1};
+    if (capacity - offset >= sizeof(record))
+      memcpy(&record, RingData(ring) + offset, sizeof(record));
+    if (record.wrap) {
+      worker_session->tail += capacity - offset;
+      continue;
+    }
+
+    // The worker is not trusted to leave the ring consistent, it might have
+    // been dying while writing it.
+    size_t need = sizeof(record) + Align8(record.size);
+    if (need > capacity - offset || need > head - tail) {
+      fprintf(stderr, "Corrupted coded ring record\n");
+      worker_session->tail = head;
+      result = false;
+      break;
+    }
+    struct EncodedFrame encoded_frame = {
+        .segments = {{.iov_base = RingData(ring) + offset + sizeof(record),
+                      .iov_len = record.size}},
+        .nsegments = 1,
+        .size = record.size,
+        .keyframe = record.keyframe,
+        .pts = record.pts,
+        .stream_id = worker_session->stream_id,
+        .sequence = record.sequence,
+        .latency = record.latency,
+    };
+    result = sink(user, &encoded_frame) && result;
+    worker_session->tail += need;
+  }
+  atomic_store_explicit(&ring->tail, worker_session->tail,
+                        memory_order_release);
+  return result;
+}
+
+struct WorkerSession* WorkerSessionCreate(const struct WorkerConfig* config) {
+  struct WorkerSession* worker_session =
+      calloc(1, sizeof(struct WorkerSession));
+  if (!worker_session) {
+    fprintf(stderr, "Failed to allocate worker session: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  worker_session->config = *config;
+  worker_session->pid = -1;
+  worker_session->sock = -1;
+
+  // Stream ids of worker encoders all start over in their own processes, so the
+  // supervisor hands out its own.
+  static atomic_uint stream_ids;
+  worker_session->stream_id = atomic_fetch_add(&stream_ids, 1) + 1;
+
+  // Coded buffers are sized for a raw frame, and the ring holds two of those,
+  // so a single frame in flight always fits whatever the wrapping point.
+  uint64_t capacity =
+      Align8(sizeof(struct CodedRecord) + (size_t)config->width *
+                                              config->height * 3 / 2) *
+      2;
+  worker_session->ring_size = WORKER_RING_PAGE + capacity;
+  worker_session->ring =
+      mmap(NULL, worker_session->ring_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (worker_session->ring == MAP_FAILED) {
+    fprintf(stderr, "Failed to map coded ring: %s\n", strerror(errno));
+    goto rollback_worker_session;
+  }
+  worker_session->ring->capacity = capacity;
+
+  if (!SpawnWorker(worker_session)) {
+    fprintf(stderr, "Failed to spawn worker\n");
+    goto rollback_ring;
+  }
+  return worker_session;
+
+rollback_ring:
+  munmap(worker_session->ring, worker_session->ring_size);
+rollback_worker_session:
+  free(worker_session);
+  return NULL;
+}
+
+bool WorkerSessionRegisterBuffer(struct WorkerSession* worker_session,
+                                 uint32_t buffer_id,
+                                 const struct ShmRingBuffer* buffer) {
+  if (buffer_id >= SHM_RING_MAX_BUFFERS || !buffer->nplanes ||
+      buffer->nplanes > LENGTH(buffer->planes)) {
+    fprintf(stderr, "Invalid worker buffer %u\n", buffer_id);
+    return false;
+  }
+  struct ShmRingBuffer copy = *buffer;
+  for (size_t i = 0; i < copy.nplanes; i++) {
+    copy.planes[i].dmabuf_fd = fcntl(buffer->planes[i].dmabuf_fd,
+                                     F_DUPFD_CLOEXEC, 0);
+    if (copy.planes[i].dmabuf_fd == -1) {
+      fprintf(stderr, "Failed to dup dmabuf: %s\n", strerror(errno));
+      while (i--) close(copy.planes[i].dmabuf_fd);
+      return false;
+    }
+  }
+  if (worker_session->registered[buffer_id])
+    ClosePlanes(&worker_session->buffers[buffer_id]);
+  worker_session->buffers[buffer_id] = copy;
+  worker_session->registered[buffer_id] = true;
+
+  // A worker that is gone gets the buffer along with all the others once it is
+  // restarted.
+  if (worker_session->pid == -1) return true;
+  return RegisterWithWorker(worker_session, buffer_id);
+}
+
+bool WorkerSessionEncode(struct WorkerSession* worker_session,
+                         uint32_t buffer_id, uint64_t pts, bool force_intra,
+                         EncodeSink sink, void* user) {
+  if (worker_session->pid == -1) {
+    if (!SpawnWorker(worker_session)) return false;
+    worker_session->stats.restarts++;
+  }
+
+  uint64_t started = MicrosNow();
+  struct WorkerMessage message = {
+      .type = kWorkerFrame,
+      .buffer_id = buffer_id,
+      .pts = pts,
+      .force_intra = force_intra || worker_session->intra_pending,
+  };
+  int fds[4];
+  size_t nfds = 0;
+  int result = -1;
+  if (SendMessage(worker_session->sock, &message, NULL, 0)) {
+    result = ReceiveMessage(worker_session->sock, WORKER_FRAME_TIMEOUT_MS,
+                            &message, fds, &nfds);
+  }
+  if (result <= 0 || message.type != kWorkerDone || nfds) {
+    if (result > 0) {
+      for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    }
+    fprintf(stderr, "Worker %d %s, restarting\n", worker_session->pid,
+            result ? "misbehaved" : "died or hung");
+    worker_session->stats.lost++;
+    ReapWorker(worker_session, true);
+    if (SpawnWorker(worker_session)) worker_session->stats.restarts++;
+    return false;
+  }
+  if (!message.success) return false;
+  worker_session->intra_pending = false;
+
+  bool drained = DrainCodedRing(worker_session, sink, user);
+  worker_session->stats.frames++;
+  worker_session->stats.roundtrip_micros += MicrosNow() - started;
+  worker_session->stats.worker_micros += message.micros;
+  return drained;
+}
+
+void WorkerSessionGetStats(const struct WorkerSession* worker_session,
+                           struct WorkerStats* worker_stats) {
+  *worker_stats = worker_session->stats;
+}
+
+void WorkerSessionDestroy(struct WorkerSession* worker_session) {
+  // Hanging up lets the worker tear down its contexts cleanly, but one stuck in
+  // the driver is killed after a while.
+  if (worker_session->sock != -1) {
+    shutdown(worker_session->sock, SHUT_WR);
+    struct pollfd pfd = {.fd = worker_session->sock, .events = POLLIN};
+    while (poll(&pfd, 1, WORKER_FRAME_TIMEOUT_MS) < 0 && errno == EINTR)
+      ;
+  }
+  ReapWorker(worker_session, true);
+  for (uint32_t i = 0; i < SHM_RING_MAX_BUFFERS; i++) {
+    if (worker_session->registered[i])
+      ClosePlanes(&worker_session->buffers[i]);
+  }
+  munmap(worker_session->ring, worker_session->ring_size);
+  free(worker_session);
+}
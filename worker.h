@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_WORKER_H_
+#define STREAMER_WORKER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "colorspace.h"
+#include "encode.h"
+
+struct ShmRingBuffer;
+
+struct WorkerConfig {
+  uint32_t width;
+  uint32_t height;
+  enum YuvColorspace colorspace;
+  enum YuvRange range;
+  enum EncodeCodec codec;
+};
+
+struct WorkerStats {
+  uint64_t frames;
+  uint64_t restarts;
+  // Frames that were in flight when their worker died.
+  uint64_t lost;
+  // Submission to completion as seen by the supervisor, and the part of it
+  // spent importing, converting and encoding inside the worker. The
+  // difference is the cost of going through another process.
+  uint64_t roundtrip_micros;
+  uint64_t worker_micros;
+};
+
+struct WorkerSession;
+
+// Supervisor side of an encoding session running in its own worker process,
+// so that a crashing or hanging driver call only takes down that session.
+// Frames are passed as dmabufs registered once over the socket, coded output
+// comes back through a shared memory ring without copying it through the
+// socket. Workers are forked, so sessions must be created in a process that
+// has not initialized gpu or va and runs no other threads.
+struct WorkerSession* WorkerSessionCreate(const struct WorkerConfig* config);
+// Plane fds are not consumed, the session keeps duplicates to register them
+// again with restarted workers. Dmabuf contents must stay intact until the
+// frame using them is encoded.
+bool WorkerSessionRegisterBuffer(struct WorkerSession* worker_session,
+                                 uint32_t buffer_id,
+                                 const struct ShmRingBuffer* buffer);
+// Encodes the registered buffer and passes the coded frame to the sink,
+// which may only use it until it returns. Frames are predicted unless
+// forced intra, a restarted worker always starts with an intra frame. A dead
+// worker fails the frame in flight and is restarted right away.
+bool WorkerSessionEncode(struct WorkerSession* worker_session,
+                         uint32_t buffer_id, uint64_t pts, bool force_intra,
+                         EncodeSink sink, void* user);
+void WorkerSessionGetStats(const struct WorkerSession* worker_session,
+                           struct WorkerStats* worker_stats);
+void WorkerSessionDestroy(struct WorkerSession* worker_session);
+
+#endif  // STREAMER_WORKER_H_